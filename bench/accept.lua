@@ -0,0 +1,62 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Accept storm: BENCH_ACCEPT_CONCURRENCY clients connect, and close,
+-- as fast as they can until BENCH_ACCEPTS connections have been accepted
+-- and closed by a single listener.
+--
+require"regress".export".*"
+
+local bench = require"bench"
+
+local monotime = cqueues.monotime
+
+local N = bench.getenv("ACCEPTS", 10000)
+local C = bench.getenv("ACCEPT_CONCURRENCY", 64)
+
+local cq = cqueues.new()
+local lso = check(socket.listen("127.0.0.1", 0))
+check(lso:listen())
+local _, host, port = check(lso:localname())
+
+local samples, issued = {}, 0
+local t0, elapsed
+
+cq:wrap(function ()
+	for _ = 1, N do
+		check(lso:accept()):close()
+	end
+
+	elapsed = monotime() - t0
+end)
+
+t0 = monotime()
+
+for _ = 1, C do
+	cq:wrap(function ()
+		while issued < N do
+			issued = issued + 1
+
+			local t1 = monotime()
+			local con = check(socket.connect(host, port))
+
+			check(con:connect())
+			samples[#samples + 1] = monotime() - t1
+			con:close()
+		end
+	end)
+end
+
+check(cq:loop())
+lso:close()
+
+bench.report("accept", {
+	accepts = N,
+	concurrency = C,
+	elapsed = elapsed,
+	rate = N / elapsed,
+	connect = bench.latency(samples),
+})
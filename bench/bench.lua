@@ -0,0 +1,113 @@
+--
+-- Shared helpers for the benchmarks. Each result is written to stdout as
+-- a single-line JSON object; `make bench` gathers them into one document.
+-- Workload sizes come from BENCH_* environment variables so that runs
+-- can be repeated exactly.
+--
+local cqueues = require"cqueues"
+
+local bench = {}
+
+function bench.getenv(name, default)
+	return tonumber(os.getenv("BENCH_" .. name)) or default
+end -- bench.getenv
+
+local escapes = { ['"'] = '\\"', ["\\"] = "\\\\", ["\n"] = "\\n", ["\r"] = "\\r", ["\t"] = "\\t" }
+
+local function quote(s)
+	return '"' .. (s:gsub('[%c"\\]', function (c)
+		return escapes[c] or string.format("\\u%04x", c:byte())
+	end)) .. '"'
+end -- quote
+
+local function encode(v)
+	local t = type(v)
+
+	if t == "number" then
+		if v ~= v or v == math.huge or v == -math.huge then
+			return "null"
+		elseif v == math.floor(v) and math.abs(v) < 2^53 then
+			return string.format("%.0f", v)
+		else
+			return string.format("%.6g", v)
+		end
+	elseif t == "string" then
+		return quote(v)
+	elseif t == "boolean" then
+		return tostring(v)
+	elseif t == "table" then
+		local out = {}
+
+		if #v > 0 then
+			for i = 1, #v do
+				out[i] = encode(v[i])
+			end
+
+			return "[" .. table.concat(out, ",") .. "]"
+		end
+
+		-- sorted so that runs diff cleanly
+		local keys = {}
+
+		for k in pairs(v) do
+			keys[#keys + 1] = tostring(k)
+		end
+
+		table.sort(keys)
+
+		for i, k in ipairs(keys) do
+			out[i] = quote(k) .. ":" .. encode(v[k])
+		end
+
+		return "{" .. table.concat(out, ",") .. "}"
+	else
+		return "null"
+	end
+end -- encode
+
+bench.encode = encode
+
+function bench.report(name, result)
+	result.bench = name
+	result.lua = _VERSION
+	result.cqueues = cqueues.VERSION
+	result.backend = cqueues.new():backend()
+
+	io.stdout:write(encode(result), "\n")
+	io.stdout:flush()
+end -- bench.report
+
+--
+-- Summarize a list of latencies in seconds as microsecond percentiles.
+--
+function bench.latency(samples)
+	local n = #samples
+	local sorted, sum = {}, 0
+
+	if n == 0 then
+		return {}
+	end
+
+	for i = 1, n do
+		sorted[i] = samples[i]
+		sum = sum + samples[i]
+	end
+
+	table.sort(sorted)
+
+	local function pct(p)
+		return sorted[math.max(1, math.ceil(n * p))] * 1000000
+	end
+
+	return {
+		samples = n,
+		mean = sum / n * 1000000,
+		min = sorted[1] * 1000000,
+		p50 = pct(0.50),
+		p90 = pct(0.90),
+		p99 = pct(0.99),
+		max = sorted[n] * 1000000,
+	}
+end -- bench.latency
+
+return bench
@@ -0,0 +1,12 @@
+#!/bin/sh
+#
+# Sourced by each benchmark. Sets up the regress environment, then puts
+# bench/ on the module path so that benchmarks can require"bench".
+#
+. "${0%%/*}/../regress/regress.sh"
+
+LUA_PATH="${CQUEUES_SRCDIR}/bench/?.lua;${LUA_PATH}"
+LUA_PATH_5_2="${CQUEUES_SRCDIR}/bench/?.lua;${LUA_PATH_5_2}"
+LUA_PATH_5_3="${CQUEUES_SRCDIR}/bench/?.lua;${LUA_PATH_5_3}"
+
+export LUA_PATH LUA_PATH_5_2 LUA_PATH_5_3
@@ -0,0 +1,49 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Condition variable ping-pong: two coroutines hand control back and
+-- forth BENCH_PINGPONG times through a pair of condition variables, so
+-- each round trip is two signals, two waits and two resumes.
+--
+require"regress".export".*"
+
+local bench = require"bench"
+
+local monotime = cqueues.monotime
+
+local N = bench.getenv("PINGPONG", 100000)
+
+local cq = cqueues.new()
+local ping, pong = condition.new(), condition.new()
+local t0, elapsed
+
+-- wrapped first so that it is waiting before the first signal
+cq:wrap(function ()
+	for _ = 1, N do
+		ping:wait()
+		pong:signal()
+	end
+end)
+
+cq:wrap(function ()
+	t0 = monotime()
+
+	for _ = 1, N do
+		ping:signal()
+		pong:wait()
+	end
+
+	elapsed = monotime() - t0
+end)
+
+check(cq:loop())
+
+bench.report("condition", {
+	rounds = N,
+	elapsed = elapsed,
+	rate = N / elapsed,
+	switch = elapsed / (2 * N) * 1000000000, -- nanoseconds
+})
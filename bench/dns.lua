@@ -0,0 +1,106 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- DNS query rate: BENCH_DNS_CONCURRENCY coroutines share a resolver pool
+-- and issue BENCH_DNS_QUERIES queries, each for a distinct name so that
+-- neither coalescing nor caching applies, against a local UDP server
+-- which answers every query immediately.
+--
+require"regress".export".*"
+
+local bench = require"bench"
+local config = require"cqueues.dns.config"
+local resolvers = require"cqueues.dns.resolvers"
+
+local monotime = cqueues.monotime
+
+local N = bench.getenv("DNS_QUERIES", 20000)
+local C = bench.getenv("DNS_CONCURRENCY", 32)
+
+local cq = cqueues.new()
+
+local srv = socket.listen{ host = "127.0.0.1", port = 0, type = socket.SOCK_DGRAM }
+check(srv:listen())
+local _, _, port = check(srv:localname())
+
+local function u16(n)
+	return string.char(math.floor(n / 256) % 256, n % 256)
+end
+
+local served = 0
+
+cq:wrap(function ()
+	while true do
+		local msgs, peers = srv:recvmany(nil, 512)
+
+		if not msgs then
+			break
+		end
+
+		local replies = {}
+
+		for i = 1, #msgs do
+			local query = msgs[i]
+
+			replies[i] = { query:sub(1, 2) .. u16(0x8580) .. u16(1) .. u16(1) .. u16(0) .. u16(0)
+				.. query:sub(13)
+				.. u16(0xc00c) .. u16(1) .. u16(1) .. u16(0) .. u16(300) .. u16(4) .. string.char(10, 1, 2, 3),
+				peers[i] }
+		end
+
+		served = served + #msgs
+		srv:sendmany(replies)
+	end
+end)
+
+local samples, issued, done = {}, 0, 0
+local t0, elapsed
+
+cq:wrap(function ()
+	local cfg = config.new{
+		nameserver = { string.format("[127.0.0.1]:%d", port) },
+		search = { },
+		lookup = { "bind" },
+	}
+	local pool = check(resolvers.new(cfg, nil, nil, false))
+	local finished = condition.new()
+
+	t0 = monotime()
+
+	for _ = 1, C do
+		cq:wrap(function ()
+			while issued < N do
+				issued = issued + 1
+
+				local t1 = monotime()
+
+				check(pool:query(string.format("q%d.bench.test.", issued), "A", "IN", 5))
+				samples[#samples + 1] = monotime() - t1
+			end
+
+			done = done + 1
+			finished:signal()
+		end)
+	end
+
+	while done < C do
+		finished:wait()
+	end
+
+	elapsed = monotime() - t0
+	srv:close()
+end)
+
+check(cq:loop())
+
+bench.report("dns", {
+	queries = N,
+	concurrency = C,
+	served = served,
+	elapsed = elapsed,
+	rate = N / elapsed,
+	latency = bench.latency(samples),
+})
@@ -0,0 +1,165 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Echo round-trip latency and streaming throughput over TCP, UNIX and
+-- TLS sockets. The server side is the line echo loop of
+-- examples/echo.srv. Each transport gets one connection for latency,
+-- with one line in flight at a time, and one for throughput, which
+-- streams BENCH_ECHO_BYTES through the echo.
+--
+require"regress".export".*"
+
+local bench = require"bench"
+
+local monotime = cqueues.monotime
+
+local ROUNDS = bench.getenv("ECHO_ROUNDS", 10000)
+local BYTES = bench.getenv("ECHO_BYTES", 32 * 1024 * 1024)
+local LINE = string.rep("x", 1023) .. "\n"
+
+local function echo(con, ctx)
+	if ctx then
+		check(con:starttls(ctx))
+	end
+
+	for ln in con:lines("*L") do
+		con:write(ln)
+	end
+
+	con:shutdown("w")
+end
+
+local function latency(con)
+	local samples = {}
+
+	check(con:write"ping\n")
+	check(con:flush())
+	check(con:read"*l" == "ping", "echo mismatch") -- warm up
+
+	for i = 1, ROUNDS do
+		local t0 = monotime()
+
+		check(con:write"ping\n")
+		check(con:flush())
+		check(con:read"*l")
+
+		samples[i] = monotime() - t0
+	end
+
+	con:close()
+
+	return bench.latency(samples)
+end
+
+local function throughput(cq, con)
+	local rounds = math.max(1, math.floor(BYTES / #LINE))
+	local rcvd, t0, elapsed = 0
+
+	t0 = monotime()
+
+	cq:wrap(function ()
+		for _ = 1, rounds do
+			check(con:write(LINE))
+		end
+
+		check(con:flush())
+		con:shutdown("w")
+	end)
+
+	while true do
+		local buf = con:read(65536)
+
+		if not buf then
+			break
+		end
+
+		rcvd = rcvd + #buf
+	end
+
+	elapsed = monotime() - t0
+	check(rcvd == rounds * #LINE, "lost %d bytes", rounds * #LINE - rcvd)
+
+	con:close()
+
+	return rcvd, elapsed
+end
+
+local function run(name, lso, connect, srvctx)
+	local cq = cqueues.new()
+	local result = {}
+
+	check(lso:listen())
+
+	cq:wrap(function ()
+		for _ = 1, 2 do
+			local con = check(lso:accept())
+
+			con:setmode("bl", "bl")
+			cq:wrap(echo, con, srvctx)
+		end
+	end)
+
+	cq:wrap(function ()
+		local con = check(connect())
+
+		con:setmode("bl", "bl")
+
+		if srvctx then
+			check(con:starttls())
+		end
+
+		result.latency = latency(con)
+
+		con = check(connect())
+		con:setmode("bl", "bf")
+
+		if srvctx then
+			check(con:starttls())
+		end
+
+		result.bytes, result.elapsed = throughput(cq, con)
+		result.throughput = result.bytes / result.elapsed
+	end)
+
+	check(cq:loop())
+	lso:close()
+
+	bench.report(name, result)
+end
+
+-- TCP
+local lso = check(socket.listen("127.0.0.1", 0))
+check(lso:listen())
+local _, host, port = check(lso:localname())
+
+run("echo.tcp", lso, function ()
+	return socket.connect(host, port)
+end)
+
+-- UNIX
+local path = os.tmpname()
+os.remove(path)
+
+run("echo.unix", check(socket.listen{ path = path, unlink = true }), function ()
+	return socket.connect{ path = path }
+end)
+
+os.remove(path)
+
+-- TLS, if luaossl is around to make a certificate
+local ok, ctx = pcall(getsslctx, "TLS", true)
+
+if ok then
+	lso = check(socket.listen("127.0.0.1", 0))
+	check(lso:listen())
+	_, host, port = check(lso:localname())
+
+	run("echo.tls", lso, function ()
+		return socket.connect(host, port)
+	end, ctx)
+else
+	bench.report("echo.tls", { skipped = tostring(ctx) })
+end
@@ -0,0 +1,88 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Measure read-side scanning throughput, in bytes per second, for the
+-- line, header and boundary read modes. Each run pushes the same payload
+-- through a socket pair and times only the reader.
+--
+require"regress".export".*"
+
+local bench = require"bench"
+
+local monotime = cqueues.monotime
+
+local TOTAL = bench.getenv("BYTES", 64 * 1024 * 1024)
+
+local function payload(unit)
+	local n = math.max(1, math.floor(65536 / #unit))
+	return string.rep(unit, n)
+end
+
+local line = string.rep("x", 78) .. "\r\n"
+local header = "X-Bench-Header: " .. string.rep("v", 61) .. "\r\n"
+local marker = "--cqueues-bench-boundary"
+
+local function drain(fmt, mode)
+	return function (con)
+		while con:xread(fmt, mode) do end
+	end
+end
+
+local modes = {
+	{ name = "*l", unit = line, drain = drain("*l", "b") },
+	{ name = "*L", unit = line, drain = drain("*L", "b") },
+	{ name = "*l/t", unit = line, drain = drain("*l", "t") },
+	{ name = "*h", unit = header, drain = drain("*h", "b") },
+	{ name = "*H", unit = header, drain = drain("*H", "b") },
+	{ name = "--", unit = string.rep("b", 4094) .. "\r\n" .. marker .. "\r\n",
+	  drain = function (con)
+		repeat
+			while con:xread(marker, "b") do end
+		until not con:xread("*l", "b")
+	  end },
+}
+
+local function run(mode)
+	local rd, wr = check(socket.pair())
+	local block = payload(mode.unit)
+	local rounds = math.max(1, math.floor(TOTAL / #block))
+	local cq = cqueues.new()
+	local elapsed
+
+	cq:wrap(function ()
+		for _ = 1, rounds do
+			check(wr:write(block))
+		end
+		check(wr:flush())
+		wr:shutdown"w"
+	end)
+
+	cq:wrap(function ()
+		local t0 = monotime()
+
+		mode.drain(rd)
+
+		elapsed = monotime() - t0
+	end)
+
+	check(cq:loop())
+
+	rd:close()
+	wr:close()
+
+	return rounds * #block, elapsed
+end
+
+for _, mode in ipairs(modes) do
+	local nbytes, elapsed = run(mode)
+
+	bench.report("scan", {
+		mode = mode.name,
+		bytes = nbytes,
+		elapsed = elapsed,
+		throughput = nbytes / elapsed,
+	})
+end
@@ -0,0 +1,137 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Cross-thread messaging. thread.pipe measures round-trip latency and
+-- streaming rate of lines echoed by a cqueues.thread over its pipe;
+-- thread.channel measures the rate of values sent to the main thread
+-- over a cqueues.channel.
+--
+require"regress".export".*"
+
+local bench = require"bench"
+local channel = require"cqueues.channel"
+
+local monotime = cqueues.monotime
+
+local ROUNDS = bench.getenv("THREAD_ROUNDS", 10000)
+local MESSAGES = bench.getenv("THREAD_MESSAGES", 100000)
+local CHANSIZE = bench.getenv("CHANNEL_SIZE", 64)
+
+do
+	local thr, pipe = check(thread.start(function (pipe)
+		local cq = require"cqueues".new()
+
+		cq:wrap(function ()
+			pipe:setmode("bl", "bl")
+
+			for ln in pipe:lines("*L") do
+				pipe:write(ln)
+			end
+
+			pipe:shutdown("w")
+		end)
+
+		assert(cq:loop())
+	end))
+
+	local cq = cqueues.new()
+	local result = {}
+
+	pipe:setmode("bl", "bl")
+
+	cq:wrap(function ()
+		local samples = {}
+
+		for i = 1, ROUNDS do
+			local t0 = monotime()
+
+			check(pipe:write"ping\n")
+			check(pipe:read"*l")
+
+			samples[i] = monotime() - t0
+		end
+
+		result.latency = bench.latency(samples)
+
+		local t0, rcvd = monotime(), 0
+
+		cq:wrap(function ()
+			pipe:setmode("bl", "bf")
+
+			for i = 1, MESSAGES do
+				check(pipe:write(i, "\n"))
+			end
+
+			check(pipe:flush())
+			pipe:shutdown("w")
+		end)
+
+		for _ in pipe:lines("*l") do
+			rcvd = rcvd + 1
+		end
+
+		check(rcvd == MESSAGES, "lost %d messages", MESSAGES - rcvd)
+
+		result.messages = MESSAGES
+		result.elapsed = monotime() - t0
+		result.rate = MESSAGES / result.elapsed
+	end)
+
+	check(cq:loop())
+	check(thr:join())
+
+	bench.report("thread.pipe", result)
+end
+
+do
+	local ch = check(channel.new(CHANSIZE))
+	local t0 = monotime()
+
+	local thr = check(thread.start(function (_, ch, n)
+		local cq = require"cqueues".new()
+
+		cq:wrap(function ()
+			for i = 1, tonumber(n) do
+				assert(ch:send(i))
+			end
+
+			assert(ch:send(false))
+		end)
+
+		assert(cq:loop())
+	end, ch, MESSAGES))
+
+	local cq = cqueues.new()
+	local rcvd = 0
+
+	cq:wrap(function ()
+		while true do
+			local v = ch:recv(10)
+
+			check(v ~= nil, "timeout waiting on channel")
+
+			if not v then
+				break
+			end
+
+			rcvd = rcvd + 1
+		end
+	end)
+
+	check(cq:loop())
+
+	local elapsed = monotime() - t0
+
+	check(thr:join())
+	check(rcvd == MESSAGES, "lost %d messages", MESSAGES - rcvd)
+
+	bench.report("thread.channel", {
+		messages = MESSAGES,
+		size = CHANSIZE,
+		elapsed = elapsed,
+		rate = MESSAGES / elapsed,
+	})
+end
@@ -0,0 +1,52 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Timer churn: BENCH_TIMERS coroutines each sleep BENCH_TIMER_ROUNDS
+-- times, with timeouts spread deterministically over 0-10ms so the
+-- timer tree is continually inserted into and drained.
+--
+require"regress".export".*"
+
+local bench = require"bench"
+
+local monotime = cqueues.monotime
+
+local N = bench.getenv("TIMERS", 100000)
+local ROUNDS = bench.getenv("TIMER_ROUNDS", 3)
+
+local cq = cqueues.new()
+local t0 = monotime()
+
+for i = 1, N do
+	local timeout = ((i * 7919) % 1000) / 100000
+
+	cq:wrap(function ()
+		for _ = 1, ROUNDS do
+			cqueues.sleep(timeout)
+		end
+	end)
+end
+
+local spawn = monotime() - t0
+local kbytes = collectgarbage"count"
+
+t0 = monotime()
+check(cq:loop())
+
+local elapsed = monotime() - t0
+local st = cq:stats()
+
+bench.report("timers", {
+	coroutines = N,
+	rounds = ROUNDS,
+	spawn = spawn,
+	elapsed = elapsed,
+	timers = st.timers,
+	rate = st.timers / elapsed,
+	steps = st.steps,
+	maxstep = st.maxstep,
+	luamem = kbytes * 1024,
+})
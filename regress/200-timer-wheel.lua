@@ -0,0 +1,51 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Timeouts on a cqueue with a timer resolution are kept in a timing wheel
+-- and rounded up to the next tick. Check that they never fire early, that
+-- cancelled timeouts are removed from the wheel, and that the
+-- resulting order is still by deadline.
+--
+require"regress".export".*"
+
+local cq = cqueues.new{ resolution = 0.005 }
+local fired = {}
+
+for i = 1, 50 do
+	local timeout = (i % 10) * 0.013
+
+	cq:wrap(function ()
+		local start = cqueues.monotime()
+
+		cqueues.poll(timeout)
+
+		local elapsed = cqueues.monotime() - start
+		check(elapsed >= timeout, "sleep too short (%g < %g)", elapsed, timeout)
+		fired[#fired + 1] = timeout
+	end)
+end
+
+-- a distant deadline cancelled early by a signal
+local cv = condition.new()
+
+cq:wrap(function ()
+	check(cqueues.poll(cv, 3600) == cv, "condition not signaled")
+end)
+
+cq:wrap(function ()
+	cqueues.sleep(0.02)
+	cv:signal()
+end)
+
+local ok, why = cq:loop()
+check(ok, "%s", tostring(why))
+check(#fired == 50, "only %d of 50 timeouts fired", #fired)
+
+for i = 2, #fired do
+	check(fired[i - 1] <= fired[i], "timeouts fired out of order")
+end
+
+say("OK")
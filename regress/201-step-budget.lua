@@ -0,0 +1,42 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- A step budget caps how many coroutines are resumed per step. Leftover
+-- coroutines stay pending and are resumed, ahead of newly ready ones, on
+-- the following steps.
+--
+require"regress".export".*"
+
+local cq = cqueues.new{ budget = 2, maxevents = 4 }
+local ran = {}
+
+for i = 1, 5 do
+	cq:wrap(function ()
+		ran[#ran + 1] = i
+	end)
+end
+
+check(cq:step(0))
+check(#ran == 2, "resumed %d coroutines with budget of 2", #ran)
+check(cq:timeout() == 0, "leftover coroutines not pending")
+
+check(cq:step(0, { budget = 0 }))
+check(#ran == 5, "per-step budget override ignored (%d resumed)", #ran)
+
+for i = 1, 5 do
+	check(ran[i] == i, "coroutines resumed out of order")
+end
+
+check(cq:empty(), "cqueue not empty")
+
+-- options fixed at creation are rejected rather than silently ignored
+for _, opt in ipairs{ "resolution", "recycle", "edge", "slack" } do
+	local ok, why = pcall(cq.step, cq, 0, { [opt] = 1 })
+
+	check(not ok and tostring(why):match(opt), "step accepted .%s", opt)
+end
+
+say("OK")
@@ -0,0 +1,56 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- With .recycle set, coroutines which return normally are parked and
+-- restarted by later :wrap calls. Coroutines which error are discarded.
+--
+require"regress".export".*"
+
+local cq = cqueues.new{ recycle = 2 }
+local seen = {}
+
+for i = 1, 3 do
+	cq:wrap(function (n)
+		seen[#seen + 1] = n
+		cqueues.sleep(0)
+		return "ignored", n
+	end, i)
+end
+
+check(cq:loop())
+check(#seen == 3, "expected 3 coroutines to run, got %d", #seen)
+
+local hits, misses, parked = cq:recycleinfo()
+check(hits == 0 and misses == 3 and parked == 2, "recycleinfo: %d, %d, %d", hits, misses, parked)
+
+local running = {}
+
+for i = 4, 6 do
+	cq:wrap(function (n)
+		seen[#seen + 1] = n
+		running[cqueues.running()] = true
+		if n == 5 then
+			error("oops", 0)
+		end
+	end, i)
+end
+
+local ok, why = cq:loop()
+check(not ok and why == "oops", "expected error from coroutine")
+check(cq:loop())
+check(#seen == 6, "expected 6 coroutines to run, got %d", #seen)
+
+local n = 0
+for _ in pairs(running) do
+	n = n + 1
+end
+check(n == 3, "reused coroutine ran concurrently with itself")
+
+hits, misses, parked = cq:recycleinfo()
+check(hits == 2 and misses == 4, "recycleinfo: %d, %d, %d", hits, misses, parked)
+check(parked == 2, "expected 2 parked coroutines, got %d", parked)
+
+say("OK")
@@ -0,0 +1,37 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Event objects are allocated from slabs which should be handed back once
+-- a burst of pollers has drained.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+local cv = condition.new()
+
+for i = 1, 1000 do
+	cq:wrap(function ()
+		cqueues.poll(cv)
+	end)
+end
+
+check(cq:step(0))
+
+local peak = cq:meminfo()
+info("peak: live=%d free=%d slab=%d", peak.event.live, peak.event.free, peak.event.slab)
+check(peak.event.live > 0, "no live events while polling")
+check(peak.event.live + peak.event.free <= peak.event.slab, "event accounting exceeds slab size")
+
+cv:signal()
+check(cq:loop())
+
+local idle = cq:meminfo()
+info("idle: live=%d free=%d slab=%d", idle.event.live, idle.event.free, idle.event.slab)
+check(idle.event.live == 0, "events still live after drain")
+check(idle.event.slab < peak.event.slab, "slabs not released after drain")
+check(idle.wakecb.live == 0, "wakecbs still live after drain")
+
+say("OK")
@@ -0,0 +1,46 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- In edge-triggered mode descriptors stay registered between polls and
+-- readiness which arrives while nobody is polling must not be lost.
+--
+require"regress".export".*"
+
+local cq = cqueues.new{ edge = true }
+local a, b = check(socket.pair())
+local got = {}
+
+cq:wrap(function ()
+	for i = 1, 10 do
+		-- give the writer a head start every other line
+		if i % 2 == 0 then
+			cqueues.sleep(0.01)
+		end
+
+		local ln = check(a:read"*l")
+		got[#got + 1] = tonumber(ln)
+	end
+end)
+
+cq:wrap(function ()
+	for i = 1, 10 do
+		check(b:write(i, "\n"))
+		check(b:flush())
+
+		if i % 3 == 0 then
+			cqueues.sleep(0.01)
+		end
+	end
+end)
+
+check(cq:loop(5))
+check(#got == 10, "only %d of 10 lines read", #got)
+
+for i = 1, 10 do
+	check(got[i] == i, "line %d out of order", i)
+end
+
+say("OK")
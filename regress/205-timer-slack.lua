@@ -0,0 +1,57 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Timer slack rounds deadlines up to a common boundary so that timeouts
+-- within the same window are delivered by a single step. Deadlines spread
+-- over less than one window can straddle at most one boundary.
+--
+require"regress".export".*"
+
+local function batch(cq, poll)
+	local early, done = 0, 0
+
+	for i = 1, 10 do
+		cq:wrap(function ()
+			local deadline = cqueues.monotime() + i * 0.01
+
+			poll(i * 0.01)
+
+			if cqueues.monotime() < deadline then
+				early = early + 1
+			end
+
+			done = done + 1
+		end)
+	end
+
+	check(cq:step(0))
+
+	local steps = 0
+
+	while done < 10 do
+		local before = done
+
+		check(cq:step())
+
+		if done > before then
+			steps = steps + 1
+		end
+	end
+
+	check(early == 0, "%d timeouts fired early", early)
+	check(steps <= 2, "expected at most 2 wakeups, got %d", steps)
+	check(cq:empty(), "cqueue not empty")
+end
+
+info("testing per-cqueue slack")
+batch(cqueues.new{ slack = 0.25 }, cqueues.sleep)
+
+info("testing per-poll slack")
+batch(cqueues.new(), function (timeout)
+	cqueues.poll{ timeout = timeout, slack = 0.25 }
+end)
+
+say("OK")
@@ -0,0 +1,62 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Runnable coroutines are resumed highest priority first, but under a step
+-- budget a starved priority level is eventually resumed ahead of others.
+--
+require"regress".export".*"
+
+info("testing resume order")
+do
+	local cq = cqueues.new()
+	local ran = {}
+
+	for _, priority in ipairs{ 0, -2, 3, 1 } do
+		cq:wrap(function ()
+			check(cqueues.setpriority(priority) == 0, "unexpected initial priority")
+			cqueues.poll(0)
+			ran[#ran + 1] = priority
+		end)
+	end
+
+	check(cq:loop())
+	check(#ran == 4, "not all coroutines ran")
+	check(ran[1] == 3 and ran[2] == 1 and ran[3] == 0 and ran[4] == -2, "coroutines resumed out of priority order")
+end
+
+info("testing starvation protection")
+do
+	local cq = cqueues.new{ budget = 1 }
+	local done, steps = false, 0
+
+	for _ = 1, 2 do
+		cq:wrap(function ()
+			cqueues.setpriority(3)
+
+			while not done do
+				cqueues.poll(0)
+			end
+		end)
+	end
+
+	cq:wrap(function ()
+		cqueues.setpriority(-3)
+		cqueues.poll(0)
+		done = true
+	end)
+
+	while not done and steps < 100 do
+		check(cq:step())
+		steps = steps + 1
+	end
+
+	check(done, "low priority coroutine starved")
+	check(cq:loop())
+end
+
+check(not pcall(cqueues.setpriority, 1), "setpriority allowed outside of a controller")
+
+say("OK")
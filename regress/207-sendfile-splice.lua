@@ -0,0 +1,63 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- socket:sendfile copies a file range straight to a socket and
+-- socket:splice relays one socket to another, including any input the
+-- source had already buffered.
+--
+require"regress".export".*"
+
+local data = {}
+for i = 1, 20000 do
+	data[#data + 1] = string.char(97 + i % 26)
+end
+data = table.concat(data)
+
+local fh = check(io.tmpfile())
+check(fh:write(data))
+check(fh:flush())
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	info("testing sendfile")
+	local a, b = check(socket.pair())
+
+	cq:wrap(function ()
+		check(a:sendfile(fh, 100, 10000) == 10000, "short sendfile")
+		check(a:sendfile(fh, 19990) == 10, "sendfile didn't stop at end of file")
+		a:close()
+	end)
+
+	local got = check(b:read"*a")
+	check(got == data:sub(101, 10100) .. data:sub(19991), "sendfile data mismatch")
+	b:close()
+end)
+
+cq:wrap(function ()
+	info("testing splice")
+	local a, b = check(socket.pair())
+	local c, d = check(socket.pair())
+
+	cq:wrap(function ()
+		check(a:write(data))
+		a:close()
+	end)
+
+	-- leave some input buffered in b before splicing the rest
+	check(b:read(10) == data:sub(1, 10), "short read")
+	check(c:splice(b) == #data - 10, "short splice")
+	c:close()
+
+	local got = check(d:read"*a")
+	check(got == data:sub(11), "splice data mismatch")
+	b:close()
+	d:close()
+end)
+
+check(cq:loop())
+
+say("OK")
@@ -0,0 +1,34 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- socket:writev sends a list of strings verbatim, buffering and flushing
+-- whatever the kernel doesn't accept at once, after any output already
+-- buffered by earlier writes.
+--
+require"regress".export".*"
+
+local big = string.rep("x", 1024 * 1024)
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	local a, b = check(socket.pair())
+
+	cq:wrap(function ()
+		a:setmode(nil, "fb")
+		check(a:write"pre:")
+		check(a:writev{ "head\n", big, "\ntail" })
+		check(a:writev{ "", "!" })
+		a:close()
+	end)
+
+	local got = check(b:read"*a")
+	check(got == "pre:head\n" .. big .. "\ntail!", "writev data mismatch")
+	b:close()
+end)
+
+check(cq:loop())
+
+say("OK")
@@ -0,0 +1,55 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- socket:sendmany and socket:recvmany move datagrams in bulk, returning
+-- peer addresses which can be handed straight back to sendmany.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+
+local function udp()
+	local con = socket.listen{ host = "127.0.0.1", port = 0, type = socket.SOCK_DGRAM }
+
+	check(con:listen())
+
+	return con, select(3, check(con:localname()))
+end
+
+cq:wrap(function ()
+	local a, aport = udp()
+	local b, bport = udp()
+	local list = {}
+
+	for i = 1, 100 do
+		list[i] = { "dgram" .. i, "127.0.0.1", bport }
+	end
+
+	check(a:sendmany(list))
+
+	local got = 0
+
+	while got < #list do
+		local msgs, peers = check(b:recvmany(nil, 512, 3))
+
+		for i = 1, #msgs do
+			got = got + 1
+			check(msgs[i] == "dgram" .. got, "datagram %d out of order (%s)", got, msgs[i])
+			check(peers[i][3] == aport, "unexpected peer port (%s)", tostring(peers[i][3]))
+			b:sendmany{ { msgs[i]:upper(), peers[i] } }
+		end
+	end
+
+	local msgs = check(a:recvmany(1, 512, 3))
+	check(msgs[1] == "DGRAM1", "unexpected echo (%s)", tostring(msgs[1]))
+
+	a:close()
+	b:close()
+end)
+
+check(cq:loop())
+
+say("OK")
@@ -0,0 +1,56 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- socket:starttls{ ktls = true } requests kernel TLS offload. Whether or
+-- not the kernel and OpenSSL cooperate, the session must behave exactly
+-- like userspace TLS, including socket:sendfile.
+--
+require"regress".export".*"
+
+local context = require"openssl.ssl.context"
+
+local cq = cqueues.new()
+local key, crt = genkey()
+local srv = context.new("TLS", true)
+local text = string.rep("0123456789abcdef", 4096)
+
+srv:setCertificate(crt)
+srv:setPrivateKey(key)
+
+local fh = check(io.tmpfile())
+check(fh:write(text))
+check(fh:flush())
+
+local lso = check(socket.listen("127.0.0.1", 0))
+local _, host, port = check(lso:localname())
+
+cq:wrap(function ()
+	local con = check(lso:accept())
+
+	check(con:starttls{ context = srv, ktls = true })
+	check(con:write"hello\n")
+	check(con:sendfile(fh) == #text, "short sendfile")
+	check(con:flush())
+	con:shutdown"w"
+
+	check(con:read"*l" == "bye", "unexpected reply")
+	con:close()
+end)
+
+cq:wrap(function ()
+	local con = check(socket.connect(host, port))
+
+	check(con:starttls{ ktls = true })
+	check(con:read"*l" == "hello", "unexpected greeting")
+	check(con:read(#text) == text, "sendfile data mismatch")
+	check(con:write"bye\n")
+	check(con:flush())
+	con:close()
+end)
+
+check(cq:loop())
+
+say("OK")
@@ -0,0 +1,59 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Client sockets started with starttls{ cache = true } store their
+-- session in the process-wide cache and resume it on the next connection
+-- to the same server.
+--
+require"regress".export".*"
+
+local context = require"openssl.ssl.context"
+
+local cq = cqueues.new()
+local key, crt = genkey()
+local srv = context.new("TLS", true)
+
+srv:setCertificate(crt)
+srv:setPrivateKey(key)
+
+local lso = check(socket.listen("127.0.0.1", 0))
+local _, host, port = check(lso:localname())
+local before = socket.sessioncache()
+
+cq:wrap(function ()
+	for i = 1, 3 do
+		local con = check(lso:accept())
+
+		check(con:starttls(srv))
+		check(con:write"hello\n")
+		check(con:flush())
+		check(con:read"*l" == "bye", "unexpected reply")
+		con:close()
+	end
+end)
+
+cq:wrap(function ()
+	for i = 1, 3 do
+		local con = check(socket.connect(host, port))
+
+		check(con:starttls{ cache = true })
+		check(con:read"*l" == "hello", "unexpected greeting")
+		check(con:write"bye\n")
+		check(con:flush())
+		con:close()
+	end
+end)
+
+check(cq:loop())
+
+local after = socket.sessioncache()
+info("hits:%d misses:%d count:%d", after.hits - before.hits, after.misses - before.misses, after.count)
+check(after.hits - before.hits == 2, "expected two resumed sessions")
+check(after.misses - before.misses == 1, "expected one full handshake")
+
+check(socket.sessioncache(0).count == 0, "cache not emptied")
+
+say("OK")
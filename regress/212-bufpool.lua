@@ -0,0 +1,52 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Socket buffers come from a shared pool and are given back once they
+-- drain, and socket:setmaxbuf caps how large they may grow.
+--
+require"regress".export".*"
+
+local big = string.rep("x", 256 * 1024)
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	local a, b = check(socket.pair())
+	local base = socket.bufpool().inuse
+
+	cq:wrap(function ()
+		check(a:write(big))
+		check(a:flush())
+	end)
+
+	check(b:read(#big) == big, "data mismatch")
+
+	local st = socket.bufpool()
+	check(st.inuse == base, "drained buffers still held (%d bytes)", st.inuse - base)
+	check(st.pooled > 0, "nothing returned to the pool")
+
+	-- capped input buffer can't hold a larger block
+	b:setmaxbuf(16384)
+	b:onerror(function (_, _, why) return why end)
+
+	cq:wrap(function ()
+		check(a:write(big))
+		check(a:flush())
+	end)
+
+	local data, why = b:read(#big)
+	check(not data and why == errno.ENOBUFS, "expected ENOBUFS (%s)", tostring(why))
+
+	a:close()
+	b:close()
+end)
+
+check(cq:loop())
+
+local st = socket.bufpool{ retain = 0 }
+check(st.pooled == 0, "pool not trimmed")
+socket.bufpool{ retain = 8 * 1024 * 1024 }
+
+say("OK")
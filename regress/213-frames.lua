@@ -0,0 +1,49 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Length-prefixed frames written with the "F" mode flag come back whole
+-- from the "*f" read format, and oversized frames are refused.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	local a, b = check(socket.pair())
+	local big = string.rep("\r\n", 100000)
+
+	cq:wrap(function ()
+		check(a:xwrite("hello", "F"))
+		check(a:xwrite("", "F"))
+		check(a:xwrite(big, "F"))
+	end)
+
+	check(b:xread("*f") == "hello", "short frame mismatch")
+	check(b:xread("*f") == "", "empty frame mismatch")
+	check(b:xread("*f") == big, "large frame mismatch")
+
+	-- raw prefix interleaved with ordinary reads
+	check(a:xwrite("\0\0\0\3abcxyz\n", "bn"))
+	check(b:read("*f", "*l") == "abc", "raw frame mismatch")
+
+	a:setmaxframe(nil, 8)
+	a:onerror(function (_, _, why) return why end)
+	local ok, why = a:xwrite("too long for limit", "F")
+	check(not ok and why == errno.EMSGSIZE, "expected EMSGSIZE on write (%s)", tostring(why))
+
+	b:setmaxframe(8)
+	b:onerror(function (_, _, why) return why end)
+	check(a:xwrite("\0\0\1\0", "bn"))
+	local data, why = b:xread("*f")
+	check(not data and why == errno.EMSGSIZE, "expected EMSGSIZE on read (%s)", tostring(why))
+
+	a:close()
+	b:close()
+end)
+
+check(cq:loop())
+
+say("OK")
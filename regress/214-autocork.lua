@@ -0,0 +1,40 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- With auto-cork enabled, writes made by several coroutines in one step
+-- stay buffered until the step ends and then arrive together.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+local a, b = check(socket.pair())
+
+check(a:setautocork(true) == false, "auto-cork should default to off")
+a:setmode(nil, "bn")
+
+for i = 1, 3 do
+	cq:wrap(function ()
+		check(a:write("piece", i, "\n"))
+
+		-- nothing has left the buffer yet within this step
+		check(select(2, a:pending()) > 0, "write was not corked")
+	end)
+end
+
+cq:wrap(function ()
+	b:settimeout(2)
+
+	for i = 1, 3 do
+		check(b:read"*l" == "piece" .. i, "unexpected line")
+	end
+
+	a:close()
+	b:close()
+end)
+
+check(cq:loop())
+
+say("OK")
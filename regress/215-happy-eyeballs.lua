@@ -0,0 +1,33 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- With .happy set, connecting to a name resolving to both IPv6 and IPv4
+-- addresses races the families and keeps whichever attempt wins.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+local srv = check(socket.listen{ host = "127.0.0.1", port = 0 })
+check(srv:listen())
+local _, _, port = srv:localname()
+
+cq:wrap(function ()
+	local con = check(srv:accept{ timeout = 3 })
+	check(con:write("hello\n"))
+	con:close()
+end)
+
+cq:wrap(function ()
+	-- ::1 is tried first and refused (or unreachable); 127.0.0.1 wins
+	local con = check(socket.connect{ host = "localhost", port = port, happy = 0.05 })
+	check(con:connect(3))
+	check(con:read"*l" == "hello", "unexpected data")
+	con:close()
+end)
+
+check(cq:loop())
+
+say("OK")
@@ -0,0 +1,67 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- cqueues.server runs several SO_REUSEPORT workers on one port, serves
+-- connections from each, and drains cleanly.
+--
+require"regress".export".*"
+
+local server = require"cqueues.server"
+
+-- every worker must bind the same port, so pick a free one up front
+local probe = check(socket.listen{ host = "127.0.0.1", port = 0, reuseport = true })
+check(probe:listen())
+local _, _, port = check(probe:localname())
+probe:close()
+
+local draining = false
+
+local srv = server.new{
+	host = "127.0.0.1",
+	port = port,
+	workers = 2,
+	handler = function (con, id)
+		con:write(tostring(id), "\n")
+		con:close()
+	end,
+	onerror = function (_, id, msg)
+		check(not draining, "worker %d: error during drain: %s", id, msg)
+		info("worker %d: %s", id, msg)
+	end,
+}
+
+check(server.type(srv) == "server", "server.type failed")
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	check(srv:run())
+end)
+
+cq:wrap(function ()
+	local deadline = cqueues.monotime() + 5
+
+	while srv:ready() < 2 do
+		check(cqueues.monotime() < deadline, "workers never became ready")
+		cqueues.sleep(0.05)
+	end
+
+	for i = 1, 8 do
+		local con = check(socket.connect("127.0.0.1", port))
+		local id = tonumber(con:read"*l")
+
+		check(id == 1 or id == 2, "unexpected worker id")
+		con:close()
+	end
+
+	draining = true
+	check(srv:drain(5))
+end)
+
+check(cq:loop())
+check(srv.restarts == 0, "worker restarted unexpectedly")
+
+say("OK")
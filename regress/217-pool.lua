@@ -0,0 +1,60 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- cqueues.pool runs registered jobs on persistent worker threads and
+-- yields callers until their results are ready.
+--
+require"regress".export".*"
+
+local pool = require"cqueues.pool"
+
+local cq = cqueues.new()
+local P = pool.new{ threads = 2 }
+
+check(pool.type(P) == "pool", "pool.type failed")
+
+check(P:register("sum", function (t)
+	local n = 0
+
+	for _, v in ipairs(t) do
+		n = n + v
+	end
+
+	return n, #t
+end))
+
+check(P:register("fail", function () error("oops", 0) end))
+check(P:register("rep", "string", "rep"))
+
+cq:wrap(function ()
+	local n, count = P:submit("sum", { 1, 2, 3, 4 })
+	check(n == 10 and count == 4, "unexpected sum result")
+
+	check(P:submit("rep", "ab", 3) == "ababab", "module job failed")
+
+	local ok, why = P:submit("fail")
+	check(ok == nil and why == "oops", "expected job error (%s)", tostring(why))
+
+	ok, why = P:submit("missing")
+	check(ok == nil and why:match"no such job", "expected missing job error")
+
+	-- several jobs in flight share the workers
+	local jobs = {}
+
+	for i = 1, 8 do
+		jobs[i] = check(P:async("sum", { i, i }))
+	end
+
+	for i = 1, 8 do
+		check(jobs[i]:get(5) == 2 * i, "job %d result mismatch", i)
+	end
+
+	P:close()
+end)
+
+check(cq:loop())
+
+say("OK")
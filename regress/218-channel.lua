@@ -0,0 +1,58 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Messages sent on a channel from another thread arrive in order and
+-- with their types intact, and a full channel makes senders wait.
+--
+require"regress".export".*"
+
+local channel = require"cqueues.channel"
+
+local N = 10000
+local ch = check(channel.new(16))
+
+check(channel.type(ch) == "channel", "channel.type failed")
+check(ch:size() == 16, "unexpected channel size")
+
+local thr = check(thread.start(function (pipe, ch, n)
+	local cq = require"cqueues".new()
+
+	cq:wrap(function ()
+		for i = 1, tonumber(n) do
+			assert(ch:send(i))
+		end
+
+		assert(ch:send("short"))
+		assert(ch:send(string.rep("x", 1000)))
+		assert(ch:send(false))
+		assert(ch:send(0.5))
+	end)
+
+	assert(cq:loop())
+end, ch, N))
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	for i = 1, N do
+		local v = ch:recv(5)
+		check(v == i, "expected %d, got %s", i, tostring(v))
+	end
+
+	check(ch:recv(5) == "short", "short string mismatch")
+	check(ch:recv(5) == string.rep("x", 1000), "long string mismatch")
+	check(ch:recv(5) == false, "boolean mismatch")
+	check(ch:recv(5) == 0.5, "number mismatch")
+
+	local v, why = ch:recv(0.1)
+	check(v == nil and why == errno.ETIMEDOUT, "expected timeout on empty channel")
+
+	check(thr:join(5))
+end)
+
+check(cq:loop())
+
+say("OK")
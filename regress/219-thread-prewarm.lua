@@ -0,0 +1,43 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Threads started from a pre-warmed pool behave like ordinary ones,
+-- including when more are started than there are idle threads.
+--
+require"regress".export".*"
+
+check(thread.prewarm(2))
+
+local threads = {}
+
+for i = 1, 6 do
+	local thr, pipe = check(thread.start(function (pipe, i)
+		local errno = require"cqueues.errno"
+
+		assert(errno.EAGAIN, "cqueues modules not loaded")
+		assert(pipe:write(string.format("%d\n", tonumber(i) * 2)))
+		assert(pipe:flush())
+	end, tostring(i)))
+
+	threads[i] = { thr = thr, pipe = pipe }
+end
+
+local cq = cqueues.new()
+
+for i, t in ipairs(threads) do
+	cq:wrap(function ()
+		local ln = check(t.pipe:read"*l")
+
+		check(tonumber(ln) == i * 2, "thread %d: unexpected result (%s)", i, ln)
+		check(t.thr:join())
+	end)
+end
+
+check(cq:loop())
+
+check(thread.prewarm(0))
+
+say("OK")
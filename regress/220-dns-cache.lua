@@ -0,0 +1,81 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Resolvers in a pool share one answer cache: repeated queries, positive
+-- and negative, reach the nameserver only once.
+--
+require"regress".export".*"
+
+local config = require"cqueues.dns.config"
+local resolvers = require"cqueues.dns.resolvers"
+local dnscache = require"cqueues.dns.cache"
+local packet = require"cqueues.dns.packet"
+
+local cq = cqueues.new()
+
+local srv = socket.listen{ host = "127.0.0.1", port = 0, type = socket.SOCK_DGRAM }
+check(srv:listen())
+local _, _, port = check(srv:localname())
+
+local served = 0
+
+-- answer A queries for www.* with 10.1.2.3, everything else NXDOMAIN
+local function respond(query)
+	return dnsreply(query, (query:sub(14, 16) == "www") and "\10\1\2\3" or nil)
+end
+
+cq:wrap(function ()
+	while true do
+		local msgs, peers = srv:recvmany(nil, 512)
+
+		if not msgs then
+			break
+		end
+
+		for i = 1, #msgs do
+			served = served + 1
+			srv:sendmany{ { respond(msgs[i]), peers[i] } }
+		end
+	end
+end)
+
+cq:wrap(function ()
+	local cfg = config.new{
+		nameserver = { string.format("[127.0.0.1]:%d", port) },
+		search = { },
+		lookup = { "bind" },
+	}
+	local cache = check(dnscache.new{ size = 16 })
+	local pool = check(resolvers.new(cfg, nil, nil, cache))
+
+	check(dnscache.type(pool:cache()) == "dns cache", "pool has no cache")
+
+	for _ = 1, 3 do
+		local ans = check(pool:query("www.cache.test.", "A", "IN", 5))
+		check(ans:count(packet.section.ANSWER) == 1, "no answer records")
+
+		ans = check(pool:query("nx.cache.test.", "A", "IN", 5))
+		check(ans:count(packet.section.ANSWER) == 0, "unexpected answer records")
+	end
+
+	check(served == 2, "expected 2 queries on the wire, got %d", served)
+
+	local st = cache:stat()
+	check(st.hits == 4 and st.negative == 2 and st.inserts == 2, "unexpected cache statistics")
+
+	check(cache:flush())
+	check(pool:query("www.cache.test.", "A", "IN", 5))
+	check(served == 3, "flushed cache still answered")
+
+	local uncached = check(resolvers.new(cfg, nil, nil, false))
+	check(uncached:cache() == nil, "cache not disabled")
+
+	srv:close()
+end)
+
+check(cq:loop())
+
+say("OK")
@@ -0,0 +1,80 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Identical concurrent queries through a resolver pool are coalesced
+-- into one query on the wire, even with answer caching disabled.
+--
+require"regress".export".*"
+
+local config = require"cqueues.dns.config"
+local resolvers = require"cqueues.dns.resolvers"
+local packet = require"cqueues.dns.packet"
+
+local N = 50
+
+local cq = cqueues.new()
+
+local srv = socket.listen{ host = "127.0.0.1", port = 0, type = socket.SOCK_DGRAM }
+check(srv:listen())
+local _, _, port = check(srv:localname())
+
+local served = 0
+
+cq:wrap(function ()
+	while true do
+		local msgs, peers = srv:recvmany(nil, 512)
+
+		if not msgs then
+			break
+		end
+
+		for i = 1, #msgs do
+			local query = msgs[i]
+
+			served = served + 1
+
+			-- answer slowly so that every caller piles up behind us
+			cqueues.sleep(0.2)
+
+			srv:sendmany{ { dnsreply(query, "\10\1\2\3"), peers[i] } }
+		end
+	end
+end)
+
+cq:wrap(function ()
+	local cfg = config.new{
+		nameserver = { string.format("[127.0.0.1]:%d", port) },
+		search = { },
+		lookup = { "bind" },
+	}
+	local pool = check(resolvers.new(cfg, nil, nil, false))
+	local answers, ndone, done = {}, 0, condition.new()
+
+	for i = 1, N do
+		cq:wrap(function ()
+			answers[i] = check(pool:query("www.coalesce.test.", i % 2 == 0 and "A" or 1, "IN", 5))
+			ndone = ndone + 1
+			done:signal()
+		end)
+	end
+
+	while ndone < N do
+		done:wait()
+	end
+
+	check(served == 1, "expected 1 query on the wire, got %d", served)
+
+	for i = 2, N do
+		check(answers[i] ~= answers[1], "answer packet shared between callers")
+		check(answers[i]:count(packet.section.ANSWER) == 1, "no answer records")
+	end
+
+	srv:close()
+end)
+
+check(cq:loop())
+
+say("OK")
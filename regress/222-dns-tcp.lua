@@ -0,0 +1,101 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Resolvers in a pool pipeline their TCP queries over one connection,
+-- and answers returned out of order reach the right callers.
+--
+require"regress".export".*"
+
+local config = require"cqueues.dns.config"
+local resolvers = require"cqueues.dns.resolvers"
+local packet = require"cqueues.dns.packet"
+
+local N = 8
+
+local cq = cqueues.new()
+
+local srv = check(socket.listen{ host = "127.0.0.1", port = 0 })
+check(srv:listen())
+local _, _, port = check(srv:localname())
+
+local accepted, finished = 0, false
+
+local function respond(query)
+	return dnsframe(dnsreply(query, "\10\1\2\3"))
+end
+
+-- collect every query before answering, then answer in reverse
+local function serve(con)
+	local queries = {}
+
+	con:setmode("b", "b")
+
+	while #queries < N do
+		local len = con:read(2)
+
+		if not len then
+			return
+		end
+
+		queries[#queries + 1] = check(con:read(len:byte(1) * 256 + len:byte(2)))
+	end
+
+	for i = #queries, 1, -1 do
+		check(con:write(respond(queries[i])))
+	end
+
+	check(con:flush())
+	con:close()
+end
+
+cq:wrap(function ()
+	while not finished do
+		local con = srv:accept{ timeout = 0.1 }
+
+		if con then
+			accepted = accepted + 1
+			cq:wrap(serve, con)
+		end
+	end
+end)
+
+cq:wrap(function ()
+	local cfg = config.new{
+		nameserver = { string.format("[127.0.0.1]:%d", port) },
+		search = { },
+		lookup = { "bind" },
+		options = { tcp = config.TCP_ONLY },
+	}
+	local pool = check(resolvers.new(cfg, nil, nil, false))
+	local answers, ndone, done = {}, 0, condition.new()
+
+	for i = 1, N do
+		cq:wrap(function ()
+			answers[i] = check(pool:query(string.format("host%d.pipeline.test.", i), "A", "IN", 5))
+			ndone = ndone + 1
+			done:signal()
+		end)
+	end
+
+	while ndone < N do
+		done:wait()
+	end
+
+	local st = pool:tcp():stat()
+
+	check(accepted == 1, "expected 1 connection, got %d", accepted)
+	check(st.opened == 1 and st.pipelined > 0, "queries not pipelined")
+
+	for i = 1, N do
+		check(answers[i]:count(packet.section.ANSWER) == 1, "no answer records")
+	end
+
+	finished = true
+end)
+
+check(cq:loop())
+
+say("OK")
@@ -0,0 +1,66 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- A recursive notifier reports changes anywhere in the subtree, tracks
+-- directories made after it was opened, and coalesces a burst of writes
+-- to one file into a single entry of a single batch.
+--
+require"regress".export".*"
+
+local notify = require"cqueues.notify"
+
+local top = os.tmpname()
+os.remove(top)
+check(os.execute(string.format("mkdir -p '%s/a/b'", top)))
+
+local nfy, why = notify.opendir(top, notify.ALL, { recursive = true, window = 0.2 })
+
+if not nfy then
+	check(why == errno.ENOTSUP, "notify.opendir: %s", errno.strerror(why))
+	info("recursive notification not supported")
+	os.execute(string.format("rm -rf '%s'", top))
+	say("OK")
+	return
+end
+
+local function write(path, data)
+	local fh = check(io.open(top .. "/" .. path, "a"))
+	check(fh:write(data))
+	fh:close()
+end
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	for i = 1, 100 do
+		write("a/b/burst", tostring(i))
+	end
+
+	check(os.execute(string.format("mkdir -p '%s/a/new/deeper'", top)))
+	write("a/new/deeper/file", "x")
+
+	local seen, batches = {}, 0
+
+	while not (seen["a/b/burst"] and seen["a/new/deeper/file"]) do
+		local batch = check(nfy:batch(5), "timeout waiting for changes")
+
+		batches = batches + 1
+
+		for name, changes in pairs(batch) do
+			info("%s: %s", name, table.concat({ notify.strflag(changes) }, ","))
+			seen[name] = true
+		end
+	end
+
+	check(batches <= 2, "expected writes coalesced into at most 2 batches, got %d", batches)
+	check(not pcall(nfy.add, nfy, "a"), "add unexpectedly allowed on recursive notifier")
+end)
+
+check(cq:loop())
+
+os.execute(string.format("rm -rf '%s'", top))
+
+say("OK")
@@ -0,0 +1,48 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- The controller counts steps, resumes and timers, fills its latency
+-- histograms, and zeroes everything on request.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+
+for i = 1, 10 do
+	cq:wrap(function ()
+		cqueues.sleep(0.01)
+	end)
+end
+
+check(cq:loop())
+
+local st = cq:stats(true)
+info("steps=%d waits=%d resumes=%d timers=%d ctls=%d", st.steps, st.waits, st.resumes, st.timers, st.ctls)
+check(st.steps > 0 and st.waits == st.steps, "steps and waits disagree (%d, %d)", st.steps, st.waits)
+check(st.resumes == 20, "expected 20 resumes, got %d", st.resumes)
+check(st.timers == 10, "expected 10 timers fired, got %d", st.timers)
+check(st.waittime >= 0.005, "wait time not accounted (%f)", st.waittime)
+check(st.maxresume <= st.resumetime, "longest resume exceeds total")
+
+local function total(hist)
+	local n = 0
+
+	for i = 1, #hist do
+		n = n + hist[i]
+	end
+
+	return n
+end
+
+check(total(st.resumehist) == st.resumes, "resume histogram doesn't match resume count")
+check(total(st.stephist) == st.steps, "step histogram doesn't match step count")
+check(st.memory.event, "no memory info")
+
+local zero = cq:stats()
+check(zero.steps == 0 and zero.resumes == 0, "counters not reset")
+check(total(zero.resumehist) == 0, "histogram not reset")
+
+say("OK")
@@ -0,0 +1,64 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- The trace ring is off by default, records steps, polls, resumes and
+-- timer expiries once enabled, keeps only the newest records once it
+-- wraps, and is freed by :trace(false).
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+
+check(cq:trace() == 0, "tracing enabled by default")
+check(#cq:tracedump() == 0, "records from a disabled ring")
+
+local size = cq:trace(1000)
+check(size == 1024, "expected ring rounded up to 1024, got %d", size)
+
+for i = 1, 4 do
+	cq:wrap(function ()
+		cqueues.sleep(0.01)
+	end)
+end
+
+check(cq:loop())
+
+local seen, last = {}, 0
+
+for _, rec in ipairs(cq:tracedump()) do
+	check(rec.time >= last, "records out of order")
+	last = rec.time
+	seen[rec.event] = (seen[rec.event] or 0) + 1
+end
+
+for name, n in pairs(seen) do
+	info("%s: %d", name, n)
+end
+
+check(seen.step and seen.wait and seen.wake, "step or poll not traced")
+check(seen.resume == 8 and seen.yield == 8, "expected 8 resumes and yields")
+check(seen.timer == 4, "expected 4 timers, got %d", seen.timer or 0)
+
+local _, count = cq:trace()
+check(count > 0, "no records counted")
+
+-- wrap a small ring
+check(cq:trace(4) == 4)
+
+for i = 1, 10 do
+	cq:wrap(function () end)
+end
+
+check(cq:loop())
+
+local _, count = cq:trace()
+check(count > 4, "expected ring to wrap, only %d records", count)
+check(#cq:tracedump(true) == 4, "wrapped ring should hold exactly 4 records")
+check(#cq:tracedump() == 0, "ring not cleared")
+
+check(cq:trace(false) == 0, "unable to disable tracing")
+
+say("OK")
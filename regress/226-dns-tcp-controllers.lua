@@ -0,0 +1,100 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Queries from different controllers don't share a TCP connection. An
+-- answer read off a shared connection by a query on one controller
+-- would leave the owner on the other asleep until its next poll timeout.
+--
+require"regress".export".*"
+
+local config = require"cqueues.dns.config"
+local resolvers = require"cqueues.dns.resolvers"
+local packet = require"cqueues.dns.packet"
+
+local N = 4 -- queries per controller
+
+local cq = cqueues.new()
+
+local srv = check(socket.listen{ host = "127.0.0.1", port = 0 })
+check(srv:listen())
+local _, _, port = check(srv:localname())
+
+local finished = false
+
+-- answer each query as it arrives, hanging up after N
+local function serve(con)
+	con:setmode("b", "b")
+
+	for _ = 1, N do
+		local len = con:read(2)
+
+		if not len then
+			break
+		end
+
+		local query = check(con:read(len:byte(1) * 256 + len:byte(2)))
+
+		check(con:write(dnsframe(dnsreply(query, "\10\1\2\3"))))
+		check(con:flush())
+	end
+
+	con:close()
+end
+
+cq:wrap(function ()
+	while not finished do
+		local con = srv:accept{ timeout = 0.1 }
+
+		if con then
+			cq:wrap(serve, con)
+		end
+	end
+end)
+
+cq:wrap(function ()
+	local cfg = config.new{
+		nameserver = { string.format("[127.0.0.1]:%d", port) },
+		search = { },
+		lookup = { "bind" },
+		options = { tcp = config.TCP_ONLY },
+	}
+	local pool = check(resolvers.new(cfg, nil, nil, false))
+	local began, nrun, done = cqueues.monotime(), 0, condition.new()
+
+	for _, name in ipairs{ "a", "b" } do
+		local sub = cqueues.new()
+
+		for i = 1, N do
+			sub:wrap(function ()
+				local ans = check(pool:query(string.format("host%d.%s.test.", i, name), "A", "IN", 5))
+
+				check(ans:count(packet.section.ANSWER) == 1, "no answer records")
+			end)
+		end
+
+		cq:wrap(function ()
+			check(sub:loop())
+			nrun = nrun + 1
+			done:signal()
+		end)
+	end
+
+	while nrun < 2 do
+		done:wait()
+	end
+
+	local elapsed = cqueues.monotime() - began
+	local st = pool:tcp():stat()
+
+	check(st.opened == 2, "expected 1 connection per controller, got %d in all", st.opened)
+	check(elapsed < 1, "answers stalled for %.2fs", elapsed)
+
+	finished = true
+end)
+
+check(cq:loop())
+
+say("OK")
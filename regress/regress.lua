@@ -204,6 +204,40 @@ function regress.getsslctx(protocol, accept, keytype)
 	return ctx
 end -- regress.getsslctx
 
+--
+-- Stub nameserver replies for the DNS tests. dnsreply answers a wire
+-- format query with one A record for addr (a 4-byte string), or if addr
+-- is nil with NXDOMAIN and an SOA for "test." in the authority section.
+-- dnsframe adds the 2-byte length prefix used over TCP.
+--
+local function u16(n)
+	return string.char(math.floor(n / 256) % 256, n % 256)
+end -- u16
+
+local function u32(n)
+	return u16(math.floor(n / 65536)) .. u16(n % 65536)
+end -- u32
+
+function regress.dnsreply(query, addr)
+	local qid, question = query:sub(1, 2), query:sub(13)
+
+	if addr then
+		return qid .. u16(0x8580) .. u16(1) .. u16(1) .. u16(0) .. u16(0)
+			.. question
+			.. u16(0xc00c) .. u16(1) .. u16(1) .. u32(300) .. u16(#addr) .. addr
+	else
+		local soa = "\2ns\4test\0" .. "\1h\4test\0" .. u32(1) .. u32(60) .. u32(60) .. u32(60) .. u32(60)
+
+		return qid .. u16(0x8583) .. u16(1) .. u16(0) .. u16(1) .. u16(0)
+			.. question
+			.. "\4test\0" .. u16(6) .. u16(1) .. u32(60) .. u16(#soa) .. soa
+	end
+end -- regress.dnsreply
+
+function regress.dnsframe(msg)
+	return u16(#msg) .. msg
+end -- regress.dnsframe
+
 -- test 87-alpn-disappears relies on package.searchpath
 function regress.searchpath(name, paths, sep, rep)
 	sep = (sep or "."):gsub("[%^%$%(%)%%%.%[%]%*%+%-%?]", "%%%0")
@@ -0,0 +1,593 @@
+/* ==========================================================================
+ * channel.c - Lua Continuation Queues
+ * --------------------------------------------------------------------------
+ * Copyright (c) 2026  William Ahern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * ==========================================================================
+ */
+#include "config.h"
+
+#include <stddef.h>	/* size_t offsetof */
+#include <stdint.h>	/* uint64_t intptr_t */
+#include <stdlib.h>	/* calloc(3) free(3) malloc(3) */
+#include <string.h>	/* memcpy(3) */
+#include <errno.h>	/* EAGAIN EINTR EINVAL ENOMEM */
+
+#include <unistd.h>	/* read(2) write(2) */
+
+#if HAVE_EVENTFD
+#include <sys/eventfd.h> /* eventfd(2) */
+#endif
+
+#include "cqueues.h"
+
+
+/*
+ * Bounded multi-producer, multi-consumer ring of copied values shared
+ * between LWP threads. Each slot carries a sequence number which says
+ * whether it is free for the producer at position pos (seq == pos) or
+ * holds a message for the consumer at pos (seq == pos + 1), so the only
+ * contended writes are the compare-and-swap on the head or tail cursor.
+ *
+ * Receivers sleep on a descriptor. A receiver that finds the ring empty
+ * drains the descriptor, sets .waiting, and looks once more before
+ * reporting EAGAIN. Producers signal only if they observe .waiting, so a
+ * steady stream of messages to a busy receiver costs no syscalls.
+ */
+#ifndef CHAN_DEFSIZE
+#define CHAN_DEFSIZE 1024
+#endif
+
+#ifndef CHAN_MAXSIZE
+#define CHAN_MAXSIZE (1UL << 24)
+#endif
+
+/* strings up to this long are copied into the slot itself */
+#ifndef CHAN_INLINE
+#define CHAN_INLINE 48
+#endif
+
+/* empty polls of the ring before arming a wakeup */
+#ifndef CHAN_SPIN
+#define CHAN_SPIN 64
+#endif
+
+#define CHAN_CACHELINE 64
+
+#if defined __x86_64__ || defined __i386__
+#define chan_pause() __builtin_ia32_pause()
+#elif defined __aarch64__
+#define chan_pause() __asm__ __volatile__ ("yield")
+#else
+#define chan_pause() (void)0
+#endif
+
+struct chan_slot {
+	size_t seq;
+	struct cthread_arg arg;
+	char text[CHAN_INLINE];
+}; /* struct chan_slot */
+
+struct channel {
+	long refs;
+	size_t mask;
+	int fd[2];
+
+	/* keep the cursors off each other's (and .waiting's) cache line */
+	char pad0[CHAN_CACHELINE];
+	size_t tail;
+	char pad1[CHAN_CACHELINE];
+	size_t head;
+	char pad2[CHAN_CACHELINE];
+	int waiting;
+	char pad3[CHAN_CACHELINE];
+
+	struct chan_slot slot[];
+}; /* struct channel */
+
+
+static void chan_alert(struct channel *ch) {
+#if HAVE_EVENTFD
+	static const uint64_t one = 1;
+
+	while (-1 == write(ch->fd[0], &one, sizeof one) && errno == EINTR)
+		;;
+#else
+	while (-1 == write(ch->fd[1], "!", 1) && errno == EINTR)
+		;;
+#endif
+} /* chan_alert() */
+
+
+static void chan_calm(struct channel *ch) {
+#if HAVE_EVENTFD
+	uint64_t n;
+
+	while (-1 == read(ch->fd[0], &n, sizeof n) && errno == EINTR)
+		;;
+#else
+	char buf[64];
+
+	while (0 < read(ch->fd[0], buf, sizeof buf) || errno == EINTR)
+		;;
+#endif
+} /* chan_calm() */
+
+
+static struct channel *chan_open(size_t size, int *_error) {
+	struct channel *ch;
+	size_t n, i;
+	int error;
+
+	for (n = 2; n < size && n < CHAN_MAXSIZE; n <<= 1)
+		;;
+
+	if (!(ch = calloc(1, offsetof(struct channel, slot) + n * sizeof ch->slot[0])))
+		goto syerr;
+
+	ch->refs = 1;
+	ch->mask = n - 1;
+	ch->fd[0] = -1;
+	ch->fd[1] = -1;
+
+	for (i = 0; i < n; i++)
+		ch->slot[i].seq = i;
+
+#if HAVE_EVENTFD
+	if (-1 == (ch->fd[0] = eventfd(0, O_CLOEXEC|O_NONBLOCK)))
+		goto syerr;
+#else
+	if ((error = cqs_pipe(ch->fd, O_CLOEXEC|O_NONBLOCK)))
+		goto error;
+#endif
+
+	return ch;
+syerr:
+	error = errno;
+#if !HAVE_EVENTFD
+error:
+#endif
+	free(ch);
+	*_error = error;
+
+	return NULL;
+} /* chan_open() */
+
+
+static void chan_ref(struct channel *ch) {
+	__atomic_fetch_add(&ch->refs, 1, __ATOMIC_RELAXED);
+} /* chan_ref() */
+
+
+static void chan_unref(struct channel *ch) {
+	size_t pos;
+
+	if (!ch || __atomic_sub_fetch(&ch->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	/* nobody else can see us now; release undelivered strings */
+	for (pos = ch->head; pos != ch->tail; pos++) {
+		struct chan_slot *slot = &ch->slot[pos & ch->mask];
+
+		if (slot->arg.type == LUA_TSTRING && slot->arg.v.string.iov_base != slot->text)
+			free(slot->arg.v.string.iov_base);
+	}
+
+	cqs_closefd(&ch->fd[0]);
+	cqs_closefd(&ch->fd[1]);
+	free(ch);
+} /* chan_unref() */
+
+
+/* claim a free slot for writing; NULL if the ring is full */
+static struct chan_slot *chan_reserve(struct channel *ch, size_t *_pos) {
+	size_t pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+	struct chan_slot *slot;
+	intptr_t dif;
+
+	for (;;) {
+		slot = &ch->slot[pos & ch->mask];
+		dif = (intptr_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ch->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	*_pos = pos;
+
+	return slot;
+} /* chan_reserve() */
+
+
+static void chan_commit(struct channel *ch, struct chan_slot *slot, size_t pos) {
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in chan_wait() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ch->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&ch->waiting, 0, __ATOMIC_ACQ_REL))
+		chan_alert(ch);
+} /* chan_commit() */
+
+
+/* claim the oldest message for reading; NULL if the ring is empty */
+static struct chan_slot *chan_peek(struct channel *ch, size_t *_pos) {
+	size_t pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+	struct chan_slot *slot;
+	intptr_t dif;
+
+	for (;;) {
+		slot = &ch->slot[pos & ch->mask];
+		dif = (intptr_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ch->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	*_pos = pos;
+
+	return slot;
+} /* chan_peek() */
+
+
+/* spin briefly before a receiver has to sleep; producers are often mid-send */
+static struct chan_slot *chan_trypeek(struct channel *ch, size_t *_pos) {
+	static int spin = -1;
+	struct chan_slot *slot;
+	int i;
+
+	/* pointless without another CPU to produce while we spin */
+	if (spin < 0)
+		spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1)? CHAN_SPIN : 0;
+
+	for (i = 0; !(slot = chan_peek(ch, _pos)); i++) {
+		if (i >= spin)
+			return NULL;
+
+		chan_pause();
+	}
+
+	return slot;
+} /* chan_trypeek() */
+
+
+static void chan_release(struct channel *ch, struct chan_slot *slot, size_t pos) {
+	__atomic_store_n(&slot->seq, pos + ch->mask + 1, __ATOMIC_RELEASE);
+} /* chan_release() */
+
+
+/* arm wakeup before sleeping; caller must look at the ring once more */
+static void chan_wait(struct channel *ch) {
+	chan_calm(ch);
+	__atomic_store_n(&ch->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+} /* chan_wait() */
+
+
+static size_t chan_count(struct channel *ch) {
+	size_t head = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+	size_t tail = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+
+	return (tail > head)? tail - head : 0;
+} /* chan_count() */
+
+
+/*
+ * L U A  I N T E R F A C E S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static struct channel *ch_checkself(lua_State *L, int index) {
+	struct channel **ud = luaL_checkudata(L, index, CQS_CHANNEL);
+
+	luaL_argcheck(L, *ud != NULL, index, "closed channel");
+
+	return *ud;
+} /* ch_checkself() */
+
+
+static void ch_push(lua_State *L, struct channel *ch) {
+	struct channel **ud = lua_newuserdata(L, sizeof *ud);
+
+	*ud = ch;
+	luaL_setmetatable(L, CQS_CHANNEL);
+} /* ch_push() */
+
+
+void *cqs_channel_ref(lua_State *L, int index) {
+	struct channel **ud = luaL_testudata(L, index, CQS_CHANNEL);
+
+	if (!ud || !*ud)
+		return NULL;
+
+	chan_ref(*ud);
+
+	return *ud;
+} /* cqs_channel_ref() */
+
+
+void cqs_channel_push(lua_State *L, void *ch) {
+	ch_push(L, ch);
+} /* cqs_channel_push() */
+
+
+void cqs_channel_unref(void *ch) {
+	chan_unref(ch);
+} /* cqs_channel_unref() */
+
+
+static int ch_new(lua_State *L) {
+	lua_Integer size = luaL_optinteger(L, 1, CHAN_DEFSIZE);
+	struct channel **ud;
+	int error;
+
+	luaL_argcheck(L, size > 0, 1, "size must be positive");
+
+	ud = lua_newuserdata(L, sizeof *ud);
+	*ud = NULL;
+	luaL_setmetatable(L, CQS_CHANNEL);
+
+	if (!(*ud = chan_open(size, &error))) {
+		lua_pushnil(L);
+		lua_pushinteger(L, error);
+
+		return 2;
+	}
+
+	return 1;
+} /* ch_new() */
+
+
+static int ch_send(lua_State *L) {
+	struct channel *ch = ch_checkself(L, 1);
+	struct cthread_arg arg = { .type = lua_type(L, 2) };
+	struct chan_slot *slot;
+	char *text = NULL;
+	size_t pos;
+
+	switch (arg.type) {
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		if (lua_isinteger(L, 2)) {
+			arg.v.integer = lua_tointeger(L, 2);
+			arg.isinteger = 1;
+			break;
+		}
+#endif
+		arg.v.number = lua_tonumber(L, 2);
+		break;
+	case LUA_TBOOLEAN:
+		arg.v.boolean = lua_toboolean(L, 2);
+		break;
+	case LUA_TSTRING:
+		arg.v.string.iov_base = (char *)lua_tolstring(L, 2, &arg.v.string.iov_len);
+
+		/* allocate before reserving so a failure can't wedge a slot */
+		if (arg.v.string.iov_len > CHAN_INLINE) {
+			if (!(text = malloc(arg.v.string.iov_len)))
+				return luaL_error(L, "channel:send: %s", cqs_strerror(ENOMEM));
+
+			memcpy(text, arg.v.string.iov_base, arg.v.string.iov_len);
+			arg.v.string.iov_base = text;
+		}
+
+		break;
+	default:
+		return luaL_argerror(L, 2, "string, number or boolean expected");
+	}
+
+	if (!(slot = chan_reserve(ch, &pos))) {
+		free(text);
+
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, EAGAIN);
+
+		return 2;
+	}
+
+	slot->arg = arg;
+
+	if (arg.type == LUA_TSTRING && !text) {
+		memcpy(slot->text, arg.v.string.iov_base, arg.v.string.iov_len);
+		slot->arg.v.string.iov_base = slot->text;
+	}
+
+	chan_commit(ch, slot, pos);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* ch_send() */
+
+
+static int ch_recv(lua_State *L) {
+	struct channel *ch = ch_checkself(L, 1);
+	struct chan_slot *slot;
+	struct cthread_arg arg;
+	char text[CHAN_INLINE];
+	size_t pos;
+
+	if (!(slot = chan_trypeek(ch, &pos))) {
+		chan_wait(ch);
+
+		if (!(slot = chan_peek(ch, &pos))) {
+			lua_pushnil(L);
+			lua_pushinteger(L, EAGAIN);
+
+			return 2;
+		}
+	}
+
+	/* copy out and free the slot before anything can throw */
+	arg = slot->arg;
+
+	if (arg.type == LUA_TSTRING && arg.v.string.iov_base == slot->text) {
+		memcpy(text, slot->text, arg.v.string.iov_len);
+		arg.v.string.iov_base = text;
+	}
+
+	chan_release(ch, slot, pos);
+
+	switch (arg.type) {
+	case LUA_TNUMBER:
+		if (arg.isinteger) {
+			lua_pushinteger(L, arg.v.integer);
+		} else {
+			lua_pushnumber(L, arg.v.number);
+		}
+		break;
+	case LUA_TBOOLEAN:
+		lua_pushboolean(L, arg.v.boolean);
+		break;
+	case LUA_TSTRING:
+		if (arg.v.string.iov_base == text) {
+			lua_pushlstring(L, text, arg.v.string.iov_len);
+		} else {
+			/* NB: leaks if lua_pushlstring throws */
+			lua_pushlstring(L, arg.v.string.iov_base, arg.v.string.iov_len);
+			free(arg.v.string.iov_base);
+		}
+		break;
+	default:
+		lua_pushnil(L);
+		break;
+	}
+
+	return 1;
+} /* ch_recv() */
+
+
+static int ch_count(lua_State *L) {
+	lua_pushinteger(L, chan_count(ch_checkself(L, 1)));
+
+	return 1;
+} /* ch_count() */
+
+
+static int ch_size(lua_State *L) {
+	lua_pushinteger(L, ch_checkself(L, 1)->mask + 1);
+
+	return 1;
+} /* ch_size() */
+
+
+static int ch_pollfd(lua_State *L) {
+	lua_pushinteger(L, ch_checkself(L, 1)->fd[0]);
+
+	return 1;
+} /* ch_pollfd() */
+
+
+static int ch_events(lua_State *L) {
+	ch_checkself(L, 1);
+
+	lua_pushliteral(L, "r");
+
+	return 1;
+} /* ch_events() */
+
+
+static int ch_timeout(lua_State *L) {
+	ch_checkself(L, 1);
+
+	return 0;
+} /* ch_timeout() */
+
+
+static int ch__eq(lua_State *L) {
+	struct channel **a = luaL_testudata(L, 1, CQS_CHANNEL);
+	struct channel **b = luaL_testudata(L, 2, CQS_CHANNEL);
+
+	lua_pushboolean(L, a && b && *a == *b);
+
+	return 1;
+} /* ch__eq() */
+
+
+static int ch__gc(lua_State *L) {
+	struct channel **ud = luaL_checkudata(L, 1, CQS_CHANNEL);
+
+	chan_unref(*ud);
+	*ud = NULL;
+
+	return 0;
+} /* ch__gc() */
+
+
+static int ch_type(lua_State *L) {
+	if (luaL_testudata(L, 1, CQS_CHANNEL)) {
+		lua_pushstring(L, "channel");
+	} else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+} /* ch_type() */
+
+
+static int ch_interpose(lua_State *L) {
+	return cqs_interpose(L, CQS_CHANNEL);
+} /* ch_interpose() */
+
+
+static const luaL_Reg ch_methods[] = {
+	{ "send",    &ch_send },
+	{ "recv",    &ch_recv },
+	{ "count",   &ch_count },
+	{ "size",    &ch_size },
+	{ "pollfd",  &ch_pollfd },
+	{ "events",  &ch_events },
+	{ "timeout", &ch_timeout },
+	{ NULL,      NULL }
+}; /* ch_methods[] */
+
+static const luaL_Reg ch_metamethods[] = {
+	{ "__eq", &ch__eq },
+	{ "__gc", &ch__gc },
+	{ NULL,   NULL }
+}; /* ch_metamethods[] */
+
+static const luaL_Reg ch_globals[] = {
+	{ "new",       &ch_new },
+	{ "type",      &ch_type },
+	{ "interpose", &ch_interpose },
+	{ NULL,        NULL }
+}; /* ch_globals[] */
+
+int luaopen__cqueues_channel(lua_State *L) {
+	cqs_newmetatable(L, CQS_CHANNEL, ch_methods, ch_metamethods, 0);
+
+	luaL_newlib(L, ch_globals);
+
+	return 1;
+} /* luaopen__cqueues_channel() */
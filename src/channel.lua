@@ -0,0 +1,79 @@
+local loader = function(loader, ...)
+	local channel = require"_cqueues.channel"
+	local cqueues = require"cqueues"
+	local errno = require"cqueues.errno"
+	local monotime = cqueues.monotime
+	local poll = cqueues.poll
+	local EAGAIN = errno.EAGAIN
+	local ETIMEDOUT = errno.ETIMEDOUT
+
+	--
+	-- channel:recv
+	--
+	-- Wait for the next message. The channel descriptor only becomes
+	-- readable after a receiver has found the ring empty, so polling
+	-- costs nothing while messages keep arriving.
+	--
+	local recv; recv = channel.interpose("recv", function (self, timeout)
+		local deadline = timeout and (monotime() + timeout)
+
+		while true do
+			local v, why = recv(self)
+
+			if v ~= nil then
+				return v
+			elseif why ~= EAGAIN then
+				return nil, why
+			elseif deadline then
+				local curtime = monotime()
+
+				if curtime >= deadline then
+					return nil, ETIMEDOUT
+				end
+
+				poll(self, deadline - curtime)
+			else
+				poll(self)
+			end
+		end
+	end)
+
+	--
+	-- channel:send
+	--
+	-- Queue a copy of the value. There is no wakeup for senders, so when
+	-- the ring is full retry with a backoff bounded by 50ms.
+	--
+	local send; send = channel.interpose("send", function (self, v, timeout)
+		local deadline = timeout and (monotime() + timeout)
+		local backoff = 0.001
+
+		while true do
+			local ok, why = send(self, v)
+
+			if ok then
+				return true
+			elseif why ~= EAGAIN then
+				return false, why
+			elseif deadline then
+				local curtime = monotime()
+
+				if curtime >= deadline then
+					return false, ETIMEDOUT
+				end
+
+				poll(math.min(backoff, deadline - curtime))
+			else
+				poll(backoff)
+			end
+
+			backoff = math.min(backoff * 2, 0.05)
+		end
+	end)
+
+	channel.loader = loader
+
+	return channel
+end -- loader
+
+return loader(loader, ...)
@@ -25,15 +25,16 @@
  */
 #include "config.h"
 
-#include <limits.h>	/* INT_MAX LONG_MAX */
+#include <limits.h>	/* CHAR_BIT INT_MAX LONG_MAX UINT_MAX */
 #include <float.h>	/* FLT_RADIX */
 #include <stdarg.h>	/* va_list va_start va_end */
-#include <stddef.h>	/* NULL offsetof() size_t */
-#include <stdlib.h>	/* malloc(3) free(3) */
-#include <string.h>	/* memset(3) */
+#include <stddef.h>	/* NULL offsetof() size_t ptrdiff_t */
+#include <stdint.h>	/* UINT64_C UINT64_MAX uint64_t uintptr_t */
+#include <stdlib.h>	/* malloc(3) free(3) posix_memalign(3) */
+#include <string.h>	/* memcpy(3) memset(3) */
 #include <signal.h>	/* sigprocmask(2) pthread_sigmask(3) */
 #include <time.h>	/* struct timespec clock_gettime(3) */
-#include <math.h>	/* FP_* NAN fmax(3) fpclassify(3) isfinite(3) signbit(3) islessequal(3) isgreater(3) ceil(3) modf(3) */
+#include <math.h>	/* FP_* NAN fmax(3) fpclassify(3) isfinite(3) signbit(3) islessequal(3) isgreater(3) ceil(3) modf(3) frexp(3) */
 #include <errno.h>	/* errno */
 #include <assert.h>	/* assert */
 
@@ -321,6 +322,15 @@ static inline double reltimeout(double timeout) {
 } /* reltimeout() */
 
 
+/*
+ * round timeout up to the next multiple of slack so that deadlines falling
+ * within the same window share a single wakeup
+ */
+static inline double slacktimeout(double timeout, double slack) {
+	return (isfinite(timeout) && slack > 0)? ceil(timeout / slack) * slack : timeout;
+} /* slacktimeout() */
+
+
 static inline double mintimeout(double a, double b) {
 	if (islessequal(a, b) || !isfinite(b))
 		return a;
@@ -346,69 +356,385 @@ static void *make(size_t size, int *error) {
 } /* make() */
 
 
+/*
+ * Objects are carved out of POOL_SLABSIZE slabs, each aligned to its own
+ * size so pool_put() can locate an object's slab by masking the address.
+ * Allocations are served from partially used slabs before empty ones to
+ * keep objects packed. Once a slab's objects are all returned it's freed,
+ * except for up to POOL_SPARE slabs kept to absorb churn.
+ */
+#ifndef POOL_SLABSIZE
+#define POOL_SLABSIZE 4096
+#endif
+
+#ifndef POOL_SPARE
+#define POOL_SPARE 1
+#endif
+
+#define POOL_ALIGN (sizeof (union { void *p; double d; long long ll; }))
+#define POOL_ROUNDUP(n) (((n) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+
+struct slab {
+	LIST_ENTRY(slab) le;
+	void *head; /* free objects */
+	size_t nfree;
+}; /* struct slab */
+
+#define SLAB_HDRSIZE POOL_ROUNDUP(sizeof (struct slab))
+
 struct pool {
-	size_t size, count;
-	void *head;
+	size_t size, perslab;
+	LIST_HEAD(, slab) partial, full, empty;
+	size_t nslabs, nempty, live;
 }; /* pool */
 
 static void pool_init(struct pool *P, size_t size) {
-	P->size  = MAX(size, sizeof (void **));
-	P->count = 0;
-	P->head  = NULL;
+	P->size = POOL_ROUNDUP(MAX(size, sizeof (void **)));
+	P->perslab = (POOL_SLABSIZE - SLAB_HDRSIZE) / P->size;
+	assert(P->perslab > 0);
+	LIST_INIT(&P->partial);
+	LIST_INIT(&P->full);
+	LIST_INIT(&P->empty);
+	P->nslabs = 0;
+	P->nempty = 0;
+	P->live = 0;
 } /* pool_init() */
 
+static void slab_free(struct pool *P, struct slab *S) {
+	LIST_REMOVE(S, le);
+	free(S);
+	P->nslabs--;
+} /* slab_free() */
+
 static void pool_destroy(struct pool *P) {
-	void *p;
+	struct slab *S;
 
-	while ((p = P->head)) {
-		P->head = *(void **)p;
-		free(p);
-		P->count--;
-	}
+	while ((S = LIST_FIRST(&P->partial)))
+		slab_free(P, S);
+	while ((S = LIST_FIRST(&P->full)))
+		slab_free(P, S);
+	while ((S = LIST_FIRST(&P->empty)))
+		slab_free(P, S);
+
+	P->nempty = 0;
+	P->live = 0;
 } /* pool_destroy() */
 
+static struct slab *slab_make(struct pool *P, int *error) {
+	struct slab *S;
+	char *p;
+	size_t i;
+
+	if ((*error = posix_memalign((void **)&S, POOL_SLABSIZE, POOL_SLABSIZE)))
+		return NULL;
+
+	S->head = NULL;
+	S->nfree = P->perslab;
+
+	/* thread free list in address order */
+	for (i = P->perslab, p = (char *)S + SLAB_HDRSIZE + (P->perslab - 1) * P->size; i > 0; i--, p -= P->size) {
+		*(void **)p = S->head;
+		S->head = p;
+	}
+
+	LIST_INSERT_HEAD(&P->partial, S, le);
+	P->nslabs++;
+
+	return S;
+} /* slab_make() */
+
 static void pool_put(struct pool *P, void *p) {
-	*(void **)p = P->head;
-	P->head = p;
+	struct slab *S = (struct slab *)((uintptr_t)p & ~(uintptr_t)(POOL_SLABSIZE - 1));
+
+	*(void **)p = S->head;
+	S->head = p;
+	P->live--;
+
+	if (++S->nfree == P->perslab) {
+		if (P->nempty >= POOL_SPARE) {
+			slab_free(P, S);
+		} else {
+			LIST_REMOVE(S, le);
+			LIST_INSERT_HEAD(&P->empty, S, le);
+			P->nempty++;
+		}
+	} else if (S->nfree == 1) {
+		LIST_REMOVE(S, le);
+		LIST_INSERT_HEAD(&P->partial, S, le);
+	}
 } /* pool_put() */
 
-static int pool_grow(struct pool *P, size_t n) {
+static void *pool_get(struct pool *P, int *error) {
+	struct slab *S;
 	void *p;
-	int error;
 
-	while (n--) {
-		if (P->count + 1 == 0)
-			return ENOMEM;
+	if (!(S = LIST_FIRST(&P->partial))) {
+		if ((S = LIST_FIRST(&P->empty))) {
+			LIST_REMOVE(S, le);
+			LIST_INSERT_HEAD(&P->partial, S, le);
+			P->nempty--;
+		} else if (!(S = slab_make(P, error))) {
+			return NULL;
+		}
+	}
 
-		if (!(p = make(P->size, &error)))
-			return error;
+	p = S->head;
+	S->head = *(void **)p;
+	P->live++;
+
+	if (--S->nfree == 0) {
+		LIST_REMOVE(S, le);
+		LIST_INSERT_HEAD(&P->full, S, le);
+	}
+
+	return p;
+} /* pool_get() */
+
+
+/*
+ * T I M I N G  W H E E L  R O U T I N E S
+ *
+ * Hierarchical timing wheel for O(1) timer insertion and cancellation.
+ * Deadlines are quantized to ticks of a fixed resolution, rounded up so a
+ * timer never expires early. A timer is filed on the wheel corresponding
+ * to the highest bit differing between its deadline and the current tick,
+ * and cascades onto lower wheels as the higher wheels turn over. Deadlines
+ * beyond WHEEL_SPAN ticks are rejected so the caller can use an exact
+ * container instead.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define WHEEL_BIT 6
+#define WHEEL_NUM 6
+#define WHEEL_LEN (1U << WHEEL_BIT)
+#define WHEEL_MAX (WHEEL_LEN - 1)
+#define WHEEL_MASK (WHEEL_LEN - 1)
+#define WHEEL_SPAN (UINT64_C(1) << (WHEEL_BIT * WHEEL_NUM))
+
+#if __GNUC__ || __clang__
+#define wheel_ctz(n) __builtin_ctzll(n)
+#define wheel_fls(n) ((int)(sizeof (unsigned long long) * CHAR_BIT) - __builtin_clzll(n))
+#else
+static inline int wheel_ctz(uint64_t n) {
+	int i;
+
+	for (i = 0; !(n & 1); n >>= 1)
+		i++;
+
+	return i;
+} /* wheel_ctz() */
+
+static inline int wheel_fls(uint64_t n) {
+	int i;
+
+	for (i = 0; n; n >>= 1)
+		i++;
 
-		P->count++;
+	return i;
+} /* wheel_fls() */
+#endif
+
+static inline uint64_t wheel_rotl(const uint64_t v, int c) {
+	if (!(c &= 63))
+		return v;
+
+	return (v << c) | (v >> (64 - c));
+} /* wheel_rotl() */
+
+static inline uint64_t wheel_rotr(const uint64_t v, int c) {
+	if (!(c &= 63))
+		return v;
+
+	return (v >> c) | (v << (64 - c));
+} /* wheel_rotr() */
+
+
+TAILQ_HEAD(wheel_list, wheel_timer);
+
+struct wheel_timer {
+	uint64_t expires;
+	struct wheel_list *pending; /* NULL when not scheduled */
+	TAILQ_ENTRY(wheel_timer) tqe;
+}; /* struct wheel_timer */
+
+struct wheel {
+	double resolution;
+	uint64_t curtick;
+	uint64_t pending[WHEEL_NUM];
+	struct wheel_list slot[WHEEL_NUM][WHEEL_LEN];
+	struct wheel_list expired;
+}; /* struct wheel */
+
+
+static uint64_t wheel_f2tick(const struct wheel *W, double f, double (*round)(double)) {
+	double tick = round(f / W->resolution);
+
+	if (!(tick > 0))
+		return 0;
+	else if (tick >= 18446744073709551615.0)
+		return UINT64_MAX;
+	else
+		return tick;
+} /* wheel_f2tick() */
 
-		pool_put(P, p);
+#define wheel_ceil(W, f) wheel_f2tick((W), (f), &ceil)
+#define wheel_floor(W, f) wheel_f2tick((W), (f), &floor)
+
+
+static void wheel_init(struct wheel *W, double resolution, double curtime) {
+	unsigned i, j;
+
+	W->resolution = resolution;
+	W->curtick = wheel_floor(W, curtime);
+
+	for (i = 0; i < WHEEL_NUM; i++) {
+		W->pending[i] = 0;
+
+		for (j = 0; j < WHEEL_LEN; j++)
+			TAILQ_INIT(&W->slot[i][j]);
 	}
 
-	return 0;
-} /* pool_grow() */
+	TAILQ_INIT(&W->expired);
+} /* wheel_init() */
 
-static void *pool_get(struct pool *P, int *_error) {
-	void *p;
-	int error;
 
-	if (!(p = P->head)) {
-		error = pool_grow(P, MAX(1, P->count));
+static void wheel_del(struct wheel *W, struct wheel_timer *wt) {
+	if (!wt->pending)
+		return;
 
-		if (!(p = P->head)) {
-			*_error = error;
+	TAILQ_REMOVE(wt->pending, wt, tqe);
 
-			return NULL;
+	if (wt->pending != &W->expired && TAILQ_EMPTY(wt->pending)) {
+		ptrdiff_t index = wt->pending - &W->slot[0][0];
+
+		W->pending[index / WHEEL_LEN] &= ~(UINT64_C(1) << (index % WHEEL_LEN));
+	}
+
+	wt->pending = NULL;
+} /* wheel_del() */
+
+
+/* returns false if the deadline is too distant for the wheel */
+static _Bool wheel_add(struct wheel *W, struct wheel_timer *wt, uint64_t expires) {
+	wheel_del(W, wt);
+
+	if (expires > W->curtick) {
+		uint64_t rem = expires - W->curtick;
+		int wheel, slot;
+
+		if (rem >= WHEEL_SPAN)
+			return 0;
+
+		wheel = (wheel_fls(rem) - 1) / WHEEL_BIT;
+		slot = WHEEL_MASK & ((expires >> (wheel * WHEEL_BIT)) - !!wheel);
+
+		wt->pending = &W->slot[wheel][slot];
+		W->pending[wheel] |= UINT64_C(1) << slot;
+	} else {
+		wt->pending = &W->expired;
+	}
+
+	wt->expires = expires;
+	TAILQ_INSERT_TAIL(wt->pending, wt, tqe);
+
+	return 1;
+} /* wheel_add() */
+
+
+/*
+ * Advance the wheel to curtick, moving expired timers onto W->expired and
+ * refiling the remainder of any slot which turned over.
+ */
+static void wheel_update(struct wheel *W, uint64_t curtick) {
+	struct wheel_list todo;
+	struct wheel_timer *wt;
+	uint64_t elapsed;
+	int wheel;
+
+	if (curtick <= W->curtick)
+		return;
+
+	TAILQ_INIT(&todo);
+	elapsed = curtick - W->curtick;
+
+	for (wheel = 0; wheel < WHEEL_NUM; wheel++) {
+		uint64_t pending;
+
+		/*
+		 * Mark every slot between the last and current positions,
+		 * inclusive; or every slot if we've gone full circle. If we
+		 * wrapped around then the next wheel must tick as well.
+		 */
+		if ((elapsed >> (wheel * WHEEL_BIT)) > WHEEL_MAX) {
+			pending = ~UINT64_C(0);
+		} else {
+			int _elapsed = WHEEL_MASK & (elapsed >> (wheel * WHEEL_BIT));
+			int oslot = WHEEL_MASK & (W->curtick >> (wheel * WHEEL_BIT));
+			int nslot = WHEEL_MASK & (curtick >> (wheel * WHEEL_BIT));
+
+			pending = wheel_rotl((UINT64_C(1) << _elapsed) - 1, oslot);
+			pending |= wheel_rotr(wheel_rotl((UINT64_C(1) << _elapsed) - 1, nslot), _elapsed);
+			pending |= UINT64_C(1) << nslot;
+		}
+
+		while (pending & W->pending[wheel]) {
+			int slot = wheel_ctz(pending & W->pending[wheel]);
+
+			while ((wt = TAILQ_FIRST(&W->slot[wheel][slot]))) {
+				TAILQ_REMOVE(&W->slot[wheel][slot], wt, tqe);
+				TAILQ_INSERT_TAIL(&todo, wt, tqe);
+			}
+
+			W->pending[wheel] &= ~(UINT64_C(1) << slot);
 		}
+
+		if (!(pending & 1))
+			break;
+
+		elapsed = MAX(elapsed, (uint64_t)WHEEL_LEN << (wheel * WHEEL_BIT));
 	}
 
-	P->head = *(void **)p;
+	W->curtick = curtick;
 
-	return p;
-} /* pool_get() */
+	while ((wt = TAILQ_FIRST(&todo))) {
+		TAILQ_REMOVE(&todo, wt, tqe);
+		wt->pending = NULL;
+		wheel_add(W, wt, wt->expires);
+	}
+} /* wheel_update() */
+
+
+/*
+ * Returns the absolute time of the next expiration or cascade, 0 if timers
+ * have already expired, or NAN if the wheel is empty.
+ */
+static double wheel_timeout(const struct wheel *W) {
+	uint64_t timeout = UINT64_MAX, _timeout, relmask = 0;
+	int wheel, slot;
+
+	if (!TAILQ_EMPTY(&W->expired))
+		return 0.0;
+
+	for (wheel = 0; wheel < WHEEL_NUM; wheel++) {
+		if (W->pending[wheel]) {
+			slot = WHEEL_MASK & (W->curtick >> (wheel * WHEEL_BIT));
+
+			/* higher wheels are at least one rotation away */
+			_timeout = (uint64_t)(wheel_ctz(wheel_rotr(W->pending[wheel], slot)) + !!wheel) << (wheel * WHEEL_BIT);
+			_timeout -= relmask & W->curtick;
+
+			timeout = MIN(_timeout, timeout);
+		}
+
+		relmask <<= WHEEL_BIT;
+		relmask |= WHEEL_MASK;
+	}
+
+	if (timeout == UINT64_MAX)
+		return NAN;
+
+	return (W->curtick + timeout) * W->resolution;
+} /* wheel_timeout() */
 
 
 /*
@@ -430,11 +756,33 @@ static void *pool_get(struct pool *P, int *_error) {
 #include <sys/eventfd.h> /* eventfd(2) */
 #endif
 
+#if ENABLE_IOURING
+#if !ENABLE_EPOLL
+#error "io_uring backend requires epoll fallback"
+#endif
+#include <sys/mman.h>		/* PROT_READ PROT_WRITE MAP_SHARED MAP_POPULATE MAP_FAILED mmap(2) munmap(2) */
+#include <sys/syscall.h>	/* __NR_io_uring_setup __NR_io_uring_enter */
+#include <linux/io_uring.h>	/* struct io_uring_params struct io_uring_sqe struct io_uring_cqe IORING_* */
+#endif
+
 
 #define KPOLL_FOREACH(ke, kp) for (ke = (kp)->pending.event; ke < &(kp)->pending.event[(kp)->pending.count]; ke++)
 
 #define KPOLL_MAXWAIT 32
 
+/*
+ * Pseudo poll flag requesting an edge-triggered registration from
+ * kpoll_ctl(). Deliberately outside the range of flags we ever pass to or
+ * collect from the kernel.
+ */
+#define KPOLL_EDGE 0x4000
+
+#if ENABLE_EPOLL
+#define KPOLL_EDGEMASK (KPOLL_EDGE|POLLIN|POLLOUT|POLLPRI)
+#else
+#define KPOLL_EDGEMASK (KPOLL_EDGE|POLLIN|POLLOUT)
+#endif
+
 #if ENABLE_EPOLL
 typedef struct epoll_event kpoll_event_t;
 #elif ENABLE_PORTS
@@ -448,12 +796,36 @@ typedef port_event_t kpoll_event_t;
 typedef struct kevent kpoll_event_t;
 #endif
 
+#if ENABLE_IOURING
+#define KPOLL_RINGSIZE 256
+
+struct kpoll_ring {
+	void *map;
+	size_t mapsize;
+
+	struct io_uring_sqe *sqes;
+	size_t sqesize;
+
+	struct {
+		unsigned *head, *tail, *mask, *array;
+		unsigned entries;
+		unsigned queued; /* filled but not yet submitted */
+	} sq;
+
+	struct {
+		unsigned *head, *tail, *mask;
+		struct io_uring_cqe *cqes;
+	} cq;
+}; /* struct kpoll_ring */
+#endif
+
 struct kpoll {
 	int fd;
 
 	struct {
-		kpoll_event_t event[KPOLL_MAXWAIT];
-		size_t count;
+		kpoll_event_t *event; /* .fixed unless grown by kpoll_setsize() */
+		size_t size, capacity, count;
+		kpoll_event_t fixed[KPOLL_MAXWAIT];
 	} pending;
 
 	struct {
@@ -461,19 +833,315 @@ struct kpoll {
 		short state;
 		int pending;
 	} alert;
+
+#if ENABLE_IOURING
+	struct kpoll_ring ring; /* .map is NULL if using epoll */
+#endif
 }; /* struct kpoll */
 
 
 static void kpoll_preinit(struct kpoll *kp) {
 	kp->fd = -1;
+	kp->pending.event = kp->pending.fixed;
+	kp->pending.size = countof(kp->pending.fixed);
+	kp->pending.capacity = countof(kp->pending.fixed);
 	kp->pending.count = 0;
 	for (size_t i = 0; i < countof(kp->alert.fd); i++)
 		kp->alert.fd[i] = -1;
 	kp->alert.state = 0;
 	kp->alert.pending = 0;
+#if ENABLE_IOURING
+	memset(&kp->ring, 0, sizeof kp->ring);
+#endif
 } /* kpoll_preinit() */
 
 
+static inline _Bool kpoll_isring(const struct kpoll *kp NOTUSED) {
+#if ENABLE_IOURING
+	return kp->ring.map != NULL;
+#else
+	return 0;
+#endif
+} /* kpoll_isring() */
+
+
+/*
+ * io_uring backend
+ *
+ * Descriptors are polled with one-shot IORING_OP_POLL_ADD requests which
+ * must be rearmed after each completion, just like Solaris Event Ports.
+ * Multishot polls are edge-triggered, which would break the level-triggered
+ * semantics the scheduler relies on. Additions and modifications are queued
+ * on the submission ring and flushed by the next io_uring_enter, which also
+ * waits for completions, so an entire step costs a single system call.
+ *
+ * Descriptors are disarmed by canceling all requests keyed on the
+ * descriptor (IORING_ASYNC_CANCEL_FD, Linux 5.19). A pending poll holds a
+ * reference to the open file, so kpoll_forget() submits the cancellation
+ * immediately. Otherwise a descriptor closed after cqueues.cancel would
+ * remain open in the kernel until the poll completed.
+ *
+ * If the kernel lacks any required feature we fall back to epoll.
+ */
+#if ENABLE_IOURING
+static int ring_enter(struct kpoll *kp, unsigned flags, unsigned min_complete, const struct timespec *ts) {
+	struct io_uring_getevents_arg arg = { 0 };
+	void *argp = NULL;
+	size_t argsz = 0;
+	long n;
+
+	if (ts && (flags & IORING_ENTER_GETEVENTS)) {
+		arg.ts = (uintptr_t)ts;
+		flags |= IORING_ENTER_EXT_ARG;
+		argp = &arg;
+		argsz = sizeof arg;
+	}
+
+	if (-1 == (n = syscall(__NR_io_uring_enter, kp->fd, kp->ring.sq.queued, min_complete, flags, argp, argsz)))
+		return errno;
+
+	kp->ring.sq.queued -= MIN((unsigned)n, kp->ring.sq.queued);
+
+	return 0;
+} /* ring_enter() */
+
+
+static int ring_flush(struct kpoll *kp) {
+	int error;
+
+	while (kp->ring.sq.queued) {
+		if ((error = ring_enter(kp, 0, 0, NULL))) {
+			if (error == EINTR)
+				continue;
+
+			return error;
+		}
+	}
+
+	return 0;
+} /* ring_flush() */
+
+
+static int ring_getsqe(struct kpoll *kp, struct io_uring_sqe **sqe) {
+	struct kpoll_ring *ring = &kp->ring;
+	unsigned tail, index;
+	int error;
+
+	tail = *ring->sq.tail;
+
+	if (tail - __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE) >= ring->sq.entries) {
+		if ((error = ring_flush(kp)))
+			return error;
+	}
+
+	index = tail & *ring->sq.mask;
+	*sqe = &ring->sqes[index];
+	memset(*sqe, 0, sizeof **sqe);
+	ring->sq.array[index] = index;
+
+	return 0;
+} /* ring_getsqe() */
+
+
+static void ring_putsqe(struct kpoll *kp) {
+	struct kpoll_ring *ring = &kp->ring;
+
+	__atomic_store_n(ring->sq.tail, *ring->sq.tail + 1, __ATOMIC_RELEASE);
+	ring->sq.queued++;
+} /* ring_putsqe() */
+
+
+static int ring_cancelfd(struct kpoll *kp, int fd) {
+	struct io_uring_sqe *sqe;
+	int error;
+
+	if ((error = ring_getsqe(kp, &sqe)))
+		return error;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD|IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = 0; /* completions with NULL udata are discarded */
+
+	ring_putsqe(kp);
+
+	return 0;
+} /* ring_cancelfd() */
+
+
+static int ring_polladd(struct kpoll *kp, int fd, short events, void *udata) {
+	struct io_uring_sqe *sqe;
+	uint32_t mask = (unsigned short)events;
+	int error;
+
+	if ((error = ring_getsqe(kp, &sqe)))
+		return error;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	mask = (mask << 16) | (mask >> 16); /* see liburing io_uring_prep_poll_add */
+#endif
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = mask;
+	sqe->user_data = (uintptr_t)udata;
+
+	ring_putsqe(kp);
+
+	return 0;
+} /* ring_polladd() */
+
+
+static void ring_destroy(struct kpoll *kp) {
+	struct kpoll_ring *ring = &kp->ring;
+
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqesize);
+
+	if (ring->map && ring->map != MAP_FAILED)
+		munmap(ring->map, ring->mapsize);
+
+	memset(ring, 0, sizeof *ring);
+} /* ring_destroy() */
+
+
+/*
+ * Probe for IORING_ASYNC_CANCEL_FD by canceling requests on our own
+ * descriptor. Kernels which don't understand the flags return EINVAL.
+ */
+static int ring_probe(struct kpoll *kp) {
+	struct kpoll_ring *ring = &kp->ring;
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int error, res;
+
+	if ((error = ring_cancelfd(kp, kp->fd)))
+		return error;
+
+	do {
+		error = ring_enter(kp, IORING_ENTER_GETEVENTS, 1, NULL);
+	} while (error == EINTR);
+
+	if (error)
+		return error;
+
+	head = *ring->cq.head;
+
+	if (head == __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE))
+		return ENOTSUP;
+
+	cqe = &ring->cq.cqes[head & *ring->cq.mask];
+	res = cqe->res;
+	__atomic_store_n(ring->cq.head, head + 1, __ATOMIC_RELEASE);
+
+	return (res == -EINVAL)? ENOTSUP : 0;
+} /* ring_probe() */
+
+
+static int ring_init(struct kpoll *kp) {
+	static const unsigned required = IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG;
+	struct kpoll_ring *ring = &kp->ring;
+	struct io_uring_params params;
+	size_t sqsize, cqsize;
+	char *map;
+	int fd, error;
+
+	memset(&params, 0, sizeof params);
+	params.flags = IORING_SETUP_CLAMP;
+
+	if (-1 == (fd = syscall(__NR_io_uring_setup, KPOLL_RINGSIZE, &params)))
+		return errno;
+
+	kp->fd = fd; /* io_uring descriptors are always close-on-exec */
+
+	if ((params.features & required) != required) {
+		error = ENOTSUP;
+		goto error;
+	}
+
+	sqsize = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+	cqsize = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+	ring->mapsize = MAX(sqsize, cqsize);
+	ring->sqesize = params.sq_entries * sizeof (struct io_uring_sqe);
+
+	ring->map = mmap(NULL, ring->mapsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->map == MAP_FAILED)
+		goto syerr;
+
+	ring->sqes = mmap(NULL, ring->sqesize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto syerr;
+
+	map = ring->map;
+	ring->sq.head = (unsigned *)(map + params.sq_off.head);
+	ring->sq.tail = (unsigned *)(map + params.sq_off.tail);
+	ring->sq.mask = (unsigned *)(map + params.sq_off.ring_mask);
+	ring->sq.array = (unsigned *)(map + params.sq_off.array);
+	ring->sq.entries = params.sq_entries;
+	ring->sq.queued = 0;
+	ring->cq.head = (unsigned *)(map + params.cq_off.head);
+	ring->cq.tail = (unsigned *)(map + params.cq_off.tail);
+	ring->cq.mask = (unsigned *)(map + params.cq_off.ring_mask);
+	ring->cq.cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+
+	if ((error = ring_probe(kp)))
+		goto error;
+
+	return 0;
+syerr:
+	error = errno;
+error:
+	ring_destroy(kp);
+	cqs_closefd(&kp->fd);
+
+	return error;
+} /* ring_init() */
+
+
+static int ring_wait(struct kpoll *kp, double timeout) {
+	struct kpoll_ring *ring = &kp->ring;
+	struct io_uring_cqe *cqe;
+	kpoll_event_t *event;
+	unsigned head, tail;
+	int error;
+
+	kp->pending.count = 0;
+
+	head = *ring->cq.head;
+	tail = __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail) {
+		error = ring_enter(kp, IORING_ENTER_GETEVENTS, (timeout == 0.0)? 0 : 1, f2ts(timeout));
+	} else {
+		error = ring_flush(kp);
+	}
+
+	if (error && error != EINTR && error != ETIME && error != EBUSY && error != EAGAIN)
+		return error;
+
+	head = *ring->cq.head;
+	tail = __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail && kp->pending.count < kp->pending.size; head++) {
+		cqe = &ring->cq.cqes[head & *ring->cq.mask];
+
+		/* discard cancellation results and canceled polls */
+		if (!cqe->user_data || cqe->res == -ECANCELED)
+			continue;
+
+		event = &kp->pending.event[kp->pending.count++];
+		memset(event, 0, sizeof *event);
+		event->data.ptr = (void *)(uintptr_t)cqe->user_data;
+		event->events = (cqe->res >= 0)? (unsigned)cqe->res : (POLLIN|POLLOUT|POLLPRI|POLLERR);
+		event->events |= EPOLLONESHOT; /* see kpoll_diff() */
+	}
+
+	__atomic_store_n(ring->cq.head, head, __ATOMIC_RELEASE);
+
+	return 0;
+} /* ring_wait() */
+#endif /* ENABLE_IOURING */
+
+
 static int kpoll_ctl(struct kpoll *, int, short *, short, void *);
 static int alert_rearm(struct kpoll *);
 
@@ -523,6 +1191,11 @@ static int alert_rearm(struct kpoll *kp) {
 static int kpoll_init(struct kpoll *kp) {
 	int error;
 
+#if ENABLE_IOURING
+	if (!ring_init(kp))
+		return alert_init(kp);
+#endif
+
 #if ENABLE_EPOLL
 #if defined EPOLL_CLOEXEC
 	(void)error;
@@ -555,11 +1228,55 @@ static int kpoll_init(struct kpoll *kp) {
 
 static void kpoll_destroy(struct kpoll *kp, int (*closefd)(int *, void *), void *cb_udata) {
 	alert_destroy(kp, closefd, cb_udata);
+#if ENABLE_IOURING
+	ring_destroy(kp);
+#endif
 	closefd(&kp->fd, cb_udata);
+	if (kp->pending.event != kp->pending.fixed)
+		free(kp->pending.event);
 	kpoll_preinit(kp);
 } /* kpoll_destroy() */
 
 
+/* set the number of events collected per kpoll_wait */
+static int kpoll_setsize(struct kpoll *kp, size_t size) {
+	kpoll_event_t *event;
+
+	size = MAX(1, MIN(size, INT_MAX));
+
+	if (size > kp->pending.capacity) {
+		if (kp->pending.event == kp->pending.fixed) {
+			if (!(event = malloc(size * sizeof *event)))
+				return errno;
+
+			memcpy(event, kp->pending.fixed, kp->pending.count * sizeof *event);
+		} else if (!(event = realloc(kp->pending.event, size * sizeof *event))) {
+			return errno;
+		}
+
+		kp->pending.event = event;
+		kp->pending.capacity = size;
+	}
+
+	kp->pending.size = size;
+
+	return 0;
+} /* kpoll_setsize() */
+
+
+static const char *kpoll_name(const struct kpoll *kp) {
+	if (kpoll_isring(kp))
+		return "io_uring";
+#if ENABLE_EPOLL
+	return "epoll";
+#elif ENABLE_PORTS
+	return "ports";
+#elif ENABLE_KQUEUE
+	return "kqueue";
+#endif
+} /* kpoll_name() */
+
+
 static inline void *kpoll_udata(const kpoll_event_t *event) {
 #if ENABLE_EPOLL
 	return event->data.ptr;
@@ -587,6 +1304,11 @@ static inline short kpoll_diff(const kpoll_event_t *event NOTUSED, short ostate
 	/* Solaris Event Ports aren't persistent. */
 	return 0;
 #else
+#if ENABLE_IOURING
+	/* neither are io_uring polls, which ring_wait() flags as one-shot */
+	if (event->events & EPOLLONESHOT)
+		return 0;
+#endif
 	return ostate;
 #endif
 } /* kpoll_diff() */
@@ -600,11 +1322,30 @@ static int kpoll_ctl(struct kpoll *kp, int fd, short *state, short events, void
 	if (*state == events)
 		return 0;
 
+#if ENABLE_IOURING
+	if (kpoll_isring(kp)) {
+		int error;
+
+		if (*state && (error = ring_cancelfd(kp, fd)))
+			return error;
+
+		*state = 0;
+
+		if (events && (error = ring_polladd(kp, fd, events & ~KPOLL_EDGE, udata)))
+			return error;
+
+		*state = events;
+
+		return 0;
+	}
+#endif
+
 	op = (!*state)? EPOLL_CTL_ADD : (!events)? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
 
 	memset(&event, 0, sizeof event);
 
-	event.events = events;
+	event.events = events & ~KPOLL_EDGE;
+	event.events |= (events & KPOLL_EDGE)? EPOLLET : 0;
 	event.data.ptr = udata;
 
 	if (0 != epoll_ctl(kp->fd, op, fd, &event))
@@ -636,7 +1377,7 @@ static int kpoll_ctl(struct kpoll *kp, int fd, short *state, short events, void
 
 	if (events & POLLIN) {
 		if (!(*state & POLLIN)) {
-			KP_SET(&event, fd, EVFILT_READ, EV_ADD, 0, 0, udata);
+			KP_SET(&event, fd, EVFILT_READ, EV_ADD|((events & KPOLL_EDGE)? EV_CLEAR : 0), 0, 0, udata);
 
 			if (0 != kevent(kp->fd, &event, 1, NULL, 0, &(struct timespec){ 0, 0 }))
 				return errno;
@@ -654,7 +1395,7 @@ static int kpoll_ctl(struct kpoll *kp, int fd, short *state, short events, void
 
 	if (events & POLLOUT) {
 		if (!(*state & POLLOUT)) {
-			KP_SET(&event, fd, EVFILT_WRITE, EV_ADD, 0, 0, udata);
+			KP_SET(&event, fd, EVFILT_WRITE, EV_ADD|((events & KPOLL_EDGE)? EV_CLEAR : 0), 0, 0, udata);
 
 			if (0 != kevent(kp->fd, &event, 1, NULL, 0, &(struct timespec){ 0, 0 }))
 				return errno;
@@ -670,11 +1411,23 @@ static int kpoll_ctl(struct kpoll *kp, int fd, short *state, short events, void
 		*state &= ~POLLOUT;
 	}
 
+	*state = (*state & (POLLIN|POLLOUT))? (*state & ~KPOLL_EDGE) | (events & KPOLL_EDGE) : 0;
+
 	return 0;
 #endif
 } /* kpoll_ctl() */
 
 
+/* whether registrations can be made edge-triggered, and so sticky */
+static inline _Bool kpoll_hasedge(const struct kpoll *kp NOTUSED) {
+#if ENABLE_PORTS
+	return 0;
+#else
+	return !kpoll_isring(kp);
+#endif
+} /* kpoll_hasedge() */
+
+
 static int kpoll_alert(struct kpoll *kp) {
 	int error;
 
@@ -766,11 +1519,49 @@ static inline short kpoll_isalert(struct kpoll *kp, const kpoll_event_t *event)
 } /* kpoll_isalert() */
 
 
+/*
+ * Disarm any outstanding requests for a descriptor which might be about to
+ * be closed. Only necessary for io_uring; other backends drop closed
+ * descriptors automatically.
+ */
+static int kpoll_forget(struct kpoll *kp NOTUSED, int fd NOTUSED) {
+#if ENABLE_IOURING
+	int error;
+
+	if (kpoll_isring(kp)) {
+		if ((error = ring_cancelfd(kp, fd)))
+			return error;
+
+		return ring_flush(kp);
+	}
+#endif
+	return 0;
+} /* kpoll_forget() */
+
+
+/*
+ * Submit queued interest changes so the kpoll descriptor accurately
+ * reflects our state when polled by somebody else (e.g. a parent cqueue).
+ */
+static int kpoll_flush(struct kpoll *kp NOTUSED) {
+#if ENABLE_IOURING
+	if (kpoll_isring(kp))
+		return ring_flush(kp);
+#endif
+	return 0;
+} /* kpoll_flush() */
+
+
 static int kpoll_wait(struct kpoll *kp, double timeout) {
 #if ENABLE_EPOLL
 	int n;
 
-	if (-1 == (n = epoll_wait(kp->fd, kp->pending.event, (int)countof(kp->pending.event), f2ms(timeout))))
+#if ENABLE_IOURING
+	if (kpoll_isring(kp))
+		return ring_wait(kp, timeout);
+#endif
+
+	if (-1 == (n = epoll_wait(kp->fd, kp->pending.event, (int)kp->pending.size, f2ms(timeout))))
 		return (errno == EINTR)? 0 : errno;
 
 	kp->pending.count = n;
@@ -782,7 +1573,7 @@ static int kpoll_wait(struct kpoll *kp, double timeout) {
 
 	kp->pending.count = 0;
 
-	if (0 != port_getn(kp->fd, kp->pending.event, countof(kp->pending.event), &n, f2ts(timeout)))
+	if (0 != port_getn(kp->fd, kp->pending.event, kp->pending.size, &n, f2ts(timeout)))
 		return (errno == ETIME || errno == EINTR)? 0 : errno;
 
 	kp->pending.count = n;
@@ -791,7 +1582,7 @@ static int kpoll_wait(struct kpoll *kp, double timeout) {
 #elif ENABLE_KQUEUE
 	int n;
 
-	if (-1 == (n = kevent(kp->fd, NULL, 0, kp->pending.event, (int)countof(kp->pending.event), f2ts(timeout))))
+	if (-1 == (n = kevent(kp->fd, NULL, 0, kp->pending.event, (int)kp->pending.size, f2ts(timeout))))
 		return (errno == EINTR)? 0 : errno;
 
 	kp->pending.count = n;
@@ -1108,6 +1899,7 @@ struct event {
 	int fd;
 	short events;
 	double timeout;
+	double slack; /* NAN to use the cqueue default */
 
 	_Bool pending;
 
@@ -1126,6 +1918,7 @@ struct event {
 struct fileno {
 	int fd;
 	short state;
+	short ready; /* edges not yet delivered; edge-triggered mode only */
 
 	LIST_HEAD(, event) events;
 
@@ -1139,17 +1932,37 @@ struct timer {
 	double timeout;
 
 	LLRB_ENTRY(timer) rbe;
+
+	struct wheel_timer wt; /* used instead of rbe when wt.pending set */
 }; /* struct timer */
 
+#define wt2timer(wt) ((struct timer *)((char *)(wt) - offsetof(struct timer, wt)))
+
+
+/*
+ * Runnable coroutines are queued by priority, highest first. A class which
+ * had runnable coroutines but wasn't reached for THREAD_AGELIMIT consecutive
+ * passes, because of a step budget, is drained ahead of the others.
+ */
+#define THREAD_PRIOMAX 3
+#define THREAD_PRIOMIN (-THREAD_PRIOMAX)
+#define THREAD_NPRIO (THREAD_PRIOMAX - THREAD_PRIOMIN + 1)
+
+#ifndef THREAD_AGELIMIT
+#define THREAD_AGELIMIT 4
+#endif
 
 struct thread {
 	lua_State *L; /* only for coroutines */
+	int priority;
 
 	TAILQ_HEAD(, event) events;
 	unsigned count;
 
 	struct threads *threads;
-	LIST_ENTRY(thread) le;
+	TAILQ_ENTRY(thread) tqe;
+
+	_Bool recyclable; /* coroutine created by :wrap */
 
 	double mintimeout;
 
@@ -1159,11 +1972,106 @@ struct thread {
 #define timer2thread(timer) ((struct thread *)((char *)(timer) - offsetof(struct thread, timer)))
 
 
+/*
+ * How soon to retry auto-corked output the kernel wouldn't take at the end
+ * of a step, when nothing else would wake the loop.
+ */
+#ifndef CQUEUE_CORKRETRY
+#define CQUEUE_CORKRETRY 0.01
+#endif
+
+/*
+ * Latency histogram buckets for :stats. Bucket 0 counts samples under one
+ * microsecond, bucket i those under 2^i microseconds not counted by bucket
+ * i-1, and the final bucket everything longer.
+ */
+#ifndef CQUEUE_HISTBINS
+#define CQUEUE_HISTBINS 24
+#endif
+
+static inline void hist_add(unsigned long *hist, double elapsed) {
+	int exp = 0;
+
+	if (isgreaterequal(elapsed * 1000000, 1.0))
+		frexp(elapsed * 1000000, &exp);
+
+	hist[MIN(exp, CQUEUE_HISTBINS - 1)]++;
+} /* hist_add() */
+
+/*
+ * Binary trace ring for :trace. Fixed-size records overwrite the oldest
+ * once the ring wraps; with tracing off each site costs one NULL test
+ * (plus a nop for its USDT probe).
+ */
+#ifndef CQUEUE_TRACEMAX
+#define CQUEUE_TRACEMAX (1U << 20) /* records */
+#endif
+
+#ifndef CQUEUE_TRACEDEF
+#define CQUEUE_TRACEDEF 4096 /* records for :trace(true) */
+#endif
+
+enum trace_type {
+	TRACE_STEP = 1,
+	TRACE_WAIT,
+	TRACE_WAKE,
+	TRACE_RESUME,
+	TRACE_YIELD,
+	TRACE_EVENT,
+	TRACE_TIMER,
+}; /* enum trace_type */
+
+static const char *const trace_name[] = {
+	[TRACE_STEP]   = "step",
+	[TRACE_WAIT]   = "wait",
+	[TRACE_WAKE]   = "wake",
+	[TRACE_RESUME] = "resume",
+	[TRACE_YIELD]  = "yield",
+	[TRACE_EVENT]  = "event",
+	[TRACE_TIMER]  = "timer",
+};
+
+struct trace {
+	size_t mask, count; /* count is total ever recorded */
+
+	struct trace_rec {
+		double time;
+		int type, a;
+		long long b;
+	} rec[];
+}; /* struct trace */
+
+static void trace_add(struct trace *trace, int type, int a, long long b) {
+	struct trace_rec *rec = &trace->rec[trace->count++ & trace->mask];
+
+	rec->time = monotime();
+	rec->type = type;
+	rec->a = a;
+	rec->b = b;
+} /* trace_add() */
+
+/* timeouts are traced in whole microseconds, with -1 for forever */
+static inline int trace_us(double timeout) {
+	if (!isfinite(timeout))
+		return -1;
+
+	return (timeout * 1000000 > INT_MAX)? INT_MAX : (int)(timeout * 1000000);
+} /* trace_us() */
+
+#define cqueue_probe(Q, name, type, a, b) do { \
+	CQS_PROBE3(name, (Q), (a), (b)); \
+	if ((Q)->trace) \
+		trace_add((Q)->trace, (type), (a), (b)); \
+} while (0)
+
 struct cqueue {
 	struct kpoll kp;
+	_Bool edge; /* sticky edge-triggered registrations */
 
 	struct {
-		LLRB_HEAD(table, fileno) table;
+		struct fileno **index; /* direct-indexed by fd */
+		size_t indexlen;
+		LLRB_HEAD(table, fileno) table; /* descriptors >= FILENO_INDEXMAX */
 		LIST_HEAD(, fileno) polling, outstanding, inactive;
 	} fileno;
 
@@ -1172,19 +2080,64 @@ struct cqueue {
 	} pool;
 
 	struct {
-		LIST_HEAD(threads, thread) polling, pending;
+		TAILQ_HEAD(threads, thread) polling, pending[THREAD_NPRIO];
 		struct thread *current;
+		struct thread *last[THREAD_NPRIO]; /* final thread of each class in current pass */
+		unsigned char order[THREAD_NPRIO]; /* classes in current pass order */
+		unsigned norder, pos; /* position of current within order */
+		unsigned age[THREAD_NPRIO]; /* consecutive passes runnable but not reached */
 		unsigned count;
+		unsigned budget, resumed; /* per step; budget 0 is unlimited */
 	} thread;
 
+	struct {
+		size_t maxevents;
+		unsigned budget;
+	} step; /* defaults for :step */
+
+	struct {
+		unsigned max, count; /* parked at uservalue[1..count] */
+		unsigned long hits, misses;
+	} recycle;
+
 	LLRB_HEAD(timers, timer) timers;
+	struct wheel *wheel; /* NULL unless a timer resolution was requested */
+	double slack; /* default timer coalescing window */
 
 	struct cstack *cstack;
 
+	int corked; /* auto-corked sockets the kernel pushed back on */
+
+	struct {
+		unsigned long steps, waits, events, maxevents;
+		unsigned long resumes, timers, ctls;
+		double waittime, steptime, maxstep, resumetime, maxresume;
+		unsigned long stephist[CQUEUE_HISTBINS], resumehist[CQUEUE_HISTBINS];
+	} stats; /* see :stats */
+
+	struct trace *trace; /* NULL unless enabled with :trace */
+
 	LIST_ENTRY(cqueue) le;
 }; /* struct cqueue */
 
 
+static inline struct threads *thread_runq(struct cqueue *Q, struct thread *T) {
+	return &Q->thread.pending[THREAD_PRIOMAX - T->priority];
+} /* thread_runq() */
+
+
+static _Bool thread_pending(struct cqueue *Q) {
+	unsigned i;
+
+	for (i = 0; i < THREAD_NPRIO; i++) {
+		if (!TAILQ_EMPTY(&Q->thread.pending[i]))
+			return 1;
+	}
+
+	return 0;
+} /* thread_pending() */
+
+
 static inline int fileno_cmp(const struct fileno *const a, const struct fileno *const b) {
 	return a->fd - b->fd;
 } /* fileno_cmp() */
@@ -1256,7 +2209,7 @@ static struct cqueue *cqueue_enter(lua_State *L, struct callinfo *I, int index)
 
 
 static cqs_error_t cqueue_tryalert(struct cqueue *Q) {
-	if (!cstack_isrunning(Q->cstack, Q) || LIST_EMPTY(&Q->thread.pending)) {
+	if (!cstack_isrunning(Q->cstack, Q) || !thread_pending(Q)) {
 		return kpoll_alert(&Q->kp);
 	} else {
 		return 0;
@@ -1389,11 +2342,19 @@ static void err_error(lua_State *L, struct callinfo *I) {
 
 
 static void cqueue_preinit(struct cqueue *Q) {
+	unsigned i;
+
 	memset(Q, 0, sizeof *Q);
 
 	kpoll_preinit(&Q->kp);
 
 	Q->thread.current = NULL;
+	TAILQ_INIT(&Q->thread.polling);
+	for (i = 0; i < THREAD_NPRIO; i++)
+		TAILQ_INIT(&Q->thread.pending[i]);
+
+	Q->step.maxevents = KPOLL_MAXWAIT;
+	Q->step.budget = 0;
 
 	pool_init(&Q->pool.wakecb, sizeof (struct wakecb));
 	pool_init(&Q->pool.fileno, sizeof (struct fileno));
@@ -1401,9 +2362,89 @@ static void cqueue_preinit(struct cqueue *Q) {
 } /* cqueue_preinit() */
 
 
+struct cqueue_options {
+	double resolution; /* timer wheel tick; 0 for exact timers only */
+	size_t maxevents; /* kpoll events collected per step */
+	unsigned budget; /* coroutines resumed per step; 0 for unlimited */
+	unsigned recycle; /* finished :wrap coroutines kept for reuse */
+	_Bool edge; /* edge-triggered registrations if supported */
+	double slack; /* timer coalescing window; 0 for exact deadlines */
+}; /* struct cqueue_options */
+
+#define CQUEUE_OPTS_INITIALIZER { 0, KPOLL_MAXWAIT, 0, 0, 0, 0 }
+
+/* fixed when the cqueue is created; cqueue:step can't honor them */
+static const char *const cqueue_newonly[] = { "resolution", "recycle", "edge", "slack" };
+
+/*
+ * Update opts from any fields present in the table at index. For a step
+ * only .maxevents and .budget apply, and the others raise an error.
+ */
+static void cqueue_checkopts(lua_State *L, int index, struct cqueue_options *opts, _Bool step) {
+	lua_Number n;
+
+	if (lua_isnoneornil(L, index))
+		return;
+
+	luaL_checktype(L, index, LUA_TTABLE);
+
+	for (size_t i = 0; step && i < countof(cqueue_newonly); i++) {
+		lua_getfield(L, index, cqueue_newonly[i]);
+		if (!lua_isnil(L, -1))
+			luaL_argerror(L, index, lua_pushfstring(L, "%s: not a step option", cqueue_newonly[i]));
+		lua_pop(L, 1);
+	}
+
+	lua_getfield(L, index, "resolution");
+	if (!lua_isnil(L, -1)) {
+		n = luaL_checknumber(L, -1);
+		luaL_argcheck(L, isfinite(n) && !signbit(n), index, "invalid timer resolution");
+		opts->resolution = n;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, index, "maxevents");
+	if (!lua_isnil(L, -1)) {
+		n = luaL_checknumber(L, -1);
+		luaL_argcheck(L, n >= 1 && n <= INT_MAX, index, "maxevents out of range");
+		opts->maxevents = n;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, index, "budget");
+	if (!lua_isnil(L, -1)) {
+		n = luaL_checknumber(L, -1);
+		luaL_argcheck(L, n >= 0 && n <= UINT_MAX, index, "budget out of range");
+		opts->budget = n;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, index, "recycle");
+	if (!lua_isnil(L, -1)) {
+		n = luaL_checknumber(L, -1);
+		luaL_argcheck(L, n >= 0 && n <= INT_MAX, index, "recycle out of range");
+		opts->recycle = n;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, index, "edge");
+	if (!lua_isnil(L, -1))
+		opts->edge = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, index, "slack");
+	if (!lua_isnil(L, -1)) {
+		n = luaL_checknumber(L, -1);
+		luaL_argcheck(L, isfinite(n) && !signbit(n), index, "invalid timer slack");
+		opts->slack = n;
+	}
+	lua_pop(L, 1);
+} /* cqueue_checkopts() */
+
+
 static void cstack_add(lua_State *, struct cqueue *);
 
-static void cqueue_init(lua_State *L, struct cqueue *Q, int index) {
+static void cqueue_init(lua_State *L, struct cqueue *Q, int index, const struct cqueue_options *opts) {
 	int error;
 
 	index = lua_absindex(L, index);
@@ -1411,6 +2452,19 @@ static void cqueue_init(lua_State *L, struct cqueue *Q, int index) {
 	if ((error = kpoll_init(&Q->kp)))
 		luaL_error(L, "unable to initialize continuation queue: %s", cqs_strerror(error));
 
+	Q->step.maxevents = opts->maxevents;
+	Q->step.budget = opts->budget;
+	Q->recycle.max = opts->recycle;
+	Q->edge = opts->edge && kpoll_hasedge(&Q->kp);
+	Q->slack = opts->slack;
+
+	if (opts->resolution > 0) {
+		if (!(Q->wheel = make(sizeof *Q->wheel, &error)))
+			luaL_error(L, "unable to initialize continuation queue: %s", cqs_strerror(error));
+
+		wheel_init(Q->wheel, opts->resolution, monotime());
+	}
+
 	/*
 	 * give ourselves an empty table of threads
 	 */
@@ -1438,26 +2492,48 @@ static void cqueue_destroy(lua_State *L, struct cqueue *Q, struct callinfo *I) {
 	struct thread *thread;
 	struct fileno *fileno;
 	void *next;
+	size_t i;
 
 	cstack_del(Q);
 
 	Q->thread.current = NULL;
 
-	while ((thread = LIST_FIRST(&Q->thread.pending))) {
-		thread_del(L, Q, I, thread);
+	for (i = 0; i < THREAD_NPRIO; i++) {
+		while ((thread = TAILQ_FIRST(&Q->thread.pending[i]))) {
+			thread_del(L, Q, I, thread);
+		}
 	}
 
-	while ((thread = LIST_FIRST(&Q->thread.polling))) {
+	while ((thread = TAILQ_FIRST(&Q->thread.polling))) {
 		thread_del(L, Q, I, thread);
 	}
 
+	/* parked coroutines are released along with the uservalue table */
+	Q->recycle.count = 0;
+	Q->recycle.max = 0;
+
+	for (i = 0; i < Q->fileno.indexlen; i++) {
+		if ((fileno = Q->fileno.index[i]))
+			fileno_del(Q, fileno, 0);
+	}
+
 	for (fileno = LLRB_MIN(table, &Q->fileno.table); fileno; fileno = next) {
 		next = LLRB_NEXT(table, &Q->fileno.table, fileno);
 		fileno_del(Q, fileno, 0);
 	}
 
+	free(Q->fileno.index);
+	Q->fileno.index = NULL;
+	Q->fileno.indexlen = 0;
+
 	kpoll_destroy(&Q->kp, &cstack_onclosefd, cstack);
 
+	free(Q->wheel);
+	Q->wheel = NULL;
+
+	free(Q->trace);
+	Q->trace = NULL;
+
 	pool_destroy(&Q->pool.event);
 	pool_destroy(&Q->pool.fileno);
 	pool_destroy(&Q->pool.wakecb);
@@ -1465,8 +2541,11 @@ static void cqueue_destroy(lua_State *L, struct cqueue *Q, struct callinfo *I) {
 
 
 static int cqueue_new(lua_State *L) {
+	struct cqueue_options opts = CQUEUE_OPTS_INITIALIZER;
 	struct cqueue *Q;
 
+	cqueue_checkopts(L, 1, &opts, 0);
+
 	Q = lua_newuserdata(L, sizeof *Q);
 
 	cqueue_preinit(Q);
@@ -1474,7 +2553,7 @@ static int cqueue_new(lua_State *L) {
 	luaL_getmetatable(L, CQUEUE_CLASS);
 	lua_setmetatable(L, -2);
 
-	cqueue_init(L, Q, -1);
+	cqueue_init(L, Q, -1, &opts);
 
 	return 1;
 } /* cqueue_new() */
@@ -1507,35 +2586,87 @@ static int cqueue__gc(lua_State *L) {
 
 static void thread_move(struct thread *T, struct threads *list) {
 	if (T->threads != list) {
-		LIST_REMOVE(T, le);
-		LIST_INSERT_HEAD(list, T, le);
+		TAILQ_REMOVE(T->threads, T, tqe);
+		TAILQ_INSERT_TAIL(list, T, tqe);
 		T->threads = list;
 	}
 } /* thread_move() */
 
 
+static void thread_pend(struct cqueue *Q, struct thread *T) {
+	thread_move(T, thread_runq(Q, T));
+} /* thread_pend() */
+
+
+/*
+ * Descriptors below FILENO_INDEXMAX are always kept in the direct index,
+ * which grows by doubling to cover the largest such descriptor seen.
+ * Anything larger goes into the tree.
+ */
+#define FILENO_INDEXMIN 64
+#define FILENO_INDEXMAX (1 << 20)
+
+#define fileno_isindexed(fd) ((fd) < FILENO_INDEXMAX)
+
 static struct fileno *fileno_find(struct cqueue *Q, int fd) {
 	struct fileno key;
 
+	if (fileno_isindexed(fd))
+		return ((size_t)fd < Q->fileno.indexlen)? Q->fileno.index[fd] : NULL;
+
 	key.fd = fd;
 
 	return LLRB_FIND(table, &Q->fileno.table, &key);
 } /* fileno_find() */
 
 
+static int fileno_grow(struct cqueue *Q, int fd) {
+	struct fileno **index;
+	size_t size;
+
+	if ((size_t)fd < Q->fileno.indexlen)
+		return 0;
+
+	size = MAX(FILENO_INDEXMIN, Q->fileno.indexlen);
+
+	while (size <= (size_t)fd)
+		size *= 2;
+
+	size = MIN(size, FILENO_INDEXMAX);
+
+	if (!(index = realloc(Q->fileno.index, size * sizeof *index)))
+		return errno;
+
+	memset(&index[Q->fileno.indexlen], 0, (size - Q->fileno.indexlen) * sizeof *index);
+
+	Q->fileno.index = index;
+	Q->fileno.indexlen = size;
+
+	return 0;
+} /* fileno_grow() */
+
+
 static struct fileno *fileno_get(struct cqueue *Q, int fd, int *error) {
 	struct fileno *fileno;
 
 	if (!(fileno = fileno_find(Q, fd))) {
+		if (fileno_isindexed(fd) && (*error = fileno_grow(Q, fd)))
+			return NULL;
+
 		if (!(fileno = pool_get(&Q->pool.fileno, error)))
 			return NULL;
 
 		fileno->fd = fd;
 		fileno->state = 0;
+		fileno->ready = 0;
 		LIST_INIT(&fileno->events);
 
 		LIST_INSERT_HEAD(&Q->fileno.inactive, fileno, le);
-		LLRB_INSERT(table, &Q->fileno.table, fileno);
+
+		if (fileno_isindexed(fd))
+			Q->fileno.index[fd] = fileno;
+		else
+			LLRB_INSERT(table, &Q->fileno.table, fileno);
 	}
 
 	return fileno;
@@ -1548,10 +2679,12 @@ static cqs_error_t fileno_signal(struct cqueue *Q, struct fileno *fileno, short
 
 	LIST_FOREACH(event, &fileno->events, fle) {
 		/* XXX: If POLLPRI should we always mark as pending? */
-		if (event->events & events)
+		if (event->events & events) {
 			event->pending = 1;
+			fileno->ready &= ~event->events;
+		}
 
-		thread_move(event->thread, &Q->thread.pending);
+		thread_pend(Q, event->thread);
 
 		if ((_error = cqueue_tryalert(Q)))
 			error = _error;
@@ -1564,6 +2697,9 @@ static cqs_error_t fileno_signal(struct cqueue *Q, struct fileno *fileno, short
 static int fileno_ctl(struct cqueue *Q, struct fileno *fileno, short events) {
 	int error;
 
+	if (fileno->state != events)
+		Q->stats.ctls++;
+
 	if ((error = kpoll_ctl(&Q->kp, fileno->fd, &fileno->state, events, fileno)))
 		return error; /* XXX: Should we call fileno_signal? */
 
@@ -1586,6 +2722,14 @@ static int fileno_update(struct cqueue *Q, struct fileno *fileno) {
 		events |= event->events;
 	}
 
+	/*
+	 * In edge-triggered mode a descriptor is registered for everything
+	 * the first time it's polled and left alone until cancelled;
+	 * readiness is tracked in .ready instead.
+	 */
+	if (Q->edge && (events || fileno->state))
+		events = KPOLL_EDGEMASK;
+
 	return fileno_ctl(Q, fileno, events);
 } /* fileno_update() */
 
@@ -1602,7 +2746,10 @@ static int fileno_del(struct cqueue *Q, struct fileno *fileno, _Bool update) {
 	if (update)
 		error = fileno_update(Q, fileno);
 
-	LLRB_REMOVE(table, &Q->fileno.table, fileno);
+	if (fileno_isindexed(fileno->fd))
+		Q->fileno.index[fileno->fd] = NULL;
+	else
+		LLRB_REMOVE(table, &Q->fileno.table, fileno);
 
 	LIST_REMOVE(fileno, le);
 
@@ -1617,7 +2764,7 @@ static cqs_error_t wakecb_wakeup(struct wakecb *cb) {
 	struct event *event = cb->arg[1];
 
 	event->pending = 1;
-	thread_move(event->thread, &Q->thread.pending);
+	thread_pend(Q, event->thread);
 
 	return cqueue_tryalert(Q);
 } /* wakecb_wakeup() */
@@ -1741,6 +2888,17 @@ static cqs_status_t object_getinfo(lua_State *L, struct cqueue *Q, struct callin
 		event->timeout = abstimeout(luaL_optnumber(L, -1, event->timeout));
 
 		lua_pop(L, 1); /* pop timeout */
+
+		/* only objects with a deadline pay for the slack lookup */
+		if (isfinite(event->timeout)) {
+			if (LUA_OK != (status = object_pcall(L, I, T, -1, "slack", LUA_TNUMBER, LUA_TNIL)))
+				goto oops;
+
+			if (lua_isnumber(L, -1))
+				event->slack = fmax(lua_tonumber(L, -1), 0);
+
+			lua_pop(L, 1); /* pop slack */
+		}
 	}
 
 	lua_pop(L, 1); /* pop object */
@@ -1756,6 +2914,7 @@ static void event_init(struct event *event, struct thread *T, int index) {
 
 	event->fd = -1;
 	event->timeout = NAN;
+	event->slack = NAN;
 	event->index = index;
 	event->thread = T;
 
@@ -1784,8 +2943,16 @@ static cqs_status_t event_add(lua_State *L, struct cqueue *Q, struct callinfo *I
 		LIST_INSERT_HEAD(&fileno->events, event, fle);
 		event->fileno = fileno;
 
+		/* consume an edge which arrived while nobody was looking */
+		if (fileno->ready & event->events) {
+			event->pending = 1;
+			fileno->ready &= ~event->events;
+		}
+
 		LIST_REMOVE(fileno, le);
 		LIST_INSERT_HEAD(&Q->fileno.outstanding, fileno, le);
+
+		cqueue_probe(Q, event__add, TRACE_EVENT, event->fd, event->events);
 	}
 
 	return LUA_OK;
@@ -1819,11 +2986,15 @@ static void event_del(struct cqueue *Q, struct event *event) {
 
 static void timer_init(struct timer *timer) {
 	timer->timeout = NAN;
+	timer->wt.pending = NULL;
 } /* timer_init() */
 
 
 static void timer_del(struct cqueue *Q, struct timer *timer) {
-	if (isfinite(timer->timeout)) {
+	if (timer->wt.pending) {
+		wheel_del(Q->wheel, &timer->wt);
+		timer->timeout = NAN;
+	} else if (isfinite(timer->timeout)) {
 		LLRB_REMOVE(timers, &Q->timers, timer);
 		timer->timeout = NAN;
 	}
@@ -1835,6 +3006,11 @@ static void timer_add(struct cqueue *Q, struct timer *timer, double timeout) {
 
 	if (isfinite(timeout)) {
 		timer->timeout = timeout;
+
+		/* fall back to the tree for deadlines beyond the wheel span */
+		if (Q->wheel && wheel_add(Q->wheel, &timer->wt, wheel_ceil(Q->wheel, timeout)))
+			return;
+
 		LLRB_INSERT(timers, &Q->timers, timer);
 	}
 } /* timer_add() */
@@ -1845,19 +3021,46 @@ static void timer_destroy(struct cqueue *Q, struct timer *timer) {
 } /* timer_destroy() */
 
 
-static double thread_timeout(struct thread *T) {
+static _Bool thread_ready(struct thread *T) {
+	struct event *event;
+
+	TAILQ_FOREACH(event, &T->events, tqe) {
+		if (event->pending)
+			return 1;
+	}
+
+	return 0;
+} /* thread_ready() */
+
+
+/* earliest wakeup, with each deadline rounded up to its slack window */
+static double thread_timeout(struct cqueue *Q, struct thread *T) {
 	double timeout = NAN;
 	struct event *event;
 
 	TAILQ_FOREACH(event, &T->events, tqe) {
-		timeout = mintimeout(timeout, event->timeout);
+		timeout = mintimeout(timeout, slacktimeout(event->timeout, isnan(event->slack)? Q->slack : event->slack));
 	}
 
 	return timeout;
 } /* thread_timeout() */
 
 
-static void thread_add(lua_State *L, struct cqueue *Q, struct callinfo *I, int index) {
+/* expects thread context userdata at top of stack; pops it */
+static void thread_link(lua_State *L, struct cqueue *Q, struct callinfo *I, struct thread *T) {
+	/* anchor thread context to cqueue object */
+	cqs_getuservalue(L, I->self);
+	lua_pushvalue(L, -2);
+	lua_rawsetp(L, -2, CQS_UNIQUE_LIGHTUSERDATA_MASK(T));
+	lua_pop(L, 2);
+
+	T->threads = thread_runq(Q, T);
+	TAILQ_INSERT_TAIL(T->threads, T, tqe);
+	Q->thread.count++;
+} /* thread_link() */
+
+
+static struct thread *thread_add(lua_State *L, struct cqueue *Q, struct callinfo *I, int index) {
 	struct thread *T;
 
 	index = lua_absindex(L, index);
@@ -1872,16 +3075,72 @@ static void thread_add(lua_State *L, struct cqueue *Q, struct callinfo *I, int i
 	cqs_setuservalue(L, -2);
 	T->L = lua_tothread(L, index);
 
-	/* anchor thread context to cqueue object */
+	thread_link(L, Q, I, T);
+
+	return T;
+} /* thread_add() */
+
+
+/*
+ * Park the context of a :wrap coroutine which returned normally so that a
+ * later :wrap can restart it with a new function. The context userdata
+ * keeps its coroutine anchored as its uservalue, and is itself moved from
+ * its lightuserdata key to the array part of the cqueue's thread table.
+ */
+static _Bool thread_recycle(lua_State *L, struct cqueue *Q, struct callinfo *I, struct thread *T) {
+	struct event *event;
+
+	if (!T->recyclable || Q->recycle.count >= Q->recycle.max)
+		return 0;
+
+	if (lua_status(T->L) != LUA_OK || !lua_checkstack(L, 3))
+		return 0;
+
 	cqs_getuservalue(L, I->self);
-	lua_pushvalue(L, -2);
+	lua_rawgetp(L, -1, CQS_UNIQUE_LIGHTUSERDATA_MASK(T));
+	lua_rawseti(L, -2, Q->recycle.count + 1);
+	lua_pushnil(L);
 	lua_rawsetp(L, -2, CQS_UNIQUE_LIGHTUSERDATA_MASK(T));
-	lua_pop(L, 2);
+	lua_pop(L, 1);
+	Q->recycle.count++;
 
-	LIST_INSERT_HEAD(&Q->thread.pending, T, le);
-	T->threads = &Q->thread.pending;
-	Q->thread.count++;
-} /* thread_add() */
+	while ((event = TAILQ_FIRST(&T->events))) {
+		event_del(Q, event);
+	}
+	timer_destroy(Q, &T->timer);
+	TAILQ_REMOVE(T->threads, T, tqe);
+	T->threads = NULL;
+	Q->thread.count--;
+
+	/* discard return values */
+	lua_settop(T->L, 0);
+
+	return 1;
+} /* thread_recycle() */
+
+
+/* pushes a parked thread context, or returns NULL if there are none */
+static struct thread *thread_reuse(lua_State *L, struct cqueue *Q, struct callinfo *I) {
+	struct thread *T;
+
+	if (!Q->recycle.count)
+		return NULL;
+
+	cqs_getuservalue(L, I->self);
+	lua_rawgeti(L, -1, Q->recycle.count);
+	lua_pushnil(L);
+	lua_rawseti(L, -3, Q->recycle.count);
+	lua_remove(L, -2);
+	Q->recycle.count--;
+
+	T = lua_touserdata(L, -1);
+	assert(T && T->L && TAILQ_EMPTY(&T->events));
+	T->count = 0;
+	T->priority = 0;
+	timer_init(&T->timer);
+
+	return T;
+} /* thread_reuse() */
 
 
 static void thread_del(lua_State *L, struct cqueue *Q, struct callinfo *I, struct thread *T) {
@@ -1891,7 +3150,7 @@ static void thread_del(lua_State *L, struct cqueue *Q, struct callinfo *I, struc
 		event_del(Q, event);
 	}
 	timer_destroy(Q, &T->timer);
-	LIST_REMOVE(T, le);
+	TAILQ_REMOVE(T->threads, T, tqe);
 	Q->thread.count--;
 
 	/*
@@ -1965,8 +3224,8 @@ static cqs_error_t cqueue_reboot(struct cqueue *Q, _Bool stop, _Bool restart) {
 			fileno->state = 0;
 		}
 
-		while ((thread = LIST_FIRST(&Q->thread.polling))) {
-			thread_move(thread, &Q->thread.pending);
+		while ((thread = TAILQ_FIRST(&Q->thread.polling))) {
+			thread_pend(Q, thread);
 		}
 
 		kpoll_destroy(&Q->kp, &cstack_onclosefd, Q->cstack);
@@ -2040,8 +3299,12 @@ static cqs_status_t cqueue_resume(lua_State *L, struct cqueue *Q, struct callinf
 
 	cstack_push(Q->cstack, &(struct stackinfo){ Q, L, I->self, T->L });
 
+	cqueue_probe(Q, resume__enter, TRACE_RESUME, T->priority, (intptr_t)T->L);
+
 	status = lua_resume(T->L, L, nargs);
 
+	cqueue_probe(Q, resume__return, TRACE_YIELD, status, (intptr_t)T->L);
+
 	cstack_pop(Q->cstack);
 
 	switch (status) {
@@ -2060,9 +3323,11 @@ static cqs_status_t cqueue_resume(lua_State *L, struct cqueue *Q, struct callinf
 			if (LUA_OK != (status = cqueue_update(L, Q, I, T)))
 				goto defunct;
 
-			timer_add(Q, &T->timer, thread_timeout(T));
+			timer_add(Q, &T->timer, thread_timeout(Q, T));
 
-			if (!TAILQ_EMPTY(&T->events) || isfinite(T->timer.timeout))
+			if (Q->edge && thread_ready(T))
+				thread_pend(Q, T);
+			else if (!TAILQ_EMPTY(&T->events) || isfinite(T->timer.timeout))
 				thread_move(T, &Q->thread.polling);
 		} else {
 			if (LUA_OK != (tmp_status = cqueue_update(L, Q, I, T))) {
@@ -2077,7 +3342,8 @@ static cqs_status_t cqueue_resume(lua_State *L, struct cqueue *Q, struct callinf
 		if (LUA_OK != (status = cqueue_update(L, Q, I, T)))
 			goto defunct;
 
-		thread_del(L, Q, I, T);
+		if (!thread_recycle(L, Q, I, T))
+			thread_del(L, Q, I, T);
 
 		break;
 	default:
@@ -2106,14 +3372,91 @@ nospace:
 } /* cqueue_resume() */
 
 
+/*
+ * Mark the end of each run queue and order the classes for this pass,
+ * starved classes first. Threads made pending during the pass wait for the
+ * next.
+ */
+static void cqueue_startpass(struct cqueue *Q) {
+	unsigned i, n = 0;
+
+	for (i = 0; i < THREAD_NPRIO; i++) {
+		Q->thread.last[i] = TAILQ_LAST(&Q->thread.pending[i], threads);
+
+		if (Q->thread.last[i] && Q->thread.age[i] >= THREAD_AGELIMIT)
+			Q->thread.order[n++] = i;
+	}
+
+	for (i = 0; i < THREAD_NPRIO; i++) {
+		if (Q->thread.last[i] && Q->thread.age[i] < THREAD_AGELIMIT)
+			Q->thread.order[n++] = i;
+
+		/* reset as soon as one of its threads is resumed */
+		if (Q->thread.last[i])
+			Q->thread.age[i]++;
+	}
+
+	Q->thread.norder = n;
+	Q->thread.pos = 0;
+
+	assert(NULL == Q->thread.current);
+	Q->thread.current = (n)? TAILQ_FIRST(&Q->thread.pending[Q->thread.order[0]]) : NULL;
+} /* cqueue_startpass() */
+
+
+/* thread following current in this pass; call before resuming current */
+static struct thread *cqueue_nextpass(struct cqueue *Q) {
+	struct thread *nxt;
+
+	if (Q->thread.current != Q->thread.last[Q->thread.order[Q->thread.pos]])
+		return TAILQ_NEXT(Q->thread.current, tqe);
+
+	while (++Q->thread.pos < Q->thread.norder) {
+		if ((nxt = TAILQ_FIRST(&Q->thread.pending[Q->thread.order[Q->thread.pos]])))
+			return nxt;
+	}
+
+	return NULL;
+} /* cqueue_nextpass() */
+
+
+static void cqueue_resumed(struct cqueue *Q, double elapsed) {
+	Q->stats.resumes++;
+	Q->stats.resumetime += elapsed;
+	Q->stats.maxresume = fmax(Q->stats.maxresume, elapsed);
+	hist_add(Q->stats.resumehist, elapsed);
+} /* cqueue_resumed() */
+
+
 static cqs_status_t cqueue_process_threads(lua_State *L, struct cqueue *Q, struct callinfo *I) {
 	cqs_status_t status;
 	struct thread *nxt;
+	double t0, t1;
+
+	/* one clock read per resume; each is charged until the next starts */
+	t0 = (Q->thread.current)? monotime() : 0.0;
 
 	for (; Q->thread.current; Q->thread.current = nxt) {
-		nxt = LIST_NEXT(Q->thread.current, le);
+		if (Q->thread.budget && Q->thread.resumed >= Q->thread.budget) {
+			/* leave the remainder at the head of the pending lists */
+			Q->thread.current = NULL;
+
+			break;
+		}
+
+		Q->thread.age[Q->thread.order[Q->thread.pos]] = 0;
+
+		nxt = cqueue_nextpass(Q);
+
+		Q->thread.resumed++;
 
-		if (LUA_OK != (status = cqueue_resume(L, Q, I, Q->thread.current))) {
+		status = cqueue_resume(L, Q, I, Q->thread.current);
+
+		t1 = monotime();
+		cqueue_resumed(Q, t1 - t0);
+		t0 = t1;
+
+		if (LUA_OK != status) {
 			return status;
 		}
 	}
@@ -2122,12 +3465,27 @@ static cqs_status_t cqueue_process_threads(lua_State *L, struct cqueue *Q, struc
 } /* cqueue_process_threads() */
 
 
+static void cqueue_expire(struct cqueue *Q, struct timer *timer, double curtime) {
+	struct thread *T = timer2thread(timer);
+	struct event *event;
+
+	TAILQ_FOREACH(event, &T->events, tqe) {
+		if (islessequal(event->timeout, curtime))
+			event->pending = 1;
+	}
+
+	Q->stats.timers++;
+	cqueue_probe(Q, timer, TRACE_TIMER, T->priority, (intptr_t)T->L);
+
+	thread_pend(Q, T);
+} /* cqueue_expire() */
+
+
 static cqs_status_t cqueue_process(lua_State *L, struct cqueue *Q, struct callinfo *I) {
 	int onalert = 0;
 	kpoll_event_t *ke;
 	struct fileno *fileno;
-	struct event *event;
-	struct thread *T;
+	struct wheel_timer *wt;
 	struct timer *timer;
 	double curtime;
 	short events;
@@ -2136,6 +3494,7 @@ static cqs_status_t cqueue_process(lua_State *L, struct cqueue *Q, struct callin
 	KPOLL_FOREACH(ke, &Q->kp) {
 		if (kpoll_isalert(&Q->kp, ke)) {
 			onalert = 1;
+			Q->kp.alert.state = kpoll_diff(ke, Q->kp.alert.state);
 
 			continue;
 		}
@@ -2143,29 +3502,48 @@ static cqs_status_t cqueue_process(lua_State *L, struct cqueue *Q, struct callin
 		fileno = kpoll_udata(ke);
 		events = kpoll_pending(ke);
 
+		if (Q->edge) {
+			if (events & (POLLERR|POLLHUP))
+				events |= POLLIN|POLLOUT;
+
+			/* remember edges until delivered; see fileno_signal() */
+			fileno->ready |= events & (POLLIN|POLLOUT|POLLPRI);
+		}
+
 		fileno_signal(Q, fileno, events);
 		fileno->state = kpoll_diff(ke, fileno->state);
 	}
 
 	curtime = monotime();
 
+	if (Q->wheel) {
+		wheel_update(Q->wheel, wheel_floor(Q->wheel, curtime));
+
+		/* expired timers stay listed until the thread is resumed */
+		TAILQ_FOREACH(wt, &Q->wheel->expired, tqe) {
+			timer = wt2timer(wt);
+
+			if (isgreater(timer->timeout, curtime))
+				continue; /* rounding; catch it next time */
+
+			cqueue_expire(Q, timer, curtime);
+		}
+	}
+
 	LLRB_FOREACH(timer, timers, &Q->timers) {
 		if (isgreater(timer->timeout, curtime))
 			break;
 
-		T = timer2thread(timer);
+		cqueue_expire(Q, timer, curtime);
+	}
 
-		TAILQ_FOREACH(event, &T->events, tqe) {
-			if (islessequal(event->timeout, curtime))
-				event->pending = 1;
-		}
+	cqueue_startpass(Q);
+	status = cqueue_process_threads(L, Q, I);
 
-		thread_move(T, &Q->thread.pending);
-	}
+	/* one flush for everything auto-corked during the pass */
+	Q->corked = cqs_socket_uncorkall();
 
-	assert(NULL == Q->thread.current);
-	Q->thread.current = LIST_FIRST(&Q->thread.pending);
-	if (LUA_OK != (status = cqueue_process_threads(L, Q, I))) {
+	if (LUA_OK != status) {
 		return status;
 	}
 
@@ -2179,14 +3557,18 @@ static cqs_status_t cqueue_process(lua_State *L, struct cqueue *Q, struct callin
 
 static double cqueue_timeout_(struct cqueue *Q) {
 	struct timer *timer;
-	double curtime;
+	double timeout = NAN;
 
-	if (!(timer = LLRB_MIN(timers, &Q->timers)))
-		return NAN;
+	if ((timer = LLRB_MIN(timers, &Q->timers)))
+		timeout = timer->timeout;
 
-	curtime = monotime();
+	if (Q->wheel)
+		timeout = mintimeout(timeout, wheel_timeout(Q->wheel));
 
-	return (islessequal(timer->timeout, curtime))? 0.0 : timer->timeout - curtime;
+	if (Q->corked)
+		timeout = mintimeout(timeout, monotime() + CQUEUE_CORKRETRY);
+
+	return reltimeout(timeout);
 } /* cqueue_timeout_() */
 
 
@@ -2195,7 +3577,7 @@ LUA_KFUNCTION(cqueue_step_cont) {
 #else
 static int cqueue_step_cont(lua_State *L) {
 #endif
-	int nargs = lua_gettop(L);
+	int nargs = lua_gettop(L), pstatus;
 	struct callinfo I = CALLINFO_INITIALIZER;
 	struct cqueue *Q = cqueue_checkself(L, 1);
 	struct thread *T = Q->thread.current;
@@ -2212,7 +3594,10 @@ static int cqueue_step_cont(lua_State *L) {
 
 	cqueue_enter(L, &I, 1);
 
-	switch(cqueue_process_threads(L, Q, &I)) {
+	pstatus = cqueue_process_threads(L, Q, &I);
+	Q->corked = cqs_socket_uncorkall();
+
+	switch(pstatus) {
 	case LUA_OK:
 		break;
 	case LUA_YIELD:
@@ -2244,14 +3629,27 @@ oops:
 } /* yield_cont() */
 
 
+static void cqueue_stepped(struct cqueue *Q, double waited, double elapsed) {
+	Q->stats.waits++;
+	Q->stats.waittime += waited;
+	Q->stats.events += Q->kp.pending.count;
+	Q->stats.maxevents = MAX(Q->stats.maxevents, Q->kp.pending.count);
+
+	Q->stats.steptime += elapsed;
+	Q->stats.maxstep = fmax(Q->stats.maxstep, elapsed);
+	hist_add(Q->stats.stephist, elapsed);
+} /* cqueue_stepped() */
+
+
 static int cqueue_step(lua_State *L) {
+	struct cqueue_options opts = CQUEUE_OPTS_INITIALIZER;
 	struct callinfo I;
 	struct cqueue *Q;
-	double timeout;
-	int error;
+	double timeout, t0, t1;
+	int status, error;
 	int nargs;
 
-	lua_settop(L, 2);
+	lua_settop(L, 3);
 
 	Q = cqueue_enter(L, &I, 1);
 
@@ -2259,19 +3657,41 @@ static int cqueue_step(lua_State *L) {
 		return luaL_error(L, "cannot step live cqueue");
 	}
 
-	if (Q->thread.count && LIST_EMPTY(&Q->thread.pending)) {
+	opts.maxevents = Q->step.maxevents;
+	opts.budget = Q->step.budget;
+	cqueue_checkopts(L, 3, &opts, 1);
+	lua_settop(L, 2);
+
+	if (Q->thread.count && !thread_pending(Q)) {
 		timeout = mintimeout(luaL_optnumber(L, 2, NAN), cqueue_timeout_(Q));
 	} else {
 		timeout = 0.0;
 	}
 
-	if ((error = kpoll_wait(&Q->kp, timeout))) {
+	Q->thread.budget = opts.budget;
+	Q->thread.resumed = 0;
+	Q->stats.steps++;
+	cqueue_probe(Q, step, TRACE_STEP, (int)MIN(opts.budget, INT_MAX), Q->thread.count);
+
+	t0 = monotime();
+
+	if (!(error = kpoll_setsize(&Q->kp, opts.maxevents))) {
+		cqueue_probe(Q, wait__enter, TRACE_WAIT, trace_us(timeout), opts.maxevents);
+		error = kpoll_wait(&Q->kp, timeout);
+		cqueue_probe(Q, wait__return, TRACE_WAKE, (int)Q->kp.pending.count, error);
+	}
+
+	if (error) {
 		err_setfstring(L, &I, "error polling: %s", cqs_strerror(error));
 		err_setcode(L, &I, error);
 		goto oops;
 	}
 
-	switch(cqueue_process(L, Q, &I)) {
+	t1 = monotime();
+	status = cqueue_process(L, Q, &I);
+	cqueue_stepped(Q, t1 - t0, monotime() - t1);
+
+	switch(status) {
 	case LUA_OK:
 		break;
 	case LUA_YIELD:
@@ -2333,6 +3753,7 @@ error:
 static int cqueue_wrap(lua_State *L) {
 	struct callinfo I;
 	struct cqueue *Q;
+	struct thread *T;
 	struct lua_State *newL;
 	int top, error;
 
@@ -2341,12 +3762,25 @@ static int cqueue_wrap(lua_State *L) {
 	Q = cqueue_enter(L, &I, 1);
 	luaL_checktype(L, 2, LUA_TFUNCTION);
 
-	newL = lua_newthread(L);
-	lua_insert(L, 2);
-	luaL_checkstack(newL, top - 1, "too many arguments");
-	lua_xmove(L, newL, top - 1);
+	if ((T = thread_reuse(L, Q, &I))) {
+		lua_insert(L, 2);
+		luaL_checkstack(T->L, top - 1, "too many arguments");
+		lua_xmove(L, T->L, top - 1);
+
+		thread_link(L, Q, &I, T);
+		Q->recycle.hits++;
+	} else {
+		newL = lua_newthread(L);
+		lua_insert(L, 2);
+		luaL_checkstack(newL, top - 1, "too many arguments");
+		lua_xmove(L, newL, top - 1);
+
+		T = thread_add(L, Q, &I, -1);
+		T->recyclable = 1;
 
-	thread_add(L, Q, &I, -1);
+		if (Q->recycle.max)
+			Q->recycle.misses++;
+	}
 
 	if ((error = cqueue_tryalert(Q)))
 		goto error;
@@ -2400,6 +3834,177 @@ static int cqueue_count(lua_State *L) {
 } /* cqueue_count() */
 
 
+static int cqueue_recycleinfo(lua_State *L) {
+	struct cqueue *Q = cqueue_checkself(L, 1);
+
+	lua_pushnumber(L, Q->recycle.hits);
+	lua_pushnumber(L, Q->recycle.misses);
+	lua_pushinteger(L, Q->recycle.count);
+
+	return 3;
+} /* cqueue_recycleinfo() */
+
+
+static void cqueue_pushmeminfo(lua_State *L, const struct pool *P, const char *name) {
+	lua_createtable(L, 0, 3);
+	lua_pushnumber(L, P->live * P->size);
+	lua_setfield(L, -2, "live");
+	lua_pushnumber(L, (P->nslabs * P->perslab - P->live) * P->size);
+	lua_setfield(L, -2, "free");
+	lua_pushnumber(L, P->nslabs * POOL_SLABSIZE);
+	lua_setfield(L, -2, "slab");
+	lua_setfield(L, -2, name);
+} /* cqueue_pushmeminfo() */
+
+static int cqueue_meminfo(lua_State *L) {
+	struct cqueue *Q = cqueue_checkself(L, 1);
+
+	lua_createtable(L, 0, 3);
+	cqueue_pushmeminfo(L, &Q->pool.wakecb, "wakecb");
+	cqueue_pushmeminfo(L, &Q->pool.fileno, "fileno");
+	cqueue_pushmeminfo(L, &Q->pool.event, "event");
+
+	return 1;
+} /* cqueue_meminfo() */
+
+
+static void cqueue_pushhist(lua_State *L, const unsigned long *hist, const char *name) {
+	int i;
+
+	lua_createtable(L, CQUEUE_HISTBINS, 0);
+
+	for (i = 0; i < CQUEUE_HISTBINS; i++) {
+		lua_pushnumber(L, hist[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	lua_setfield(L, -2, name);
+} /* cqueue_pushhist() */
+
+static int cqueue_stats(lua_State *L) {
+	struct cqueue *Q = cqueue_checkself(L, 1);
+	static const struct { const char *name; size_t offset; } counter[] = {
+		{ "steps",     offsetof(struct cqueue, stats.steps) },
+		{ "waits",     offsetof(struct cqueue, stats.waits) },
+		{ "events",    offsetof(struct cqueue, stats.events) },
+		{ "maxevents", offsetof(struct cqueue, stats.maxevents) },
+		{ "resumes",   offsetof(struct cqueue, stats.resumes) },
+		{ "timers",    offsetof(struct cqueue, stats.timers) },
+		{ "ctls",      offsetof(struct cqueue, stats.ctls) },
+	}, timer[] = {
+		{ "waittime",   offsetof(struct cqueue, stats.waittime) },
+		{ "steptime",   offsetof(struct cqueue, stats.steptime) },
+		{ "maxstep",    offsetof(struct cqueue, stats.maxstep) },
+		{ "resumetime", offsetof(struct cqueue, stats.resumetime) },
+		{ "maxresume",  offsetof(struct cqueue, stats.maxresume) },
+	};
+	unsigned i;
+
+	lua_createtable(L, 0, countof(counter) + countof(timer) + 6);
+
+	for (i = 0; i < countof(counter); i++) {
+		lua_pushnumber(L, *(unsigned long *)((char *)Q + counter[i].offset));
+		lua_setfield(L, -2, counter[i].name);
+	}
+
+	for (i = 0; i < countof(timer); i++) {
+		lua_pushnumber(L, *(double *)((char *)Q + timer[i].offset));
+		lua_setfield(L, -2, timer[i].name);
+	}
+
+	cqueue_pushhist(L, Q->stats.stephist, "stephist");
+	cqueue_pushhist(L, Q->stats.resumehist, "resumehist");
+
+	lua_pushnumber(L, Q->pool.fileno.live);
+	lua_setfield(L, -2, "fds");
+	lua_pushinteger(L, Q->thread.count);
+	lua_setfield(L, -2, "threads");
+
+	lua_createtable(L, 0, 3);
+	cqueue_pushmeminfo(L, &Q->pool.wakecb, "wakecb");
+	cqueue_pushmeminfo(L, &Q->pool.fileno, "fileno");
+	cqueue_pushmeminfo(L, &Q->pool.event, "event");
+	lua_setfield(L, -2, "memory");
+
+	if (lua_toboolean(L, 2))
+		memset(&Q->stats, 0, sizeof Q->stats);
+
+	return 1;
+} /* cqueue_stats() */
+
+
+static int cqueue_trace(lua_State *L) {
+	struct cqueue *Q = cqueue_checkself(L, 1);
+	struct trace *trace;
+	lua_Number n;
+	size_t size;
+
+	if (!lua_isnoneornil(L, 2)) {
+		if (lua_isboolean(L, 2))
+			n = (lua_toboolean(L, 2))? CQUEUE_TRACEDEF : 0;
+		else
+			n = luaL_checknumber(L, 2);
+
+		luaL_argcheck(L, n >= 0 && n <= CQUEUE_TRACEMAX, 2, "trace size out of range");
+
+		for (size = 1; size < n; size <<= 1)
+			;
+
+		if (n == 0) {
+			free(Q->trace);
+			Q->trace = NULL;
+		} else if (!Q->trace || Q->trace->mask + 1 != size) {
+			if (!(trace = malloc(sizeof *trace + size * sizeof *trace->rec)))
+				return luaL_error(L, "unable to allocate trace ring: %s", cqs_strerror(errno));
+
+			trace->mask = size - 1;
+			trace->count = 0;
+
+			free(Q->trace);
+			Q->trace = trace;
+		}
+	}
+
+	lua_pushnumber(L, (Q->trace)? Q->trace->mask + 1 : 0);
+	lua_pushnumber(L, (Q->trace)? Q->trace->count : 0);
+
+	return 2;
+} /* cqueue_trace() */
+
+
+static int cqueue_tracedump(lua_State *L) {
+	struct cqueue *Q = cqueue_checkself(L, 1);
+	struct trace *trace = Q->trace;
+	struct trace_rec *rec;
+	size_t i, n;
+
+	n = (trace)? MIN(trace->count, trace->mask + 1) : 0;
+
+	lua_createtable(L, (int)n, 0);
+
+	/* oldest first */
+	for (i = 0; i < n; i++) {
+		rec = &trace->rec[(trace->count - n + i) & trace->mask];
+
+		lua_createtable(L, 0, 4);
+		lua_pushnumber(L, rec->time);
+		lua_setfield(L, -2, "time");
+		lua_pushstring(L, trace_name[rec->type]);
+		lua_setfield(L, -2, "event");
+		lua_pushinteger(L, rec->a);
+		lua_setfield(L, -2, "a");
+		lua_pushnumber(L, (lua_Number)rec->b);
+		lua_setfield(L, -2, "b");
+		lua_rawseti(L, -2, (int)(i + 1));
+	}
+
+	if (trace && lua_toboolean(L, 2))
+		trace->count = 0;
+
+	return 1;
+} /* cqueue_tracedump() */
+
+
 static cqs_error_t cqueue_cancelfd(struct cqueue *Q, int fd) {
 	struct fileno *fileno;
 	int error = 0, _error;
@@ -2409,8 +4014,11 @@ static cqs_error_t cqueue_cancelfd(struct cqueue *Q, int fd) {
 
 	if ((_error = fileno_signal(Q, fileno, POLLIN|POLLOUT|POLLPRI)))
 		error = _error;
+	fileno->ready = 0;
 	if ((_error = fileno_ctl(Q, fileno, 0)))
 		error = _error;
+	if ((_error = kpoll_forget(&Q->kp, fd)))
+		error = _error;
 
 	return error;
 } /* cqueue_cancelfd() */
@@ -2620,6 +4228,9 @@ static int cqueue_pause(lua_State *L) {
 	if (Q->kp.fd < 0 || Q->kp.fd >= (int)FD_SETSIZE)
 		return luaL_error(L, "cqueue:pause: fd %d outside allowable range 0..%d", Q->kp.fd, (int)(FD_SETSIZE - 1));
 
+	if ((error = kpoll_flush(&Q->kp)))
+		goto error;
+
 	FD_ZERO(&rfds);
 	FD_SET(Q->kp.fd, &rfds);
 
@@ -2636,6 +4247,10 @@ error:
 
 static int cqueue_pollfd(lua_State *L) {
 	struct cqueue *Q = cqueue_checkself(L, 1);
+	int error;
+
+	if ((error = kpoll_flush(&Q->kp)))
+		return luaL_error(L, "cqueue:pollfd: %s", cqs_strerror(error));
 
 	lua_pushinteger(L, Q->kp.fd);
 
@@ -2643,6 +4258,15 @@ static int cqueue_pollfd(lua_State *L) {
 } /* cqueue_pollfd() */
 
 
+static int cqueue_backend(lua_State *L) {
+	struct cqueue *Q = cqueue_checkself(L, 1);
+
+	lua_pushstring(L, kpoll_name(&Q->kp));
+
+	return 1;
+} /* cqueue_backend() */
+
+
 static int cqueue_events(lua_State *L) {
 	cqueue_checkself(L, 1);
 
@@ -2655,7 +4279,7 @@ static int cqueue_events(lua_State *L) {
 static int cqueue_timeout(lua_State *L) {
 	struct cqueue *Q = cqueue_checkself(L, 1);
 
-	if (!LIST_EMPTY(&Q->thread.pending)) {
+	if (thread_pending(Q)) {
 		lua_pushnumber(L, 0.0);
 	} else {
 		double timeout = cqueue_timeout_(Q);
@@ -2854,6 +4478,26 @@ static int cstack_running(lua_State *L) {
 } /* cstack_running() */
 
 
+static int cstack_setpriority(lua_State *L) {
+	struct cstack *CS = cstack_self(L);
+	lua_Integer priority = luaL_checkinteger(L, 1);
+	struct thread *T;
+
+	if (!CS->running || CS->running->T != L)
+		return luaL_error(L, "setpriority: not called from a managed coroutine");
+
+	T = CS->running->Q->thread.current;
+	assert(T && T->L == L);
+
+	lua_pushinteger(L, T->priority);
+
+	/* takes effect the next time the coroutine becomes runnable */
+	T->priority = MIN(MAX(priority, THREAD_PRIOMIN), THREAD_PRIOMAX);
+
+	return 1;
+} /* cstack_setpriority() */
+
+
 /*
  * C Q U E U E S  M O D U L E  L I N K A G E
  *
@@ -2875,6 +4519,12 @@ static const luaL_Reg cqueue_methods[] = {
 	{ "pollfd",  &cqueue_pollfd },
 	{ "events",  &cqueue_events },
 	{ "timeout", &cqueue_timeout },
+	{ "backend", &cqueue_backend },
+	{ "recycleinfo", &cqueue_recycleinfo },
+	{ "meminfo", &cqueue_meminfo },
+	{ "stats",   &cqueue_stats },
+	{ "trace",   &cqueue_trace },
+	{ "tracedump", &cqueue_tracedump },
 	{ "close",   &cqueue_close },
 	{ NULL,      NULL }
 }; /* cqueue_methods[] */
@@ -2894,6 +4544,7 @@ static const luaL_Reg cqueues_globals[] = {
 	{ "cancel",    &cstack_cancel },
 	{ "reset",     &cstack_reset },
 	{ "running",   &cstack_running },
+	{ "setpriority", &cstack_setpriority },
 	{ NULL,        NULL }
 }; /* cqueues_globals[] */
 
@@ -33,6 +33,7 @@
 #include <sys/param.h>  /* __NetBSD_Version__ OpenBSD __FreeBSD__version */
 #include <sys/types.h>
 #include <sys/socket.h>	/* socketpair(2) */
+#include <sys/uio.h>	/* struct iovec */
 #include <unistd.h>	/* close(2) pipe(2) */
 #include <fcntl.h>	/* F_GETFL F_SETFD F_SETFL FD_CLOEXEC O_NONBLOCK O_CLOEXEC fcntl(2) */
 
@@ -86,6 +87,16 @@
 #define ENABLE_KQUEUE HAVE_KQUEUE
 #endif
 
+/* experimental; requires Linux 5.19, otherwise falls back to epoll */
+#ifndef ENABLE_IOURING
+#define ENABLE_IOURING 0
+#endif
+
+/* static probes for SystemTap, bpftrace and friends; nops until attached */
+#ifndef ENABLE_USDT
+#define ENABLE_USDT HAVE_SYS_SDT_H
+#endif
+
 #if __GNUC__
 #define NOTUSED __attribute__((unused))
 #define EXTENSION __extension__
@@ -100,6 +111,13 @@
 #define NOTREACHED (void)0
 #endif
 
+#if ENABLE_USDT
+#include <sys/sdt.h>
+#define CQS_PROBE3(name, a, b, c) DTRACE_PROBE3(cqueues, name, (a), (b), (c))
+#else
+#define CQS_PROBE3(name, a, b, c) (void)0
+#endif
+
 
 /*
  * C L A S S  I N T E R F A C E S / R O U T I N E S
@@ -117,6 +135,7 @@
 #define CQS_THREAD "CQS Thread"
 #define CQS_NOTIFY "CQS Notify"
 #define CQS_CONDITION "CQS Condition"
+#define CQS_CHANNEL "CQS Channel"
 
 #ifndef CQS_USE_47BIT_LIGHTUSERDATA_HACK
 /* LuaJIT only supports pointers with the low 47 bits set */
@@ -151,6 +170,8 @@ cqs_nargs_t luaopen__cqueues_notify(lua_State *);
 
 cqs_nargs_t luaopen__cqueues_condition(lua_State *);
 
+cqs_nargs_t luaopen__cqueues_channel(lua_State *);
+
 cqs_nargs_t luaopen__cqueues_dns_record(lua_State *);
 
 cqs_nargs_t luaopen__cqueues_dns_packet(lua_State *);
@@ -163,6 +184,9 @@ cqs_nargs_t luaopen__cqueues_dns_hints(lua_State *);
 
 cqs_nargs_t luaopen__cqueues_dns_resolver(lua_State *);
 
+cqs_nargs_t luaopen__cqueues_dns_cache(lua_State *);
+cqs_nargs_t luaopen__cqueues_dns_tcp(lua_State *);
+
 cqs_nargs_t luaopen__cqueues_dns(lua_State *);
 
 
@@ -179,6 +203,40 @@ int cqs_socket_events(lua_State *, int);
 
 double cqs_socket_timeout(lua_State *, int);
 
+int cqs_socket_uncorkall(void);
+
+
+/*
+ * Value copied out of one Lua VM for loading into another, as used for
+ * thread.start arguments and channel messages.
+ */
+struct cthread_arg {
+	int type;
+	int iscfunction:1;
+	int isinteger:1;
+
+	/*
+	 * NB: The value representation below is not a simple mapping to the
+	 * Lua type. Ex: Lua functions are serialized to a Lua string stored
+	 * in .v.string, but the argument type is still LUA_TFUNCTION.
+	 */
+	union {
+		struct iovec string;
+		lua_Number number;
+		lua_Integer integer;
+		_Bool boolean;
+		void *pointer;
+	} v;
+}; /* struct cthread_arg */
+
+/* returns a new reference if the value at index is a channel, else NULL */
+void *cqs_channel_ref(lua_State *, int);
+
+/* pushes channel object, taking ownership of the reference */
+void cqs_channel_push(lua_State *, void *);
+
+void cqs_channel_unref(void *);
+
 
 static void cqs_requiref(lua_State *L, const char *modname, lua_CFunction openf, int glb) {
 	luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
@@ -201,6 +259,7 @@ static void cqs_openlibs(lua_State *L) {
 	cqs_requiref(L, "_cqueues.signal", &luaopen__cqueues_signal, 0);
 	cqs_requiref(L, "_cqueues.thread", &luaopen__cqueues_thread, 0);
 	cqs_requiref(L, "_cqueues.notify", &luaopen__cqueues_notify, 0);
+	cqs_requiref(L, "_cqueues.channel", &luaopen__cqueues_channel, 0);
 #if 0 /* Make optional? */
 	cqs_requiref(L, "_cqueues.condition", &luaopen__cqueues_condition, 0);
 	cqs_requiref(L, "_cqueues.dns.record", &luaopen__cqueues_dns_record, 0);
@@ -209,6 +268,8 @@ static void cqs_openlibs(lua_State *L) {
 	cqs_requiref(L, "_cqueues.dns.hosts", &luaopen__cqueues_dns_hosts, 0);
 	cqs_requiref(L, "_cqueues.dns.hints", &luaopen__cqueues_dns_hints, 0);
 	cqs_requiref(L, "_cqueues.dns.resolver", &luaopen__cqueues_dns_resolver, 0);
+	cqs_requiref(L, "_cqueues.dns.cache", &luaopen__cqueues_dns_cache, 0);
+	cqs_requiref(L, "_cqueues.dns.tcp", &luaopen__cqueues_dns_tcp, 0);
 	cqs_requiref(L, "_cqueues.dns", &luaopen__cqueues_dns, 0);
 #endif
 
@@ -68,13 +68,13 @@ local loader = function(loader, ...)
 	-- Wrap the low-level :step interface to make managing event loops
 	-- slightly easier.
 	--
-	local step; step = core.interpose("step", function (self, timeout)
+	local step; step = core.interpose("step", function (self, timeout, opts)
 		if core.running() then
 			core.poll(self, timeout)
 
-			return step(self, 0.0)
+			return step(self, 0.0, opts)
 		else
-			return step(self, timeout)
+			return step(self, timeout, opts)
 		end
 	end)
 	--
@@ -89,8 +89,8 @@ local loader = function(loader, ...)
 				return ok, ...
 			end
 		end
-		local step_; step_ = core.interpose("step", function (self, timeout)
-			return checkstep(self, step_(self, timeout))
+		local step_; step_ = core.interpose("step", function (self, timeout, opts)
+			return checkstep(self, step_(self, timeout, opts))
 		end)
 	end -- core:step
 
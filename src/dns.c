@@ -62,6 +62,8 @@
 #define HOSTS_CLASS    "DNS Hosts"
 #define HINTS_CLASS    "DNS Hints"
 #define RESOLVER_CLASS "DNS Resolver"
+#define CACHE_CLASS    "DNS Cache"
+#define TCP_CLASS      "DNS TCP"
 
 
 static int optfint(lua_State *L, int t, const char *k, int def) {
@@ -2051,6 +2053,281 @@ int luaopen__cqueues_dns_hints(lua_State *L) {
 } /* luaopen__cqueues_dns_hints() */
 
 
+/*
+ * C A C H E  B I N D I N G S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static int cache_new(lua_State *L) {
+	struct dns_cache_options opts = { 0 };
+	struct dns_cache **cache;
+	int error;
+
+	if (lua_istable(L, 1)) {
+		opts.size = optfint(L, 1, "size", 0);
+		opts.maxttl = optfint(L, 1, "maxttl", 0);
+		opts.negttl = optfint(L, 1, "negttl", 0);
+
+		/* false disables prefetching */
+		lua_getfield(L, 1, "prefetch");
+		if (lua_isboolean(L, -1))
+			opts.prefetch = (lua_toboolean(L, -1))? 0 : -1;
+		else
+			opts.prefetch = luaL_optint(L, -1, 0);
+		lua_pop(L, 1);
+	}
+
+	cache = lua_newuserdata(L, sizeof *cache);
+	*cache = 0;
+
+	if (!(*cache = dns_cache_open(&opts, &error)))
+		return lua_pushboolean(L, 0), lua_pushinteger(L, error), 2;
+
+	luaL_setmetatable(L, CACHE_CLASS);
+
+	return 1;
+} /* cache_new() */
+
+
+static int cache_shared(lua_State *L) {
+	struct dns_cache **cache;
+	int error;
+
+	cache = lua_newuserdata(L, sizeof *cache);
+	*cache = 0;
+
+	if (!(*cache = dns_cache_shared(&error)))
+		return lua_pushboolean(L, 0), lua_pushinteger(L, error), 2;
+
+	luaL_setmetatable(L, CACHE_CLASS);
+
+	return 1;
+} /* cache_shared() */
+
+
+static int cache_interpose(lua_State *L) {
+	return cqs_interpose(L, CACHE_CLASS);
+} /* cache_interpose() */
+
+
+static struct dns_cache *cache_check(lua_State *L, int index) {
+	return *(struct dns_cache **)luaL_checkudata(L, index, CACHE_CLASS);
+} /* cache_check() */
+
+
+static struct dns_cache *cache_test(lua_State *L, int index) {
+	struct dns_cache **cache = luaL_testudata(L, index, CACHE_CLASS);
+	return (cache)? *cache : 0;
+} /* cache_test() */
+
+
+static int cache_type(lua_State *L) {
+	if (cache_test(L, 1)) {
+		lua_pushstring(L, "dns cache");
+	} else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+} /* cache_type() */
+
+
+static int cache_stat(lua_State *L) {
+	struct dns_cache *cache = cache_check(L, 1);
+	struct dns_cache_stat st;
+	int error;
+
+	if ((error = dns_cache_stat(cache, &st)))
+		return luaL_error(L, "%s", cqs_strerror(error));
+
+	lua_newtable(L);
+
+#define setfield(name) do { \
+	lua_pushinteger(L, st.name); \
+	lua_setfield(L, -2, #name); \
+} while (0)
+
+	setfield(count);
+	setfield(hits);
+	setfield(misses);
+	setfield(negative);
+	setfield(inserts);
+	setfield(evictions);
+	setfield(expired);
+	setfield(prefetches);
+
+#undef setfield
+
+	return 1;
+} /* cache_stat() */
+
+
+static int cache_flush(lua_State *L) {
+	struct dns_cache *cache = cache_check(L, 1);
+	int error;
+
+	if ((error = dns_cache_flush(cache)))
+		return luaL_error(L, "%s", cqs_strerror(error));
+
+	return lua_pushboolean(L, 1), 1;
+} /* cache_flush() */
+
+
+static int cache__gc(lua_State *L) {
+	struct dns_cache **cache = luaL_checkudata(L, 1, CACHE_CLASS);
+
+	dns_cache_close(*cache);
+	*cache = 0;
+
+	return 0;
+} /* cache__gc() */
+
+
+static const luaL_Reg cache_methods[] = {
+	{ "stat",  &cache_stat },
+	{ "flush", &cache_flush },
+	{ NULL,    NULL },
+}; /* cache_methods[] */
+
+static const luaL_Reg cache_metatable[] = {
+	{ "__gc", &cache__gc },
+	{ NULL,   NULL }
+}; /* cache_metatable[] */
+
+static const luaL_Reg cache_globals[] = {
+	{ "new",       &cache_new },
+	{ "shared",    &cache_shared },
+	{ "interpose", &cache_interpose },
+	{ "type",      &cache_type },
+	{ NULL,        NULL }
+};
+
+int luaopen__cqueues_dns_cache(lua_State *L) {
+	cqs_newmetatable(L, CACHE_CLASS, cache_methods, cache_metatable, 0);
+
+	luaL_newlib(L, cache_globals);
+
+	return 1;
+} /* luaopen__cqueues_dns_cache() */
+
+
+/*
+ * T C P  B I N D I N G S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static int tcp_new(lua_State *L) {
+	struct dns_tcp_options opts = { 0 };
+	struct dns_tcp **tcp;
+	int error;
+
+	if (lua_istable(L, 1)) {
+		opts.maxconn = optfint(L, 1, "maxconn", 0);
+		opts.pipeline = optfint(L, 1, "pipeline", 0);
+		opts.idle = optfint(L, 1, "idle", 0);
+	}
+
+	tcp = lua_newuserdata(L, sizeof *tcp);
+	*tcp = 0;
+
+	if (!(*tcp = dns_tcp_open(&opts, &error)))
+		return lua_pushboolean(L, 0), lua_pushinteger(L, error), 2;
+
+	luaL_setmetatable(L, TCP_CLASS);
+
+	return 1;
+} /* tcp_new() */
+
+
+static int tcp_interpose(lua_State *L) {
+	return cqs_interpose(L, TCP_CLASS);
+} /* tcp_interpose() */
+
+
+static struct dns_tcp *tcp_check(lua_State *L, int index) {
+	return *(struct dns_tcp **)luaL_checkudata(L, index, TCP_CLASS);
+} /* tcp_check() */
+
+
+static struct dns_tcp *tcp_test(lua_State *L, int index) {
+	struct dns_tcp **tcp = luaL_testudata(L, index, TCP_CLASS);
+	return (tcp)? *tcp : 0;
+} /* tcp_test() */
+
+
+static int tcp_type(lua_State *L) {
+	if (tcp_test(L, 1)) {
+		lua_pushstring(L, "dns tcp");
+	} else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+} /* tcp_type() */
+
+
+static int tcp_stat(lua_State *L) {
+	struct dns_tcp *tcp = tcp_check(L, 1);
+	struct dns_tcp_stat st;
+
+	dns_tcp_stat(tcp, &st);
+
+	lua_newtable(L);
+
+#define setfield(name) do { \
+	lua_pushinteger(L, st.name); \
+	lua_setfield(L, -2, #name); \
+} while (0)
+
+	setfield(count);
+	setfield(opened);
+	setfield(reused);
+	setfield(pipelined);
+	setfield(retries);
+	setfield(expired);
+
+#undef setfield
+
+	return 1;
+} /* tcp_stat() */
+
+
+static int tcp__gc(lua_State *L) {
+	struct dns_tcp **tcp = luaL_checkudata(L, 1, TCP_CLASS);
+
+	dns_tcp_close(*tcp);
+	*tcp = 0;
+
+	return 0;
+} /* tcp__gc() */
+
+
+static const luaL_Reg tcp_methods[] = {
+	{ "stat", &tcp_stat },
+	{ NULL,   NULL },
+}; /* tcp_methods[] */
+
+static const luaL_Reg tcp_metatable[] = {
+	{ "__gc", &tcp__gc },
+	{ NULL,   NULL }
+}; /* tcp_metatable[] */
+
+static const luaL_Reg tcp_globals[] = {
+	{ "new",       &tcp_new },
+	{ "interpose", &tcp_interpose },
+	{ "type",      &tcp_type },
+	{ NULL,        NULL }
+};
+
+int luaopen__cqueues_dns_tcp(lua_State *L) {
+	cqs_newmetatable(L, TCP_CLASS, tcp_methods, tcp_metatable, 0);
+
+	luaL_newlib(L, tcp_globals);
+
+	return 1;
+} /* luaopen__cqueues_dns_tcp() */
+
+
 /*
  * R E S O L V E R  B I N D I N G S
  *
@@ -2098,6 +2375,8 @@ static int res_new(lua_State *L) {
 	struct dns_resolv_conf *resconf = resconf_test(L, 1);
 	struct dns_hosts *hosts = hosts_test(L, 2);
 	struct dns_hints *hints = hints_test(L, 3);
+	struct dns_cache *cache = cache_test(L, 4);
+	struct dns_tcp *tcp = tcp_test(L, 5);
 	int error;
 
 	if (resconf)
@@ -2130,9 +2409,12 @@ static int res_new(lua_State *L) {
 			goto error;
 	}
 
-	if (!(R->res = dns_res_open(resconf, hosts, hints, NULL, dns_opts(.closefd = { R, &res_closefd }), &error)))
+	if (!(R->res = dns_res_open(resconf, hosts, hints, cache, dns_opts(.closefd = { R, &res_closefd }), &error)))
 		goto error;
 
+	if (tcp)
+		dns_res_settcp(R->res, tcp);
+
 	dns_resconf_close(resconf);
 	dns_hosts_close(hosts);
 	dns_hints_close(hints);
@@ -2185,6 +2467,9 @@ static int res_submit(lua_State *L) {
 	int class = luaL_optint(L, 4, DNS_C_IN);
 	int error;
 
+	/* the submitting controller; see resolver:submit in dns.resolver.lua */
+	dns_res_settcpgroup(R, lua_topointer(L, 5));
+
 	if (!(error = dns_res_submit(R, name, type, class))) {
 		lua_pushboolean(L, 1);
 
@@ -2359,6 +2644,8 @@ int luaopen__cqueues_dns_resolver(lua_State *L) {
 	cqs_requiref(L, "_cqueues.dns.hosts", &luaopen__cqueues_dns_hosts, 0);
 	cqs_requiref(L, "_cqueues.dns.hints", &luaopen__cqueues_dns_hints, 0);
 	cqs_requiref(L, "_cqueues.dns.packet", &luaopen__cqueues_dns_packet, 0);
+	cqs_requiref(L, "_cqueues.dns.cache", &luaopen__cqueues_dns_cache, 0);
+	cqs_requiref(L, "_cqueues.dns.tcp", &luaopen__cqueues_dns_tcp, 0);
 
 	luaL_newlib(L, res_globals);
 
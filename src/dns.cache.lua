@@ -0,0 +1,7 @@
+local loader = function(loader, ...)
+	local cache = require"_cqueues.dns.cache"
+
+	return cache
+end
+
+return loader(loader, ...)
@@ -8,12 +8,12 @@ local loader = function(loader, ...)
 	local ETIMEDOUT = errno.ETIMEDOUT
 	local monotime = cqueues.monotime
 
-	local _new = resolver.new; resolver.new = function (resconf, hosts, hints)
+	local _new = resolver.new; resolver.new = function (resconf, hosts, hints, cache, tcp)
 		if type(resconf) == "table" then
 			resconf = config.new(resconf)
 		end
 
-		return _new(resconf, hosts, hints)
+		return _new(resconf, hosts, hints, cache, tcp)
 	end
 
 	resolver.stub = function (init)
@@ -46,7 +46,9 @@ local loader = function(loader, ...)
 		type = toconst(type, record.type, "type", 2)
 		class = toconst(class, record.class, "class", 2)
 
-		return _submit(self, name, type, class)
+		-- TCP connections are only shared within one controller, as
+		-- an answer read by a query on another wouldn't wake ours
+		return _submit(self, name, type, class, (cqueues.running()))
 	end)
 
 	resolver.interpose("query", function (self, name, type, class, timeout)
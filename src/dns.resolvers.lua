@@ -1,6 +1,10 @@
 local loader = function(loader, ...)
 	local resolver = require"cqueues.dns.resolver"
 	local config = require"cqueues.dns.config"
+	local cache = require"cqueues.dns.cache"
+	local tcp = require"cqueues.dns.tcp"
+	local record = require"cqueues.dns.record"
+	local packet = require"cqueues.dns.packet"
 	local condition = require"cqueues.condition"
 	local monotime = require"cqueues".monotime
 	local random = require"cqueues.dns".random
@@ -114,10 +118,10 @@ local loader = function(loader, ...)
 	local function getby(self, deadline)
 		local res
 		while true do
-			local cache_len = #self.cache
-			if cache_len > 1 then
-				res = self.cache[cache_len]
-				self.cache[cache_len] = nil
+			local idle_len = #self.idle
+			if idle_len > 1 then
+				res = self.idle[idle_len]
+				self.idle[idle_len] = nil
 				if res then
 					break
 				else
@@ -128,7 +132,7 @@ local loader = function(loader, ...)
 				end
 			elseif self.alive.n < self.hiwat then
 				local why
-				res, why = resolver.new(self.resconf, self.hosts, self.hints)
+				res, why = resolver.new(self.resconf, self.hosts, self.hints, self.dnscache, self.dnstcp)
 				if not res then
 					return nil, why
 				end
@@ -148,15 +152,15 @@ local loader = function(loader, ...)
 	function pool:put(res)
 		self.alive:delete(res)
 
-		local cache_len = #self.cache
-		if cache_len < self.lowat and res:stat().queries < self.querymax then
-			if not self.lifo and cache_len > 0 then
-				local i = random(cache_len+1) + 1
+		local idle_len = #self.idle
+		if idle_len < self.lowat and res:stat().queries < self.querymax then
+			if not self.lifo and idle_len > 0 then
+				local i = random(idle_len+1) + 1
 
-				self.cache[cache_len+1] = self.cache[i]
-				self.cache[i] = res
+				self.idle[idle_len+1] = self.idle[i]
+				self.idle[i] = res
 			else
-				self.cache[cache_len+1] = res
+				self.idle[idle_len+1] = res
 			end
 		else
 			res:close()
@@ -169,16 +173,80 @@ local loader = function(loader, ...)
 	end -- pool:signal
 
 
+	-- raise here rather than while our lookup is registered
+	local function qconst(id, map, what, def)
+		local n
+
+		if id == nil then
+			return def
+		elseif type(id) == "number" then
+			n = map[id] and id
+		elseif type(id) == "string" then
+			n = map[id] or map[string.upper(id)]
+		end
+
+		if not n then
+			error((tostring(id) .. ": unknown DNS " .. what), 3)
+		end
+
+		return n
+	end -- qconst
+
+	--
+	-- Concurrent identical queries share one lookup. The first caller
+	-- does the work; the rest wait on its condition variable and never
+	-- check out a resolver. Each waiter receives its own copy of the
+	-- answer. A waiter outliving a lookup which timed-out retries.
+	--
 	function pool:query(name, type, class, timeout)
 		local deadline = todeadline(timeout or self.timeout)
-		local res, why = getby(self, deadline)
+		type = qconst(type, record.type, "type", record.type.A)
+		class = qconst(class, record.class, "class", record.class.IN)
+
+		local key = string.format("%s %d %d", string.lower(name), type, class)
+
+		while true do
+			local q = self.inflight[key]
+
+			if not q then
+				break
+			end
+
+			repeat
+				if deadline and deadline <= monotime() then
+					return nil, ETIMEDOUT
+				end
+
+				q.cond:wait(totimeout(deadline))
+			until q.done
+
+			if q.answer then
+				return packet.new(q.answer:dump())
+			elseif q.why ~= ETIMEDOUT then
+				return nil, q.why
+			end
+		end
+
+		-- register before getby, which may yield
+		local q = { cond = condition.new(), done = false }
+		local res, r, y
+
+		self.inflight[key] = q
+
+		res, y = getby(self, deadline)
 
-		if not res then
-			return nil, why
+		if res then
+			r, y = res:query(name, type, class, totimeout(deadline))
+		end
+
+		self.inflight[key] = nil
+		q.done, q.answer, q.why = true, r, y
+		q.cond:signal()
+
+		if res then
+			self:put(res)
 		end
 
-		local r, y = res:query(name, type, class, totimeout(deadline))
-		self:put(res)
 		if not r then
 			return nil, y
 		end
@@ -192,6 +260,18 @@ local loader = function(loader, ...)
 	end -- pool:check
 
 
+	-- answer cache shared by the pool's resolvers, if any
+	function pool:cache()
+		return self.dnscache or nil
+	end -- pool:cache
+
+
+	-- TCP connections shared by the pool's resolvers, if any
+	function pool:tcp()
+		return self.dnstcp or nil
+	end -- pool:tcp
+
+
 	function pool:onleak(f)
 		return self.alive:onleak(f)
 	end -- pool:onleak
@@ -205,12 +285,37 @@ local loader = function(loader, ...)
 	resolvers.onleak = nil
 	resolvers.lifo = false
 
-	function resolvers.new(resconf, hosts, hints)
+	--
+	-- A nil cache gives the pool a private answer cache; false disables
+	-- caching. Likewise a nil dnstcp gives the pool's resolvers a set of
+	-- persistent TCP connections to pipeline their queries on; false
+	-- opens a connection per query.
+	--
+	function resolvers.new(resconf, hosts, hints, dnscache, dnstcp)
 		local self = {}
+		local why
+
+		if dnscache == nil then
+			dnscache, why = cache.new()
+
+			if not dnscache then
+				return nil, why
+			end
+		end
+
+		if dnstcp == nil then
+			dnstcp, why = tcp.new()
+
+			if not dnstcp then
+				return nil, why
+			end
+		end
 
 		self.resconf = (type(resconf) == "table" and config.new(resconf)) or resconf
 		self.hosts = hosts
 		self.hints = hints
+		self.dnscache = dnscache
+		self.dnstcp = dnstcp
 		self.condvar = condition.new()
 		self.lowat = resolvers.lowat
 		self.hiwat = resolvers.hiwat
@@ -218,14 +323,26 @@ local loader = function(loader, ...)
 		self.querymax = resolvers.querymax
 		self.onleak = resolvers.onleak
 		self.lifo = resolvers.lifo
-		self.cache = {}
+		self.idle = {}
+		self.inflight = {}
 		self.alive = alive.new(self.condvar)
 
 		return setmetatable(self, { __index = pool })
 	end -- resolvers.new
 
 
+	-- the system configuration shares answers with socket.connect
 	function resolvers.stub(cfg)
+		if cfg == nil then
+			local dnscache, why = cache.shared()
+
+			if not dnscache then
+				return nil, why
+			end
+
+			return resolvers.new(config.stub(), nil, nil, dnscache)
+		end
+
 		return resolvers.new(config.stub(cfg))
 	end -- resolvers.stub
 
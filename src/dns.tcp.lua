@@ -0,0 +1,7 @@
+local loader = function(loader, ...)
+	local tcp = require"_cqueues.dns.tcp"
+
+	return tcp
+end
+
+return loader(loader, ...)
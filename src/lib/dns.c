@@ -308,6 +308,7 @@ int dns_v_api(void) {
 #define DNS_EALREADY	WSAEALREADY
 #define DNS_EAGAIN	EAGAIN
 #define DNS_ETIMEDOUT	WSAETIMEDOUT
+#define DNS_ECONNRESET	WSAECONNRESET
 
 #define dns_syerr()	((int)GetLastError())
 #define dns_soerr()	((int)WSAGetLastError())
@@ -321,6 +322,7 @@ int dns_v_api(void) {
 #define DNS_EALREADY	EALREADY
 #define DNS_EAGAIN	EAGAIN
 #define DNS_ETIMEDOUT	ETIMEDOUT
+#define DNS_ECONNRESET	ECONNRESET
 
 #define dns_syerr()	errno
 #define dns_soerr()	errno
@@ -6101,6 +6103,537 @@ void dns_cache_close(struct dns_cache *cache) {
 } /* dns_cache_close() */
 
 
+/*
+ * Built-in LRU cache. Entries hang off a chained hash table and a
+ * doubly-linked recency list. Answers are copied in and out, so callers
+ * never see an entry's packet and the lock only covers bookkeeping.
+ */
+#if DNS_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#define DNS_LRU_HOT	2	/* hits before an entry may be prefetched */
+#define DNS_LRU_RETRY	5	/* seconds before a lost prefetch is reissued */
+
+struct dns_lru_entry {
+	struct dns_lru_entry *hnext;		/* hash chain */
+	struct dns_lru_entry *prev, *next;	/* most recently used first */
+
+	unsigned hash;
+	enum dns_type type;
+	enum dns_class class;
+	_Bool negative;
+
+	time_t inserted, expires, refresh;
+	unsigned hits;
+
+	struct dns_packet *answer;
+
+	size_t namelen;
+	char name[];
+}; /* struct dns_lru_entry */
+
+struct dns_lru {
+	struct dns_cache cache;
+
+	struct dns_cache_options opts;
+
+#if DNS_THREAD_SAFE
+	pthread_mutex_t mutex;
+#endif
+
+	struct dns_lru_entry **table;
+	size_t tsize; /* power of 2 */
+
+	struct dns_lru_entry *head, *tail;
+
+	struct dns_cache_stat stat;
+}; /* struct dns_lru */
+
+#if DNS_THREAD_SAFE
+#define dns_lru_lock(lru)	pthread_mutex_lock(&(lru)->mutex)
+#define dns_lru_unlock(lru)	pthread_mutex_unlock(&(lru)->mutex)
+#else
+#define dns_lru_lock(lru)	(void)0
+#define dns_lru_unlock(lru)	(void)0
+#endif
+
+
+static time_t dns_now(void) {
+#if defined CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (0 == clock_gettime(CLOCK_MONOTONIC, &ts))
+		return ts.tv_sec;
+#endif
+	return time(0);
+} /* dns_now() */
+
+
+struct dns_lru_key {
+	char name[DNS_D_MAXNAME + 1];
+	size_t namelen;
+	enum dns_type type;
+	enum dns_class class;
+	unsigned hash;
+}; /* struct dns_lru_key */
+
+static int dns_lru_key(struct dns_lru_key *key, struct dns_packet *Q) {
+	struct dns_rr rr;
+	unsigned h = 2166136261U; /* FNV-1a */
+	size_t i;
+	int error;
+
+	if (!dns_header(Q)->qdcount)
+		return DNS_EILLEGAL;
+
+	if ((error = dns_rr_parse(&rr, 12, Q)))
+		return error;
+
+	if (!(key->namelen = dns_d_expand(key->name, sizeof key->name, rr.dn.p, Q, &error)))
+		return error;
+	else if (key->namelen >= sizeof key->name)
+		return DNS_EILLEGAL;
+
+	for (i = 0; i < key->namelen; i++) {
+		key->name[i] = tolower((unsigned char)key->name[i]);
+		h = (h ^ (unsigned char)key->name[i]) * 16777619U;
+	}
+
+	key->type = rr.type;
+	key->class = rr.class;
+	key->hash = (h ^ ((unsigned)rr.type << 16) ^ (unsigned)rr.class) * 16777619U;
+
+	return 0;
+} /* dns_lru_key() */
+
+
+static struct dns_lru_entry **dns_lru_slot(struct dns_lru *lru, const struct dns_lru_key *key) {
+	struct dns_lru_entry **pp = &lru->table[key->hash & (lru->tsize - 1)];
+
+	for (; *pp; pp = &(*pp)->hnext) {
+		struct dns_lru_entry *e = *pp;
+
+		if (e->hash == key->hash && e->type == key->type && e->class == key->class
+		&&  e->namelen == key->namelen && !memcmp(e->name, key->name, key->namelen))
+			break;
+	}
+
+	return pp;
+} /* dns_lru_slot() */
+
+
+static void dns_lru_unlink(struct dns_lru *lru, struct dns_lru_entry *e) {
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		lru->head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		lru->tail = e->prev;
+
+	e->prev = e->next = NULL;
+} /* dns_lru_unlink() */
+
+
+static void dns_lru_push(struct dns_lru *lru, struct dns_lru_entry *e) {
+	e->prev = NULL;
+	e->next = lru->head;
+
+	if (lru->head)
+		lru->head->prev = e;
+	else
+		lru->tail = e;
+
+	lru->head = e;
+} /* dns_lru_push() */
+
+
+/* pp is the hash chain link pointing at e */
+static void dns_lru_remove(struct dns_lru *lru, struct dns_lru_entry **pp) {
+	struct dns_lru_entry *e = *pp;
+
+	*pp = e->hnext;
+	dns_lru_unlink(lru, e);
+
+	dns_p_free(e->answer);
+	free(e);
+
+	lru->stat.count--;
+} /* dns_lru_remove() */
+
+
+static void dns_lru_evict(struct dns_lru *lru, struct dns_lru_entry *e) {
+	struct dns_lru_entry **pp = &lru->table[e->hash & (lru->tsize - 1)];
+
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+
+	dns_lru_remove(lru, pp);
+} /* dns_lru_evict() */
+
+
+static void dns_lru_grow(struct dns_lru *lru) {
+	struct dns_lru_entry **table, *e, *nxt;
+	size_t tsize = lru->tsize * 2, i;
+
+	/* table growth is an optimization; just run with longer chains */
+	if (!(table = calloc(tsize, sizeof *table)))
+		return;
+
+	for (i = 0; i < lru->tsize; i++) {
+		for (e = lru->table[i]; e; e = nxt) {
+			nxt = e->hnext;
+			e->hnext = table[e->hash & (tsize - 1)];
+			table[e->hash & (tsize - 1)] = e;
+		}
+	}
+
+	free(lru->table);
+	lru->table = table;
+	lru->tsize = tsize;
+} /* dns_lru_grow() */
+
+
+/* rewrite TTLs to reflect time spent in the cache */
+static void dns_lru_age(struct dns_packet *P, time_t age) {
+	struct dns_rr rr;
+
+	dns_rr_foreach(&rr, P, .section = (DNS_S_ALL & ~DNS_S_QD)) {
+		unsigned char *ttl = &P->data[rr.rd.p - 6];
+		unsigned left;
+
+		if (rr.type == DNS_T_OPT)
+			continue;
+
+		left = (rr.ttl > age)? rr.ttl - (unsigned)age : 0;
+
+		ttl[0] = 0xff & (left >> 24);
+		ttl[1] = 0xff & (left >> 16);
+		ttl[2] = 0xff & (left >> 8);
+		ttl[3] = 0xff & (left >> 0);
+	}
+} /* dns_lru_age() */
+
+
+static dns_refcount_t dns_lru_release(struct dns_cache *cache) {
+	struct dns_lru *lru = cache->state;
+	dns_refcount_t count;
+
+	if (1 != (count = dns_atomic_fetch_sub(&cache->_.refcount)))
+		return count;
+
+	while (lru->head)
+		dns_lru_evict(lru, lru->head);
+
+#if DNS_THREAD_SAFE
+	pthread_mutex_destroy(&lru->mutex);
+#endif
+	free(lru->table);
+	free(lru);
+
+	return count;
+} /* dns_lru_release() */
+
+
+static struct dns_packet *dns_lru_query(struct dns_packet *Q, struct dns_cache *cache, int *error) {
+	struct dns_lru *lru = cache->state;
+	struct dns_lru_entry **pp, *e;
+	struct dns_lru_key key;
+	struct dns_packet *A = NULL;
+	time_t now, age;
+
+	/* uncacheable question */
+	if (dns_lru_key(&key, Q))
+		return NULL;
+
+	now = dns_now();
+
+	dns_lru_lock(lru);
+
+	if (!(e = *(pp = dns_lru_slot(lru, &key))))
+		goto miss;
+
+	if (now >= e->expires) {
+		lru->stat.expired++;
+		dns_lru_remove(lru, pp);
+
+		goto miss;
+	}
+
+	e->hits++;
+
+	/*
+	 * Let one caller refresh a hot entry nearing expiry. If its
+	 * answer never arrives another caller is picked after a while.
+	 */
+	if (lru->opts.prefetch >= 0 && !e->negative && e->hits >= DNS_LRU_HOT && now >= e->refresh
+	&&  (e->expires - now) * 100 <= (e->expires - e->inserted) * lru->opts.prefetch) {
+		e->refresh = now + DNS_LRU_RETRY;
+		lru->stat.prefetches++;
+
+		goto miss;
+	}
+
+	if (!(A = dns_p_make(e->answer->end, error)))
+		goto unlock;
+
+	dns_p_copy(A, e->answer);
+	age = now - e->inserted;
+
+	dns_lru_unlink(lru, e);
+	dns_lru_push(lru, e);
+
+	lru->stat.hits++;
+	if (e->negative)
+		lru->stat.negative++;
+
+	dns_lru_unlock(lru);
+
+	if ((*error = dns_p_study(A))) {
+		dns_p_free(A);
+
+		return NULL;
+	}
+
+	dns_lru_age(A, age);
+	dns_header(A)->qid = dns_header(Q)->qid;
+
+	return A;
+miss:
+	lru->stat.misses++;
+unlock:
+	dns_lru_unlock(lru);
+
+	return NULL;
+} /* dns_lru_query() */
+
+
+static int dns_lru_insert(struct dns_packet *Q, struct dns_packet *A, struct dns_cache *cache) {
+	struct dns_lru *lru = cache->state;
+	struct dns_lru_entry **pp, *e;
+	struct dns_lru_key key;
+	struct dns_packet *P;
+	struct dns_rr rr;
+	unsigned ttl = ~0U;
+	_Bool negative, soa = 0;
+	time_t now;
+	int error;
+
+	if (dns_header(A)->tc || dns_p_opcode(A) != DNS_OP_QUERY)
+		return 0;
+
+	if (dns_p_rcode(A) == DNS_RC_NXDOMAIN)
+		negative = 1;
+	else if (dns_p_rcode(A) == DNS_RC_NOERROR)
+		negative = !dns_p_count(A, DNS_S_AN);
+	else
+		return 0;
+
+	dns_rr_foreach(&rr, A, .section = DNS_S_AN) {
+		ttl = DNS_PP_MIN(ttl, rr.ttl);
+	}
+
+	/* RFC 2308 section 5: only with an SOA to bound the TTL */
+	if (negative) {
+		dns_rr_foreach(&rr, A, .section = DNS_S_NS, .type = DNS_T_SOA) {
+			struct dns_soa rd;
+
+			if ((error = dns_soa_parse(&rd, &rr, A)))
+				return error;
+
+			ttl = DNS_PP_MIN(ttl, DNS_PP_MIN(rr.ttl, rd.minimum));
+			soa = 1;
+		}
+
+		if (!soa)
+			return 0; /* e.g. a referral */
+
+		ttl = DNS_PP_MIN(ttl, lru->opts.negttl);
+	} else {
+		ttl = DNS_PP_MIN(ttl, lru->opts.maxttl);
+	}
+
+	if (!ttl)
+		return 0;
+
+	if ((error = dns_lru_key(&key, Q)))
+		return error;
+
+	if (!(P = dns_p_make(A->end, &error)))
+		return error;
+
+	dns_p_copy(P, A);
+
+	now = dns_now();
+
+	dns_lru_lock(lru);
+
+	if ((e = *(pp = dns_lru_slot(lru, &key)))) {
+		dns_p_free(e->answer);
+		dns_lru_unlink(lru, e);
+	} else {
+		if (!(e = malloc(offsetof(struct dns_lru_entry, name) + key.namelen))) {
+			error = dns_syerr();
+			dns_lru_unlock(lru);
+			dns_p_free(P);
+
+			return error;
+		}
+
+		e->hnext = NULL;
+		e->hash = key.hash;
+		e->type = key.type;
+		e->class = key.class;
+		e->namelen = key.namelen;
+		memcpy(e->name, key.name, key.namelen);
+
+		*pp = e;
+		lru->stat.count++;
+	}
+
+	e->negative = negative;
+	e->inserted = now;
+	e->expires = now + ttl;
+	e->refresh = now;
+	e->hits = 0;
+	e->answer = P;
+
+	dns_lru_push(lru, e);
+	lru->stat.inserts++;
+
+	while (lru->stat.count > lru->opts.size) {
+		dns_lru_evict(lru, lru->tail);
+		lru->stat.evictions++;
+	}
+
+	if (lru->stat.count > lru->tsize)
+		dns_lru_grow(lru);
+
+	dns_lru_unlock(lru);
+
+	return 0;
+} /* dns_lru_insert() */
+
+
+struct dns_cache *dns_cache_open(const struct dns_cache_options *opts, int *error) {
+	static const struct dns_cache_options defaults = {
+		.size     = DNS_CACHE_SIZE,
+		.maxttl   = DNS_CACHE_MAXTTL,
+		.negttl   = DNS_CACHE_NEGTTL,
+		.prefetch = DNS_CACHE_PREFETCH,
+	};
+	struct dns_lru *lru;
+
+	if (!(lru = calloc(1, sizeof *lru)))
+		goto syerr;
+
+	lru->opts = (opts)? *opts : defaults;
+
+	if (!lru->opts.size)
+		lru->opts.size = defaults.size;
+	if (!lru->opts.maxttl)
+		lru->opts.maxttl = defaults.maxttl;
+	if (!lru->opts.negttl)
+		lru->opts.negttl = defaults.negttl;
+	if (!lru->opts.prefetch)
+		lru->opts.prefetch = defaults.prefetch;
+
+	lru->tsize = 64;
+
+	if (!(lru->table = calloc(lru->tsize, sizeof *lru->table)))
+		goto syerr;
+
+#if DNS_THREAD_SAFE
+	if ((*error = pthread_mutex_init(&lru->mutex, NULL))) {
+		free(lru->table);
+		free(lru);
+
+		return NULL;
+	}
+#endif
+
+	dns_cache_init(&lru->cache);
+
+	lru->cache.state   = lru;
+	lru->cache.release = &dns_lru_release;
+	lru->cache.query   = &dns_lru_query;
+	lru->cache.insert  = &dns_lru_insert;
+
+	return &lru->cache;
+syerr:
+	*error = dns_syerr();
+
+	if (lru)
+		free(lru->table);
+	free(lru);
+
+	return NULL;
+} /* dns_cache_open() */
+
+
+struct dns_cache *dns_cache_shared(int *error) {
+#if DNS_THREAD_SAFE
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+	static struct dns_cache *shared;
+	struct dns_cache *cache;
+
+#if DNS_THREAD_SAFE
+	pthread_mutex_lock(&mutex);
+#endif
+
+	if (!shared)
+		shared = dns_cache_open(NULL, error);
+
+	if ((cache = shared))
+		dns_cache_acquire(cache);
+
+#if DNS_THREAD_SAFE
+	pthread_mutex_unlock(&mutex);
+#endif
+
+	return cache;
+} /* dns_cache_shared() */
+
+
+int dns_cache_stat(struct dns_cache *cache, struct dns_cache_stat *st) {
+	struct dns_lru *lru;
+
+	if (cache->query != &dns_lru_query)
+		return EINVAL;
+
+	lru = cache->state;
+
+	dns_lru_lock(lru);
+	*st = lru->stat;
+	dns_lru_unlock(lru);
+
+	return 0;
+} /* dns_cache_stat() */
+
+
+int dns_cache_flush(struct dns_cache *cache) {
+	struct dns_lru *lru;
+
+	if (cache->query != &dns_lru_query)
+		return EINVAL;
+
+	lru = cache->state;
+
+	dns_lru_lock(lru);
+
+	while (lru->head)
+		dns_lru_evict(lru, lru->head);
+
+	dns_lru_unlock(lru);
+
+	return 0;
+} /* dns_cache_flush() */
+
+
 /*
  * S O C K E T  R O U T I N E S
  *
@@ -6251,6 +6784,8 @@ enum {
 	DNS_SO_TCP_DONE,
 };
 
+struct dns_tcpconn;
+
 struct dns_socket {
 	struct dns_options opts;
 
@@ -6268,6 +6803,9 @@ struct dns_socket {
 
 	struct dns_stat stat;
 
+	struct dns_tcp *pool; /* shared TCP connections, if any */
+	const void *group; /* only share connections within the same group */
+
 	/*
 	 * NOTE: dns_so_reset() zeroes everything from here down.
 	 */
@@ -6286,6 +6824,11 @@ struct dns_socket {
 
 	struct dns_packet *answer;
 	size_t alen, apos;
+
+	struct dns_tcpconn *conn;
+	struct dns_socket *cnext; /* next socket attached to conn */
+	unsigned long long qseq; /* end of our frame in conn's output */
+	unsigned retries;
 }; /* struct dns_socket */
 
 
@@ -6384,226 +6927,825 @@ struct dns_socket *dns_so_open(const struct sockaddr *local, int type, const str
 	if (!dns_so_init(so, local, type, opts, error))
 		goto error;
 
-	return so;
-syerr:
-	*error	= dns_syerr();
-error:
-	dns_so_close(so);
+	return so;
+syerr:
+	*error	= dns_syerr();
+error:
+	dns_so_close(so);
+
+	return 0;
+} /* dns_so_open() */
+
+
+static void dns_so_destroy(struct dns_socket *so) {
+	dns_so_reset(so);
+	dns_so_closefds(so, DNS_SO_CLOSE_ALL);
+	dns_tcp_close(so->pool);
+	so->pool = NULL;
+} /* dns_so_destroy() */
+
+
+void dns_so_close(struct dns_socket *so) {
+	if (!so)
+		return;
+
+	dns_so_destroy(so);
+
+	free(so);
+} /* dns_so_close() */
+
+
+static void dns_so_tcpdetach(struct dns_socket *);
+
+void dns_so_reset(struct dns_socket *so) {
+	dns_so_tcpdetach(so);
+	dns_p_setptr(&so->answer, NULL);
+
+	memset(&so->state, '\0', sizeof *so - offsetof(struct dns_socket, state));
+} /* dns_so_reset() */
+
+
+unsigned short dns_so_mkqid(struct dns_socket *so) {
+	return dns_k_permutor_step(&so->qids);
+} /* dns_so_mkqid() */
+
+
+#define DNS_SO_MINBUF	768
+
+static int dns_so_newanswer(struct dns_socket *so, size_t len) {
+	size_t size	= offsetof(struct dns_packet, data) + DNS_PP_MAX(len, DNS_SO_MINBUF);
+	void *p;
+
+	if (!(p = realloc(so->answer, size)))
+		return dns_syerr();
+
+	so->answer	= dns_p_init(p, size);
+
+	return 0;
+} /* dns_so_newanswer() */
+
+
+int dns_so_submit(struct dns_socket *so, struct dns_packet *Q, struct sockaddr *host) {
+	struct dns_rr rr;
+	int error = DNS_EUNKNOWN;
+
+	dns_so_reset(so);
+
+	if ((error = dns_rr_parse(&rr, 12, Q)))
+		goto error;
+
+	if (!(so->qlen = dns_d_expand(so->qname, sizeof so->qname, rr.dn.p, Q, &error)))
+		goto error;
+	/*
+	 * NOTE: Don't bail if expansion is too long; caller may be
+	 * intentionally sending long names. However, we won't be able to
+	 * verify it on return.
+	 */
+
+	so->qtype	= rr.type;
+	so->qclass	= rr.class;
+
+	if ((error = dns_so_newanswer(so, (Q->memo.opt.maxudp)? Q->memo.opt.maxudp : DNS_SO_MINBUF)))
+		goto syerr;
+
+	memcpy(&so->remote, host, dns_sa_len(host));
+
+	so->query	= Q;
+	so->qout	= 0;
+
+	dns_begin(&so->elapsed);
+
+	if (dns_header(so->query)->qid == 0)
+		dns_header(so->query)->qid	= dns_so_mkqid(so);
+
+	so->qid		= dns_header(so->query)->qid;
+	so->state	= (so->type == SOCK_STREAM)? DNS_SO_TCP_INIT : DNS_SO_UDP_INIT;
+
+	so->stat.queries++;
+
+	return 0;
+syerr:
+	error	= dns_syerr();
+error:
+	dns_so_reset(so);
+
+	return error;
+} /* dns_so_submit() */
+
+
+static int dns_so_verify(struct dns_socket *so, struct dns_packet *P) {
+	char qname[DNS_D_MAXNAME + 1];
+	size_t qlen;
+	struct dns_rr rr;
+	int error = -1;
+
+	if (so->qid != dns_header(so->answer)->qid)
+		goto reject;
+
+	if (!dns_p_count(so->answer, DNS_S_QD))
+		goto reject;
+
+	if (0 != dns_rr_parse(&rr, 12, so->answer))
+		goto reject;
+
+	if (rr.type != so->qtype || rr.class != so->qclass)
+		goto reject;
+
+	if (!(qlen = dns_d_expand(qname, sizeof qname, rr.dn.p, P, &error)))
+		goto error;
+	else if (qlen >= sizeof qname || qlen != so->qlen)
+		goto reject;
+
+	if (0 != strcasecmp(so->qname, qname))
+		goto reject;
+
+	return 0;
+reject:
+	error = DNS_EUNKNOWN;
+error:
+	DNS_SHOW(P, "rejecting packet (%s)", dns_strerror(error));
+
+	return error;
+} /* dns_so_verify() */
+
+
+static _Bool dns_so_tcp_keep(struct dns_socket *so) {
+	struct sockaddr_storage remote;
+
+	if (so->tcp == -1)
+		return 0;
+
+	if (0 != getpeername(so->tcp, (struct sockaddr *)&remote, &(socklen_t){ sizeof remote }))
+		return 0;
+
+	return 0 == dns_sa_cmp(&remote, &so->remote);
+} /* dns_so_tcp_keep() */
+
+
+#if defined __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Warray-bounds"
+#endif
+
+static int dns_so_tcp_send(struct dns_socket *so) {
+	unsigned char *qsrc;
+	size_t qend;
+	long n;
+
+	so->query->data[-2] = 0xff & (so->query->end >> 8);
+	so->query->data[-1] = 0xff & (so->query->end >> 0);
+
+	qsrc = &so->query->data[-2] + so->qout;
+	qend = so->query->end + 2;
+
+	while (so->qout < qend) {
+		if (0 > (n = dns_send(so->tcp, (void *)&qsrc[so->qout], qend - so->qout, 0)))
+			return dns_soerr();
+
+		so->qout += n;
+		so->stat.tcp.sent.bytes += n;
+	}
+
+	so->stat.tcp.sent.count++;
+
+	return 0;
+} /* dns_so_tcp_send() */
+
+
+static int dns_so_tcp_recv(struct dns_socket *so) {
+	unsigned char *asrc;
+	size_t aend, alen;
+	int error;
+	long n;
+
+	aend = so->alen + 2;
+
+	while (so->apos < aend) {
+		asrc = &so->answer->data[-2];
+
+		if (0 > (n = recv(so->tcp, (void *)&asrc[so->apos], aend - so->apos, 0)))
+			return dns_soerr();
+		else if (n == 0)
+			return DNS_EUNKNOWN;	/* FIXME */
+
+		so->apos += n;
+		so->stat.tcp.rcvd.bytes += n;
+
+		if (so->alen == 0 && so->apos >= 2) {
+			alen = ((0xff & so->answer->data[-2]) << 8)
+			     | ((0xff & so->answer->data[-1]) << 0);
+
+			if ((error = dns_so_newanswer(so, alen)))
+				return error;
+
+			so->alen = alen;
+			aend = alen + 2;
+		}
+	}
+
+	so->answer->end	= so->alen;
+	so->stat.tcp.rcvd.count++;
+
+	return 0;
+} /* dns_so_tcp_recv() */
+
+#if __clang__
+#pragma clang diagnostic pop
+#endif
+
+
+/*
+ * Shared TCP connections. Each attached socket appends its framed query
+ * to the connection's output buffer and any of them may flush it. Frames
+ * are read whole by whichever attached socket wakes first, straight into
+ * the answer buffer of the socket owning the QID, so no partial frame is
+ * left sitting on the descriptor to keep other pollers spinning. Nothing
+ * would wake an owner polling from another event loop once its answer
+ * was read for it, so a connection is only shared by sockets of the
+ * group it was opened for; the owners then wake together on the same
+ * readiness. A QID abandoned in flight stays reserved
+ * until its answer is discarded or the connection closes, so a late
+ * answer can't be mistaken for that of a later query.
+ */
+#define DNS_TCP_QIDSET	(65536 / 8)
+
+#define dns_tcp_isset(set, qid)	((set)[(qid) >> 3] & (1 << ((qid) & 7)))
+#define dns_tcp_set(set, qid)	((set)[(qid) >> 3] |= (1 << ((qid) & 7)))
+#define dns_tcp_clr(set, qid)	((set)[(qid) >> 3] &= ~(1 << ((qid) & 7)))
+
+struct dns_tcpconn {
+	struct dns_tcpconn *next;
+
+	int fd;
+	_Bool connected, dead;
+	struct sockaddr_storage remote;
+	const void *group;
+
+	unsigned refs;	/* attached sockets, each with one query in flight */
+	time_t idle;	/* when refs last dropped to zero */
+
+	unsigned char *wbuf;
+	size_t wpos, wlen, wsize;
+	unsigned long long wseq; /* bytes flushed since connecting */
+
+	struct dns_socket *socks; /* attached, linked through cnext */
+
+	unsigned char rhdr[4];	/* length and QID of the next frame */
+	size_t rhlen, rleft;	/* rleft is the unread part of the current frame */
+	struct dns_socket *rsock; /* whose answer it is, or NULL to discard it */
+
+	unsigned char inflight[DNS_TCP_QIDSET];
+	unsigned char stale[DNS_TCP_QIDSET];
+}; /* struct dns_tcpconn */
+
+struct dns_tcp {
+	dns_atomic_t refcount;
+
+	struct dns_tcp_options opts;
+
+#if DNS_THREAD_SAFE
+	pthread_mutex_t mutex;
+#endif
+
+	struct dns_tcpconn *conns;
+
+	struct dns_tcp_stat stat;
+}; /* struct dns_tcp */
+
+#if DNS_THREAD_SAFE
+#define dns_tcp_lock(tcp)	pthread_mutex_lock(&(tcp)->mutex)
+#define dns_tcp_unlock(tcp)	pthread_mutex_unlock(&(tcp)->mutex)
+#else
+#define dns_tcp_lock(tcp)	(void)(tcp)
+#define dns_tcp_unlock(tcp)	(void)(tcp)
+#endif
+
+
+struct dns_tcp *dns_tcp_open(const struct dns_tcp_options *opts, int *error) {
+	static const struct dns_tcp_options defaults = {
+		.maxconn  = DNS_TCP_MAXCONN,
+		.pipeline = DNS_TCP_PIPELINE,
+		.idle     = DNS_TCP_IDLE,
+	};
+	struct dns_tcp *tcp;
+
+	if (!(tcp = calloc(1, sizeof *tcp)))
+		goto syerr;
+
+	tcp->opts = (opts)? *opts : defaults;
+
+	if (!tcp->opts.maxconn)
+		tcp->opts.maxconn = defaults.maxconn;
+	if (!tcp->opts.pipeline)
+		tcp->opts.pipeline = defaults.pipeline;
+	if (!tcp->opts.idle)
+		tcp->opts.idle = defaults.idle;
+
+#if DNS_THREAD_SAFE
+	if ((*error = pthread_mutex_init(&tcp->mutex, NULL))) {
+		free(tcp);
+
+		return NULL;
+	}
+#endif
+
+	dns_tcp_acquire(tcp);
+
+	return tcp;
+syerr:
+	*error = dns_syerr();
+
+	return NULL;
+} /* dns_tcp_open() */
+
+
+/* NB: with so, closure is deferred like that of the socket's own fds */
+static void dns_tcp_free(struct dns_socket *so, struct dns_tcpconn *conn) {
+	if (!so || 0 != dns_so_closefd(so, &conn->fd))
+		dns_socketclose(&conn->fd, (so)? &so->opts : NULL);
+
+	free(conn->wbuf);
+	free(conn);
+} /* dns_tcp_free() */
+
+
+void dns_tcp_close(struct dns_tcp *tcp) {
+	struct dns_tcpconn *conn;
+
+	if (!tcp || 1 < dns_tcp_release(tcp))
+		return;
+
+	/* attached sockets hold references, so nothing is in use */
+	while ((conn = tcp->conns)) {
+		tcp->conns = conn->next;
+		dns_tcp_free(NULL, conn);
+	}
+
+#if DNS_THREAD_SAFE
+	pthread_mutex_destroy(&tcp->mutex);
+#endif
+
+	free(tcp);
+} /* dns_tcp_close() */
+
+
+dns_refcount_t dns_tcp_acquire(struct dns_tcp *tcp) {
+	return dns_atomic_fetch_add(&tcp->refcount);
+} /* dns_tcp_acquire() */
+
+
+dns_refcount_t dns_tcp_release(struct dns_tcp *tcp) {
+	return dns_atomic_fetch_sub(&tcp->refcount);
+} /* dns_tcp_release() */
+
+
+void dns_tcp_stat(struct dns_tcp *tcp, struct dns_tcp_stat *st) {
+	dns_tcp_lock(tcp);
+	*st = tcp->stat;
+	dns_tcp_unlock(tcp);
+} /* dns_tcp_stat() */
+
+
+static _Bool dns_tcp_again(int error) {
+	switch (error) {
+	case DNS_EAGAIN:
+#if DNS_EWOULDBLOCK != DNS_EAGAIN
+	case DNS_EWOULDBLOCK:
+#endif
+	case DNS_EINTR:
+	case DNS_EINPROGRESS:
+	case DNS_EALREADY:
+		return 1;
+	default:
+		return 0;
+	}
+} /* dns_tcp_again() */
+
+
+/* unlink a failed connection; it's freed once the last socket detaches */
+static void dns_tcp_kill(struct dns_tcp *tcp, struct dns_tcpconn *conn) {
+	struct dns_tcpconn **pp;
+
+	if (conn->dead)
+		return;
+
+	conn->dead = 1;
+
+	for (pp = &tcp->conns; *pp; pp = &(*pp)->next) {
+		if (*pp == conn) {
+			*pp = conn->next;
+			tcp->stat.count--;
+
+			break;
+		}
+	}
+} /* dns_tcp_kill() */
+
+
+/* whether an idle connection is still open at the other end */
+static _Bool dns_tcp_alive(struct dns_tcpconn *conn) {
+	char c;
+
+	if (!conn->connected)
+		return 1;
+
+	if (0 < recv(conn->fd, &c, 1, MSG_PEEK))
+		return 1;
+
+	return dns_tcp_again(dns_soerr());
+} /* dns_tcp_alive() */
+
+
+static struct dns_tcpconn *dns_tcp_new(struct dns_socket *so, int *error) {
+	struct dns_tcpconn *conn;
+
+	if (!(conn = calloc(1, sizeof *conn))) {
+		*error = dns_syerr();
+
+		return NULL;
+	}
+
+	if (-1 == (conn->fd = dns_socket((struct sockaddr *)&so->local, SOCK_STREAM, error))) {
+		free(conn);
+
+		return NULL;
+	}
+
+	memcpy(&conn->remote, &so->remote, dns_sa_len(&so->remote));
+	conn->group = so->group;
+	conn->idle = dns_now();
+
+	return conn;
+} /* dns_tcp_new() */
+
+
+static int dns_tcp_append(struct dns_tcpconn *conn, struct dns_packet *Q) {
+	size_t need = Q->end + 2;
+
+	if (conn->wpos > 0) {
+		memmove(conn->wbuf, &conn->wbuf[conn->wpos], conn->wlen - conn->wpos);
+		conn->wlen -= conn->wpos;
+		conn->wpos = 0;
+	}
+
+	if (conn->wsize - conn->wlen < need) {
+		size_t size = DNS_PP_MAX(512, DNS_PP_MAX(conn->wsize * 2, conn->wlen + need));
+		void *p;
+
+		if (!(p = realloc(conn->wbuf, size)))
+			return dns_syerr();
+
+		conn->wbuf = p;
+		conn->wsize = size;
+	}
+
+	conn->wbuf[conn->wlen++] = 0xff & (Q->end >> 8);
+	conn->wbuf[conn->wlen++] = 0xff & (Q->end >> 0);
+	memcpy(&conn->wbuf[conn->wlen], Q->data, Q->end);
+	conn->wlen += Q->end;
 
 	return 0;
-} /* dns_so_open() */
+} /* dns_tcp_append() */
 
 
-static void dns_so_destroy(struct dns_socket *so) {
-	dns_so_reset(so);
-	dns_so_closefds(so, DNS_SO_CLOSE_ALL);
-} /* dns_so_destroy() */
+/*
+ * Pick the least busy connection to our nameserver, or open another
+ * while they're all saturated and we're under the limit, then queue
+ * our query there. Idle connections past their time are swept here.
+ */
+static int dns_tcp_attach(struct dns_socket *so) {
+	struct dns_tcp *tcp = so->pool;
+	struct dns_tcpconn *conn, *best = NULL, **pp;
+	time_t now = dns_now();
+	unsigned n = 0;
+	int error;
 
+	dns_tcp_lock(tcp);
 
-void dns_so_close(struct dns_socket *so) {
-	if (!so)
-		return;
+	for (pp = &tcp->conns; (conn = *pp); ) {
+		if (!conn->refs && (now - conn->idle >= (time_t)tcp->opts.idle || !dns_tcp_alive(conn))) {
+			if (now - conn->idle >= (time_t)tcp->opts.idle)
+				tcp->stat.expired++;
 
-	dns_so_destroy(so);
+			*pp = conn->next;
+			tcp->stat.count--;
+			dns_tcp_free(so, conn);
 
-	free(so);
-} /* dns_so_close() */
+			continue;
+		}
 
+		if (conn->group == so->group && 0 == dns_sa_cmp(&conn->remote, &so->remote)) {
+			n++;
 
-void dns_so_reset(struct dns_socket *so) {
-	dns_p_setptr(&so->answer, NULL);
+			if (!best || conn->refs < best->refs)
+				best = conn;
+		}
 
-	memset(&so->state, '\0', sizeof *so - offsetof(struct dns_socket, state));
-} /* dns_so_reset() */
+		pp = &conn->next;
+	}
 
+	if (!best || (best->refs >= tcp->opts.pipeline && n < tcp->opts.maxconn)) {
+		if (!(conn = dns_tcp_new(so, &error)))
+			goto error;
 
-unsigned short dns_so_mkqid(struct dns_socket *so) {
-	return dns_k_permutor_step(&so->qids);
-} /* dns_so_mkqid() */
+		conn->next = tcp->conns;
+		tcp->conns = conn;
+		tcp->stat.count++;
+		tcp->stat.opened++;
+	} else {
+		conn = best;
+		tcp->stat.reused++;
 
+		if (conn->refs)
+			tcp->stat.pipelined++;
+	}
 
-#define DNS_SO_MINBUF	768
+	/* QIDs must be unique on the connection */
+	while (dns_tcp_isset(conn->inflight, so->qid) || dns_tcp_isset(conn->stale, so->qid))
+		so->qid = dns_so_mkqid(so);
 
-static int dns_so_newanswer(struct dns_socket *so, size_t len) {
-	size_t size	= offsetof(struct dns_packet, data) + DNS_PP_MAX(len, DNS_SO_MINBUF);
-	void *p;
+	dns_header(so->query)->qid = so->qid;
 
-	if (!(p = realloc(so->answer, size)))
-		return dns_syerr();
+	if ((error = dns_tcp_append(conn, so->query)))
+		goto error;
 
-	so->answer	= dns_p_init(p, size);
+	dns_tcp_set(conn->inflight, so->qid);
+	conn->refs++;
+
+	so->cnext = conn->socks;
+	conn->socks = so;
+	so->conn = conn;
+	so->qseq = conn->wseq + (conn->wlen - conn->wpos);
+	so->alen = 0;
+	so->apos = 0;
+
+	dns_tcp_unlock(tcp);
 
 	return 0;
-} /* dns_so_newanswer() */
+error:
+	dns_tcp_unlock(tcp);
 
+	return error;
+} /* dns_tcp_attach() */
 
-int dns_so_submit(struct dns_socket *so, struct dns_packet *Q, struct sockaddr *host) {
-	struct dns_rr rr;
-	int error = DNS_EUNKNOWN;
 
-	dns_so_reset(so);
+static void dns_so_tcpdetach(struct dns_socket *so) {
+	struct dns_tcpconn *conn = so->conn;
+	struct dns_tcp *tcp = so->pool;
+	struct dns_socket **pp;
 
-	if ((error = dns_rr_parse(&rr, 12, Q)))
-		goto error;
+	if (!conn)
+		return;
 
-	if (!(so->qlen = dns_d_expand(so->qname, sizeof so->qname, rr.dn.p, Q, &error)))
-		goto error;
-	/*
-	 * NOTE: Don't bail if expansion is too long; caller may be
-	 * intentionally sending long names. However, we won't be able to
-	 * verify it on return.
-	 */
+	dns_tcp_lock(tcp);
 
-	so->qtype	= rr.type;
-	so->qclass	= rr.class;
+	if (dns_tcp_isset(conn->inflight, so->qid)) {
+		dns_tcp_clr(conn->inflight, so->qid);
 
-	if ((error = dns_so_newanswer(so, (Q->memo.opt.maxudp)? Q->memo.opt.maxudp : DNS_SO_MINBUF)))
-		goto syerr;
+		if (conn->rsock == so)
+			conn->rsock = NULL; /* being read; discard the rest */
+		else
+			dns_tcp_set(conn->stale, so->qid);
+	}
 
-	memcpy(&so->remote, host, dns_sa_len(host));
+	for (pp = &conn->socks; *pp; pp = &(*pp)->cnext) {
+		if (*pp == so) {
+			*pp = so->cnext;
+			break;
+		}
+	}
 
-	so->query	= Q;
-	so->qout	= 0;
+	if (!--conn->refs) {
+		conn->idle = dns_now();
 
-	dns_begin(&so->elapsed);
+		if (conn->dead)
+			dns_tcp_free(so, conn);
+	}
 
-	if (dns_header(so->query)->qid == 0)
-		dns_header(so->query)->qid	= dns_so_mkqid(so);
+	dns_tcp_unlock(tcp);
 
-	so->qid		= dns_header(so->query)->qid;
-	so->state	= (so->type == SOCK_STREAM)? DNS_SO_TCP_INIT : DNS_SO_UDP_INIT;
+	so->conn = NULL;
+} /* dns_so_tcpdetach() */
 
-	so->stat.queries++;
+
+static int dns_tcp_flush(struct dns_socket *so, struct dns_tcpconn *conn) {
+	long n;
+
+	while (conn->wpos < conn->wlen) {
+		if (0 > (n = dns_send(conn->fd, &conn->wbuf[conn->wpos], conn->wlen - conn->wpos, 0)))
+			return dns_soerr();
+
+		conn->wpos += n;
+		conn->wseq += n;
+		so->stat.tcp.sent.bytes += n;
+	}
 
 	return 0;
-syerr:
-	error	= dns_syerr();
-error:
-	dns_so_reset(so);
+} /* dns_tcp_flush() */
+
+
+/* a connection error fails every query on it */
+static int dns_tcp_fail(struct dns_socket *so, int error) {
+	if (!dns_tcp_again(error))
+		dns_tcp_kill(so->pool, so->conn);
 
 	return error;
-} /* dns_so_submit() */
+} /* dns_tcp_fail() */
 
 
-static int dns_so_verify(struct dns_socket *so, struct dns_packet *P) {
-	char qname[DNS_D_MAXNAME + 1];
-	size_t qlen;
-	struct dns_rr rr;
-	int error = -1;
+/* the attached socket with qid in flight, if any */
+static struct dns_socket *dns_tcp_owner(struct dns_tcpconn *conn, unsigned short qid) {
+	struct dns_socket *so;
 
-	if (so->qid != dns_header(so->answer)->qid)
-		goto reject;
+	if (!dns_tcp_isset(conn->inflight, qid))
+		return NULL;
 
-	if (!dns_p_count(so->answer, DNS_S_QD))
-		goto reject;
+	for (so = conn->socks; so; so = so->cnext) {
+		if (so->qid == qid)
+			return so;
+	}
 
-	if (0 != dns_rr_parse(&rr, 12, so->answer))
-		goto reject;
+	return NULL;
+} /* dns_tcp_owner() */
 
-	if (rr.type != so->qtype || rr.class != so->qclass)
-		goto reject;
 
-	if (!(qlen = dns_d_expand(qname, sizeof qname, rr.dn.p, P, &error)))
-		goto error;
-	else if (qlen >= sizeof qname || qlen != so->qlen)
-		goto reject;
+#define dns_tcp_answered(so)	((so)->alen && (so)->apos == (so)->alen)
 
-	if (0 != strcasecmp(so->qname, qname))
-		goto reject;
+/* read frames until our answer is complete or the descriptor runs dry */
+static int dns_tcp_recv(struct dns_socket *so, struct dns_tcpconn *conn) {
+	unsigned char junk[512];
+	struct dns_socket *owner;
+	unsigned short qid;
+	size_t len;
+	long n;
 
-	return 0;
-reject:
-	error = DNS_EUNKNOWN;
-error:
-	DNS_SHOW(P, "rejecting packet (%s)", dns_strerror(error));
+	for (;;) {
+		if (conn->rleft && !conn->rsock) {
+			if (0 > (n = recv(conn->fd, (void *)junk, DNS_PP_MIN(conn->rleft, sizeof junk), 0)))
+				return dns_tcp_fail(so, dns_soerr());
+			else if (n == 0)
+				return dns_tcp_fail(so, DNS_ECONNRESET);
+
+			conn->rleft -= n;
+		} else if (conn->rleft) {
+			owner = conn->rsock;
+
+			if (0 > (n = recv(conn->fd, (void *)&owner->answer->data[owner->apos], conn->rleft, 0)))
+				return dns_tcp_fail(so, dns_soerr());
+			else if (n == 0)
+				return dns_tcp_fail(so, DNS_ECONNRESET);
+
+			owner->apos += n;
+			owner->stat.tcp.rcvd.bytes += n;
+
+			if (!(conn->rleft -= n)) {
+				dns_tcp_clr(conn->inflight, owner->qid);
+				owner->answer->end = owner->alen;
+				owner->stat.tcp.rcvd.count++;
+				conn->rsock = NULL;
+
+				if (owner == so)
+					return 0;
+			}
+		} else {
+			if (0 > (n = recv(conn->fd, (void *)&conn->rhdr[conn->rhlen], sizeof conn->rhdr - conn->rhlen, 0)))
+				return dns_tcp_fail(so, dns_soerr());
+			else if (n == 0)
+				return dns_tcp_fail(so, DNS_ECONNRESET);
 
-	return error;
-} /* dns_so_verify() */
+			so->stat.tcp.rcvd.bytes += n;
 
+			if ((conn->rhlen += n) < sizeof conn->rhdr)
+				continue;
 
-static _Bool dns_so_tcp_keep(struct dns_socket *so) {
-	struct sockaddr_storage remote;
+			conn->rhlen = 0;
 
-	if (so->tcp == -1)
-		return 0;
+			len = ((0xff & conn->rhdr[0]) << 8) | (0xff & conn->rhdr[1]);
+			memcpy(&qid, &conn->rhdr[2], 2);
 
-	if (0 != getpeername(so->tcp, (struct sockaddr *)&remote, &(socklen_t){ sizeof remote }))
-		return 0;
+			if (len < 12)
+				return dns_tcp_fail(so, DNS_EILLEGAL);
 
-	return 0 == dns_sa_cmp(&remote, &so->remote);
-} /* dns_so_tcp_keep() */
+			conn->rleft = len - 2;
+			conn->rsock = NULL;
 
+			if (!(owner = dns_tcp_owner(conn, qid))) {
+				dns_tcp_clr(conn->stale, qid);
+			} else if (!dns_so_newanswer(owner, len)) {
+				/* the QID was consumed with the header */
+				memcpy(owner->answer->data, &qid, 2);
+				owner->alen = len;
+				owner->apos = 2;
+				conn->rsock = owner;
+			} /* else discard it; the owner will time out */
+		}
+	}
+} /* dns_tcp_recv() */
 
-#if defined __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Warray-bounds"
+
+#ifndef DNS_TCP_RETRY
+#define DNS_TCP_RETRY	1 /* resubmissions after losing a connection */
 #endif
 
-static int dns_so_tcp_send(struct dns_socket *so) {
-	unsigned char *qsrc;
-	size_t qend;
-	long n;
+static int dns_so_tcpcheck(struct dns_socket *so) {
+	struct dns_tcp *tcp = so->pool;
+	struct dns_tcpconn *conn;
+	int error;
 
-	so->query->data[-2] = 0xff & (so->query->end >> 8);
-	so->query->data[-1] = 0xff & (so->query->end >> 0);
+retry:
+	switch (so->state) {
+	case DNS_SO_TCP_INIT:
+		if ((error = dns_tcp_attach(so)))
+			return error;
 
-	qsrc = &so->query->data[-2] + so->qout;
-	qend = so->query->end + 2;
+		so->state++;
+		/* FALL THROUGH */
+	case DNS_SO_TCP_CONN:
+	case DNS_SO_TCP_SEND:
+	case DNS_SO_TCP_RECV:
+		dns_tcp_lock(tcp);
 
-	while (so->qout < qend) {
-		if (0 > (n = dns_send(so->tcp, (void *)&qsrc[so->qout], qend - so->qout, 0)))
-			return dns_soerr();
+		conn = so->conn;
 
-		so->qout += n;
-		so->stat.tcp.sent.bytes += n;
-	}
+		/* another attached socket may have read our answer for us */
+		if (dns_tcp_answered(so)) {
+			error = 0;
 
-	so->stat.tcp.sent.count++;
+			goto answered;
+		}
 
-	return 0;
-} /* dns_so_tcp_send() */
+		if (conn->dead) {
+			error = DNS_ECONNRESET;
 
+			goto unlock;
+		}
 
-static int dns_so_tcp_recv(struct dns_socket *so) {
-	unsigned char *asrc;
-	size_t aend, alen;
-	int error;
-	long n;
+		if (so->state == DNS_SO_TCP_CONN) {
+			if (!conn->connected) {
+				if (0 != connect(conn->fd, (struct sockaddr *)&conn->remote, dns_sa_len(&conn->remote))) {
+					if ((error = dns_soerr()) != DNS_EISCONN) {
+						error = dns_tcp_fail(so, error);
 
-	aend = so->alen + 2;
+						goto unlock;
+					}
+				}
 
-	while (so->apos < aend) {
-		asrc = &so->answer->data[-2];
+				conn->connected = 1;
+			}
 
-		if (0 > (n = recv(so->tcp, (void *)&asrc[so->apos], aend - so->apos, 0)))
-			return dns_soerr();
-		else if (n == 0)
-			return DNS_EUNKNOWN;	/* FIXME */
+			so->state++;
+		}
 
-		so->apos += n;
-		so->stat.tcp.rcvd.bytes += n;
+		if (so->state == DNS_SO_TCP_SEND) {
+			if ((error = dns_tcp_flush(so, conn))) {
+				error = dns_tcp_fail(so, error);
 
-		if (so->alen == 0 && so->apos >= 2) {
-			alen = ((0xff & so->answer->data[-2]) << 8)
-			     | ((0xff & so->answer->data[-1]) << 0);
+				goto unlock;
+			}
 
-			if ((error = dns_so_newanswer(so, alen)))
-				return error;
+			if (conn->wseq < so->qseq) {
+				error = DNS_EAGAIN;
 
-			so->alen = alen;
-			aend = alen + 2;
+				goto unlock;
+			}
+
+			so->stat.tcp.sent.count++;
+			so->state++;
 		}
-	}
 
-	so->answer->end	= so->alen;
-	so->stat.tcp.rcvd.count++;
+		if ((error = dns_tcp_recv(so, conn)))
+			goto unlock;
+answered:
+		so->state = DNS_SO_TCP_DONE;
+unlock:
+		/* resubmit on a fresh connection, as per RFC 7766 section 6.2.1 */
+		if (error && conn->dead && so->retries < DNS_TCP_RETRY) {
+			so->retries++;
+			tcp->stat.retries++;
+			dns_tcp_unlock(tcp);
 
-	return 0;
-} /* dns_so_tcp_recv() */
+			dns_so_tcpdetach(so);
+			so->state = DNS_SO_TCP_INIT;
 
-#if __clang__
-#pragma clang diagnostic pop
-#endif
+			goto retry;
+		}
+
+		dns_tcp_unlock(tcp);
+
+		if (error)
+			return error;
+
+		dns_so_tcpdetach(so);
+		/* FALL THROUGH */
+	case DNS_SO_TCP_DONE:
+		if (so->answer->end < 12)
+			return DNS_EILLEGAL;
+
+		return dns_so_verify(so, so->answer);
+	default:
+		return DNS_EUNKNOWN;
+	} /* switch() */
+} /* dns_so_tcpcheck() */
 
 
 int dns_so_check(struct dns_socket *so) {
@@ -6611,6 +7753,13 @@ int dns_so_check(struct dns_socket *so) {
 	long n;
 
 retry:
+	if (so->pool && so->state >= DNS_SO_TCP_INIT) {
+		if ((error = dns_so_tcpcheck(so)))
+			goto error;
+
+		return 0;
+	}
+
 	switch (so->state) {
 	case DNS_SO_UDP_INIT:
 		so->state++;
@@ -6649,6 +7798,12 @@ retry:
 		if (!dns_header(so->answer)->tc || so->type == SOCK_DGRAM)
 			return 0;
 
+		if (so->pool) {
+			so->state++;
+
+			goto retry;
+		}
+
 		so->state++;
 		/* FALL THROUGH */
 	case DNS_SO_TCP_INIT:
@@ -6834,7 +7989,7 @@ int dns_so_pollfd(struct dns_socket *so) {
 	case DNS_SO_TCP_CONN:
 	case DNS_SO_TCP_SEND:
 	case DNS_SO_TCP_RECV:
-		return so->tcp;
+		return (so->conn)? so->conn->fd : so->tcp;
 	} /* switch() */
 
 	return -1;
@@ -6851,6 +8006,21 @@ const struct dns_stat *dns_so_stat(struct dns_socket *so) {
 } /* dns_so_stat() */
 
 
+void dns_so_settcp(struct dns_socket *so, struct dns_tcp *tcp) {
+	if (tcp)
+		dns_tcp_acquire(tcp); /* acquire first in case same object */
+
+	dns_so_reset(so);
+	dns_tcp_close(so->pool);
+	so->pool = tcp;
+} /* dns_so_settcp() */
+
+
+void dns_so_settcpgroup(struct dns_socket *so, const void *group) {
+	so->group = group;
+} /* dns_so_settcpgroup() */
+
+
 /*
  * R E S O L V E R  R O U T I N E S
  *
@@ -6877,6 +8047,7 @@ enum dns_res_state {
 	DNS_R_RESOLV1_NS,	/* Epilog: Inspect answer */
 	DNS_R_FOREACH_A,
 	DNS_R_QUERY_A,
+	DNS_R_ANSWER_A,		/* Inspect answer from wire or cache */
 	DNS_R_CNAME0_A,
 	DNS_R_CNAME1_A,
 
@@ -7013,6 +8184,7 @@ struct dns_resolver *dns_res_stub(const struct dns_options *opts, int *error) {
 	struct dns_resolv_conf *resconf	= 0;
 	struct dns_hosts *hosts		= 0;
 	struct dns_hints *hints		= 0;
+	struct dns_cache *cache		= 0;
 	struct dns_resolver *res	= 0;
 
 	if (!(resconf = dns_resconf_local(error)))
@@ -7024,13 +8196,17 @@ struct dns_resolver *dns_res_stub(const struct dns_options *opts, int *error) {
 	if (!(hints = dns_hints_local(resconf, error)))
 		goto epilog;
 
-	if (!(res = dns_res_open(resconf, hosts, hints, NULL, opts, error)))
+	/* share answers among stub resolvers; run uncached if we can't */
+	cache = dns_cache_shared(&(int){ 0 });
+
+	if (!(res = dns_res_open(resconf, hosts, hints, cache, opts, error)))
 		goto epilog;
 
 epilog:
 	dns_resconf_close(resconf);
 	dns_hosts_close(hosts);
 	dns_hints_close(hints);
+	dns_cache_close(cache);
 
 	return res;
 } /* dns_res_stub() */
@@ -7466,6 +8642,22 @@ exec:
 		F->state++;
 		/* FALL THROUGH */
 	case DNS_R_HINTS:
+		if (R->cache && R->cache->insert) {
+			error = 0;
+
+			if (dns_p_setptr(&F->answer, R->cache->query(F->query, R->cache, &error))) {
+				/*
+				 * Anything which would have us iterate
+				 * nameservers needs hints we don't have.
+				 */
+				if (dns_p_count(F->answer, DNS_S_AN) > 0 || !R->resconf->options.recurse || dns_header(F->answer)->aa)
+					dgoto(R->sp, DNS_R_ANSWER_A);
+
+				dns_p_setptr(&F->answer, NULL);
+			} else if (error)
+				goto error;
+		}
+
 		if (!dns_p_setptr(&F->hints, dns_hints_query(R->hints, F->query, &error)))
 			goto error;
 
@@ -7598,6 +8790,13 @@ exec:
 			}
 		}
 
+		/* failing to cache isn't fatal */
+		if (R->cache && R->cache->insert)
+			R->cache->insert(F->query, F->answer, R->cache);
+
+		F->state++;
+		/* FALL THROUGH */
+	case DNS_R_ANSWER_A:
 		if ((error = dns_rr_parse(&rr, 12, F->query)))
 			goto error;
 
@@ -7994,6 +9193,16 @@ void dns_res_sethints(struct dns_resolver *res, struct dns_hints *hints) {
 } /* dns_res_sethints() */
 
 
+void dns_res_settcp(struct dns_resolver *res, struct dns_tcp *tcp) {
+	dns_so_settcp(&res->so, tcp);
+} /* dns_res_settcp() */
+
+
+void dns_res_settcpgroup(struct dns_resolver *res, const void *group) {
+	dns_so_settcpgroup(&res->so, group);
+} /* dns_res_settcpgroup() */
+
+
 /*
  * A D D R I N F O  R O U T I N E S
  *
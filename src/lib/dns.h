@@ -1031,6 +1031,12 @@ struct dns_cache {
 	short (*events)(struct dns_cache *);
 	void (*clear)(struct dns_cache *);
 
+	/*
+	 * Optional. If set the resolver also consults .query before each
+	 * question goes on the wire, and stores every answer received.
+	 */
+	int (*insert)(struct dns_packet *, struct dns_packet *, struct dns_cache *);
+
 	union {
 		long i;
 		void *p;
@@ -1047,6 +1053,62 @@ DNS_PUBLIC struct dns_cache *dns_cache_init(struct dns_cache *);
 DNS_PUBLIC void dns_cache_close(struct dns_cache *);
 
 
+/*
+ * Built-in answer cache, keyed by question and bounded by entry count
+ * with LRU eviction. Positive answers live for their smallest TTL and
+ * negative answers for their SOA minimum (RFC 2308). Zero options select
+ * the defaults below.
+ */
+#ifndef DNS_CACHE_SIZE
+#define DNS_CACHE_SIZE		4096
+#endif
+
+#ifndef DNS_CACHE_MAXTTL
+#define DNS_CACHE_MAXTTL	86400
+#endif
+
+#ifndef DNS_CACHE_NEGTTL
+#define DNS_CACHE_NEGTTL	3600
+#endif
+
+#ifndef DNS_CACHE_PREFETCH
+#define DNS_CACHE_PREFETCH	10	/* percent of TTL */
+#endif
+
+struct dns_cache_options {
+	size_t size;		/* maximum number of entries */
+	unsigned maxttl;	/* upper bound on positive TTLs */
+	unsigned negttl;	/* upper bound on negative TTLs */
+
+	/*
+	 * Within this percentage of expiry a repeatedly hit entry is
+	 * reported as a miss to one caller, whose resolver then refreshes
+	 * it, while everyone else keeps being answered from the cache.
+	 * Negative disables.
+	 */
+	int prefetch;
+}; /* struct dns_cache_options */
+
+#define dns_cache_opts(...)	(&dns_quietinit((struct dns_cache_options){ __VA_ARGS__ }))
+
+struct dns_cache_stat {
+	unsigned long hits, misses, negative;	/* negative counts hits too */
+	unsigned long inserts, evictions, expired, prefetches;
+	size_t count;
+}; /* struct dns_cache_stat */
+
+DNS_PUBLIC struct dns_cache *dns_cache_open(const struct dns_cache_options *, int *);
+
+/** process-wide cache used by dns_res_stub(); returns a new reference */
+DNS_PUBLIC struct dns_cache *dns_cache_shared(int *);
+
+/** EINVAL if not opened with dns_cache_open() */
+DNS_PUBLIC int dns_cache_stat(struct dns_cache *, struct dns_cache_stat *);
+
+/** discard all entries; EINVAL if not opened with dns_cache_open() */
+DNS_PUBLIC int dns_cache_flush(struct dns_cache *);
+
+
 /*
  * A P P L I C A T I O N  I N T E R F A C E
  *
@@ -1104,6 +1166,53 @@ struct dns_stat {
 
 struct dns_socket;
 
+/*
+ * Persistent DNS-over-TCP connections (RFC 7766) shared by any number of
+ * sockets. Queries to the same nameserver are pipelined on an open
+ * connection and answers matched by QID in whatever order they arrive.
+ * Another connection is opened once every existing one has `pipeline'
+ * queries in flight, up to `maxconn' per nameserver. Connections are
+ * closed after `idle' seconds without queries. Zero options select the
+ * defaults below.
+ */
+#ifndef DNS_TCP_MAXCONN
+#define DNS_TCP_MAXCONN		2	/* connections per nameserver */
+#endif
+
+#ifndef DNS_TCP_PIPELINE
+#define DNS_TCP_PIPELINE	16	/* queries in flight per connection */
+#endif
+
+#ifndef DNS_TCP_IDLE
+#define DNS_TCP_IDLE		10	/* seconds */
+#endif
+
+struct dns_tcp_options {
+	unsigned maxconn;
+	unsigned pipeline;
+	unsigned idle;
+}; /* struct dns_tcp_options */
+
+#define dns_tcp_opts(...)	(&dns_quietinit((struct dns_tcp_options){ __VA_ARGS__ }))
+
+struct dns_tcp_stat {
+	unsigned long opened, reused, pipelined;	/* pipelined counts reuse too */
+	unsigned long retries, expired;
+	size_t count;
+}; /* struct dns_tcp_stat */
+
+struct dns_tcp;
+
+DNS_PUBLIC struct dns_tcp *dns_tcp_open(const struct dns_tcp_options *, int *);
+
+DNS_PUBLIC void dns_tcp_close(struct dns_tcp *);
+
+DNS_PUBLIC dns_refcount_t dns_tcp_acquire(struct dns_tcp *);
+
+DNS_PUBLIC dns_refcount_t dns_tcp_release(struct dns_tcp *);
+
+DNS_PUBLIC void dns_tcp_stat(struct dns_tcp *, struct dns_tcp_stat *);
+
 DNS_PUBLIC struct dns_socket *dns_so_open(const struct sockaddr *, int, const struct dns_options *, int *error);
 
 DNS_PUBLIC void dns_so_close(struct dns_socket *);
@@ -1132,6 +1241,12 @@ DNS_PUBLIC int dns_so_poll(struct dns_socket *, int);
 
 DNS_PUBLIC const struct dns_stat *dns_so_stat(struct dns_socket *);
 
+/** route TCP queries over the shared connections of a dns_tcp, or NULL */
+DNS_PUBLIC void dns_so_settcp(struct dns_socket *, struct dns_tcp *);
+
+/** share TCP connections only with sockets of the same group, e.g. those polled by one event loop */
+DNS_PUBLIC void dns_so_settcpgroup(struct dns_socket *, const void *);
+
 
 /*
  * R E S O L V E R  I N T E R F A C E
@@ -1180,6 +1295,10 @@ DNS_PUBLIC const struct dns_stat *dns_res_stat(struct dns_resolver *);
 
 DNS_PUBLIC void dns_res_sethints(struct dns_resolver *, struct dns_hints *);
 
+DNS_PUBLIC void dns_res_settcp(struct dns_resolver *, struct dns_tcp *);
+
+DNS_PUBLIC void dns_res_settcpgroup(struct dns_resolver *, const void *);
+
 
 /*
  * A D D R I N F O  I N T E R F A C E
@@ -112,6 +112,12 @@ struct fifo {
 	struct {
 		unsigned char byte, count;
 	} rbits, wbits;
+
+	/* optional allocator with lua_Alloc semantics; see fifo_setalloc() */
+	struct {
+		void *(*realloc)(void *, void *, size_t, size_t);
+		void *arg;
+	} alloc;
 }; /* struct fifo */
 
 
@@ -142,6 +148,8 @@ static struct fifo *fifo_init(struct fifo *fifo, void *buf, size_t size) {
 	fifo->rbits.count = 0;
 	fifo->wbits.byte  = 0;
 	fifo->wbits.count = 0;
+	fifo->alloc.realloc = 0;
+	fifo->alloc.arg     = 0;
 
 	return fifo;
 } /* fifo_init() */
@@ -171,11 +179,47 @@ static inline struct fifo *fifo_from(struct fifo *fifo, void *src, size_t size)
 #define fifo_into(...)        FIFO_XPASTE(fifo_into, FIFO_NARG(__VA_ARGS__))(__VA_ARGS__)
 
 
+/*
+ * Replace realloc(3) for dynamic buffers. Like lua_Alloc, the function is
+ * passed the old and new sizes, and a new size of 0 means free. Must be
+ * set while the fifo is empty and unallocated.
+ */
+FIFO_NOTUSED static struct fifo *fifo_setalloc(struct fifo *fifo, void *(*fn)(void *, void *, size_t, size_t), void *arg) {
+	assert(!fifo->count && (!fifo->base || fifo->base == fifo->sbuf.iov_base));
+
+	fifo->alloc.realloc = fn;
+	fifo->alloc.arg     = arg;
+
+	return fifo;
+} /* fifo_setalloc() */
+
+
+static inline void *fifo_alloc(struct fifo *fifo, void *p, size_t osize, size_t nsize) {
+	if (fifo->alloc.realloc)
+		return fifo->alloc.realloc(fifo->alloc.arg, p, osize, nsize);
+
+	if (!nsize) {
+		free(p);
+
+		return (void *)0;
+	}
+
+	return realloc(p, nsize);
+} /* fifo_alloc() */
+
+
 FIFO_NOTUSED static struct fifo *fifo_reset(struct fifo *fifo) {
+	void *(*fn)(void *, void *, size_t, size_t) = fifo->alloc.realloc;
+	void *arg = fifo->alloc.arg;
+
 	if (fifo->base != fifo->sbuf.iov_base)
-		free(fifo->base);
+		fifo_alloc(fifo, fifo->base, fifo->size, 0);
+
+	fifo_init(fifo, fifo->sbuf.iov_base, fifo->sbuf.iov_len);
+	fifo->alloc.realloc = fn;
+	fifo->alloc.arg     = arg;
 
-	return fifo_init(fifo, fifo->sbuf.iov_base, fifo->sbuf.iov_len);
+	return fifo;
 } /* fifo_reset() */
 
 
@@ -258,7 +302,7 @@ static int fifo_realloc(struct fifo *fifo, size_t size) {
 
 	size = fifo_roundup(size);
 
-	if (!(tmp = realloc(fifo->base, size)))
+	if (!(tmp = fifo_alloc(fifo, fifo->base, fifo->size, size)))
 		return errno;
 
 	fifo->base = tmp;
@@ -268,6 +312,22 @@ static int fifo_realloc(struct fifo *fifo, size_t size) {
 } /* fifo_realloc() */
 
 
+/*
+ * Give back dynamic memory once all data has been consumed, so idle
+ * buffers don't pin their high-water mark. Pending bits are unaffected.
+ */
+FIFO_NOTUSED static void fifo_release(struct fifo *fifo) {
+	if (fifo->count || fifo_type(fifo) == FIFO_STATIC || !fifo->base)
+		return;
+
+	fifo_alloc(fifo, fifo->base, fifo->size, 0);
+
+	fifo->base = (void *)0;
+	fifo->size = 0;
+	fifo->head = 0;
+} /* fifo_release() */
+
+
 static inline int fifo_grow(struct fifo *fifo, size_t size) {
 	if (fifo->size - fifo->count >= size)
 		return 0;
@@ -330,7 +390,7 @@ static size_t fifo_wvec(struct fifo *fifo, struct iovec *iov, _Bool realign) {
 FIFO_NOTUSED static size_t fifo_slice(struct fifo *fifo, struct iovec *iov, size_t p, size_t count) {
 	size_t pe;
 
-	if (p > fifo->count) {
+	if (p > fifo->count || !fifo->size) {
 		iov->iov_base = 0;
 		iov->iov_len  = 0;
 
@@ -350,6 +410,29 @@ FIFO_NOTUSED static size_t fifo_slice(struct fifo *fifo, struct iovec *iov, size
 } /* fifo_slice() */
 
 
+/* like fifo_slice(), but returns a wrapped range as two vectors rather than realigning */
+FIFO_NOTUSED static int fifo_slicev(struct fifo *fifo, struct iovec iov[2], size_t p, size_t count) {
+	size_t head;
+
+	if (p >= fifo->count || !count)
+		return 0;
+
+	count = FIFO_MIN(count, fifo->count - p);
+	head  = (fifo->head + p) % fifo->size;
+
+	iov[0].iov_base = &fifo->base[head];
+	iov[0].iov_len  = FIFO_MIN(count, fifo->size - head);
+
+	if (iov[0].iov_len == count)
+		return 1;
+
+	iov[1].iov_base = &fifo->base[0];
+	iov[1].iov_len  = count - iov[0].iov_len;
+
+	return 2;
+} /* fifo_slicev() */
+
+
 static size_t fifo_tvec(struct fifo *fifo, struct iovec *iov, int ch) {
 	unsigned char *p;
 
@@ -406,7 +489,9 @@ static int fifo_wbuf(struct fifo *fifo, struct iovec *iov, size_t size) {
 #endif
 
 static inline size_t fifo_discard(struct fifo *fifo, size_t count) {
-	count       = FIFO_MIN(count, fifo->count);
+	if (!(count = FIFO_MIN(count, fifo->count)))
+		return 0; /* fifo->size may be 0 */
+
 	fifo->head  = (fifo->head + count) % fifo->size;
 	fifo->count -= count;
 #if FIFO_AUTOALIGN
@@ -425,7 +510,9 @@ static inline size_t fifo_update(struct fifo *fifo, size_t count) {
 
 
 static inline size_t fifo_rewind(struct fifo *fifo, size_t count) {
-	count       = FIFO_MIN(count, fifo->size - fifo->count);
+	if (!(count = FIFO_MIN(count, fifo->size - fifo->count)))
+		return 0; /* fifo->size may be 0 */
+
 	fifo->head  = (fifo->head + (fifo->size - count)) % fifo->size;
 	fifo->count += count;
 	return count;
@@ -38,6 +38,8 @@
 #include <fcntl.h>	/* O_CLOEXEC O_DIRECTORY ... open(2) openat(2) fcntl(2) */
 #include <dirent.h>	/* DIR fdopendir(3) opendir(3) readdir_r(3) closedir(3) */
 #include <poll.h>	/* POLLIN poll(2) */
+#include <time.h>	/* CLOCK_MONOTONIC clock_gettime(2) */
+#include <sys/time.h>	/* gettimeofday(2) */
 
 #include "notify.h"
 #include "llrb.h"
@@ -52,6 +54,10 @@
 #define ENABLE_INOTIFY HAVE_INOTIFY_INIT
 #endif
 
+#ifndef ENABLE_FANOTIFY
+#define ENABLE_FANOTIFY (ENABLE_INOTIFY && HAVE_FANOTIFY_INIT)
+#endif
+
 #ifndef ENABLE_FEN
 #define ENABLE_FEN HAVE_PORT_H
 #endif
@@ -95,6 +101,19 @@
 #if ENABLE_INOTIFY
 
 #include <sys/inotify.h>
+#include <sys/stat.h>	/* struct stat lstat(2) */
+
+#define NFY_INMASK (IN_ATTRIB|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_MODIFY|IN_MOVE|IN_MOVE_SELF|IN_ONLYDIR)
+
+#if ENABLE_FANOTIFY
+#include <sys/fanotify.h>
+
+/* directory handles and names are reported since Linux 5.9 */
+#if !defined FAN_REPORT_DFID_NAME || !defined FAN_MARK_FILESYSTEM
+#undef ENABLE_FANOTIFY
+#define ENABLE_FANOTIFY 0
+#endif
+#endif
 
 #elif ENABLE_FEN
 
@@ -139,6 +158,9 @@ int notify_features(void) {
 #endif
 #if HAVE_IN_CLOEXEC
 	| NOTIFY_IN_CLOEXEC
+#endif
+#if ENABLE_FANOTIFY
+	| NOTIFY_FANOTIFY
 #endif
 	;
 } /* notify_features() */
@@ -148,7 +170,7 @@ const char *notify_strflag(int flag) {
 	static const char *table[32] = {
 		[0] = "CREATE", "ATTRIB", "MODIFY", "REVOKE", "DELETE",
 		[16] = "inotify", "FEN", "kqueue", "kqueue1", "openat",
-		       "fdopendir", "O_CLOEXEC", "IN_CLOEXEC",
+		       "fdopendir", "O_CLOEXEC", "IN_CLOEXEC", "fanotify",
 	};
 
 	return (ffs(0xFFFFFFFF & flag))? table[ffs(0xFFFFFFFF & flag) - 1] : NULL;
@@ -437,8 +459,14 @@ struct notify {
 
 	_Bool dirty;
 
+	int window; /* ms to hold a batch open; see notify_setwindow */
+	_Bool settling;
+	long long since;
+
 #if ENABLE_INOTIFY
 	_Bool critical;
+
+	struct tree *tree; /* NOTIFY_RECURSIVE */
 #endif
 
 #if ENABLE_FEN
@@ -528,6 +556,462 @@ static void discard(struct notify *nfy, struct file *file) {
 } /* discard() */
 
 
+/*
+ * R E C U R S I V E  W A T C H  R O U T I N E S
+ *
+ * With NOTIFY_RECURSIVE every directory in the subtree is tracked, keyed
+ * by its inotify watch descriptor or, under a fanotify filesystem mark,
+ * by its file handle. Changes are coalesced by path relative to the top
+ * directory and released together by notify_step.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#if ENABLE_INOTIFY
+
+#ifndef NOTIFY_MAXCHANGES
+#define NOTIFY_MAXCHANGES 4096 /* coalesced paths held before giving up */
+#endif
+
+#define NFY_KEYMAX (sizeof (int) + 128) /* handle_type + MAX_HANDLE_SZ */
+
+struct dir {
+	LLRB_ENTRY(dir) rbe;
+
+	size_t keylen;
+	unsigned char key[NFY_KEYMAX];
+
+	size_t pathlen;
+	char path[];
+}; /* struct dir */
+
+static inline int dircmp(const struct dir *a, const struct dir *b) {
+	if (a->keylen != b->keylen)
+		return (a->keylen < b->keylen)? -1 : 1;
+
+	return memcmp(a->key, b->key, a->keylen);
+} /* dircmp() */
+
+
+struct change {
+	LLRB_ENTRY(change) rbe;
+	TAILQ_ENTRY(change) tqe;
+
+	int changes;
+
+	size_t pathlen;
+	char path[];
+}; /* struct change */
+
+static inline int changecmp(const struct change *a, const struct change *b)
+	{ return strcmp(a->path, b->path); }
+
+
+struct tree {
+	LLRB_HEAD(dirs, dir) dirs;
+	LLRB_HEAD(changes, change) changes;
+
+	TAILQ_HEAD(, change) pending;
+	TAILQ_HEAD(, change) ready;
+	struct change *gone; /* returned by the last notify_get */
+	unsigned count;
+
+	_Bool fan;
+
+	char path[PATH_MAX]; /* scratch; always begins with nfy->dirpath */
+}; /* struct tree */
+
+
+LLRB_GENERATE_STATIC(dirs, dir, rbe, dircmp)
+LLRB_GENERATE_STATIC(changes, change, rbe, changecmp)
+
+
+static struct dir *dir_find(struct notify *nfy, const void *key, size_t keylen) {
+	struct dir *dir = &((union { char pad[offsetof(struct dir, path) + 1]; struct dir dir; }){ { 0 } }).dir;
+
+	if (keylen > sizeof dir->key)
+		return NULL;
+
+	memcpy(dir->key, key, keylen);
+	dir->keylen = keylen;
+
+	return LLRB_FIND(dirs, &nfy->tree->dirs, dir);
+} /* dir_find() */
+
+
+static void dir_discard(struct notify *nfy, struct dir *dir, _Bool unwatch) {
+	int wd;
+
+	if (unwatch && !nfy->tree->fan) {
+		memcpy(&wd, dir->key, sizeof wd);
+		inotify_rm_watch(nfy->fd, wd);
+	}
+
+	LLRB_REMOVE(dirs, &nfy->tree->dirs, dir);
+
+	free(dir);
+} /* dir_discard() */
+
+
+/* forget the directory at path and everything beneath it */
+static void dir_prune(struct notify *nfy, const char *path, size_t pathlen) {
+	struct dir *dir, *next;
+
+	for (dir = LLRB_MIN(dirs, &nfy->tree->dirs); dir != NULL; dir = next) {
+		next = LLRB_NEXT(dirs, &nfy->tree->dirs, dir);
+
+		if (dir->pathlen < pathlen || memcmp(dir->path, path, pathlen))
+			continue;
+		if (dir->pathlen > pathlen && dir->path[pathlen] != '/')
+			continue;
+
+		dir_discard(nfy, dir, 1);
+	}
+} /* dir_prune() */
+
+
+static void tree_lost(struct notify *nfy, int changes) {
+	nfy->changes |= changes;
+	nfy->dirty = 1;
+	nfy->critical = 1;
+} /* tree_lost() */
+
+
+/* merge changes to path into any still waiting to be returned */
+static void tree_change(struct notify *nfy, const char *path, int changes) {
+	struct tree *tree = nfy->tree;
+	union { char pad[offsetof(struct change, path) + PATH_MAX]; struct change change; } key;
+	size_t pathlen = strlen(path);
+	struct change *change;
+
+	if (!(changes &= nfy->flags & NOTIFY_ALL))
+		return;
+
+	memcpy(key.change.path, path, pathlen + 1);
+
+	if ((change = LLRB_FIND(changes, &tree->changes, &key.change))) {
+		change->changes |= changes;
+
+		return;
+	}
+
+	/* too many to track individually, so report "." instead */
+	if (tree->count >= NOTIFY_MAXCHANGES || !(change = calloc(1, offsetof(struct change, path) + pathlen + 1))) {
+		tree_lost(nfy, changes);
+
+		return;
+	}
+
+	change->changes = changes;
+	memcpy(change->path, path, pathlen + 1);
+	change->pathlen = pathlen;
+
+	LLRB_INSERT(changes, &tree->changes, change);
+	TAILQ_INSERT_TAIL(&tree->pending, change, tqe);
+	tree->count++;
+} /* tree_change() */
+
+
+#if ENABLE_FANOTIFY
+static void fan_key(unsigned char *key, size_t *keylen, const struct file_handle *fh) {
+	size_t n = NFY_KEYMAX - sizeof fh->handle_type;
+
+	if (fh->handle_bytes < n)
+		n = fh->handle_bytes;
+
+	memcpy(key, &fh->handle_type, sizeof fh->handle_type);
+	memcpy(&key[sizeof fh->handle_type], fh->f_handle, n);
+	*keylen = sizeof fh->handle_type + n;
+} /* fan_key() */
+#endif
+
+
+/* start watching the directory at tree->path */
+static int tree_key(struct notify *nfy, unsigned char *key, size_t *keylen, int *wd) {
+	*wd = -1;
+
+#if ENABLE_FANOTIFY
+	if (nfy->tree->fan) {
+		struct file_handle *fh = &((union { char pad[sizeof (struct file_handle) + MAX_HANDLE_SZ]; struct file_handle fh; }){ { 0 } }).fh;
+		int mntid;
+
+		fh->handle_bytes = MAX_HANDLE_SZ;
+
+		if (0 != name_to_handle_at(AT_FDCWD, nfy->tree->path, fh, &mntid, 0))
+			return errno;
+
+		fan_key(key, keylen, fh);
+
+		return 0;
+	}
+#endif
+
+	if (-1 == (*wd = inotify_add_watch(nfy->fd, nfy->tree->path, NFY_INMASK|IN_DONT_FOLLOW)))
+		return errno;
+
+	memcpy(key, wd, sizeof *wd);
+	*keylen = sizeof *wd;
+
+	return 0;
+} /* tree_key() */
+
+
+static _Bool tree_isdir(const char *path, const struct dirent *ent) {
+	struct stat st;
+
+#if defined DT_DIR && defined DT_UNKNOWN
+	if (ent->d_type != DT_UNKNOWN)
+		return ent->d_type == DT_DIR;
+#endif
+
+	return 0 == lstat(path, &st) && S_ISDIR(st.st_mode);
+} /* tree_isdir() */
+
+
+/*
+ * Track the directory at tree->path, len bytes long, and every directory
+ * beneath it. With report set each entry found is recorded as created,
+ * covering anything made before the new watch was in place.
+ */
+static int tree_scan(struct notify *nfy, size_t len, _Bool report) {
+	struct tree *tree = nfy->tree;
+	unsigned char key[NFY_KEYMAX] = { 0 };
+	size_t keylen = 0, rellen, namelen;
+	const char *rel;
+	struct dirent *ent;
+	struct dir *dir;
+	DIR *dp;
+	int wd, error;
+
+	if ((error = tree_key(nfy, key, &keylen, &wd)))
+		return error;
+
+	/* already reachable through another path, e.g. a bind mount */
+	if (dir_find(nfy, key, keylen))
+		return 0;
+
+	rel = (len > nfy->dirlen)? &tree->path[nfy->dirlen + 1] : "";
+	rellen = strlen(rel);
+
+	if (!(dir = calloc(1, offsetof(struct dir, path) + rellen + 1)))
+		return errno;
+
+	memcpy(dir->key, key, keylen);
+	dir->keylen = keylen;
+	memcpy(dir->path, rel, rellen);
+	dir->pathlen = rellen;
+
+	LLRB_INSERT(dirs, &tree->dirs, dir);
+
+	if (!rellen && !tree->fan)
+		nfy->dirwd = wd;
+
+	if (!(dp = opendir(tree->path)))
+		return errno;
+
+	while ((ent = readdir(dp))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		if (len + 1 + (namelen = strlen(ent->d_name)) >= sizeof tree->path)
+			continue;
+
+		tree->path[len] = '/';
+		memcpy(&tree->path[len + 1], ent->d_name, namelen + 1);
+
+		if (report)
+			tree_change(nfy, &tree->path[nfy->dirlen + 1], NOTIFY_CREATE);
+
+		if (!tree_isdir(tree->path, ent))
+			continue;
+
+		switch ((error = tree_scan(nfy, len + 1 + namelen, report))) {
+		case 0:
+			/* FALL THROUGH */
+		case ENOENT:
+			/* FALL THROUGH */
+		case ENOTDIR:
+			/* FALL THROUGH */
+		case EACCES:
+			/* FALL THROUGH */
+		case ELOOP:
+			break;
+		default:
+			goto error;
+		}
+	}
+
+	tree->path[len] = '\0';
+	closedir(dp);
+
+	return 0;
+error:
+	tree->path[len] = '\0';
+	closedir(dp);
+
+	return error;
+} /* tree_scan() */
+
+
+/* a change to the entry name within dir */
+static void tree_event(struct notify *nfy, const struct dir *dir, const char *name, int changes, _Bool isdir) {
+	struct tree *tree = nfy->tree;
+	size_t namelen = strlen(name), len = nfy->dirlen;
+
+	if (len + 1 + dir->pathlen + 1 + namelen >= sizeof tree->path) {
+		tree_lost(nfy, changes);
+
+		return;
+	}
+
+	if (dir->pathlen) {
+		tree->path[len++] = '/';
+		memcpy(&tree->path[len], dir->path, dir->pathlen);
+		len += dir->pathlen;
+	}
+
+	tree->path[len++] = '/';
+	memcpy(&tree->path[len], name, namelen + 1);
+	len += namelen;
+
+	tree_change(nfy, &tree->path[nfy->dirlen + 1], changes);
+
+	if (isdir && (changes & NOTIFY_DELETE))
+		dir_prune(nfy, &tree->path[nfy->dirlen + 1], len - nfy->dirlen - 1);
+
+	if (isdir && (changes & NOTIFY_CREATE)) {
+		switch (tree_scan(nfy, len, 1)) {
+		case 0:
+			/* FALL THROUGH */
+		case ENOENT:
+			/* FALL THROUGH */
+		case ENOTDIR:
+			/* FALL THROUGH */
+		case EACCES:
+			break;
+		default:
+			/* e.g. ENOSPC once max_user_watches is reached */
+			tree_lost(nfy, NOTIFY_CREATE);
+			break;
+		}
+	}
+
+	tree->path[nfy->dirlen] = '\0';
+} /* tree_event() */
+
+
+#if ENABLE_FANOTIFY
+#define FAN_EVENTS (FAN_ATTRIB|FAN_CREATE|FAN_DELETE|FAN_DELETE_SELF|FAN_MODIFY|FAN_MOVED_FROM|FAN_MOVED_TO|FAN_MOVE_SELF|FAN_ONDIR)
+
+/*
+ * One mark covers the whole filesystem, so new directories need no setup
+ * beyond learning their handle. Marking a filesystem requires
+ * CAP_SYS_ADMIN; on failure the caller falls back to inotify.
+ */
+static int fan_open(struct notify *nfy) {
+	int fd, error;
+
+	if (-1 == (fd = fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME|FAN_CLOEXEC|FAN_NONBLOCK, O_RDONLY|O_CLOEXEC)))
+		return errno;
+
+	if (0 != fanotify_mark(fd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, FAN_EVENTS, AT_FDCWD, nfy->dirpath)) {
+		error = errno;
+		closefd(&fd);
+
+		return error;
+	}
+
+	nfy->fd = fd;
+	nfy->tree->fan = 1;
+
+	return 0;
+} /* fan_open() */
+#endif
+
+
+static int tree_open(struct notify *nfy) {
+	struct tree *tree;
+
+	if (nfy->dirlen >= sizeof tree->path)
+		return ENAMETOOLONG;
+
+	if (!(tree = calloc(1, sizeof *tree)))
+		return errno;
+
+	TAILQ_INIT(&tree->pending);
+	TAILQ_INIT(&tree->ready);
+	memcpy(tree->path, nfy->dirpath, nfy->dirlen);
+
+	nfy->tree = tree;
+
+	return 0;
+} /* tree_open() */
+
+
+static void tree_close(struct notify *nfy) {
+	struct tree *tree = nfy->tree;
+	struct dir *dir, *nxtdir;
+	struct change *change, *nxtchange;
+
+	if (!tree)
+		return;
+
+	for (dir = LLRB_MIN(dirs, &tree->dirs); dir != NULL; dir = nxtdir) {
+		nxtdir = LLRB_NEXT(dirs, &tree->dirs, dir);
+		LLRB_REMOVE(dirs, &tree->dirs, dir);
+		free(dir);
+	}
+
+	for (change = LLRB_MIN(changes, &tree->changes); change != NULL; change = nxtchange) {
+		nxtchange = LLRB_NEXT(changes, &tree->changes, change);
+		LLRB_REMOVE(changes, &tree->changes, change);
+		free(change);
+	}
+
+	free(tree->gone);
+	free(tree);
+
+	nfy->tree = NULL;
+} /* tree_close() */
+
+
+static void tree_post(struct notify *nfy) {
+	if (nfy->tree)
+		TAILQ_CONCAT(&nfy->tree->ready, &nfy->tree->pending, tqe);
+} /* tree_post() */
+
+
+static int tree_get(struct notify *nfy, const char **name) {
+	struct tree *tree = nfy->tree;
+	struct change *change;
+
+	free(tree->gone);
+	tree->gone = NULL;
+
+	if (!(change = TAILQ_FIRST(&tree->ready)))
+		return 0;
+
+	TAILQ_REMOVE(&tree->ready, change, tqe);
+	LLRB_REMOVE(changes, &tree->changes, change);
+	tree->count--;
+	tree->gone = change;
+
+	if (name)
+		*name = change->path;
+
+	return change->changes;
+} /* tree_get() */
+
+#define tree_pending(nfy) ((nfy)->tree && !TAILQ_EMPTY(&(nfy)->tree->pending))
+#define tree_ready(nfy) ((nfy)->tree && !TAILQ_EMPTY(&(nfy)->tree->ready))
+
+#else
+
+#define tree_pending(nfy) 0
+#define tree_ready(nfy) 0
+
+#endif /* ENABLE_INOTIFY */
+
+
 struct notify *notify_opendir(const char *dirpath, int flags, int *_error) {
 	struct notify *nfy = NULL;
 	size_t dirlen = strlen(dirpath);
@@ -553,7 +1037,22 @@ struct notify *notify_opendir(const char *dirpath, int flags, int *_error) {
 	nfy->dirlen = dirlen;
 	memcpy(nfy->dirpath, dirpath, dirlen);
 
+#if !ENABLE_INOTIFY
+	if (flags & NOTIFY_RECURSIVE) {
+		error = ENOTSUP;
+		goto error;
+	}
+#endif
+
 #if ENABLE_INOTIFY
+	if ((flags & NOTIFY_RECURSIVE) && (error = tree_open(nfy)))
+		goto error;
+
+#if ENABLE_FANOTIFY
+	if (nfy->tree && (flags & NOTIFY_FILESYSTEM) && !fan_open(nfy))
+		goto scan;
+#endif
+
 #if HAVE_INOTIFY_INIT1 && HAVE_IN_NONBLOCK && HAVE_IN_CLOEXEC
 	if (-1 == (nfy->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)))
 		goto syerr;
@@ -568,8 +1067,11 @@ struct notify *notify_opendir(const char *dirpath, int flags, int *_error) {
 		goto error;
 #endif
 
-	if (-1 == (nfy->dirwd = inotify_add_watch(nfy->fd, nfy->dirpath, IN_ATTRIB|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_MODIFY|IN_MOVE|IN_MOVE_SELF|IN_ONLYDIR)))
+	if (!nfy->tree && -1 == (nfy->dirwd = inotify_add_watch(nfy->fd, nfy->dirpath, NFY_INMASK)))
 		goto syerr;
+scan:
+	if (nfy->tree && (error = tree_scan(nfy, nfy->dirlen, 0)))
+		goto error;
 #elif ENABLE_FEN
 	if (-1 == (nfy->fd = port_create())) {
 		if (errno == EAGAIN)
@@ -641,6 +1143,10 @@ void notify_close(struct notify *nfy) {
 	port_dissociate(nfy->fd, PORT_SOURCE_FILE, (intptr_t)&nfy->dirfo);
 #endif
 
+#if ENABLE_INOTIFY
+	tree_close(nfy);
+#endif
+
 	free(nfy);
 } /* notify_close() */
 
@@ -650,9 +1156,61 @@ int notify_pollfd(struct notify *nfy) {
 } /* notify_pollfd() */
 
 
+static long long nfy_now(void) {
+#if HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+} /* nfy_now() */
+
+
+/* ms left before the batch begun at nfy->since may be released */
+static int nfy_remains(struct notify *nfy) {
+	long long elapsed;
+
+	if (nfy->window <= 0 || !nfy->settling)
+		return 0;
+
+	elapsed = nfy_now() - nfy->since;
+
+	return (elapsed < nfy->window)? (int)(nfy->window - elapsed) : 0;
+} /* nfy_remains() */
+
+
+static int nfy_settle(struct notify *nfy) {
+	if (nfy->window > 0 && !nfy->settling) {
+		nfy->settling = 1;
+		nfy->since = nfy_now();
+	}
+
+	return nfy_remains(nfy);
+} /* nfy_settle() */
+
+
+void notify_setwindow(struct notify *nfy, int window) {
+	nfy->window = (window > 0)? window : 0;
+} /* notify_setwindow() */
+
+
+static _Bool nfy_pending(struct notify *nfy) {
+	return nfy->dirty || !LIST_EMPTY(&nfy->pending) || tree_pending(nfy);
+} /* nfy_pending() */
+
+
 int notify_timeout(struct notify *nfy) {
-	if (nfy->dirty || !LIST_EMPTY(&nfy->pending) || !LIST_EMPTY(&nfy->changed))
+	if (!LIST_EMPTY(&nfy->changed) || tree_ready(nfy))
 		return 0;
+	else if (nfy_pending(nfy))
+		return nfy_remains(nfy);
 	else
 		return -1;
 } /* notify_timeout() */
@@ -701,6 +1259,31 @@ static int decode(int flags) {
 } /* decode() */
 
 
+#if ENABLE_FANOTIFY
+static int fan_decode(unsigned long long mask) {
+	static const struct { unsigned long long mask; int event; } table[] = {
+		{ FAN_ATTRIB,      NOTIFY_ATTRIB },
+		{ FAN_CREATE,      NOTIFY_CREATE },
+		{ FAN_DELETE,      NOTIFY_DELETE },
+		{ FAN_DELETE_SELF, NOTIFY_DELETE },
+		{ FAN_MODIFY,      NOTIFY_MODIFY },
+		{ FAN_MOVE_SELF,   NOTIFY_DELETE },
+		{ FAN_MOVED_FROM,  NOTIFY_DELETE },
+		{ FAN_MOVED_TO,    NOTIFY_CREATE },
+	};
+	int events = 0;
+	unsigned i;
+
+	for (i = 0; i < countof(table); i++) {
+		if (table[i].mask & mask)
+			events |= table[i].event;
+	}
+
+	return events;
+} /* fan_decode() */
+#endif
+
+
 #define NOTIFY_MAXSTEP 32
 
 #define ms2ts(ms) (((ms) >= 0)? &(struct timespec){ (ms) / 1000, (((ms) % 1000) * 1000000) } : NULL)
@@ -715,17 +1298,129 @@ static int decode(int flags) {
 #define in_msgend(msg, len) (struct inotify_event *)((unsigned char *)(msg) + (len))
 #define in_msgnxt(msg) (struct inotify_event *)((unsigned char *)(msg) + offsetof(struct inotify_event, name) + (msg)->len)
 
+static void in_tree(struct notify *nfy, const struct inotify_event *msg) {
+	struct dir *dir;
+
+	if (msg->mask & IN_Q_OVERFLOW) {
+		tree_lost(nfy, NOTIFY_ALL);
+
+		return;
+	}
+
+	if (!(dir = dir_find(nfy, &msg->wd, sizeof msg->wd)))
+		return;
+
+	/* subdirectory events without a name repeat those of the parent */
+	if (msg->len && *msg->name) {
+		tree_event(nfy, dir, msg->name, decode(msg->mask), !!(msg->mask & IN_ISDIR));
+	} else if (!dir->pathlen) {
+		nfy->changes |= decode(msg->mask);
+		nfy->dirty = 1;
+
+		if (msg->mask & (IN_IGNORED|IN_UNMOUNT))
+			nfy->critical = 1;
+	}
+
+	if ((msg->mask & IN_IGNORED) && dir->pathlen)
+		dir_discard(nfy, dir, 0);
+} /* in_tree() */
+
+
+#if ENABLE_FANOTIFY
+#define FAN_BUFSIZ 4096
+
+static void fan_event(struct notify *nfy, const struct fanotify_event_metadata *msg) {
+	const struct fanotify_event_info_fid *fid;
+	const struct file_handle *fh;
+	unsigned char key[NFY_KEYMAX];
+	size_t keylen;
+	const char *name = NULL;
+	struct dir *dir;
+
+	if (msg->fd >= 0)
+		close(msg->fd);
+
+	if (msg->mask & FAN_Q_OVERFLOW) {
+		tree_lost(nfy, NOTIFY_ALL);
+
+		return;
+	}
+
+	if (msg->event_len < msg->metadata_len + sizeof *fid)
+		return;
+
+	fid = (const void *)((const unsigned char *)msg + msg->metadata_len);
+	fh = (const void *)fid->handle;
+
+	if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+		name = (const char *)fh->f_handle + fh->handle_bytes;
+	else if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID)
+		return;
+
+	fan_key(key, &keylen, fh);
+
+	/* the mark covers the whole filesystem, not just our subtree */
+	if (!(dir = dir_find(nfy, key, keylen)))
+		return;
+
+	if (name && strcmp(name, ".")) {
+		tree_event(nfy, dir, name, fan_decode(msg->mask), !!(msg->mask & FAN_ONDIR));
+	} else if (!dir->pathlen) {
+		nfy->changes |= fan_decode(msg->mask);
+		nfy->dirty = 1;
+	}
+} /* fan_event() */
+
+
+static int fan_step1(struct notify *nfy) {
+	union { char pad[FAN_BUFSIZ]; struct fanotify_event_metadata event; } buf;
+	struct fanotify_event_metadata *msg;
+	ssize_t len;
+	int count = 0;
+
+	while ((len = read(nfy->fd, &buf, sizeof buf)) > 0) {
+		for (msg = &buf.event; FAN_EVENT_OK(msg, len); msg = FAN_EVENT_NEXT(msg, len)) {
+			fan_event(nfy, msg);
+			++count;
+		}
+
+		if (count >= NOTIFY_MAXSTEP)
+			return 0;
+	}
+
+	if (count > 0)
+		return 0;
+	else if (len == 0)
+		return EPIPE;
+	else
+		return errno;
+} /* fan_step1() */
+#endif
+
+
 static int in_step1(struct notify *nfy) {
 	struct inotify_event *buf, *msg, *end;
 	ssize_t len;
 	int count = 0;
 
+#if ENABLE_FANOTIFY
+	if (nfy->tree && nfy->tree->fan)
+		return fan_step1(nfy);
+#endif
+
 	buf = in_msgbuf(IN_BUFSIZ);
 
 	while ((len = read(nfy->fd, buf, IN_BUFSIZ)) > 0) {
 		for (msg = buf, end = in_msgend(buf, len); msg < end; msg = in_msgnxt(msg)) {
 			size_t namelen = strlen(msg->name);
 
+			if (nfy->tree) {
+				in_tree(nfy, msg);
+				++count;
+
+				continue;
+			}
+
 			if (namelen) {
 				struct file *file;
 
@@ -1063,21 +1758,35 @@ static int kq_post(struct notify *nfy) {
 
 
 int notify_step(struct notify *nfy, int timeout) {
-	int error;
+	int remains, error;
 
-	if (nfy->dirty || !LIST_EMPTY(&nfy->pending))
+	if (nfy_pending(nfy))
 		goto post;
 
-	if (nfy->changes || !LIST_EMPTY(&nfy->changed))
+	if (nfy->changes || !LIST_EMPTY(&nfy->changed) || tree_ready(nfy))
 		return 0;
 
 	if ((error = NFY_STEP(nfy, timeout)))
 		return error;
 
 post:
+	/* keep coalescing into the current batch until the window closes */
+	if (nfy_pending(nfy) && (remains = nfy_settle(nfy)) > 0) {
+		if ((error = NFY_STEP(nfy, (timeout >= 0 && timeout < remains)? timeout : remains)))
+			return error;
+
+		if (nfy_remains(nfy) > 0)
+			return 0;
+	}
+
 	if ((error = NFY_POST(nfy)))
 		return error;
 
+#if ENABLE_INOTIFY
+	tree_post(nfy);
+#endif
+	nfy->settling = 0;
+
 	return 0;
 } /* notify_step() */
 
@@ -1092,6 +1801,12 @@ int notify_add(struct notify *nfy, const char *name, int flags) {
 	if (memchr(name, '/', namelen))
 		return EISDIR;
 
+#if ENABLE_INOTIFY
+	/* every path is reported already */
+	if (nfy->tree)
+		return EINVAL;
+#endif
+
 	if ((file = lookup(nfy, name, namelen)))
 		return 0;
 
@@ -1163,6 +1878,11 @@ int notify_get(struct notify *nfy, const char **name) {
 	struct file *file;
 	int changes;
 
+#if ENABLE_INOTIFY
+	if (nfy->tree && (changes = tree_get(nfy, name)))
+		return changes;
+#endif
+
 	if ((file = LIST_FIRST(&nfy->changed))) {
 		NFY_LIST_MOVE(&nfy->dormant, file, le);
 
@@ -1196,8 +1916,11 @@ int notify_get(struct notify *nfy, const char **name) {
 
 
 #define USAGE \
-	"notify [-fh] [DIR [FILE ...]]\n" \
+	"notify [-frFw:h] [DIR [FILE ...]]\n" \
 	"  -f  print kernel notification features\n" \
+	"  -r  watch the whole subtree of DIR\n" \
+	"  -F  with -r, try a fanotify filesystem mark\n" \
+	"  -w  coalesce changes over the specified milliseconds\n" \
 	"  -h  print usage message\n" \
 	"\n" \
 	"Report bugs to <william@25thandClement.com>\n"
@@ -1218,13 +1941,23 @@ int main(int argc, char **argv) {
 	const char *path;
 	struct notify *notify;
 	const char *file;
-	int optc, i, error;
+	int flags = NOTIFY_ALL, window = 0;
+	int optc, i, changes, error;
 
-	while (-1 != (optc = getopt(argc, argv, "fh"))) {
+	while (-1 != (optc = getopt(argc, argv, "frFw:h"))) {
 		switch (optc) {
 		case 'f':
 			printfeat();
 			return 0;
+		case 'r':
+			flags |= NOTIFY_RECURSIVE;
+			break;
+		case 'F':
+			flags |= NOTIFY_FILESYSTEM;
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
 		case 'h':
 			fputs(USAGE, stdout);
 			return 0;
@@ -1239,20 +1972,29 @@ int main(int argc, char **argv) {
 
 	path = (argc > 0)? argv[0] : "/tmp";
 
-	if (!(notify = notify_opendir(path, NOTIFY_ALL, &error)))
+	if (!(notify = notify_opendir(path, flags, &error)))
 		errx(1, "%s: %s", path, strerror(error));
 
-	if (argc > 1) {
+	notify_setwindow(notify, window);
+
+	if (flags & NOTIFY_RECURSIVE) {
+		/* every path is reported without notify_add */
+	} else if (argc > 1) {
 		for (i = 1; i < argc; i++) {
 			if ((error = notify_add(notify, argv[i], NOTIFY_ALL)))
 				errx(1, "%s: %s", argv[i], strerror(error));
 		}
-	} else if ((error = notify_add(notify, "test.file", NOTIFY_ALL)))
+	} else if ((error = notify_add(notify, "test.file", NOTIFY_ALL))) {
 		errx(1, "test.file: %s", strerror(error));
+	}
 
 	while (!(error = notify_step(notify, -1))) {
-		while (notify_get(notify, &file))
-			puts(file);
+		while ((changes = notify_get(notify, &file))) {
+			if (flags & NOTIFY_RECURSIVE)
+				printf("%#.2x %s\n", changes, file);
+			else
+				puts(file);
+		}
 	}
 
 	return 0;
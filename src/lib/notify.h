@@ -40,6 +40,9 @@
 #define NOTIFY_GLOB 0x20
 #define NOTIFY_GREP 0x40
 
+#define NOTIFY_RECURSIVE  0x80  /* notify_opendir: report every path in the subtree */
+#define NOTIFY_FILESYSTEM 0x100 /* with NOTIFY_RECURSIVE, try a fanotify filesystem mark first */
+
 
 #define nfy_error_t int
 #define nfy_timeout_t int
@@ -60,6 +63,8 @@ nfy_error_t notify_add(struct notify *, const char *, nfy_flags_t);
 
 nfy_flags_t notify_get(struct notify *, const char **);
 
+void notify_setwindow(struct notify *, nfy_timeout_t);
+
 
 #define NOTIFY_INOTIFY    0x010000
 #define NOTIFY_FEN        0x020000
@@ -69,6 +74,7 @@ nfy_flags_t notify_get(struct notify *, const char **);
 #define NOTIFY_FDOPENDIR  0x200000
 #define NOTIFY_O_CLOEXEC  0x400000
 #define NOTIFY_IN_CLOEXEC 0x800000
+#define NOTIFY_FANOTIFY   0x1000000
 
 nfy_flags_t notify_features(void);
 
@@ -29,17 +29,18 @@
 
 #include <stddef.h> /* offsetof size_t */
 #include <limits.h> /* INT_MAX LONG_MAX */
-#include <stdlib.h> /* malloc(3) free(3) */
+#include <stdio.h>  /* snprintf(3) */
+#include <stdlib.h> /* malloc(3) calloc(3) realloc(3) free(3) */
 #include <string.h> /* strdup(3) strlen(3) memset(3) strncpy(3) memcpy(3) strerror(3) */
 #include <errno.h>  /* EINVAL EAFNOSUPPORT EAGAIN EWOULDBLOCK EINPROGRESS EALREADY ENAMETOOLONG EOPNOTSUPP ENOTSOCK ENOPROTOOPT */
 #include <signal.h> /* SIGPIPE SIG_BLOCK SIG_SETMASK sigset_t sigprocmask(2) pthread_sigmask(3) sigtimedwait(2) sigpending(2) sigemptyset(3) sigismember(3) sigaddset(3) */
 #include <assert.h> /* assert(3) */
-#include <time.h>   /* time(2) */
+#include <time.h>   /* CLOCK_MONOTONIC clock_gettime(2) time(2) */
 
 #include <sys/types.h>   /* socklen_t mode_t in_port_t */
 #include <sys/stat.h>    /* fchmod(2) fstat(2) S_IFSOCK S_ISSOCK */
 #include <sys/select.h>  /* FD_ZERO FD_SET fd_set select(2) */
-#include <sys/socket.h>  /* AF_UNIX AF_INET AF_INET6 SO_TYPE SO_NOSIGPIPE MSG_EOR MSG_NOSIGNAL struct sockaddr_storage socket(2) connect(2) bind(2) listen(2) accept(2) getsockname(2) getpeername(2) */
+#include <sys/socket.h>  /* AF_UNIX AF_INET AF_INET6 SO_TYPE SO_NOSIGPIPE MSG_EOR MSG_NOSIGNAL struct sockaddr_storage socket(2) connect(2) bind(2) listen(2) accept(2) getsockname(2) getpeername(2) sendmmsg(2) recvmmsg(2) */
 #if defined(AF_UNIX)
 #include <sys/un.h>      /* struct sockaddr_un struct unpcbid */
 #endif
@@ -53,6 +54,11 @@
 #if defined __sun
 #include <ucred.h>       /* ucred_t getpeerucred(2) ucred_free(3) */
 #endif
+#if defined __linux__
+#include <sys/sendfile.h> /* sendfile(2) */
+#elif defined __FreeBSD__ || defined __DragonFly__ || defined __APPLE__
+#include <sys/uio.h>     /* sendfile(2) */
+#endif
 
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
@@ -100,6 +106,10 @@ int socket_v_api(void) {
 #endif
 #endif
 
+#if SO_THREAD_SAFE
+#include <pthread.h> /* PTHREAD_MUTEX_INITIALIZER pthread_mutex_lock(3) pthread_mutex_unlock(3) */
+#endif
+
 #ifdef LIBRESSL_VERSION_NUMBER
 #define OPENSSL_PREREQ(M, m, p) (0)
 #define LIBRESSL_PREREQ(M, m, p) \
@@ -130,6 +140,42 @@ int socket_v_api(void) {
 #define HAVE_BIO_GET_DATA (OPENSSL_PREREQ(1,1,0) || LIBRESSL_PREREQ(2,7,0))
 #endif
 
+#ifndef HAVE_SENDFILE
+#define HAVE_SENDFILE (__linux__ || __FreeBSD__ || __DragonFly__ || __APPLE__)
+#endif
+
+#ifndef HAVE_SPLICE
+#ifdef _GNU_SOURCE
+#define HAVE_SPLICE __linux__
+#else
+#define HAVE_SPLICE 0
+#endif
+#endif
+
+#ifndef HAVE_SSL_OP_ENABLE_KTLS
+#ifdef SSL_OP_ENABLE_KTLS
+#define HAVE_SSL_OP_ENABLE_KTLS 1
+#else
+#define HAVE_SSL_OP_ENABLE_KTLS 0
+#endif
+#endif
+
+#ifndef HAVE_SSL_SENDFILE
+#define HAVE_SSL_SENDFILE (HAVE_SSL_OP_ENABLE_KTLS && OPENSSL_PREREQ(3,0,0))
+#endif
+
+#ifndef HAVE_RECVMMSG
+#if defined _GNU_SOURCE && defined __linux__
+#define HAVE_RECVMMSG 1
+#else
+#define HAVE_RECVMMSG 0
+#endif
+#endif
+
+#ifndef HAVE_SENDMMSG
+#define HAVE_SENDMMSG HAVE_RECVMMSG
+#endif
+
 #ifndef HAVE_BIO_UP_REF
 #define HAVE_BIO_UP_REF (OPENSSL_PREREQ(1,1,0) || LIBRESSL_PREREQ(2,7,0))
 #endif
@@ -142,6 +188,18 @@ int socket_v_api(void) {
 #define HAVE_SSL_UP_REF (OPENSSL_PREREQ(1,1,0) || LIBRESSL_PREREQ(2,7,0))
 #endif
 
+#ifndef HAVE_SSL_SESSION_UP_REF
+#define HAVE_SSL_SESSION_UP_REF (OPENSSL_PREREQ(1,1,0) || LIBRESSL_PREREQ(2,7,0))
+#endif
+
+#ifndef HAVE_SSL_SESSION_DUP
+#define HAVE_SSL_SESSION_DUP (OPENSSL_PREREQ(1,1,1) || LIBRESSL_PREREQ(3,7,0))
+#endif
+
+#ifndef HAVE_SSL_SESSION_IS_RESUMABLE
+#define HAVE_SSL_SESSION_IS_RESUMABLE (OPENSSL_PREREQ(1,1,1) || LIBRESSL_PREREQ(3,6,0))
+#endif
+
 
 /*
  * C O M P A T  R O U T I N E S
@@ -225,6 +283,30 @@ static int compat_SSL_up_ref(SSL *ssl) {
 } /* compat_SSL_up_ref() */
 #endif
 
+#if !HAVE_SSL_SESSION_UP_REF
+#define SSL_SESSION_up_ref(sess) (CRYPTO_add(&(sess)->references, 1, CRYPTO_LOCK_SSL_SESSION) > 1)
+#endif
+
+#if !HAVE_SSL_SESSION_IS_RESUMABLE
+#define SSL_SESSION_is_resumable(sess) (1)
+#endif
+
+#ifndef SO_SESSIONMAX
+#define SO_SESSIONMAX 256
+#endif
+
+#ifndef SO_RACEMAX
+#define SO_RACEMAX 8 /* concurrent Happy Eyeballs connection attempts */
+#endif
+
+#ifndef SO_RACEADDR
+#define SO_RACEADDR 16 /* addresses kept per family */
+#endif
+
+#ifndef SO_RACERESDELAY
+#define SO_RACERESDELAY 0.05 /* RFC 8305 Resolution Delay */
+#endif
+
 
 /*
  * D E B U G  R O U T I N E S
@@ -431,6 +513,22 @@ static void so_initdebug(void) {
 #endif /* SOCKET_DEBUG */
 
 
+/*
+ * Static USDT probes under the "cqueues" provider. Unlike so_trace they're
+ * compiled in whenever <sys/sdt.h> exists and cost a nop until attached.
+ */
+#ifndef ENABLE_USDT
+#define ENABLE_USDT HAVE_SYS_SDT_H
+#endif
+
+#if ENABLE_USDT
+#include <sys/sdt.h>
+#define so_probe(name, so, a, b) DTRACE_PROBE3(cqueues, name, (so)->fd, (a), (b))
+#else
+#define so_probe(...) (void)0
+#endif
+
+
 /*
  * M A C R O  R O U T I N E S
  *
@@ -1279,9 +1377,12 @@ enum so_state {
 }; /* enum so_state */
 
 
+struct so_race;
+
 struct socket {
 	struct so_options opts;
 	struct dns_addrinfo *res;
+	struct so_race *race; /* Happy Eyeballs state while connecting */
 
 	int fd;
 
@@ -1314,6 +1415,9 @@ struct socket {
 		int state;
 		_Bool accept;
 		_Bool vrfd;
+		_Bool ktls;
+		_Bool cache;
+		char *key; /* session cache key, if caching */
 	} ssl;
 
 	struct {
@@ -1531,237 +1635,861 @@ error:
 } /* so_connect_() */
 
 
-static BIO *so_newbio(struct socket *, int *);
+/*
+ * H A P P Y  E Y E B A L L S
+ *
+ * RFC 8305 connection racing. AAAA and A lookups run concurrently on
+ * separate stub resolvers. Connection attempts alternate between families,
+ * IPv6 first, starting a new one every connection attempt delay or as soon
+ * as every attempt in flight has failed. The first attempt to connect is
+ * adopted as the socket's descriptor and the rest are closed.
+ *
+ * Only the newest attempt is polled; so_timeout() has the caller check
+ * back within one delay so older attempts and late answers are noticed.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-static int so_starttls_(struct socket *so) {
-	X509 *peer;
-	int rval, error;
+struct so_race {
+	struct dns_addrinfo *res[2]; /* [0] AAAA, [1] A; NULL when finished */
+	double resolved; /* when A finished with AAAA outstanding */
 
-	if (so->ssl.error)
-		return so->ssl.error;
+	struct {
+		struct addrinfo *ent[SO_RACEADDR];
+		unsigned count, next;
+	} addr[2];
+	unsigned turn; /* family of the next attempt */
 
-	so_pipeign(so, 0);
+	struct {
+		int fd;
+		struct addrinfo *host;
+	} try[SO_RACEMAX];
+	unsigned ntry;
 
-	ERR_clear_error();
+	double delay, next; /* earliest start of the next attempt */
+	int pollfd;
+	int lerror;
+}; /* struct so_race */
 
-	switch (so->ssl.state) {
-	case 0: {
-		/*
-		 * NOTE: For SOCK_DGRAM continue using OpenSSL's BIO until
-		 * we have time to reverse engineer the semantics necessary
-		 * for DTLS.
-		 */
-		if (S_ISSOCK(so->mode) && so->type == SOCK_DGRAM) {
-			struct sockaddr_storage peer;
-			BIO *bio;
 
-			memset(&peer, 0, sizeof peer);
+static double so_monotime(void) {
+	struct timespec ts;
 
-			if (0 != getpeername(so->fd, (struct sockaddr *)&peer, &(socklen_t){ sizeof peer })) {
-				error = errno;
-				goto error;
-			}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-			if (!(bio = BIO_new_dgram(so->fd, BIO_NOCLOSE))) {
-				error = SO_EOPENSSL;
-				goto error;
-			}
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+} /* so_monotime() */
 
-			BIO_ctrl_set_connected(bio, &peer);
 
-			SSL_set_bio(so->ssl.ctx, bio, bio);
-			SSL_set_read_ahead(so->ssl.ctx, 1);
-		} else {
-			BIO *bio;
+static void so_race_close(struct so_race *R, const struct so_options *opts) {
+	unsigned i, j;
 
-			if (!(bio = so_newbio(so, &error)))
-				goto error;
+	if (!R)
+		return;
 
-			SSL_set_bio(so->ssl.ctx, bio, bio);
-		}
+	for (i = 0; i < R->ntry; i++) {
+		so_closesocket(&R->try[i].fd, opts);
+		free(R->try[i].host);
+	}
 
-		if (so->ssl.accept) {
-			SSL_set_accept_state(so->ssl.ctx);
-		} else {
-			SSL_set_connect_state(so->ssl.ctx);
-		}
+	for (i = 0; i < 2; i++) {
+		for (j = R->addr[i].next; j < R->addr[i].count; j++)
+			free(R->addr[i].ent[j]);
 
-		so->ssl.state++;
+		dns_ai_close(R->res[i]);
 	}
-	/* FALL THROUGH */
-	case 1:
-		rval = SSL_do_handshake(so->ssl.ctx);
 
-		if (rval > 0) {
-			/* SUCCESS (continue to next state) */
-			;;
-		} else {
-			/* ERROR (either need I/O or a plain error) or SHUTDOWN */
-			so->events &= ~(POLLIN|POLLOUT);
+	free(R);
+} /* so_race_close() */
 
-			error = ssl_error(so->ssl.ctx, rval, &so->events);
 
-			goto error;
-		} /* (rval) */
+static struct so_race *so_race_open(const char *host, const char *port, const struct addrinfo *hints, const struct so_options *opts, int *error) {
+	static const enum dns_type qtype[2] = { DNS_T_AAAA, DNS_T_A };
+	struct dns_resolver *res;
+	struct so_race *R;
+	int i;
 
-		so->ssl.state++;
-		/* FALL THROUGH */
-	case 2:
-		/*
-		 * NOTE: Must call SSL_get_peer_certificate() first, which
-		 * processes the certificate. SSL_get_verify_result() merely
-		 * returns the result of this processing.
-		 */
-		peer = SSL_get_peer_certificate(so->ssl.ctx);
-		so->ssl.vrfd = (peer && SSL_get_verify_result(so->ssl.ctx) == X509_V_OK);
-		x509_discard(&peer);
+	if (!(R = calloc(1, sizeof *R))) {
+		*error = so_syerr();
 
-		so->ssl.state++;
-		/* FALL THROUGH */
-	case 3:
-		if (so->opts.tls_verify && !so->ssl.vrfd) {
-			error = SO_ENOTVRFD;
+		return NULL;
+	}
 
-			goto error;
-		}
+	R->resolved = -1;
+	R->delay = opts->sin_happy;
+	R->pollfd = -1;
 
-		so->ssl.state++;
-		/* FALL THROUGH */
-	case 4:
-		break;
-	} /* switch(so->ssl.state) */
+	for (i = 0; i < 2; i++) {
+		struct dns_options *dopts = dns_opts();
 
-#if SOCKET_DEBUG
-	if (SOCKET_DEBUG) {
-		const SSL_CIPHER *cipher = SSL_get_current_cipher(so->ssl.ctx);
+		dopts->closefd.arg = opts->fd_close.arg;
+		dopts->closefd.cb = opts->fd_close.cb;
 
-		so_trace(SO_T_STARTTLS, so->fd, so->host, so->ssl.ctx,
-			"%s-%s", SSL_get_version(so->ssl.ctx), SSL_CIPHER_get_name(cipher));
-	}
-#endif
+		if (!(res = dns_res_stub(dopts, error)))
+			goto error;
 
-	so_pipeok(so, 0);
+		R->res[i] = dns_ai_open(host, port, qtype[i], hints, res, error);
+		dns_res_close(res);
 
-	return 0;
+		if (!R->res[i])
+			goto error;
+	}
+
+	return R;
 error:
-	if (error != SO_EAGAIN)
-		so_trace(SO_T_STARTTLS, so->fd, so->host, so->ssl.ctx, "%s", so_strerror(error));
+	so_race_close(R, opts);
 
-	so_pipeok(so, 0);
+	return NULL;
+} /* so_race_open() */
 
-	return error;
-} /* so_starttls_() */
 
+/* drain whatever answers have arrived; returns true while any are pending */
+static _Bool so_race_resolve(struct so_race *R, double now) {
+	struct addrinfo *ent;
+	int i, error;
 
-static int so_rstlowat_(struct socket *so) {
-	if (0 != setsockopt(so->fd, SOL_SOCKET, SO_RCVLOWAT, &so->olowat, sizeof so->olowat))
-		return so_soerr();
+	for (i = 0; i < 2; i++) {
+		while (R->res[i]) {
+			ent = NULL;
 
-	return 0;
-} /* so_rstlowat_() */
+			if (!(error = dns_ai_nextent(&ent, R->res[i]))) {
+				if (R->addr[i].count < SO_RACEADDR)
+					R->addr[i].ent[R->addr[i].count++] = ent;
+				else
+					free(ent);
 
+				continue;
+			}
 
-static int so_shutwr_(struct socket *so) {
-	if (so->fd != -1 && 0 != shutdown(so->fd, SHUT_WR))
-		return so_soerr();
+			if (error == SO_EAGAIN || error == SO_EWOULDBLOCK)
+				break;
 
-	so->shut.wr = 1;
-	so->st.sent.eof = 1;
+			if (error != ENOENT)
+				R->lerror = error;
 
-	return 0;
-} /* so_shutwr_() */
+			dns_ai_close(R->res[i]);
+			R->res[i] = NULL;
 
+			if (i == 1 && R->res[0])
+				R->resolved = now;
+		}
+	}
 
-static _Bool so_isconn(int fd) {
-		struct sockaddr sa;
-		socklen_t slen = sizeof sa;
+	return R->res[0] || R->res[1];
+} /* so_race_resolve() */
 
-		return 0 == getpeername(fd, &sa, &slen) || so_soerr() != SO_ENOTCONN;
-} /* so_isconn() */
 
-static int so_shutrd_(struct socket *so) {
-	if (so->fd != -1 && 0 != shutdown(so->fd, SHUT_RD)) {
-		/*
-		 * NOTE: OS X will fail with ENOTCONN if the requested
-		 * SHUT_RD or SHUT_WR flag is already set, including if the
-		 * SHUT_RD flag is set from the peer sending eof. Other OSs
-		 * just treat this as a noop and return successfully.
-		 */
-		if (so_soerr() != SO_ENOTCONN)
-			return so_soerr();
-		else if (!so_isconn(so->fd))
-			return SO_ENOTCONN;
-	}
+static struct addrinfo *so_race_nextaddr(struct so_race *R, double now) {
+	unsigned i, af;
 
-	so->shut.rd = 1;
+	/* give AAAA a moment to arrive when only A has answered */
+	if (R->res[0] && !R->addr[0].count && R->resolved >= 0 && now < R->resolved + SO_RACERESDELAY)
+		return NULL;
 
-	return 0;
-} /* so_shutrd_() */
+	if (R->res[0] && !R->addr[0].count && R->resolved < 0)
+		return NULL;
 
+	for (i = 0; i < 2; i++) {
+		af = (R->turn + i) % 2;
 
-static inline int so_state(const struct socket *so) {
-	if (so->todo & ~so->done) {
-		int i = 1;
+		if (R->addr[af].next < R->addr[af].count) {
+			R->turn = !af;
 
-		while (i < SO_S_END && !(i & (so->todo & ~so->done)))
-			i <<= 1;
+			return R->addr[af].ent[R->addr[af].next++];
+		}
+	}
 
-		return (i < SO_S_END)? i : 0;
-	} else
-		return 0;
-} /* so_state() */
+	return NULL;
+} /* so_race_nextaddr() */
 
 
-static int so_exec(struct socket *so) {
-	int state, error_, error = 0;
+static void so_race_drop(struct so_race *R, unsigned i, const struct so_options *opts) {
+	so_closesocket(&R->try[i].fd, opts);
+	free(R->try[i].host);
 
-exec:
+	R->try[i] = R->try[--R->ntry];
+} /* so_race_drop() */
 
-	switch (state = so_state(so)) {
-	case SO_S_INIT:
-		break;
-	case SO_S_GETADDR:
-		switch ((error_ = so_getaddr_(so))) {
-		case 0:
-			break;
-		case ENOENT:
-			/* NOTE: Return the last error if possible. */
-			if (error)
-				error_ = error;
-			else if (so->lerror)
-				error_ = so->lerror;
 
-			/* FALL THROUGH */
-		default:
-			error = error_;
+static int so_race_adopt(struct socket *so, unsigned i) {
+	struct so_race *R = so->race;
+	int error;
 
-			goto error;
-		}
+	so_closesocket(&so->fd, &so->opts);
+	free(so->host);
 
-		so->done |= state;
+	so->fd = R->try[i].fd;
+	so->host = R->try[i].host;
 
-		goto exec;
-	case SO_S_SOCKET:
-		if ((error = so_socket_(so)))
-			goto retry;
+	R->try[i] = R->try[--R->ntry];
 
-		so->done |= state;
+	so_race_close(R, &so->opts);
+	so->race = NULL;
 
-		goto exec;
-	case SO_S_BIND:
-		if ((error = so_bind_(so)))
-			goto retry;
+	if ((error = so_ftype(so->fd, &so->mode, &so->domain, &so->type, &so->protocol)))
+		return error;
 
-		so->done |= state;
+	so->flags = so_getfl(so->fd, ~0);
 
-		goto exec;
-	case SO_S_LISTEN:
-		if ((error = so_listen_(so)))
-			return error;
+	so_trace(SO_T_CONNECT, so->fd, so->host, "ready");
 
-		so->done |= state;
+	return 0;
+} /* so_race_adopt() */
 
-		goto exec;
+
+static int so_race_(struct socket *so) {
+	struct so_race *R = so->race;
+	struct pollfd pfd[SO_RACEMAX];
+	struct addrinfo *host;
+	socklen_t len;
+	double now = so_monotime();
+	_Bool pending;
+	unsigned i;
+	int fd, error;
+
+	so->events = 0;
+
+	pending = so_race_resolve(R, now);
+
+	/* reap attempts that finished, adopting the first to connect */
+	for (i = 0; i < R->ntry; i++) {
+		pfd[i].fd = R->try[i].fd;
+		pfd[i].events = POLLOUT;
+		pfd[i].revents = 0;
+	}
+
+	if (R->ntry && poll(pfd, R->ntry, 0) > 0) {
+		for (i = R->ntry; i-- > 0;) {
+			if (!pfd[i].revents)
+				continue;
+
+			len = sizeof error;
+
+			if (0 != getsockopt(R->try[i].fd, SOL_SOCKET, SO_ERROR, &error, &len))
+				error = so_soerr();
+
+			if (!error && !(pfd[i].revents & (POLLERR|POLLHUP)))
+				return so_race_adopt(so, i);
+
+			so_trace(SO_T_CONNECT, R->try[i].fd, R->try[i].host, "%s", so_strerror((error)? error : ECONNREFUSED));
+			R->lerror = (error)? error : ECONNREFUSED;
+
+			so_race_drop(R, i, &so->opts);
+		}
+
+		if (!R->ntry)
+			R->next = now; /* everything failed; don't wait out the delay */
+	}
+
+	/* start the next attempt when it's due */
+	while (R->ntry < SO_RACEMAX && (!R->ntry || now >= R->next) && (host = so_race_nextaddr(R, now))) {
+		if (-1 == (fd = so_socket(host->ai_family, host->ai_socktype, &so->opts, &error)))
+			goto skip;
+
+		if (so->opts.sa_bind && (error = so_bind(fd, (struct sockaddr *)so->opts.sa_bind, &so->opts)))
+			goto skip;
+
+		error = (0 == connect(fd, host->ai_addr, host->ai_addrlen))? 0 : so_soerr();
+
+		if (error && error != SO_EINPROGRESS && error != SO_EALREADY && error != SO_EINTR && error != SO_EWOULDBLOCK) {
+			so_trace(SO_T_CONNECT, fd, host, "%s", so_strerror(error));
+
+			goto skip; /* try the next address straight away */
+		}
+
+		R->try[R->ntry].fd = fd;
+		R->try[R->ntry].host = host;
+
+		if (!error)
+			return so_race_adopt(so, R->ntry++);
+
+		R->ntry++;
+		R->next = now + R->delay;
+
+		break;
+skip:
+		R->lerror = error;
+		so_closesocket(&fd, &so->opts);
+		free(host);
+	}
+
+	if (R->ntry) {
+		R->pollfd = R->try[R->ntry - 1].fd;
+		so->events = POLLOUT;
+	} else if (pending) {
+		R->pollfd = dns_ai_pollfd((R->res[0])? R->res[0] : R->res[1]);
+		so->events = dns_ai_events((R->res[0])? R->res[0] : R->res[1]);
+	} else {
+		return (R->lerror)? R->lerror : SO_ENOHOST;
+	}
+
+	return SO_EAGAIN;
+} /* so_race_() */
+
+
+/* seconds until the race wants another look, or -1 */
+static double so_race_timeout(struct so_race *R) {
+	double now = so_monotime(), timeout = -1, t;
+	time_t dt;
+	int i;
+
+	/* older attempts and late answers aren't polled directly */
+	if (R->ntry > 1 || (R->ntry && (R->res[0] || R->res[1])))
+		timeout = R->delay;
+
+	if (R->ntry && (R->addr[0].next < R->addr[0].count || R->addr[1].next < R->addr[1].count || R->res[0] || R->res[1])) {
+		t = SO_MAX(R->next - now, 0.0);
+		timeout = (timeout < 0)? t : SO_MIN(timeout, t);
+	}
+
+	if (R->resolved >= 0 && R->res[0] && !R->addr[0].count) {
+		t = SO_MAX(R->resolved + SO_RACERESDELAY - now, 0.0);
+		timeout = (timeout < 0)? t : SO_MIN(timeout, t);
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (R->res[i] && (dt = dns_ai_timeout(R->res[i])) > 0)
+			timeout = (timeout < 0)? dt : SO_MIN(timeout, (double)dt);
+	}
+
+	return timeout;
+} /* so_race_timeout() */
+
+
+/*
+ * T L S  S E S S I O N  C A C H E
+ *
+ * Process-wide cache of client sessions, keyed by server name and peer
+ * address, so short-lived connections to the same upstream can resume
+ * rather than repeat the full handshake. Eviction is least-recently-used
+ * and expired sessions are dropped on lookup.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static struct {
+#if SO_THREAD_SAFE
+	pthread_mutex_t mutex;
+#endif
+	struct so_session {
+		char *key;
+		SSL_SESSION *ctx;
+		unsigned long long atime;
+	} *entry;
+	size_t count, limit;
+	unsigned long long clock;
+	unsigned long long hits, misses;
+} so_sessions = {
+#if SO_THREAD_SAFE
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+#endif
+	.limit = SO_SESSIONMAX,
+};
+
+static void so_sessionlock(void) {
+#if SO_THREAD_SAFE
+	pthread_mutex_lock(&so_sessions.mutex);
+#endif
+} /* so_sessionlock() */
+
+static void so_sessionunlock(void) {
+#if SO_THREAD_SAFE
+	pthread_mutex_unlock(&so_sessions.mutex);
+#endif
+} /* so_sessionunlock() */
+
+/* caller must hold lock */
+static void so_sessiondrop(size_t i) {
+	free(so_sessions.entry[i].key);
+	SSL_SESSION_free(so_sessions.entry[i].ctx);
+
+	so_sessions.entry[i] = so_sessions.entry[--so_sessions.count];
+} /* so_sessiondrop() */
+
+/* caller must hold lock */
+static struct so_session *so_sessionfind(const char *key) {
+	size_t i;
+
+	for (i = 0; i < so_sessions.count; i++) {
+		if (!strcmp(so_sessions.entry[i].key, key))
+			return &so_sessions.entry[i];
+	}
+
+	return NULL;
+} /* so_sessionfind() */
+
+static SSL_SESSION *so_sessionget(const char *key) {
+	struct so_session *ent;
+	SSL_SESSION *sess = NULL;
+
+	so_sessionlock();
+
+	if ((ent = so_sessionfind(key))) {
+		long expires = SSL_SESSION_get_time(ent->ctx) + SSL_SESSION_get_timeout(ent->ctx);
+
+		if (expires <= time(NULL)) {
+			so_sessiondrop(ent - so_sessions.entry);
+		} else if (SSL_SESSION_up_ref(ent->ctx)) {
+			ent->atime = ++so_sessions.clock;
+			sess = ent->ctx;
+		}
+	}
+
+	so_sessionunlock();
+
+	return sess;
+} /* so_sessionget() */
+
+/* takes ownership of sess */
+static void so_sessionput(const char *key, SSL_SESSION *sess) {
+	struct so_session *ent, *tmp;
+	char *dup = NULL;
+
+	so_sessionlock();
+
+	if ((ent = so_sessionfind(key))) {
+		SSL_SESSION_free(ent->ctx);
+		ent->ctx = sess;
+		ent->atime = ++so_sessions.clock;
+
+		goto leave;
+	}
+
+	if (!so_sessions.limit || !(dup = strdup(key)))
+		goto fail;
+
+	if (so_sessions.count >= so_sessions.limit) {
+		size_t lru = 0, i;
+
+		for (i = 1; i < so_sessions.count; i++) {
+			if (so_sessions.entry[i].atime < so_sessions.entry[lru].atime)
+				lru = i;
+		}
+
+		so_sessiondrop(lru);
+	} else if (!so_sessions.entry) {
+		if (!(tmp = calloc(so_sessions.limit, sizeof *tmp)))
+			goto fail;
+
+		so_sessions.entry = tmp;
+	}
+
+	ent = &so_sessions.entry[so_sessions.count++];
+	ent->key = dup;
+	ent->ctx = sess;
+	ent->atime = ++so_sessions.clock;
+leave:
+	so_sessionunlock();
+
+	return;
+fail:
+	so_sessionunlock();
+
+	free(dup);
+	SSL_SESSION_free(sess);
+} /* so_sessionput() */
+
+static void so_sessioncount(_Bool hit) {
+	so_sessionlock();
+
+	if (hit)
+		so_sessions.hits++;
+	else
+		so_sessions.misses++;
+
+	so_sessionunlock();
+} /* so_sessioncount() */
+
+
+void so_sessionstat(struct so_sessionstat *st) {
+	so_sessionlock();
+
+	st->hits = so_sessions.hits;
+	st->misses = so_sessions.misses;
+	st->count = so_sessions.count;
+	st->limit = so_sessions.limit;
+
+	so_sessionunlock();
+} /* so_sessionstat() */
+
+
+int so_sessionlimit(size_t limit) {
+	struct so_session *tmp;
+	int error = 0;
+
+	so_sessionlock();
+
+	while (so_sessions.count > limit) {
+		size_t lru = 0, i;
+
+		for (i = 1; i < so_sessions.count; i++) {
+			if (so_sessions.entry[i].atime < so_sessions.entry[lru].atime)
+				lru = i;
+		}
+
+		so_sessiondrop(lru);
+	}
+
+	if (!limit) {
+		free(so_sessions.entry);
+		so_sessions.entry = NULL;
+	} else if (so_sessions.entry && limit != so_sessions.limit) {
+		if (!(tmp = realloc(so_sessions.entry, limit * sizeof *tmp))) {
+			error = errno;
+			goto leave;
+		}
+
+		so_sessions.entry = tmp;
+	}
+
+	so_sessions.limit = limit;
+leave:
+	so_sessionunlock();
+
+	return error;
+} /* so_sessionlimit() */
+
+
+/*
+ * Key on the name we sent as well as the address, since one address may
+ * front several virtual hosts with different certificates. The context,
+ * its trust store and the verify mode are part of the key, too: resuming
+ * skips certificate verification, so a session established under one
+ * policy must never be offered under a stricter one.
+ */
+static int so_sessionkey(struct socket *so) {
+	struct sockaddr_storage peer;
+	socklen_t salen = sizeof peer;
+	SSL_CTX *ctx = SSL_get_SSL_CTX(so->ssl.ctx);
+	const char *name;
+	char key[SA_ADDRSTRLEN + 512];
+
+	memset(&peer, 0, sizeof peer);
+
+	if (0 != getpeername(so->fd, (struct sockaddr *)&peer, &salen))
+		return errno;
+
+	name = (so->opts.tls_sendname && so->opts.tls_sendname != SO_OPTS_TLS_HOSTNAME)? so->opts.tls_sendname : "";
+
+	snprintf(key, sizeof key, "%p|%p|%d|%s|%s|%hu", (void *)ctx, (void *)SSL_CTX_get_cert_store(ctx), SSL_get_verify_mode(so->ssl.ctx), name, sa_ntoa(&peer), ntohs(*sa_port(&peer, SA_PORT_NONE, NULL)));
+
+	free(so->ssl.key);
+
+	if (!(so->ssl.key = strdup(key)))
+		return errno;
+
+	return 0;
+} /* so_sessionkey() */
+
+/* remember the latest session, e.g. after TLS 1.3 tickets have arrived */
+static void so_sessionsave(struct socket *so) {
+	SSL_SESSION *sess, *tmp;
+
+	if (!so->ssl.key || !so->ssl.ctx || so->ssl.state < 4)
+		return;
+
+	if (!(sess = SSL_get1_session(so->ssl.ctx)))
+		return;
+
+	if (!SSL_SESSION_is_resumable(sess)) {
+		SSL_SESSION_free(sess);
+
+		return;
+	}
+
+#if HAVE_SSL_SESSION_DUP
+	/*
+	 * NOTE: We never send close_notify, so SSL_free() will mark the
+	 * session non-resumable. Cache a private copy instead.
+	 */
+	tmp = SSL_SESSION_dup(sess);
+	SSL_SESSION_free(sess);
+
+	if (!(sess = tmp))
+		return;
+#else
+	(void)tmp;
+#endif
+
+	so_sessionput(so->ssl.key, sess);
+} /* so_sessionsave() */
+
+
+static BIO *so_newbio(struct socket *, int *);
+
+static int so_starttls_(struct socket *so) {
+	X509 *peer;
+	int rval, error;
+
+	if (so->ssl.error)
+		return so->ssl.error;
+
+	so_pipeign(so, 0);
+
+	ERR_clear_error();
+
+	switch (so->ssl.state) {
+	case 0: {
+		/*
+		 * NOTE: For SOCK_DGRAM continue using OpenSSL's BIO until
+		 * we have time to reverse engineer the semantics necessary
+		 * for DTLS.
+		 */
+		if (S_ISSOCK(so->mode) && so->type == SOCK_DGRAM) {
+			struct sockaddr_storage peer;
+			BIO *bio;
+
+			memset(&peer, 0, sizeof peer);
+
+			if (0 != getpeername(so->fd, (struct sockaddr *)&peer, &(socklen_t){ sizeof peer })) {
+				error = errno;
+				goto error;
+			}
+
+			if (!(bio = BIO_new_dgram(so->fd, BIO_NOCLOSE))) {
+				error = SO_EOPENSSL;
+				goto error;
+			}
+
+			BIO_ctrl_set_connected(bio, &peer);
+
+			SSL_set_bio(so->ssl.ctx, bio, bio);
+			SSL_set_read_ahead(so->ssl.ctx, 1);
+#if HAVE_SSL_OP_ENABLE_KTLS
+		} else if (so->ssl.ktls && S_ISSOCK(so->mode) && !(so->bio.ahead.p < so->bio.ahead.pe)) {
+			/*
+			 * NOTE: OpenSSL will only hand record processing to
+			 * the kernel through its own socket BIO, so kTLS
+			 * forgoes our BIO and with it any pushback data.
+			 * so_needign() already covers SIGPIPE for this case.
+			 */
+			BIO *bio;
+
+			if (!(bio = BIO_new_socket(so->fd, BIO_NOCLOSE))) {
+				error = SO_EOPENSSL;
+				goto error;
+			}
+
+			SSL_set_bio(so->ssl.ctx, bio, bio);
+			SSL_set_options(so->ssl.ctx, SSL_OP_ENABLE_KTLS);
+#endif
+		} else {
+			BIO *bio;
+
+			if (!(bio = so_newbio(so, &error)))
+				goto error;
+
+			SSL_set_bio(so->ssl.ctx, bio, bio);
+		}
+
+		if (so->ssl.accept) {
+			SSL_set_accept_state(so->ssl.ctx);
+		} else {
+			SSL_set_connect_state(so->ssl.ctx);
+		}
+
+		if (so->ssl.cache && !so->ssl.accept) {
+			SSL_SESSION *sess;
+
+			if ((error = so_sessionkey(so)))
+				goto error;
+
+			if ((sess = so_sessionget(so->ssl.key))) {
+				SSL_set_session(so->ssl.ctx, sess);
+				SSL_SESSION_free(sess);
+			}
+		}
+
+		so->ssl.state++;
+	}
+	/* FALL THROUGH */
+	case 1:
+		rval = SSL_do_handshake(so->ssl.ctx);
+
+		if (rval > 0) {
+			/* SUCCESS (continue to next state) */
+			if (so->ssl.key)
+				so_sessioncount(SSL_session_reused(so->ssl.ctx));
+		} else {
+			/* ERROR (either need I/O or a plain error) or SHUTDOWN */
+			so->events &= ~(POLLIN|POLLOUT);
+
+			error = ssl_error(so->ssl.ctx, rval, &so->events);
+
+			goto error;
+		} /* (rval) */
+
+		so->ssl.state++;
+		/* FALL THROUGH */
+	case 2:
+		/*
+		 * NOTE: Must call SSL_get_peer_certificate() first, which
+		 * processes the certificate. SSL_get_verify_result() merely
+		 * returns the result of this processing.
+		 */
+		peer = SSL_get_peer_certificate(so->ssl.ctx);
+		so->ssl.vrfd = (peer && SSL_get_verify_result(so->ssl.ctx) == X509_V_OK);
+		x509_discard(&peer);
+
+		so->ssl.state++;
+		/* FALL THROUGH */
+	case 3:
+		if (so->opts.tls_verify && !so->ssl.vrfd) {
+			error = SO_ENOTVRFD;
+
+			goto error;
+		}
+
+		so->ssl.state++;
+
+		so_sessionsave(so);
+		/* FALL THROUGH */
+	case 4:
+		break;
+	} /* switch(so->ssl.state) */
+
+#if SOCKET_DEBUG
+	if (SOCKET_DEBUG) {
+		const SSL_CIPHER *cipher = SSL_get_current_cipher(so->ssl.ctx);
+
+		so_trace(SO_T_STARTTLS, so->fd, so->host, so->ssl.ctx,
+			"%s-%s", SSL_get_version(so->ssl.ctx), SSL_CIPHER_get_name(cipher));
+	}
+#endif
+
+	so_probe(tls__handshake, so, so->ssl.state, 0);
+	so_pipeok(so, 0);
+
+	return 0;
+error:
+	so_probe(tls__handshake, so, so->ssl.state, error);
+
+	if (error != SO_EAGAIN)
+		so_trace(SO_T_STARTTLS, so->fd, so->host, so->ssl.ctx, "%s", so_strerror(error));
+
+	so_pipeok(so, 0);
+
+	return error;
+} /* so_starttls_() */
+
+
+static int so_rstlowat_(struct socket *so) {
+	if (0 != setsockopt(so->fd, SOL_SOCKET, SO_RCVLOWAT, &so->olowat, sizeof so->olowat))
+		return so_soerr();
+
+	return 0;
+} /* so_rstlowat_() */
+
+
+static int so_shutwr_(struct socket *so) {
+	if (so->fd != -1 && 0 != shutdown(so->fd, SHUT_WR))
+		return so_soerr();
+
+	so->shut.wr = 1;
+	so->st.sent.eof = 1;
+
+	return 0;
+} /* so_shutwr_() */
+
+
+static _Bool so_isconn(int fd) {
+		struct sockaddr sa;
+		socklen_t slen = sizeof sa;
+
+		return 0 == getpeername(fd, &sa, &slen) || so_soerr() != SO_ENOTCONN;
+} /* so_isconn() */
+
+static int so_shutrd_(struct socket *so) {
+	if (so->fd != -1 && 0 != shutdown(so->fd, SHUT_RD)) {
+		/*
+		 * NOTE: OS X will fail with ENOTCONN if the requested
+		 * SHUT_RD or SHUT_WR flag is already set, including if the
+		 * SHUT_RD flag is set from the peer sending eof. Other OSs
+		 * just treat this as a noop and return successfully.
+		 */
+		if (so_soerr() != SO_ENOTCONN)
+			return so_soerr();
+		else if (!so_isconn(so->fd))
+			return SO_ENOTCONN;
+	}
+
+	so->shut.rd = 1;
+
+	return 0;
+} /* so_shutrd_() */
+
+
+static inline int so_state(const struct socket *so) {
+	if (so->todo & ~so->done) {
+		int i = 1;
+
+		while (i < SO_S_END && !(i & (so->todo & ~so->done)))
+			i <<= 1;
+
+		return (i < SO_S_END)? i : 0;
+	} else
+		return 0;
+} /* so_state() */
+
+
+static int so_exec(struct socket *so) {
+	int state, error_, error = 0;
+
+exec:
+
+	switch (state = so_state(so)) {
+	case SO_S_INIT:
+		break;
+	case SO_S_GETADDR:
+		if (so->race) {
+			/* resolves, binds and connects in one go */
+			if ((error = so_race_(so)))
+				goto error;
+
+			so->done |= SO_S_GETADDR | SO_S_SOCKET | SO_S_BIND | (so->todo & SO_S_CONNECT);
+
+			goto exec;
+		}
+
+		switch ((error_ = so_getaddr_(so))) {
+		case 0:
+			break;
+		case ENOENT:
+			/* NOTE: Return the last error if possible. */
+			if (error)
+				error_ = error;
+			else if (so->lerror)
+				error_ = so->lerror;
+
+			/* FALL THROUGH */
+		default:
+			error = error_;
+
+			goto error;
+		}
+
+		so->done |= state;
+
+		goto exec;
+	case SO_S_SOCKET:
+		if ((error = so_socket_(so)))
+			goto retry;
+
+		so->done |= state;
+
+		goto exec;
+	case SO_S_BIND:
+		if ((error = so_bind_(so)))
+			goto retry;
+
+		so->done |= state;
+
+		goto exec;
+	case SO_S_LISTEN:
+		if ((error = so_listen_(so)))
+			return error;
+
+		so->done |= state;
+
+		goto exec;
 	case SO_S_CONNECT:
 		if ((error = so_connect_(so))) {
 			switch (error) {
@@ -1889,6 +2617,9 @@ static void so_resetssl(struct socket *);
 static int so_destroy(struct socket *so) {
 	so_resetssl(so);
 
+	so_race_close(so->race, &so->opts);
+	so->race = NULL;
+
 	dns_ai_close(so->res);
 	so->res = NULL;
 
@@ -1953,6 +2684,9 @@ struct socket *(so_open)(const char *host, const char *port, int qtype, int doma
 
 	if (isnumeric) {
 		hints.ai_flags |= AI_NUMERICHOST;
+	} else if (so->opts.sin_happy > 0 && !qtype && domain == AF_UNSPEC) {
+		if (!(so->race = so_race_open(host, port, &hints, &so->opts, &error)))
+			goto error;
 	} else {
 		struct dns_options *opts = dns_opts();
 
@@ -1963,7 +2697,7 @@ struct socket *(so_open)(const char *host, const char *port, int qtype, int doma
 			goto error;
 	}
 
-	if (!(so->res = dns_ai_open(host, port, qtype, &hints, res, &error)))
+	if (!so->race && !(so->res = dns_ai_open(host, port, qtype, &hints, res, &error)))
 		goto error;
 
 	so->todo = SO_S_GETADDR | SO_S_SOCKET | SO_S_BIND;
@@ -2170,11 +2904,18 @@ error:
 
 
 static void so_resetssl(struct socket *so) {
+	so_sessionsave(so);
+
+	free(so->ssl.key);
+	so->ssl.key = NULL;
+
 	ssl_discard(&so->ssl.ctx);
 	so->ssl.state  = 0;
 	so->ssl.error  = 0;
 	so->ssl.accept = 0;
 	so->ssl.vrfd   = 0;
+	so->ssl.ktls   = 0;
+	so->ssl.cache  = 0;
 
 	if (so->bio.ctx) {
 		BIO_free(so->bio.ctx);
@@ -2244,6 +2985,9 @@ int so_starttls(struct socket *so, const struct so_starttls *cfg) {
 			goto eossl;
 	}
 
+	so->ssl.ktls = cfg->ktls;
+	so->ssl.cache = cfg->cache;
+
 	if (so_isbool(cfg->accept)) {
 		so->ssl.accept = so_tobool(cfg->accept);
 	} else {
@@ -2415,6 +3159,62 @@ error:
 	return 0;
 } /* so_syswrite() */
 
+static size_t so_syswritev(struct socket *so, const struct iovec *iov, int iovcnt, int *error) {
+	long count;
+
+	if (so->st.sent.eof) {
+		*error = EPIPE;
+		return 0;
+	}
+
+retry:
+#if _WIN32
+	count = -1;
+	WSASetLastError(WSAEOPNOTSUPP);
+#else
+	if (S_ISSOCK(so->mode)) {
+		struct msghdr msg = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt };
+		int flags = 0;
+
+		#if defined(MSG_NOSIGNAL)
+		if (so->opts.fd_nosigpipe)
+			flags |= MSG_NOSIGNAL;
+		#endif
+		if (so->type == SOCK_SEQPACKET)
+			flags |= MSG_EOR;
+
+		count = sendmsg(so->fd, &msg, flags);
+	} else {
+		count = writev(so->fd, iov, iovcnt);
+	}
+#endif
+
+	if (count == -1)
+		goto error;
+
+	return count;
+error:
+	*error = so_soerr();
+
+	switch (*error) {
+	case EPIPE:
+		so->st.sent.eof = 1;
+		break;
+	case SO_EINTR:
+		goto retry;
+#if SO_EWOULDBLOCK != SO_EAGAIN
+	case SO_EWOULDBLOCK:
+		*error = SO_EAGAIN;
+		/* FALL THROUGH */
+#endif
+	case SO_EAGAIN:
+		so->events |= POLLOUT;
+		break;
+	} /* switch() */
+
+	return 0;
+} /* so_syswritev() */
+
 
 static _Bool bio_nonfatal(int error) {
 	switch (error) {
@@ -2638,49 +3438,329 @@ retry:
 	if (so->ssl.ctx) {
 		int n;
 
-		ERR_clear_error();
+		ERR_clear_error();
+
+		if ((n = SSL_read(so->ssl.ctx, dst, SO_MIN(lim, INT_MAX))) < 0) {
+			if (SO_EINTR == (error = ssl_error(so->ssl.ctx, n, &so->events)))
+				goto retry;
+			goto error;
+		} else if (n == 0) {
+			error = EPIPE; /* FIXME: differentiate clean from unclean shutdown? */
+			so->st.rcvd.eof = 1;
+			goto error;
+		}
+
+		len = n;
+	} else {
+		if (!(len = so_sysread(so, dst, lim, &error)))
+			goto error;
+	}
+
+	so_trace(SO_T_READ, so->fd, so->host, dst, (size_t)len, "rcvd %zu bytes", (size_t)len);
+	so_probe(so__read, so, len, 0);
+	st_update(&so->st.rcvd, len, &so->opts);
+
+	so_pipeok(so, 1);
+
+	return len;
+error:
+	*error_ = error;
+	so_probe(so__read, so, 0, error);
+
+	if (error != SO_EAGAIN)
+		so_trace(SO_T_READ, so->fd, so->host, (void *)0, (size_t)0, "%s", so_strerror(error));
+
+	so_pipeok(so, 1);
+
+	return 0;
+} /* so_read() */
+
+
+size_t so_write(struct socket *so, const void *src, size_t len, int *error_) {
+	size_t count;
+	int error;
+
+	so_pipeign(so, 0);
+
+	so->todo |= SO_S_SETWRITE;
+
+	if ((error = so_exec(so)))
+		goto error;
+
+	if (so->fd == -1) {
+		error = ENOTCONN;
+		goto error;
+	}
+
+	so->events &= ~POLLOUT;
+retry:
+	if (so->ssl.ctx) {
+		if (len > 0) {
+			int n;
+
+			ERR_clear_error();
+
+			if ((n = SSL_write(so->ssl.ctx, src, SO_MIN(len, INT_MAX))) < 0) {
+				if (SO_EINTR == (error = ssl_error(so->ssl.ctx, n, &so->events)))
+					goto retry;
+				goto error;
+			} else if (n == 0) {
+				error = EPIPE; /* FIXME: differentiate clean from unclean shutdown? */
+				so->st.sent.eof = 1;
+				goto error;
+			}
+
+			count = n;
+		} else {
+			count = 0;
+		}
+	} else {
+		if (!(count = so_syswrite(so, src, len, &error)))
+			goto error;
+	}
+
+	so_trace(SO_T_WRITE, so->fd, so->host, src, (size_t)count, "sent %zu bytes", (size_t)count);
+	so_probe(so__write, so, count, 0);
+	st_update(&so->st.sent, count, &so->opts);
+
+	so_pipeok(so, 0);
+
+	return count;
+error:
+	*error_ = error;
+	so_probe(so__write, so, 0, error);
+
+	if (error != SO_EAGAIN)
+		so_trace(SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "%s", so_strerror(error));
+
+	so_pipeok(so, 0);
+
+	return 0;
+} /* so_write() */
+
+
+/*
+ * Gathers iovcnt buffers into a single write. TLS sockets only write the
+ * first non-empty buffer per call, like so_write().
+ */
+size_t so_writev(struct socket *so, const struct iovec *iov, int iovcnt, int *error_) {
+	size_t count;
+	int error, i;
+
+	so_pipeign(so, 0);
+
+	so->todo |= SO_S_SETWRITE;
+
+	if ((error = so_exec(so)))
+		goto error;
+
+	if (so->fd == -1) {
+		error = ENOTCONN;
+		goto error;
+	}
+
+	if (so->ssl.ctx) {
+		so_pipeok(so, 0);
+
+		for (i = 0; i < iovcnt - 1 && !iov[i].iov_len; i++)
+			continue;
+
+		return so_write(so, iov[i].iov_base, iov[i].iov_len, error_);
+	}
+
+	so->events &= ~POLLOUT;
+
+	if (!(count = so_syswritev(so, iov, iovcnt, &error)))
+		goto error;
+
+	so_trace(SO_T_WRITE, so->fd, so->host, iov[0].iov_base, SO_MIN(count, iov[0].iov_len), "sent %zu bytes from %d buffers", count, iovcnt);
+	so_probe(so__write, so, count, 0);
+	st_update(&so->st.sent, count, &so->opts);
+
+	so_pipeok(so, 0);
+
+	return count;
+error:
+	*error_ = error;
+	so_probe(so__write, so, 0, error);
+
+	if (error != SO_EAGAIN)
+		so_trace(SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "%s", so_strerror(error));
+
+	so_pipeok(so, 0);
+
+	return 0;
+} /* so_writev() */
+
+
+/*
+ * Copies up to len bytes from descriptor fd, starting at *offset, straight
+ * to the socket and advances *offset. Returns 0 and sets *error_ to 0 at
+ * end of file. EOPNOTSUPP means the kernel can't do it for this pair of
+ * descriptors or the socket is in TLS mode, and the caller should fall
+ * back to a buffered copy.
+ */
+size_t so_sendfile(struct socket *so, int fd, off_t *offset, size_t len, int *error_) {
+	size_t count;
+	int error;
+
+	so_pipeign(so, 0);
+
+	so->todo |= SO_S_SETWRITE;
+
+	if ((error = so_exec(so)))
+		goto error;
+
+	if (so->fd == -1) {
+		error = ENOTCONN;
+		goto error;
+	}
+
+	if (so->ssl.ctx) {
+#if HAVE_SSL_SENDFILE
+		/*
+		 * With kTLS the kernel does the encryption, so the file can
+		 * still be sent without passing through userspace.
+		 */
+		if (BIO_get_ktls_send(SSL_get_wbio(so->ssl.ctx))) {
+			ossl_ssize_t n;
+
+			so->events &= ~POLLOUT;
+
+			do {
+				ERR_clear_error();
+			} while ((n = SSL_sendfile(so->ssl.ctx, fd, *offset, SO_MIN(len, INT_MAX), 0)) < 0
+			      && SO_EINTR == (error = ssl_error(so->ssl.ctx, (int)n, &so->events)));
+
+			if (n < 0)
+				goto error;
+
+			*offset += n;
+			count = n;
+
+			goto sent;
+		}
+#endif
+		error = EOPNOTSUPP;
+		goto error;
+	}
+
+	if (so->st.sent.eof) {
+		error = EPIPE;
+		goto error;
+	}
+
+	so->events &= ~POLLOUT;
+retry:
+#if HAVE_SENDFILE && defined __linux__
+	{
+		ssize_t n;
+
+		if (-1 == (n = sendfile(so->fd, fd, offset, SO_MIN(len, LONG_MAX))))
+			goto syerr;
 
-		if ((n = SSL_read(so->ssl.ctx, dst, SO_MIN(lim, INT_MAX))) < 0) {
-			if (SO_EINTR == (error = ssl_error(so->ssl.ctx, n, &so->events)))
-				goto retry;
-			goto error;
-		} else if (n == 0) {
-			error = EPIPE; /* FIXME: differentiate clean from unclean shutdown? */
-			so->st.rcvd.eof = 1;
+		count = n;
+	}
+#elif HAVE_SENDFILE && (defined __FreeBSD__ || defined __DragonFly__)
+	{
+		off_t n = 0;
+
+		if (!S_ISSOCK(so->mode)) {
+			error = EOPNOTSUPP;
 			goto error;
 		}
 
-		len = n;
-	} else {
-		if (!(len = so_sysread(so, dst, lim, &error)))
+		/* a partial transfer may still report EAGAIN or EINTR */
+		if (0 != sendfile(fd, so->fd, *offset, len, NULL, &n, 0) && n == 0)
+			goto syerr;
+
+		*offset += n;
+		count = n;
+	}
+#elif HAVE_SENDFILE && defined __APPLE__
+	{
+		off_t n = SO_MIN(len, LONG_MAX);
+
+		if (!S_ISSOCK(so->mode)) {
+			error = EOPNOTSUPP;
 			goto error;
+		}
+
+		if (0 != sendfile(fd, so->fd, *offset, &n, NULL, 0) && n == 0)
+			goto syerr;
+
+		*offset += n;
+		count = n;
+	}
+#else
+	(void)fd; (void)offset; (void)len;
+	error = EOPNOTSUPP;
+	goto error;
+#endif
+#if HAVE_SSL_SENDFILE
+sent:
+#endif
+	if (count == 0) {
+		error = 0;
+		goto error;
 	}
 
-	so_trace(SO_T_READ, so->fd, so->host, dst, (size_t)len, "rcvd %zu bytes", (size_t)len);
-	st_update(&so->st.rcvd, len, &so->opts);
+	so_trace(SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "sent %zu bytes from fd %d", count, fd);
+	st_update(&so->st.sent, count, &so->opts);
 
-	so_pipeok(so, 1);
+	so_pipeok(so, 0);
 
-	return len;
+	return count;
+syerr:
+	error = so_soerr();
+
+	switch (error) {
+	case EPIPE:
+		so->st.sent.eof = 1;
+		break;
+	case SO_EINTR:
+		goto retry;
+#if SO_EWOULDBLOCK != SO_EAGAIN
+	case SO_EWOULDBLOCK:
+		error = SO_EAGAIN;
+		/* FALL THROUGH */
+#endif
+	case SO_EAGAIN:
+		so->events |= POLLOUT;
+		break;
+	case EINVAL:
+		/* FALL THROUGH */
+	case ENOSYS:
+		/* e.g. Linux when fd isn't a regular file */
+		error = EOPNOTSUPP;
+		break;
+	} /* switch() */
 error:
 	*error_ = error;
 
-	if (error != SO_EAGAIN)
-		so_trace(SO_T_READ, so->fd, so->host, (void *)0, (size_t)0, "%s", so_strerror(error));
+	if (error && error != SO_EAGAIN && error != EOPNOTSUPP)
+		so_trace(SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "%s", so_strerror(error));
 
-	so_pipeok(so, 1);
+	so_pipeok(so, 0);
 
 	return 0;
-} /* so_read() */
+} /* so_sendfile() */
 
 
-size_t so_write(struct socket *so, const void *src, size_t len, int *error_) {
+/*
+ * Moves up to len bytes between the socket and a non-blocking pipe without
+ * copying through userspace. so_spliceread() fills the pipe from socket
+ * input, returning 0 with EPIPE at end of stream. so_splicewrite() drains
+ * the pipe to the socket. Both return 0 with EOPNOTSUPP where splice(2)
+ * isn't available or the socket is in TLS mode.
+ */
+static size_t so_splice_(struct socket *so, int pipefd, size_t len, _Bool rdonly, int *error_) {
 	size_t count;
 	int error;
 
-	so_pipeign(so, 0);
+	so_pipeign(so, rdonly);
 
-	so->todo |= SO_S_SETWRITE;
+	so->todo |= (rdonly)? SO_S_SETREAD : SO_S_SETWRITE;
 
 	if ((error = so_exec(so)))
 		goto error;
@@ -2690,49 +3770,99 @@ size_t so_write(struct socket *so, const void *src, size_t len, int *error_) {
 		goto error;
 	}
 
-	so->events &= ~POLLOUT;
+	if (so->ssl.ctx || !S_ISSOCK(so->mode)) {
+		error = EOPNOTSUPP;
+		goto error;
+	}
+
+	if (!rdonly && so->st.sent.eof) {
+		error = EPIPE;
+		goto error;
+	}
+
+	so->events &= (rdonly)? ~POLLIN : ~POLLOUT;
 retry:
-	if (so->ssl.ctx) {
-		if (len > 0) {
-			int n;
+#if HAVE_SPLICE
+	{
+		ssize_t n;
 
-			ERR_clear_error();
+		if (rdonly)
+			n = splice(so->fd, NULL, pipefd, NULL, SO_MIN(len, LONG_MAX), SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		else
+			n = splice(pipefd, NULL, so->fd, NULL, SO_MIN(len, LONG_MAX), SPLICE_F_MOVE|SPLICE_F_NONBLOCK|SPLICE_F_MORE);
 
-			if ((n = SSL_write(so->ssl.ctx, src, SO_MIN(len, INT_MAX))) < 0) {
-				if (SO_EINTR == (error = ssl_error(so->ssl.ctx, n, &so->events)))
-					goto retry;
-				goto error;
-			} else if (n == 0) {
-				error = EPIPE; /* FIXME: differentiate clean from unclean shutdown? */
-				so->st.sent.eof = 1;
-				goto error;
-			}
+		if (n == -1)
+			goto syerr;
 
-			count = n;
-		} else {
-			count = 0;
-		}
-	} else {
-		if (!(count = so_syswrite(so, src, len, &error)))
-			goto error;
+		count = n;
 	}
+#else
+	(void)pipefd; (void)len;
+	error = EOPNOTSUPP;
+	goto error;
+#endif
 
-	so_trace(SO_T_WRITE, so->fd, so->host, src, (size_t)count, "sent %zu bytes", (size_t)count);
-	st_update(&so->st.sent, count, &so->opts);
+	if (count == 0) {
+		/* callers only drain a pipe known to hold data */
+		error = EPIPE;
 
-	so_pipeok(so, 0);
+		if (rdonly)
+			so->st.rcvd.eof = 1;
+
+		goto error;
+	}
+
+	if (rdonly) {
+		so_trace(SO_T_READ, so->fd, so->host, (void *)0, (size_t)0, "rcvd %zu bytes into pipe", count);
+		st_update(&so->st.rcvd, count, &so->opts);
+	} else {
+		so_trace(SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "sent %zu bytes from pipe", count);
+		st_update(&so->st.sent, count, &so->opts);
+	}
+
+	so_pipeok(so, rdonly);
 
 	return count;
+syerr:
+	error = so_soerr();
+
+	switch (error) {
+	case EPIPE:
+		if (!rdonly)
+			so->st.sent.eof = 1;
+		break;
+	case SO_EINTR:
+		goto retry;
+#if SO_EWOULDBLOCK != SO_EAGAIN
+	case SO_EWOULDBLOCK:
+		error = SO_EAGAIN;
+		/* FALL THROUGH */
+#endif
+	case SO_EAGAIN:
+		so->events |= (rdonly)? POLLIN : POLLOUT;
+		break;
+	case EINVAL:
+		error = EOPNOTSUPP;
+		break;
+	} /* switch() */
 error:
 	*error_ = error;
 
-	if (error != SO_EAGAIN)
-		so_trace(SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "%s", so_strerror(error));
+	if (error != SO_EAGAIN && error != EOPNOTSUPP)
+		so_trace((rdonly)? SO_T_READ : SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "%s", so_strerror(error));
 
-	so_pipeok(so, 0);
+	so_pipeok(so, rdonly);
 
 	return 0;
-} /* so_write() */
+} /* so_splice_() */
+
+size_t so_spliceread(struct socket *so, int pipefd, size_t len, int *error) {
+	return so_splice_(so, pipefd, len, 1, error);
+} /* so_spliceread() */
+
+size_t so_splicewrite(struct socket *so, int pipefd, size_t len, int *error) {
+	return so_splice_(so, pipefd, len, 0, error);
+} /* so_splicewrite() */
 
 
 size_t so_peek(struct socket *so, void *dst, size_t lim, int flags, int *_error) {
@@ -2923,6 +4053,197 @@ error:
 } /* so_recvmsg() */
 
 
+#if HAVE_RECVMMSG || HAVE_SENDMMSG
+#define SO_MMSGVEC 64
+
+static void so_mmsgpack(struct mmsghdr *vec, const struct so_mmsg *msgs, size_t count) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		vec[i].msg_hdr = msgs[i].msg_hdr;
+		vec[i].msg_len = 0;
+	}
+} /* so_mmsgpack() */
+
+static void so_mmsgunpack(struct so_mmsg *msgs, const struct mmsghdr *vec, size_t count) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		msgs[i].msg_hdr = vec[i].msg_hdr;
+		msgs[i].msg_len = vec[i].msg_len;
+	}
+} /* so_mmsgunpack() */
+#endif
+
+/*
+ * Transfer up to count messages in as few system calls as possible, using
+ * sendmmsg(2) and recvmmsg(2) where available and looping over sendmsg(2)
+ * and recvmsg(2) otherwise. Returns the number of messages transferred.
+ * Errors are only reported if no message could be transferred; a failure
+ * midway through a batch simply ends the batch.
+ */
+size_t so_sendmany(struct socket *so, struct so_mmsg *msgs, size_t count, int flags, int *_error) {
+	size_t n = 0;
+	int error;
+
+	so_pipeign(so, 0);
+
+	so->todo |= SO_S_SETWRITE;
+
+	if ((error = so_exec(so)))
+		goto error;
+
+	so->events &= ~POLLOUT;
+
+#if defined MSG_NOSIGNAL
+	if (so->opts.fd_nosigpipe)
+		flags |= MSG_NOSIGNAL;
+#endif
+
+retry:
+	while (n < count) {
+#if HAVE_SENDMMSG
+		struct mmsghdr vec[SO_MMSGVEC];
+		size_t lim = SO_MIN(count - n, countof(vec)), i;
+		int k;
+
+		so_mmsgpack(vec, &msgs[n], lim);
+		if (-1 == (k = sendmmsg(so->fd, vec, lim, flags)))
+			goto syerr;
+
+		so_mmsgunpack(&msgs[n], vec, k);
+
+		for (i = 0; i < (size_t)k; i++)
+			st_update(&so->st.sent, msgs[n + i].msg_len, &so->opts);
+
+		n += k;
+
+		if ((size_t)k < lim)
+			break;
+#else
+		ssize_t len;
+		if (-1 == (len = sendmsg(so->fd, &msgs[n].msg_hdr, flags)))
+			goto syerr;
+
+		msgs[n].msg_len = len;
+		st_update(&so->st.sent, len, &so->opts);
+
+		n++;
+#endif
+	}
+
+	so_pipeok(so, 0);
+
+	return n;
+syerr:
+	error = errno;
+error:
+	switch (error) {
+	case SO_EINTR:
+		goto retry;
+#if SO_EWOULDBLOCK != SO_EAGAIN
+	case SO_EWOULDBLOCK:
+		/* FALL THROUGH */
+#endif
+	case SO_EAGAIN:
+		if (!n)
+			so->events |= POLLOUT;
+
+		break;
+	} /* switch() */
+
+	so_pipeok(so, 0);
+
+	if (n > 0)
+		return n;
+
+	*_error = error;
+
+	return 0;
+} /* so_sendmany() */
+
+
+size_t so_recvmany(struct socket *so, struct so_mmsg *msgs, size_t count, int flags, int *_error) {
+	size_t n = 0;
+	int i, error;
+
+	so_pipeign(so, 1);
+
+	so->todo |= SO_S_SETREAD;
+
+	if ((error = so_exec(so)))
+		goto error;
+
+	so->events &= ~POLLIN;
+retry:
+	while (n < count) {
+#if HAVE_RECVMMSG
+		struct mmsghdr vec[SO_MMSGVEC];
+		size_t lim = SO_MIN(count - n, countof(vec));
+		int k;
+
+		so_mmsgpack(vec, &msgs[n], lim);
+		if (-1 == (k = recvmmsg(so->fd, vec, lim, flags, NULL)))
+			goto syerr;
+
+		so_mmsgunpack(&msgs[n], vec, k);
+#else
+		ssize_t len;
+		int k = 1;
+		if (-1 == (len = recvmsg(so->fd, &msgs[n].msg_hdr, flags)))
+			goto syerr;
+
+		msgs[n].msg_len = len;
+#endif
+		/* zero-length reads are only end-of-file on stream sockets */
+		for (i = 0; i < k; i++, n++) {
+			if (so->type == SOCK_STREAM && msgs[n].msg_len == 0) {
+				so->st.rcvd.eof = 1;
+				error = EPIPE;
+
+				goto error;
+			}
+
+			st_update(&so->st.rcvd, msgs[n].msg_len, &so->opts);
+		}
+
+#if HAVE_RECVMMSG
+		if ((size_t)k < lim)
+			break;
+#endif
+	}
+
+	so_pipeok(so, 1);
+
+	return n;
+syerr:
+	error = errno;
+error:
+	switch (error) {
+	case SO_EINTR:
+		goto retry;
+#if SO_EWOULDBLOCK != SO_EAGAIN
+	case SO_EWOULDBLOCK:
+		/* FALL THROUGH */
+#endif
+	case SO_EAGAIN:
+		if (!n)
+			so->events |= POLLIN;
+
+		break;
+	} /* switch() */
+
+	so_pipeok(so, 1);
+
+	if (n > 0)
+		return n;
+
+	*_error = error;
+
+	return 0;
+} /* so_recvmany() */
+
+
 const struct so_stat *so_stat(struct socket *so) {
 	return &so->st;
 } /* so_stat() */
@@ -2957,13 +4278,21 @@ int so_events(struct socket *so) {
 int so_pollfd(struct socket *so) {
 	switch (so_state(so)) {
 	case SO_S_GETADDR:
-		return dns_ai_pollfd(so->res);
+		return (so->race)? so->race->pollfd : dns_ai_pollfd(so->res);
 	default:
 		return so->fd;
 	} /* switch() */
 } /* so_pollfd() */
 
 
+double so_timeout(struct socket *so) {
+	if (so->race && so_state(so) == SO_S_GETADDR)
+		return so_race_timeout(so->race);
+
+	return -1;
+} /* so_timeout() */
+
+
 int so_poll(struct socket *so, int timeout) {
 	int nfds;
 
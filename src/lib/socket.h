@@ -30,7 +30,7 @@
 #include <string.h>      /* memcpy(3) */
 #include <errno.h>       /* EAFNOSUPPORT */
 
-#include <sys/types.h>   /* socklen_t in_port_t uid_t gid_t pid_t */
+#include <sys/types.h>   /* socklen_t in_port_t off_t uid_t gid_t pid_t */
 #include <sys/uio.h>     /* struct iovec */
 #include <sys/socket.h>	 /* AF_INET AF_INET6 AF_UNIX SOCK_STREAM SHUT_RD SHUT_WR SHUT_RDWR struct sockaddr struct msghdr struct cmsghdr */
 #if defined(AF_UNIX)
@@ -156,6 +156,8 @@ struct so_options {
 	_Bool sin_nopush;
 	_Bool sin_oobinline;
 
+	double sin_happy; /* Happy Eyeballs connection attempt delay; 0 disables */
+
 	enum {
 		SO_V6ONLY_DEFAULT = 0, /* system default */
 		SO_V6ONLY_ENABLE  = 1,
@@ -563,18 +565,38 @@ struct so_starttls {
 	struct iovec pushback;
 
 	so_optional accept;
+
+	_Bool ktls; /* try kernel TLS offload after the handshake */
+	_Bool cache; /* resume from and store to the client session cache */
 }; /* struct so_starttls */
 
 int so_starttls(struct socket *, const struct so_starttls *);
 
 SSL *so_checktls(struct socket *);
 
+struct so_sessionstat {
+	unsigned long long hits, misses;
+	size_t count, limit;
+}; /* struct so_sessionstat */
+
+void so_sessionstat(struct so_sessionstat *);
+
+int so_sessionlimit(size_t);
+
 int so_shutdown(struct socket *, int /* SHUT_RD, SHUT_WR, SHUT_RDWR */);
 
 size_t so_read(struct socket *, void *, size_t, int *);
 
 size_t so_write(struct socket *, const void *, size_t, int *);
 
+size_t so_writev(struct socket *, const struct iovec *, int, int *);
+
+size_t so_sendfile(struct socket *, int, off_t *, size_t, int *);
+
+size_t so_spliceread(struct socket *, int, size_t, int *);
+
+size_t so_splicewrite(struct socket *, int, size_t, int *);
+
 #define SO_F_PEEKALL 0x01
 
 size_t so_peek(struct socket *, void *, size_t, int, int *);
@@ -615,6 +637,19 @@ int so_sendmsg(struct socket *, const struct msghdr *, int);
 
 int so_recvmsg(struct socket *, struct msghdr *, int);
 
+/*
+ * Portable analog of struct mmsghdr. .msg_len is set to the number of
+ * bytes transferred for each message.
+ */
+struct so_mmsg {
+	struct msghdr msg_hdr;
+	size_t msg_len;
+}; /* struct so_mmsg */
+
+size_t so_sendmany(struct socket *, struct so_mmsg *, size_t, int, int *);
+
+size_t so_recvmany(struct socket *, struct so_mmsg *, size_t, int, int *);
+
 
 struct so_stat {
 	struct st_log {
@@ -635,6 +670,8 @@ void so_clear(struct socket *);
 
 int so_pollfd(struct socket *);
 
+double so_timeout(struct socket *);
+
 int so_poll(struct socket *, int);
 
 int so_peerfd(struct socket *);
@@ -144,18 +144,49 @@ static const luaL_Reg ln_metatable[] = {
 }; /* ln_metatable[] */
 
 
+static _Bool ln_optbool(lua_State *L, int index, const char *k) {
+	_Bool b;
+
+	lua_getfield(L, index, k);
+	b = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	return b;
+} /* ln_optbool() */
+
 static int ln_opendir(lua_State *L) {
 	const char *path = luaL_checkstring(L, 1);
+	int flags = NOTIFY_ALL, window = 0, opts = 0;
 	struct luanotify *N = 0;
 	int error;
 
+	if (lua_istable(L, 2)) {
+		opts = 2;
+	} else {
+		flags = luaL_optinteger(L, 2, NOTIFY_ALL);
+		opts = (lua_istable(L, 3))? 3 : 0;
+	}
+
+	if (opts) {
+		if (ln_optbool(L, opts, "recursive"))
+			flags |= NOTIFY_RECURSIVE;
+		if (ln_optbool(L, opts, "filesystem"))
+			flags |= NOTIFY_FILESYSTEM;
+
+		lua_getfield(L, opts, "window");
+		window = (int)(luaL_optnumber(L, -1, 0) * 1000);
+		lua_pop(L, 1);
+	}
+
 	N = lua_newuserdata(L, sizeof *N);
 	N->notify = 0;
 	luaL_setmetatable(L, CQS_NOTIFY);
 
-	if (!(N->notify = notify_opendir(path, NOTIFY_ALL, &error)))
+	if (!(N->notify = notify_opendir(path, flags, &error)))
 		goto error;
 
+	notify_setwindow(N->notify, window);
+
 	return 1;
 error:
 	lua_pushnil(L);
@@ -262,6 +293,7 @@ int luaopen__cqueues_notify(lua_State *L) {
 		{ "FDOPENDIR",  NOTIFY_FDOPENDIR},
 		{ "O_CLOEXEC",  NOTIFY_O_CLOEXEC },
 		{ "IN_CLOEXEC", NOTIFY_IN_CLOEXEC },
+		{ "FANOTIFY",   NOTIFY_FANOTIFY },
 	};
 	unsigned i;
 
@@ -52,6 +52,31 @@ local loader = function(loader, ...)
 		end
 	end)
 
+	--
+	-- notify:batch
+	--
+	-- Waits like notify:get, then drains every change already released
+	-- with it, so a burst collected over the window costs one wakeup.
+	--
+	notify.interpose("batch", function(self, timeout)
+		local changes, filename = self:get(timeout)
+
+		if not changes then
+			return nil
+		end
+
+		local batch = { [filename] = changes }
+
+		changes, filename = get(self)
+
+		while changes do
+			batch[filename] = changes
+			changes, filename = get(self)
+		end
+
+		return batch
+	end)
+
 	--
 	-- notify:add
 	--
@@ -0,0 +1,510 @@
+local loader = function(loader, ...)
+	local cqueues = require"cqueues"
+	local thread = require"cqueues.thread"
+	local condition = require"cqueues.condition"
+	local promise = require"cqueues.promise"
+	local auxlib = require"cqueues.auxlib"
+	local assert3 = auxlib.assert3
+	local concat = table.concat
+	local format = string.format
+	local mathtype = math.type -- 5.3+ only
+	local huge = math.huge
+	local load = loadstring or load -- 5.1 compat
+	local tostring = tostring
+	local pcall = pcall
+	local select = select
+	local type = type
+
+	local pool = {}
+
+	pool.__index = pool -- keep things simple
+
+	--
+	-- Message encoding. Jobs, arguments and results cross between Lua
+	-- VMs as strings, so only nil, booleans, numbers, strings and
+	-- (acyclic) tables of those can be transferred.
+	--
+	local function encode1(buf, v, depth)
+		local t = type(v)
+
+		if t == "nil" then
+			buf[#buf + 1] = "z"
+		elseif t == "boolean" then
+			buf[#buf + 1] = v and "T" or "F"
+		elseif t == "number" then
+			local s
+
+			if v ~= v then
+				s = "nan"
+			elseif v == huge then
+				s = "inf"
+			elseif v == -huge then
+				s = "-inf"
+			elseif mathtype and mathtype(v) == "integer" then
+				s = format("%d", v)
+			else
+				s = format("%.17g", v)
+
+				if mathtype and not s:find("[.eEn]") then
+					s = s .. ".0" -- keep float subtype
+				end
+			end
+
+			buf[#buf + 1] = "n" .. s .. ";"
+		elseif t == "string" then
+			buf[#buf + 1] = "s" .. #v .. ":"
+			buf[#buf + 1] = v
+		elseif t == "table" then
+			if depth >= 32 then
+				error("table nested too deeply to transfer", 0)
+			end
+
+			buf[#buf + 1] = "t"
+
+			for k, v in pairs(v) do
+				encode1(buf, k, depth + 1)
+				encode1(buf, v, depth + 1)
+			end
+
+			buf[#buf + 1] = "e"
+		else
+			error(format("cannot transfer %s value", t), 0)
+		end
+	end -- encode1
+
+	local function encode(...)
+		local buf = {}
+
+		for i = 1, select("#", ...) do
+			encode1(buf, (select(i, ...)), 0)
+		end
+
+		return concat(buf)
+	end -- encode
+
+	local function decode1(s, pos)
+		local tag = s:sub(pos, pos)
+
+		if tag == "z" then
+			return nil, pos + 1
+		elseif tag == "T" then
+			return true, pos + 1
+		elseif tag == "F" then
+			return false, pos + 1
+		elseif tag == "n" then
+			local j = assert(s:find(";", pos, true), "malformed number")
+			local x = s:sub(pos + 1, j - 1)
+			local v = tonumber(x)
+
+			if not v then
+				v = (x == "inf" and huge) or (x == "-inf" and -huge) or 0/0
+			end
+
+			return v, j + 1
+		elseif tag == "s" then
+			local j = assert(s:find(":", pos, true), "malformed string")
+			local n = tonumber(s:sub(pos + 1, j - 1))
+
+			return s:sub(j + 1, j + n), j + n + 1
+		elseif tag == "t" then
+			local t, k, v = {}
+
+			pos = pos + 1
+
+			while s:sub(pos, pos) ~= "e" do
+				k, pos = decode1(s, pos)
+				v, pos = decode1(s, pos)
+				t[k] = v
+			end
+
+			return t, pos + 1
+		else
+			error("malformed message", 0)
+		end
+	end -- decode1
+
+	local function decode(s, pos)
+		if pos > #s then
+			return
+		end
+
+		local v
+
+		v, pos = decode1(s, pos)
+
+		return v, decode(s, pos)
+	end -- decode
+
+	pool.encode = encode
+	pool.decode = function (s, pos) return decode(s, pos or 1) end
+
+	--
+	-- Worker side. Frames from the parent are tagged "r" (register Lua
+	-- bytecode), "m" (register a module function) or "j" (run a job);
+	-- each job is answered with exactly one "o" (results) or "e"
+	-- (error message) frame.
+	--
+	function pool.serve(pipe)
+		local registry = {}
+
+		local function reply(ok, ...)
+			if ok then
+				local ok, msg = pcall(encode, ...)
+
+				if ok then
+					return "o" .. msg
+				else
+					return "e" .. encode(msg)
+				end
+			else
+				return "e" .. encode(tostring((...)))
+			end
+		end
+
+		local function run(name, ...)
+			local f = registry[name]
+
+			if not f then
+				return reply(false, format("%s: no such job", tostring(name)))
+			end
+
+			return reply(pcall(f, ...))
+		end
+
+		while true do
+			local msg = pipe:xread("*f")
+
+			if not msg then
+				return
+			end
+
+			local tag = msg:sub(1, 1)
+
+			if tag == "r" then
+				local name, code = decode(msg, 2)
+
+				registry[name] = load(code)
+			elseif tag == "m" then
+				local name, modname, field = decode(msg, 2)
+
+				registry[name] = function (...)
+					return require(modname)[field](...)
+				end
+			elseif tag == "j" then
+				pipe:xwrite(run(decode(msg, 2)), "F")
+				pipe:flush()
+			end
+		end
+	end -- pool.serve
+
+	-- runs in a fresh Lua VM: no upvalues
+	local function enter(pipe, code)
+		local cqueues = require"cqueues"
+		local loader = (loadstring or load)(code)
+		local pool = loader(loader, "cqueues.pool")
+		local cq = cqueues.new()
+
+		package.loaded["cqueues.pool"] = pool
+
+		cq:wrap(pool.serve, pipe)
+
+		assert(cq:loop())
+	end -- enter
+
+
+	--
+	-- Parent side.
+	--
+	function pool.new(opts)
+		opts = opts or {}
+
+		return setmetatable({
+			nthreads = opts.threads or thread.ncpu(),
+			workers = {},
+			idle = {},
+			registry = {}, -- replayed to new workers, in order
+			queue = {},
+			head = 0,
+			tail = 0,
+			closed = false,
+		}, pool)
+	end -- pool.new
+
+	function pool.type(self)
+		local mt = getmetatable(self)
+
+		return (mt == pool and "pool") or nil
+	end -- pool.type
+
+	-- serialize whole frames onto a worker's pipe
+	local function send(w, msg)
+		while w.writing do
+			w.wcond:wait()
+		end
+
+		w.writing = true
+
+		local ok, why = w.pipe:xwrite(msg, "F")
+
+		if ok then
+			ok, why = w.pipe:flush()
+		end
+
+		w.writing = false
+		w.wcond:signal()
+
+		return ok, why
+	end -- send
+
+	local dispatch, spawn
+
+	-- The pipe is only closed by receive(), once it has read EOF;
+	-- closing it under the suspended read would raise in the caller's
+	-- loop. Shutting down our write side makes the worker exit.
+	local function retire(self, w, why)
+		if w.dead then
+			return
+		end
+
+		w.dead = true
+		w.pipe:shutdown"w"
+
+		for i = #self.idle, 1, -1 do
+			if self.idle[i] == w then
+				table.remove(self.idle, i)
+			end
+		end
+
+		if w.job then
+			w.job:set(false, "pool worker exited: " .. tostring(why or "end of file"))
+			w.job = nil
+		end
+
+		if not self.closed then
+			spawn(self, w.index)
+		end
+	end -- retire
+
+	local function receive(self, w)
+		while true do
+			local msg, why = w.pipe:xread("*f")
+
+			if not msg then
+				retire(self, w, why)
+				w.pipe:close()
+
+				return
+			end
+
+			local job = w.job
+
+			w.job = nil
+
+			if job then
+				if msg:sub(1, 1) == "o" then
+					job:set(true, decode(msg, 2))
+				else
+					job:set(false, (decode(msg, 2)))
+				end
+			end
+
+			if not w.dead then
+				self.idle[#self.idle + 1] = w
+				dispatch(self)
+			end
+		end
+	end -- receive
+
+	local chunk -- our own loader, for workers to load from memory
+
+	function spawn(self, index)
+		chunk = chunk or string.dump(loader)
+
+		local thr, pipe, why = thread.start(enter, chunk)
+
+		if not thr then
+			return nil, why
+		end
+
+		pipe:onerror(function (_, _, why) return why end)
+
+		local w = { index = index, thread = thr, pipe = pipe, wcond = condition.new() }
+
+		self.workers[index] = w
+
+		self.cq:wrap(function ()
+			for _, msg in ipairs(self.registry) do
+				if not send(w, msg) then
+					break
+				end
+			end
+
+			if not w.dead then
+				self.idle[#self.idle + 1] = w
+				dispatch(self)
+			end
+
+			return receive(self, w)
+		end)
+
+		return w
+	end -- spawn
+
+	function dispatch(self)
+		while self.head < self.tail and #self.idle > 0 do
+			local w = table.remove(self.idle)
+
+			self.head = self.head + 1
+
+			local job = self.queue[self.head]
+
+			self.queue[self.head] = nil
+			w.job = job
+
+			local ok, why = send(w, job.msg)
+
+			if not ok then
+				retire(self, w, why)
+			end
+		end
+	end -- dispatch
+
+	-- threads are started lazily on the cqueue of the first caller
+	local function start(self)
+		if self.cq then
+			return true
+		end
+
+		self.cq = assert3(cqueues.running(), "cqueues.pool: must be called from a running cqueue")
+
+		local n, why = 0
+
+		for i = 1, self.nthreads do
+			local w, err = spawn(self, i)
+
+			if w then
+				n = n + 1
+			else
+				why = err
+			end
+		end
+
+		-- run with however many threads could be started
+		if n == 0 then
+			self.cq = nil
+
+			return nil, why
+		end
+
+		return true
+	end -- start
+
+	local function broadcast(self, msg)
+		self.registry[#self.registry + 1] = msg
+
+		for i = 1, self.nthreads do
+			local w = self.workers[i]
+
+			if w and not w.dead then
+				send(w, msg)
+			end
+		end
+	end -- broadcast
+
+	--
+	-- pool:register(name, function)
+	-- pool:register(name, modname [, field])
+	--
+	-- A Lua function is copied to every worker with string.dump, so it
+	-- must not have upvalues besides _ENV. The module form resolves
+	-- require(modname)[field or name] inside the worker, which is how
+	-- C functions are made available.
+	--
+	function pool:register(name, f, field)
+		assert3(not self.closed, "cqueues.pool: pool closed")
+
+		if type(f) == "function" then
+			broadcast(self, "r" .. encode(name, string.dump(f)))
+		else
+			broadcast(self, "m" .. encode(name, tostring(f), field or name))
+		end
+
+		return true
+	end -- pool:register
+
+	-- Queue a job, returning a promise which is pollable and resolves to
+	-- the job's results.
+	function pool:async(name, ...)
+		assert3(not self.closed, "cqueues.pool: pool closed")
+
+		local ok, why = start(self)
+
+		if not ok then
+			return nil, why
+		end
+
+		local ok, msg = pcall(encode, name, ...)
+
+		if not ok then
+			return nil, msg
+		end
+
+		local job = promise.new()
+
+		job.msg = "j" .. msg
+
+		self.tail = self.tail + 1
+		self.queue[self.tail] = job
+
+		dispatch(self)
+
+		return job
+	end -- pool:async
+
+	-- Run a job and wait for it, returning its results or nil and an
+	-- error message.
+	function pool:submit(name, ...)
+		local job, why = self:async(name, ...)
+
+		if not job then
+			return nil, why
+		end
+
+		job:wait()
+
+		if job:status() == "fulfilled" then
+			return job:get()
+		else
+			return nil, job.reason
+		end
+	end -- pool:submit
+
+	-- Stop the workers. Queued jobs which have not started are rejected.
+	function pool:close()
+		if self.closed then
+			return
+		end
+
+		self.closed = true
+
+		while self.head < self.tail do
+			self.head = self.head + 1
+			self.queue[self.head]:set(false, "cqueues.pool: pool closed")
+			self.queue[self.head] = nil
+		end
+
+		for i = 1, self.nthreads do
+			local w = self.workers[i]
+
+			if w and not w.dead then
+				retire(self, w, "pool closed")
+			end
+		end
+	end -- pool:close
+
+	pool.loader = loader
+
+	return pool
+end
+
+return loader(loader, ...)
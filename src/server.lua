@@ -0,0 +1,318 @@
+local loader = function(loader, ...)
+	local cqueues = require"cqueues"
+	local thread = require"cqueues.thread"
+	local condition = require"cqueues.condition"
+	local errno = require"cqueues.errno"
+	local auxlib = require"cqueues.auxlib"
+	local monotime = cqueues.monotime
+	local poll = cqueues.poll
+	local ETIMEDOUT = errno.ETIMEDOUT
+	local unpack = assert(table.unpack or unpack)
+
+	--
+	-- Worker thread entry point. Runs in a fresh Lua VM, so it must not
+	-- reference upvalues. Reports "ready" or "error <msg>" over the
+	-- pipe, then accepts on its own SO_REUSEPORT listener until the
+	-- supervisor writes "drain" (or closes its end of the pipe).
+	--
+	local function worker(pipe, id, host, port, handler)
+		local cqueues = require"cqueues"
+		local socket = require"cqueues.socket"
+		local condition = require"cqueues.condition"
+		local ETIMEDOUT = require"cqueues.errno".ETIMEDOUT
+		local cq = cqueues.new()
+		local draining, drained = false, condition.new()
+
+		id = tonumber(id)
+
+		local function report(...)
+			local msg = table.concat({ ... }, " "):gsub("\n", " ")
+			pipe:write(msg, "\n")
+			pipe:flush()
+		end
+
+		local srv = socket.listen{ host = host, port = port, reuseport = true }
+		srv:onerror(function (_, _, why) return why end)
+
+		local ok, why = srv:listen()
+
+		if not ok then
+			report("error", "listen:", require"cqueues.errno".strerror(why))
+			return
+		end
+
+		report("ready")
+
+		-- The listener is closed here rather than from the drain
+		-- coroutine: closing it under a suspended accept would raise.
+		cq:wrap(function ()
+			while not draining do
+				local con, why = srv:accept(0)
+
+				if con then
+					cq:wrap(handler, con, id)
+				elseif why == ETIMEDOUT then
+					cqueues.poll(srv, drained)
+				else
+					report("error", "accept:", tostring(why))
+					cqueues.sleep(0.1)
+				end
+			end
+
+			srv:close()
+		end)
+
+		cq:wrap(function ()
+			repeat
+				local cmd = pipe:read"*l"
+			until cmd == nil or cmd == "drain"
+
+			-- stop accepting; in-flight handlers run to completion
+			draining = true
+			drained:signal()
+		end)
+
+		for err in cq:errors() do
+			report("error", tostring(err))
+		end
+	end -- worker
+
+
+	local tostring = auxlib.tostring
+
+	local server = {}
+
+	server.__index = server
+
+	--
+	-- server.new{ host, port, handler [, workers] [, cpus] [, restart]
+	--             [, restartdelay] [, onerror] }
+	--
+	function server.new(opts)
+		assert(type(opts) == "table", "server.new: options table expected")
+		assert(opts.port and tostring(opts.port) ~= "0", "server.new: fixed port expected")
+		assert(opts.handler, "server.new: handler expected")
+
+		local nworkers = opts.workers or thread.ncpu()
+		local cpus = opts.cpus
+
+		if cpus == true then
+			local ncpu = thread.ncpu()
+
+			cpus = {}
+
+			for i = 1, nworkers do
+				cpus[i] = (i - 1) % ncpu
+			end
+		end
+
+		return setmetatable({
+			host = opts.host or "0.0.0.0",
+			port = tostring(opts.port),
+			handler = opts.handler,
+			nworkers = nworkers,
+			cpus = cpus or false,
+			restart = opts.restart ~= false,
+			restartdelay = opts.restartdelay or 1,
+			onerror = opts.onerror,
+			worker = {},
+			restarts = 0,
+			draining = false,
+			deadline = nil,
+			cond = condition.new(),
+		}, server)
+	end -- server.new
+
+	function server.type(self)
+		local mt = getmetatable(self)
+
+		return (mt == server and "server") or nil
+	end -- server.type
+
+	function server:spawn(i)
+		local w = self.worker[i] or { id = i }
+		local cpu = self.cpus and self.cpus[i]
+		local opts = cpu and { cpu = cpu } or {}
+		local thr, pipe, why = thread.start(opts, worker, i, self.host, self.port, self.handler)
+
+		self.worker[i] = w
+
+		if not thr then
+			w.thread, w.pipe, w.ready = nil, nil, false
+			w.restartat = monotime() + self.restartdelay
+			self:error(i, "start: " .. tostring(why))
+
+			return false, why
+		end
+
+		pipe:onerror(function (_, _, why) return why end)
+
+		w.thread, w.pipe, w.ready, w.restartat = thr, pipe, false, nil
+
+		return true
+	end -- server:spawn
+
+	function server:error(i, msg)
+		if self.onerror then
+			self.onerror(self, i, msg)
+		end
+	end -- server:error
+
+	-- consume status lines from worker without blocking
+	local function update(self, i, w)
+		while w.pipe do
+			local ln, why = w.pipe:xread("*l", 0)
+
+			if not ln then
+				if why ~= ETIMEDOUT then
+					w.pipe:close()
+					w.pipe = nil
+				end
+
+				return
+			elseif ln == "ready" then
+				w.ready = true
+			else
+				self:error(i, (ln:gsub("^error ", "")))
+			end
+		end
+	end -- update
+
+	-- reap worker if its thread has exited; restart unless draining
+	local function reap(self, i, w)
+		local ok, why = w.thread:join(0)
+
+		if not ok then
+			if why == ETIMEDOUT then
+				return false
+			end
+
+			-- EOWNERDEAD et al: thread died without unwinding
+			self:error(i, "join: " .. tostring(why))
+		elseif why then
+			self:error(i, "exit: " .. tostring(why))
+		end
+
+		update(self, i, w)
+
+		if w.pipe then
+			w.pipe:close()
+		end
+
+		w.thread, w.pipe, w.ready = nil, nil, false
+
+		if self.draining or not self.restart then
+			w.restartat = nil
+		elseif monotime() - (w.lastspawn or 0) < self.restartdelay then
+			-- died soon after starting; back off rather than spin
+			w.restartat = monotime() + self.restartdelay
+		else
+			w.restartat = monotime()
+		end
+
+		return true
+	end -- reap
+
+	--
+	-- Start the workers and supervise them until drained. Must be run
+	-- from a coroutine of a cqueue.
+	--
+	function server:run()
+		for i = 1, self.nworkers do
+			if not self.worker[i] then
+				self:spawn(i)
+				self.worker[i].lastspawn = monotime()
+			end
+		end
+
+		while true do
+			local objs, timeout, live = { self.cond }, nil, 0
+			local curtime = monotime()
+
+			for i = 1, self.nworkers do
+				local w = self.worker[i]
+
+				if w.thread and not reap(self, i, w) then
+					update(self, i, w)
+					live = live + 1
+					objs[#objs + 1] = w.thread
+					objs[#objs + 1] = w.pipe
+				end
+
+				if not w.thread and w.restartat and not self.draining then
+					if w.restartat <= curtime then
+						self.restarts = self.restarts + 1
+						self:spawn(i)
+						w.lastspawn = monotime()
+						live = live + 1
+						timeout = 0
+					else
+						local wait = w.restartat - curtime
+						timeout = math.min(timeout or wait, wait)
+					end
+				end
+			end
+
+			if live == 0 and (self.draining or not self.restart) then
+				return true
+			end
+
+			if self.deadline then
+				if curtime >= self.deadline then
+					return false, ETIMEDOUT
+				end
+
+				local wait = self.deadline - curtime
+				timeout = math.min(timeout or wait, wait)
+			end
+
+			objs[#objs + 1] = timeout
+
+			poll(unpack(objs))
+		end
+	end -- server:run
+
+	--
+	-- Stop accepting and let in-flight connections finish. server:run
+	-- returns once every worker has exited, or false, ETIMEDOUT if
+	-- timeout elapses first.
+	--
+	function server:drain(timeout)
+		self.draining = true
+		self.deadline = timeout and (monotime() + timeout)
+
+		for i = 1, self.nworkers do
+			local w = self.worker[i]
+
+			if w and w.pipe then
+				w.pipe:write("drain\n")
+				w.pipe:flush()
+			end
+		end
+
+		self.cond:signal()
+
+		return true
+	end -- server:drain
+
+	-- number of workers currently listening
+	function server:ready()
+		local n = 0
+
+		for i = 1, self.nworkers do
+			local w = self.worker[i]
+
+			if w and w.ready then
+				n = n + 1
+			end
+		end
+
+		return n
+	end -- server:ready
+
+	server.loader = loader
+
+	return server
+end
+
+return loader(loader, ...)
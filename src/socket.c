@@ -27,16 +27,18 @@
 
 #include <stddef.h>	/* NULL offsetof size_t */
 #include <stdarg.h>	/* va_list va_start va_arg va_end */
-#include <stdlib.h>	/* strtol(3) */
-#include <string.h>	/* memset(3) memchr(3) memcpy(3) memmem(3) */
+#include <limits.h>	/* LLONG_MAX */
+#include <stdlib.h>	/* strtol(3) malloc(3) free(3) */
+#include <string.h>	/* memset(3) memchr(3) memrchr(3) memcpy(3) memmem(3) memmove(3) */
 #include <math.h>	/* NAN */
-#include <errno.h>	/* EBADF ENOTSOCK EOPNOTSUPP EOVERFLOW EPIPE */
+#include <errno.h>	/* EBADF EBADMSG EMSGSIZE ENOTSOCK EOPNOTSUPP EOVERFLOW EPIPE */
 
 #include <sys/types.h>
 #include <sys/socket.h>	/* AF_UNIX MSG_CMSG_CLOEXEC SOCK_CLOEXEC SOCK_STREAM SOCK_SEQPACKET SOCK_DGRAM PF_UNSPEC socketpair(2) */
 #include <sys/un.h>	/* struct sockaddr_un */
-#include <unistd.h>	/* dup(2) */
+#include <unistd.h>	/* dup(2) pread(2) */
 #include <fcntl.h>      /* F_DUPFD_CLOEXEC fcntl(2) */
+#include <pthread.h>	/* PTHREAD_MUTEX_INITIALIZER pthread_mutex_lock(3) pthread_mutex_unlock(3) */
 #include <arpa/inet.h>	/* ntohs(3) */
 
 #include <openssl/ssl.h> /* SSL_CTX, SSL_CTX_free(), SSL_CTX_up_ref(), SSL, SSL_up_ref() */
@@ -125,6 +127,29 @@ static int iov_addzu(size_t *r, size_t a, size_t b) {
 } /* iov_addzu() */
 
 
+/*
+ * The scanners below hand each search off to memchr/memrchr/memmem
+ * rather than walking bytes themselves. The C library versions are
+ * vectorized (SSE2/AVX2/NEON, with runtime CPU dispatch on glibc), which a
+ * byte loop here can't match.
+ */
+static const void *iov_memrchr(const void *src, int ch, size_t len) {
+#if HAVE_MEMRCHR
+	return memrchr(src, ch, len);
+#else
+	const unsigned char *p, *pe, *lp = NULL;
+
+	p = src;
+	pe = p + len;
+
+	while (p < pe && (p = memchr(p, ch, pe - p)))
+		lp = p++;
+
+	return lp;
+#endif
+} /* iov_memrchr() */
+
+
 /*
  * Find end of MIME header. Returns 0 < length <= .iov_len to end of header,
  * 0 if not found. If length is >.iov_len then needs more data. Returns -1
@@ -202,10 +227,26 @@ static size_t iov_eot(const struct iovec *iov, size_t minbuf, size_t maxbuf, _Bo
 	p = iov->iov_base;
 	pe = p + iov->iov_len;
 
-	for (; p < pe && n < maxbuf; ++n) {
+	while (p < pe && n < maxbuf) {
+		size_t span = MIN((size_t)(pe - p), maxbuf - n);
+		const char *cr;
+
+		/* every byte up to the next \r counts once */
+		if (!(cr = memchr(p, '\r', span))) {
+			p += span;
+			n += span;
+			lc = p[-1];
+
+			break;
+		}
+
+		n += cr - p;
+		p = cr;
+
 		lc = *p++;
+		++n;
 
-		if (lc == '\r' && p < pe && *p == '\n') {
+		if (p < pe && *p == '\n') {
 			lc = *p++; /* skip \n so we don't ++n */
 		}
 	}
@@ -251,23 +292,18 @@ error:
 
 
 static size_t iov_eol(const struct iovec *iov) {
-	const char *p, *pe;
-	size_t eol = 0;
-
-	p = iov->iov_base;
-	pe = p + iov->iov_len;
+	const char *p;
 
-	while (p < pe && (p = memchr(p, '\n', pe - p))) {
-		eol = ++p - (char *)iov->iov_base;
-	}
+	if ((p = iov_memrchr(iov->iov_base, '\n', iov->iov_len)))
+		return (p + 1) - (char *)iov->iov_base;
 
-	return (eol)? eol : iov->iov_len;
+	return iov->iov_len;
 } /* iov_eol() */
 
 
 /* strip \r from \r\n sequences */
 static size_t iov_trimcr(struct iovec *iov, _Bool chomp) {
-	char *p, *pe;
+	char *p, *pe, *q, *cr;
 
 	p = iov->iov_base;
 	pe = p + iov->iov_len;
@@ -275,15 +311,20 @@ static size_t iov_trimcr(struct iovec *iov, _Bool chomp) {
 	if (chomp) {
 		if (pe - p >= 2 && pe[-1] == '\n' && pe[-2] == '\r')
 			*(--pe - 1) = '\n';
-	} else {
-		while (p < pe && (p = memchr(p, '\r', pe - p))) {
-			if (++p >= pe) {
-				break;
-			} else if (*p == '\n') {
-				memmove(p - 1, p, pe - p);
-				--pe;
-			}
+	} else if ((cr = memchr(p, '\r', pe - p))) {
+		/* compact in one pass rather than shifting the tail per \r */
+		for (q = p = cr; p < pe; p = cr) {
+			if (p + 1 < pe && p[1] == '\n')
+				++p; /* drop \r */
+
+			if (!(cr = memchr(p + 1, '\r', pe - (p + 1))))
+				cr = pe;
+
+			memmove(q, p, cr - p);
+			q += cr - p;
 		}
+
+		pe = q;
 	}
 
 	return iov->iov_len = pe - (char *)iov->iov_base;
@@ -292,7 +333,7 @@ static size_t iov_trimcr(struct iovec *iov, _Bool chomp) {
 
 /* strip \r?\n from \r?\n sequences */
 static size_t iov_trimcrlf(struct iovec *iov, _Bool chomp) {
-	char *sp, *p, *pe;
+	char *sp, *p, *pe, *q, *nl;
 
 	sp = iov->iov_base;
 	p = iov->iov_base;
@@ -305,17 +346,19 @@ static size_t iov_trimcrlf(struct iovec *iov, _Bool chomp) {
 			if (p < pe && pe[-1] == '\r')
 				--pe;
 		}
-	} else {
-		while (p < pe && (p = memchr(p, '\n', pe - p))) {
-			if (p > sp && p[-1] == '\r') {
-				++p;
-				memmove(p - 2, p, pe - p);
-				pe -= 2;
-			} else {
-				memmove(p, p + 1, pe - p - 1);
-				--pe;
-			}
+	} else if ((nl = memchr(p, '\n', pe - p))) {
+		for (q = p = nl; p < pe; p = nl) {
+			if (q > sp && q[-1] == '\r')
+				--q;
+
+			if (!(nl = memchr(p + 1, '\n', pe - (p + 1))))
+				nl = pe;
+
+			memmove(q, p + 1, nl - (p + 1));
+			q += nl - (p + 1);
 		}
+
+		pe = q;
 	}
 
 	return iov->iov_len = pe - (char *)iov->iov_base;
@@ -337,7 +380,15 @@ static size_t iov_trimcrlf(struct iovec *iov, _Bool chomp) {
 #define LSO_MAXERRS 100
 
 #define LSO_BUFSIZ  4096
+#define LSO_PIPESIZ 65536
+#define LSO_IOVMAX  64
+#define LSO_MMSGMAX 64
 #define LSO_MAXLINE 4096
+#define LSO_MMSGBUF (LSO_MMSGMAX * LSO_MAXLINE) /* recvmany receive area */
+#define LSO_MAXFRAME (16 * 1024 * 1024)
+#define LSO_HAPPYDELAY 0.25 /* RFC 8305 Connection Attempt Delay */
+#define LSO_HINTMIN 512
+#define LSO_HINTMAX 65536
 #define LSO_INFSIZ  ((size_t)-1)
 
 #define LSO_LINEBUF   0x01
@@ -348,10 +399,11 @@ static size_t iov_trimcrlf(struct iovec *iov, _Bool chomp) {
 #define LSO_BINARY    0x10
 #define LSO_AUTOFLUSH 0x20
 #define LSO_PUSHBACK  0x40
+#define LSO_FRAMED    0x80 /* per-operation only */
 
 #define LSO_INITMODE  (LSO_LINEBUF|LSO_TEXT|LSO_AUTOFLUSH|LSO_PUSHBACK)
-#define LSO_RDMASK    (~(LSO_ALLBUF|LSO_AUTOFLUSH))
-#define LSO_WRMASK    (~LSO_PUSHBACK)
+#define LSO_RDMASK    (~(LSO_ALLBUF|LSO_AUTOFLUSH|LSO_FRAMED))
+#define LSO_WRMASK    (~(LSO_PUSHBACK|LSO_FRAMED))
 
 /*
  * A placeholder until we make it optional. Some Microsoft services have
@@ -381,6 +433,9 @@ struct luasocket {
 		int mode;
 		size_t maxline;
 		size_t bufsiz;
+		size_t maxbuf;
+		size_t maxframe;
+		size_t hint; /* adaptive read size */
 
 		struct fifo fifo;
 
@@ -396,6 +451,8 @@ struct luasocket {
 		int mode;
 		size_t maxline;
 		size_t bufsiz;
+		size_t maxbuf;
+		size_t maxframe;
 
 		struct fifo fifo;
 
@@ -407,6 +464,17 @@ struct luasocket {
 		size_t maxerrs;
 	} obuf;
 
+	struct {
+		_Bool enabled;
+		_Bool stalled; /* kernel pushed back; flush writes as usual */
+		struct luasocket *next, **prev; /* on lso_corked while queued */
+	} cork;
+
+	struct {
+		int fd[2]; /* created on first kernel :splice */
+		size_t pending; /* spliced into fd[1] but not yet written */
+	} splice;
+
 	int type;
 	struct socket *socket;
 
@@ -419,14 +487,160 @@ struct luasocket {
 
 
 static struct luasocket lso_initializer = {
-	.ibuf = { .mode = (LSO_RDMASK & LSO_INITMODE), .maxline = LSO_MAXLINE, .bufsiz = LSO_BUFSIZ, .maxerrs = LSO_MAXERRS },
-	.obuf = { .mode = (LSO_WRMASK & LSO_INITMODE), .maxline = LSO_MAXLINE, .bufsiz = LSO_BUFSIZ, .maxerrs = LSO_MAXERRS },
+	.ibuf = { .mode = (LSO_RDMASK & LSO_INITMODE), .maxline = LSO_MAXLINE, .bufsiz = LSO_BUFSIZ, .maxbuf = LSO_INFSIZ, .maxframe = LSO_MAXFRAME, .hint = LSO_BUFSIZ, .maxerrs = LSO_MAXERRS },
+	.obuf = { .mode = (LSO_WRMASK & LSO_INITMODE), .maxline = LSO_MAXLINE, .bufsiz = LSO_BUFSIZ, .maxbuf = LSO_INFSIZ, .maxframe = LSO_MAXFRAME, .maxerrs = LSO_MAXERRS },
+	.splice = { .fd = { -1, -1 } },
 	.type = SOCK_STREAM,
 	.onerror = LUA_NOREF,
 	.timeout = LSO_NAN,
 };
 
 
+/*
+ * B U F F E R  P O O L
+ *
+ * Socket buffers come from a process-wide pool of power-of-two size
+ * classes and go back to it when drained, so idle connections don't pin
+ * their peak buffer. A bounded number of bytes is kept on the free lists;
+ * the rest is returned to the system. An optional budget caps the total
+ * held by all socket buffers.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef LSO_POOLMIN
+#define LSO_POOLMIN 12 /* log2 of smallest class */
+#endif
+
+#ifndef LSO_POOLMAX
+#define LSO_POOLMAX 20 /* log2 of largest class */
+#endif
+
+#ifndef LSO_POOLKEEP
+#define LSO_POOLKEEP (8 * 1024 * 1024)
+#endif
+
+static struct {
+	pthread_mutex_t mutex;
+	void *free[LSO_POOLMAX - LSO_POOLMIN + 1];
+	size_t inuse, pooled;
+	size_t budget, retain;
+} lso_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.retain = LSO_POOLKEEP,
+};
+
+/* size class index for size, or -1 if too large to pool */
+static int lso_poolclass(size_t size) {
+	int i = 0;
+
+	while ((size_t)1 << (LSO_POOLMIN + i) < size) {
+		if (++i > LSO_POOLMAX - LSO_POOLMIN)
+			return -1;
+	}
+
+	return i;
+} /* lso_poolclass() */
+
+static size_t lso_poolsize(size_t size) {
+	int i = lso_poolclass(size);
+
+	return (i < 0)? size : (size_t)1 << (LSO_POOLMIN + i);
+} /* lso_poolsize() */
+
+static void *lso_poolget(size_t size) {
+	size_t rsize = lso_poolsize(size);
+	int i = lso_poolclass(size);
+	void *p = NULL;
+
+	pthread_mutex_lock(&lso_pool.mutex);
+
+	if (lso_pool.budget && lso_pool.inuse + rsize > lso_pool.budget)
+		goto nobufs;
+
+	if (i >= 0 && (p = lso_pool.free[i])) {
+		memcpy(&lso_pool.free[i], p, sizeof (void *));
+		lso_pool.pooled -= rsize;
+	} else if (!(p = malloc(rsize))) {
+		goto leave;
+	}
+
+	lso_pool.inuse += rsize;
+leave:
+	pthread_mutex_unlock(&lso_pool.mutex);
+
+	return p;
+nobufs:
+	pthread_mutex_unlock(&lso_pool.mutex);
+	errno = ENOBUFS;
+
+	return NULL;
+} /* lso_poolget() */
+
+static void lso_poolput(void *p, size_t size) {
+	size_t rsize = lso_poolsize(size);
+	int i = lso_poolclass(size);
+
+	pthread_mutex_lock(&lso_pool.mutex);
+
+	lso_pool.inuse -= rsize;
+
+	if (i >= 0 && lso_pool.pooled + rsize <= lso_pool.retain) {
+		memcpy(p, &lso_pool.free[i], sizeof (void *));
+		lso_pool.free[i] = p;
+		lso_pool.pooled += rsize;
+		p = NULL;
+	}
+
+	pthread_mutex_unlock(&lso_pool.mutex);
+
+	free(p);
+} /* lso_poolput() */
+
+/* trim free lists down to the retention limit; caller must hold lock */
+static void lso_pooltrim(void) {
+	for (int i = LSO_POOLMAX - LSO_POOLMIN; i >= 0 && lso_pool.pooled > lso_pool.retain; i--) {
+		void *p;
+
+		while (lso_pool.pooled > lso_pool.retain && (p = lso_pool.free[i])) {
+			memcpy(&lso_pool.free[i], p, sizeof (void *));
+			lso_pool.pooled -= (size_t)1 << (LSO_POOLMIN + i);
+			free(p);
+		}
+	}
+} /* lso_pooltrim() */
+
+/*
+ * fifo allocator; arg points to the per-buffer size cap. Requests within
+ * the same size class are satisfied in place.
+ */
+static void *lso_bufalloc(void *arg, void *p, size_t osize, size_t nsize) {
+	size_t maxbuf = *(size_t *)arg;
+	void *q = NULL;
+
+	if (nsize > 0) {
+		if (nsize > maxbuf) {
+			errno = ENOBUFS;
+
+			return NULL;
+		}
+
+		if (p && lso_poolsize(nsize) == lso_poolsize(osize))
+			return p;
+
+		if (!(q = lso_poolget(nsize)))
+			return NULL;
+
+		if (p)
+			memcpy(q, p, MIN(osize, nsize));
+	}
+
+	if (p)
+		lso_poolput(p, osize);
+
+	return q;
+} /* lso_bufalloc() */
+
+
 static size_t lso_optsize(struct lua_State *L, int index, size_t def) {
 	lua_Number size;
 
@@ -666,6 +880,16 @@ static struct so_options lso_checkopts(lua_State *L, int index) {
 	if (lso_altfield(L, index, "oobinline", "sin_oobinline"))
 		opts.sin_oobinline = lso_popbool(L);
 
+	if (lso_altfield(L, index, "happy", "sin_happy")) {
+		if (lua_isboolean(L, -1)) {
+			opts.sin_happy = (lua_toboolean(L, -1))? LSO_HAPPYDELAY : 0;
+		} else {
+			opts.sin_happy = luaL_checknumber(L, -1);
+		}
+
+		lua_pop(L, 1);
+	}
+
 	if (lso_altfield(L, index, "nonblock", "fd_nonblock"))
 		opts.fd_nonblock = lso_popbool(L);
 
@@ -755,6 +979,9 @@ static int lso_imode(const char *str, int init) {
 		case 'P':
 			mode &= ~LSO_PUSHBACK;
 			break;
+		case 'F':
+			mode |= LSO_FRAMED;
+			break;
 		} /* switch() */
 	} /* while() */
 
@@ -824,6 +1051,12 @@ static struct luasocket *lso_newsocket(lua_State *L, int type) {
 
 	fifo_init(&S->ibuf.fifo);
 	fifo_init(&S->obuf.fifo);
+	fifo_setalloc(&S->ibuf.fifo, &lso_bufalloc, &S->ibuf.maxbuf);
+	fifo_setalloc(&S->obuf.fifo, &lso_bufalloc, &S->obuf.maxbuf);
+
+	S->cork.stalled = 0;
+	S->cork.next = NULL;
+	S->cork.prev = NULL;
 
 	if (S->onerror != LUA_NOREF && S->onerror != LUA_REFNIL) {
 		cqs_getref(L, S->onerror);
@@ -865,7 +1098,10 @@ static lso_error_t lso_adjbufs(struct luasocket *S) {
 
 
 static lso_error_t lso_prepsocket(struct luasocket *S) {
-	return lso_adjbufs(S);
+	/* buffers are drawn from the pool on first use */
+	(void)S;
+
+	return 0;
 } /* lso_prepsocket() */
 
 
@@ -922,6 +1158,89 @@ static lso_error_t lso_checktodo(struct luasocket *S) {
 } /* lso_checktodo() */
 
 
+/*
+ * A U T O  C O R K
+ *
+ * With auto-cork enabled, writes and read-side autoflushes leave small
+ * amounts of output buffered and queue the socket on a per-thread list.
+ * The cqueue flushes everything on the list once per step, before it next
+ * polls, so writes from many coroutines in one step leave in one send.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static __thread struct luasocket *lso_corked;
+
+static void lso_corkadd(struct luasocket *S) {
+	if (S->cork.prev)
+		return;
+
+	if ((S->cork.next = lso_corked))
+		lso_corked->cork.prev = &S->cork.next;
+
+	lso_corked = S;
+	S->cork.prev = &lso_corked;
+} /* lso_corkadd() */
+
+
+static void lso_corkdel(struct luasocket *S) {
+	if (!S->cork.prev)
+		return;
+
+	if (S->cork.next)
+		S->cork.next->cork.prev = S->cork.prev;
+
+	*S->cork.prev = S->cork.next;
+
+	S->cork.next = NULL;
+	S->cork.prev = NULL;
+} /* lso_corkdel() */
+
+
+/* queue pending output; returns true if the caller may skip its flush */
+static _Bool lso_corkdefer(struct luasocket *S) {
+	if (!S->cork.enabled)
+		return 0;
+
+	if (!fifo_rlen(&S->obuf.fifo) && !S->splice.pending) {
+		S->cork.stalled = 0;
+		lso_corkdel(S);
+
+		return 0;
+	}
+
+	lso_corkadd(S);
+
+	return !S->cork.stalled && fifo_rlen(&S->obuf.fifo) < S->obuf.bufsiz;
+} /* lso_corkdefer() */
+
+
+/*
+ * Flush every queued socket without blocking. Returns the number still
+ * holding output because the kernel pushed back; those stay queued and
+ * flush normally on their next write until drained.
+ */
+int cqs_socket_uncorkall(void) {
+	struct luasocket *S, *next;
+	int pending = 0, error;
+
+	for (S = lso_corked; S; S = next) {
+		next = S->cork.next;
+
+		if (!(error = lso_checktodo(S)) && !(error = lso_doflush(S, LSO_NOBUF))) {
+			S->cork.stalled = 0;
+			lso_corkdel(S);
+		} else if (error == EAGAIN) {
+			S->cork.stalled = 1;
+			pending++;
+		} else {
+			lso_corkdel(S); /* next operation reports it */
+		}
+	}
+
+	return pending;
+} /* cqs_socket_uncorkall() */
+
+
 static lso_nargs_t lso_connect2(lua_State *L) {
 	const char *host NOTUSED = NULL, *port NOTUSED = NULL;
 	const char *path = NULL;
@@ -1050,6 +1369,7 @@ static lso_nargs_t lso_listen2(lua_State *L) {
 
 	opts.fd_close.arg = S;
 	opts.fd_close.cb = &lso_closefd;
+	opts.sin_happy = 0; /* connection racing only applies to connect */
 
 	if (path) {
 		struct sockaddr_un sun;
@@ -1125,6 +1445,19 @@ static lso_nargs_t lso_starttls(lua_State *L) {
 	if ((S->todo & LSO_DO_STARTTLS))
 		goto check;
 
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "ktls");
+		S->tls.config.ktls = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "cache");
+		S->tls.config.cache = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "context");
+		lua_replace(L, 2);
+	}
+
 	if ((ssl = luaL_testudata(L, 2, "SSL*"))) {
 		/* accept-mode check handled by so_starttls() */
 	} else if ((ctx = luaL_testudata(L, 2, "SSL_CTX*"))) {
@@ -1169,6 +1502,35 @@ error:
 } /* lso_starttls() */
 
 
+static lso_nargs_t lso_sessioncache1(lua_State *L) {
+	struct so_sessionstat st;
+	int error;
+
+	if (!lua_isnoneornil(L, 1)) {
+		if ((error = so_sessionlimit(luaL_checkunsigned(L, 1)))) {
+			lua_pushnil(L);
+			lua_pushinteger(L, error);
+
+			return 2;
+		}
+	}
+
+	so_sessionstat(&st);
+
+	lua_newtable(L);
+	lua_pushinteger(L, st.hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, st.misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, st.count);
+	lua_setfield(L, -2, "count");
+	lua_pushinteger(L, st.limit);
+	lua_setfield(L, -2, "limit");
+
+	return 1;
+} /* lso_sessioncache1() */
+
+
 static lso_nargs_t lso_checktls(lua_State *L) {
 	struct luasocket *S = lso_checkself(L, 1);
 	SSL **ssl;
@@ -1517,6 +1879,138 @@ static lso_nargs_t lso_setmaxline3(struct lua_State *L) {
 } /* lso_setmaxline3() */
 
 
+static lso_nargs_t lso_setmaxbuf_(struct lua_State *L, struct luasocket *S, int ridx, int widx) {
+	lso_pushsize(L, S->ibuf.maxbuf);
+	lso_pushsize(L, S->obuf.maxbuf);
+
+	S->ibuf.maxbuf = lso_optsize(L, ridx, S->ibuf.maxbuf);
+	S->obuf.maxbuf = lso_optsize(L, widx, S->obuf.maxbuf);
+
+	return 2;
+} /* lso_setmaxbuf_() */
+
+
+static lso_nargs_t lso_setmaxbuf2(struct lua_State *L) {
+	lua_settop(L, 2);
+
+	return lso_setmaxbuf_(L, lso_prototype(L), 1, 2);
+} /* lso_setmaxbuf2() */
+
+
+static lso_nargs_t lso_setmaxbuf3(struct lua_State *L) {
+	lua_settop(L, 3);
+
+	return lso_setmaxbuf_(L, lso_checkself(L, 1), 2, 3);
+} /* lso_setmaxbuf3() */
+
+
+static lso_nargs_t lso_setmaxframe_(struct lua_State *L, struct luasocket *S, int ridx, int widx) {
+	lso_pushsize(L, S->ibuf.maxframe);
+	lso_pushsize(L, S->obuf.maxframe);
+
+	S->ibuf.maxframe = lso_optsize(L, ridx, S->ibuf.maxframe);
+	S->obuf.maxframe = lso_optsize(L, widx, S->obuf.maxframe);
+
+	return 2;
+} /* lso_setmaxframe_() */
+
+
+static lso_nargs_t lso_setmaxframe2(struct lua_State *L) {
+	lua_settop(L, 2);
+
+	return lso_setmaxframe_(L, lso_prototype(L), 1, 2);
+} /* lso_setmaxframe2() */
+
+
+static lso_nargs_t lso_setmaxframe3(struct lua_State *L) {
+	lua_settop(L, 3);
+
+	return lso_setmaxframe_(L, lso_checkself(L, 1), 2, 3);
+} /* lso_setmaxframe3() */
+
+
+static lso_nargs_t lso_setautocork_(struct lua_State *L, struct luasocket *S, int index) {
+	lua_pushboolean(L, S->cork.enabled);
+
+	if (!lua_isnone(L, index)) {
+		S->cork.enabled = lua_toboolean(L, index);
+
+		if (!S->cork.enabled) {
+			S->cork.stalled = 0;
+			lso_corkdel(S);
+		}
+	}
+
+	return 1;
+} /* lso_setautocork_() */
+
+
+static lso_nargs_t lso_setautocork1(struct lua_State *L) {
+	return lso_setautocork_(L, lso_prototype(L), 1);
+} /* lso_setautocork1() */
+
+
+static lso_nargs_t lso_setautocork2(struct lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	_Bool queued = !!S->cork.prev;
+
+	lso_setautocork_(L, S, 2);
+
+	/* don't strand output buffered while corked; errors surface later */
+	if (queued && !S->cork.enabled)
+		(void)lso_doflush(S, LSO_NOBUF);
+
+	return 1;
+} /* lso_setautocork2() */
+
+
+static lso_nargs_t lso_bufpool1(struct lua_State *L) {
+	size_t inuse, pooled, budget, retain;
+
+	pthread_mutex_lock(&lso_pool.mutex);
+	budget = lso_pool.budget;
+	retain = lso_pool.retain;
+	pthread_mutex_unlock(&lso_pool.mutex);
+
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+
+		lua_getfield(L, 1, "budget");
+		budget = (lua_isnil(L, -1))? budget : lso_optsize(L, -1, 0);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 1, "retain");
+		retain = (lua_isnil(L, -1))? retain : lso_optsize(L, -1, 0);
+		lua_pop(L, 1);
+
+		pthread_mutex_lock(&lso_pool.mutex);
+		lso_pool.budget = (budget == LSO_INFSIZ)? 0 : budget;
+		lso_pool.retain = retain;
+		lso_pooltrim();
+		pthread_mutex_unlock(&lso_pool.mutex);
+	}
+
+	pthread_mutex_lock(&lso_pool.mutex);
+	inuse = lso_pool.inuse;
+	pooled = lso_pool.pooled;
+	budget = lso_pool.budget;
+	retain = lso_pool.retain;
+	pthread_mutex_unlock(&lso_pool.mutex);
+
+	lua_newtable(L);
+	lua_pushinteger(L, inuse);
+	lua_setfield(L, -2, "inuse");
+	lua_pushinteger(L, pooled);
+	lua_setfield(L, -2, "pooled");
+	lua_pushinteger(L, budget);
+	lua_setfield(L, -2, "budget");
+	lua_pushinteger(L, retain);
+	lua_setfield(L, -2, "retain");
+
+	return 1;
+} /* lso_bufpool1() */
+
+
 static lso_nargs_t lso_settimeout_(struct lua_State *L, struct luasocket *S, int index) {
 	double timeout;
 
@@ -1705,15 +2199,21 @@ static lso_error_t lso_fill(struct luasocket *S, size_t limit) {
 	if (S->ibuf.eom && fifo_rlen(&S->ibuf.fifo) > 0)
 		return 0;
 
-	prepbuf = (S->type == SOCK_DGRAM)? (SO_MIN(limit, 65536)) : 1;
-
 	while (fifo_rlen(&S->ibuf.fifo) < limit) {
+		prepbuf = (S->type == SOCK_DGRAM)? (SO_MIN(limit, 65536)) : S->ibuf.hint;
+
 		if ((error = fifo_wbuf(&S->ibuf.fifo, &iov, prepbuf)))
 			return error;
 
 		if ((count = so_read(S->socket, iov.iov_base, iov.iov_len, &error))) {
 			fifo_update(&S->ibuf.fifo, count);
 
+			/* grow toward filled reads, shrink after short ones */
+			if (count >= S->ibuf.hint)
+				S->ibuf.hint = MIN(S->ibuf.hint * 2, LSO_HINTMAX);
+			else if (count < S->ibuf.hint / 4)
+				S->ibuf.hint = MAX(S->ibuf.hint / 2, LSO_HINTMIN);
+
 			if (S->type == SOCK_DGRAM || S->type == SOCK_SEQPACKET) {
 				S->ibuf.eom = 1;
 
@@ -1723,6 +2223,9 @@ static lso_error_t lso_fill(struct luasocket *S, size_t limit) {
 			if (error == EPIPE)
 				S->ibuf.eof = 1;
 
+			/* don't hold a buffer while waiting on an idle peer */
+			fifo_release(&S->ibuf.fifo);
+
 			return error;
 		}
 	}
@@ -1894,6 +2397,47 @@ error:
 } /* lso_getblock() */
 
 
+/*
+ * Frames are a 4-byte big-endian payload length followed by the payload.
+ * On success iov holds the payload; the caller discards iov_len + 4.
+ */
+#define LSO_FRAMEHDR 4
+
+static lso_error_t lso_getframe(struct luasocket *S, struct iovec *iov) {
+	size_t len, total;
+	int error, i;
+
+	error = lso_fill(S, LSO_FRAMEHDR);
+
+	if (fifo_rlen(&S->ibuf.fifo) < LSO_FRAMEHDR)
+		goto truncated;
+
+	for (len = 0, i = 0; i < LSO_FRAMEHDR; i++)
+		len = (len << 8) | (unsigned char)fifo_peek(&S->ibuf.fifo, i);
+
+	if (len > S->ibuf.maxframe)
+		return EMSGSIZE;
+
+	if ((error = cqs_addzu(&total, len, LSO_FRAMEHDR)))
+		return error;
+
+	error = lso_fill(S, total);
+
+	if (fifo_rlen(&S->ibuf.fifo) < total)
+		goto truncated;
+
+	fifo_slice(&S->ibuf.fifo, iov, LSO_FRAMEHDR, len);
+
+	return 0;
+truncated:
+	/* a message can't be continued by a later read */
+	if (!error && S->ibuf.eom)
+		error = EBADMSG;
+
+	return lso_asserterror(error);
+} /* lso_getframe() */
+
+
 struct lso_rcvop {
 	int index;
 
@@ -1908,6 +2452,7 @@ struct lso_rcvop {
 		LSO_BODY,
 		LSO_BLOCK,
 		LSO_LIMIT,
+		LSO_FRAME,
 	} type;
 
 	int mode;
@@ -1951,6 +2496,9 @@ static struct lso_rcvop lso_checkrcvop(lua_State *L, int index, int mode) {
 			case 'H':
 				op.type = LSO_HEADER;
 				break;
+			case 'f':
+				op.type = LSO_FRAME;
+				break;
 			}
 		} else if (fmt[0] == '-' && fmt[1] == '-') {
 			op.type = LSO_BODY;
@@ -2002,7 +2550,7 @@ static lso_error_t lso_preprcv(lua_State *L, struct luasocket *S) {
 
 	so_clear(S->socket);
 
-	if (S->obuf.mode & LSO_AUTOFLUSH) {
+	if ((S->obuf.mode & LSO_AUTOFLUSH) && !lso_corkdefer(S)) {
 		switch ((error = lso_doflush(S, LSO_NOBUF))) {
 		case EAGAIN:
 			break;
@@ -2193,6 +2741,14 @@ static lso_nargs_t lso_recv3(lua_State *L) {
 			lua_pushnil(L);
 		}
 
+		break;
+	case LSO_FRAME:
+		if ((error = lso_getframe(S, &iov)))
+			goto error;
+
+		lua_pushlstring(L, iov.iov_base, iov.iov_len);
+		fifo_discard(&S->ibuf.fifo, iov.iov_len + LSO_FRAMEHDR);
+
 		break;
 	default:
 		error = EFAULT;
@@ -2200,8 +2756,10 @@ static lso_nargs_t lso_recv3(lua_State *L) {
 		goto error;
 	} /* switch(op) */
 
-	if (!fifo_rlen(&S->ibuf.fifo))
+	if (!fifo_rlen(&S->ibuf.fifo)) {
 		S->ibuf.eom = 0;
+		fifo_release(&S->ibuf.fifo);
+	}
 
 	return 1;
 error:
@@ -2243,8 +2801,8 @@ error:
 
 static lso_error_t lso_doflush(struct luasocket *S, int mode) {
 	size_t amount = 0, n;
-	struct iovec iov;
-	int error;
+	struct iovec iov[2];
+	int iovcnt, error;
 
 	if (mode & LSO_LINEBUF) {
 		if (S->obuf.eol > 0) {
@@ -2259,11 +2817,20 @@ static lso_error_t lso_doflush(struct luasocket *S, int mode) {
 		amount = fifo_rlen(&S->obuf.fifo);
 	}
 
+	/* spliced data precedes anything buffered after it */
+	while (S->splice.pending) {
+		if (!(n = so_splicewrite(S->socket, S->splice.fd[0], S->splice.pending, &error)))
+			goto error;
+
+		S->splice.pending -= n;
+	}
+
 	while (amount) {
-		if (!fifo_slice(&S->obuf.fifo, &iov, 0, amount))
+		/* both halves of a wrapped buffer go out in one write */
+		if (!(iovcnt = fifo_slicev(&S->obuf.fifo, iov, 0, amount)))
 			break; /* should never happen */
 
-		if (!(n = so_write(S->socket, iov.iov_base, iov.iov_len, &error)))
+		if (!(n = so_writev(S->socket, iov, iovcnt, &error)))
 			goto error;
 
 		fifo_discard(&S->obuf.fifo, n);
@@ -2271,6 +2838,8 @@ static lso_error_t lso_doflush(struct luasocket *S, int mode) {
 		S->obuf.eol -= MIN(S->obuf.eol, n);
 	}
 
+	fifo_release(&S->obuf.fifo);
+
 	return 0;
 error:
 	switch (error) {
@@ -2284,6 +2853,20 @@ error:
 } /* lso_doflush() */
 
 
+static lso_error_t lso_putframe(struct luasocket *S, size_t len) {
+	unsigned char hdr[LSO_FRAMEHDR];
+	int i;
+
+	if (len > S->obuf.maxframe || len > 0xffffffffUL)
+		return EMSGSIZE;
+
+	for (i = LSO_FRAMEHDR - 1; i >= 0; i--, len >>= 8)
+		hdr[i] = 0xff & len;
+
+	return fifo_write(&S->obuf.fifo, hdr, sizeof hdr);
+} /* lso_putframe() */
+
+
 static lso_nargs_t lso_send5(lua_State *L) {
 	struct luasocket *S = lso_checkself(L, 1);
 	const unsigned char *src, *lf;
@@ -2312,7 +2895,16 @@ static lso_nargs_t lso_send5(lua_State *L) {
 
 	so_clear(S->socket);
 
-	while (p < pe) {
+	if (mode & LSO_FRAMED) {
+		/* payload goes out verbatim; a resumed send (i > 1) continues a frame */
+		byline = 0;
+		mode &= ~LSO_TEXT;
+
+		if (tp == 0 && (error = lso_putframe(S, pe - tp)))
+			goto error;
+	}
+
+	while (p < pe) {
 		if (byline) {
 			n = MIN(pe - p, S->obuf.maxline);
 
@@ -2352,7 +2944,7 @@ static lso_nargs_t lso_send5(lua_State *L) {
 		}
 	}
 
-	if ((error = lso_doflush(S, mode)))
+	if (!lso_corkdefer(S) && (error = lso_doflush(S, mode)))
 		goto error;
 
 	lua_pushinteger(L, p - tp);
@@ -2366,12 +2958,109 @@ error:
 } /* lso_send5() */
 
 
+/*
+ * Sends the strings in the array at index 2 verbatim, less the first skip
+ * bytes. If nothing is buffered they're handed to the kernel in a single
+ * gather write, and only what it doesn't take is copied to the output
+ * buffer, which is then flushed.
+ */
+static lso_nargs_t lso_writev3(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	struct iovec iov[LSO_IOVMAX];
+	const char *src;
+	size_t skip, len, count = 0, n, m;
+	int i, iovcnt, error;
+
+	if ((error = lso_prepsnd(L, S))) {
+		lua_pushinteger(L, 0);
+		lua_pushinteger(L, error);
+
+		return 2;
+	}
+
+	lua_settop(L, 3);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	skip = luaL_optinteger(L, 3, 0);
+	luaL_checkstack(L, LSO_IOVMAX, "too many buffers");
+
+	so_clear(S->socket);
+
+	if (!fifo_rlen(&S->obuf.fifo) && !S->splice.pending) {
+		n = skip;
+
+		/* pieces stay on the stack so they can't be collected */
+		for (i = 1, iovcnt = 0; iovcnt < LSO_IOVMAX; i++) {
+			lua_rawgeti(L, 2, i);
+
+			if (lua_isnil(L, -1))
+				break;
+			else if (!(src = lua_tolstring(L, -1, &len)))
+				return luaL_argerror(L, 2, "expected array of strings");
+
+			if (n >= len) {
+				n -= len;
+				continue;
+			}
+
+			iov[iovcnt].iov_base = (char *)src + n;
+			iov[iovcnt].iov_len = len - n;
+			iovcnt++;
+			n = 0;
+		}
+
+		if (iovcnt > 0 && !(count = so_writev(S->socket, iov, iovcnt, &error)) && error != EAGAIN)
+			goto error;
+
+		lua_settop(L, 3);
+	}
+
+	/* buffer whatever the kernel didn't take */
+	n = skip + count;
+
+	for (i = 1; lua_rawgeti(L, 2, i), !lua_isnil(L, -1); i++) {
+		if (!(src = lua_tolstring(L, -1, &len)))
+			return luaL_argerror(L, 2, "expected array of strings");
+
+		for (; n < len; n += m) {
+			if (fifo_rlen(&S->obuf.fifo) >= S->obuf.bufsiz) {
+				if ((error = lso_doflush(S, LSO_NOBUF)))
+					goto error;
+			}
+
+			m = MIN(len - n, LSO_BUFSIZ);
+
+			if ((error = fifo_write(&S->obuf.fifo, &src[n], m)))
+				goto error;
+
+			count += m;
+		}
+
+		n -= len;
+		lua_pop(L, 1);
+	}
+
+	if ((error = lso_doflush(S, LSO_NOBUF)))
+		goto error;
+
+	lua_pushinteger(L, count);
+
+	return 1;
+error:
+	lua_pushinteger(L, count);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_writev3() */
+
+
 static lso_nargs_t lso_flush(lua_State *L) {
 	struct luasocket *S = lso_checkself(L, 1);
-	int mode = lso_imode(luaL_optstring(L, 2, "n"), S->obuf.mode);
+	const char *how = luaL_optstring(L, 2, "n");
+	int mode = lso_imode(how, S->obuf.mode);
 	int error;
 
-	if ((error = lso_prepsnd(L, S)) || (error = lso_doflush(S, mode))) {
+	/* only a flush in the configured mode may be left to the cork */
+	if ((error = lso_prepsnd(L, S)) || (!(*how == '\0' && lso_corkdefer(S)) && (error = lso_doflush(S, mode)))) {
 		lua_pushboolean(L, 0);
 		lua_pushinteger(L, error);
 
@@ -2401,6 +3090,214 @@ static lso_nargs_t lso_uncork(lua_State *L) {
 } /* lso_uncork() */
 
 
+/* reads from fd into the output buffer when the kernel can't send it */
+static lso_error_t lso_copyfile(struct luasocket *S, int fd, off_t *offset, size_t count, size_t *sent) {
+	struct iovec iov;
+	ssize_t n;
+	int error;
+
+	while (*sent < count) {
+		if (fifo_rlen(&S->obuf.fifo) >= S->obuf.bufsiz) {
+			if ((error = lso_doflush(S, LSO_NOBUF)))
+				return error;
+		}
+
+		if ((error = fifo_wbuf(&S->obuf.fifo, &iov, MIN(count - *sent, S->obuf.bufsiz))))
+			return error;
+
+		if (-1 == (n = pread(fd, iov.iov_base, MIN(iov.iov_len, count - *sent), *offset))) {
+			if (errno == EINTR)
+				continue;
+
+			return errno;
+		} else if (n == 0) {
+			break;
+		}
+
+		fifo_update(&S->obuf.fifo, n);
+		*offset += n;
+		*sent += n;
+	}
+
+	return lso_doflush(S, LSO_NOBUF);
+} /* lso_copyfile() */
+
+
+static lso_nargs_t lso_sendfile4(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	int fd = lso_tofileno(L, 2);
+	lua_Number offset = luaL_optnumber(L, 3, 0);
+	size_t count = (lua_isnoneornil(L, 4))? LSO_INFSIZ : lso_checksize(L, 4);
+	size_t sent = 0, n;
+	off_t off;
+	int error;
+
+	luaL_argcheck(L, fd >= 0, 2, "expected file, socket or descriptor");
+	luaL_argcheck(L, offset >= 0 && offset <= LLONG_MAX, 3, "offset out of range");
+	off = offset;
+
+	if ((error = lso_prepsnd(L, S)))
+		goto error;
+
+	so_clear(S->socket);
+
+	/* anything already buffered goes out first */
+	if ((error = lso_doflush(S, LSO_NOBUF)))
+		goto error;
+
+	while (sent < count) {
+		if ((n = so_sendfile(S->socket, fd, &off, count - sent, &error))) {
+			sent += n;
+		} else if (error == EOPNOTSUPP) {
+			if ((error = lso_copyfile(S, fd, &off, count, &sent)))
+				goto error;
+
+			break;
+		} else if (error) {
+			goto error;
+		} else {
+			break; /* end of file */
+		}
+	}
+
+	lua_pushinteger(L, sent);
+
+	return 1;
+error:
+	lua_pushinteger(L, sent);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_sendfile4() */
+
+
+/*
+ * Kernel splicing needs a pipe between the two sockets. Bytes left in the
+ * pipe when the output side would block are counted as sent and drained
+ * by the next flush, ahead of the output buffer.
+ */
+static lso_error_t lso_splicekernel(struct luasocket *S, struct luasocket *src, size_t count, size_t *moved) {
+	size_t n;
+	int error;
+
+	if (S->splice.fd[0] == -1) {
+		if ((error = cqs_pipe(S->splice.fd, O_NONBLOCK|O_CLOEXEC))) {
+			cqs_closefd(&S->splice.fd[0]);
+			cqs_closefd(&S->splice.fd[1]);
+
+			return error;
+		}
+	}
+
+	while (*moved < count) {
+		if (!(n = so_spliceread(src->socket, S->splice.fd[1], MIN(count - *moved, LSO_PIPESIZ), &error))) {
+			if (error == EPIPE) {
+				src->ibuf.eof = 1;
+
+				break;
+			}
+
+			return error;
+		}
+
+		S->splice.pending += n;
+		*moved += n;
+
+		if ((error = lso_doflush(S, LSO_NOBUF)))
+			return error;
+	}
+
+	return 0;
+} /* lso_splicekernel() */
+
+
+static lso_error_t lso_splicecopy(struct luasocket *S, struct luasocket *src, size_t count, size_t *moved) {
+	struct iovec iov;
+	size_t n;
+	int error;
+
+	while (*moved < count) {
+		if (fifo_rlen(&S->obuf.fifo) >= S->obuf.bufsiz) {
+			if ((error = lso_doflush(S, LSO_NOBUF)))
+				return error;
+		}
+
+		if ((error = fifo_wbuf(&S->obuf.fifo, &iov, MIN(count - *moved, S->obuf.bufsiz))))
+			return error;
+
+		if (!(n = so_read(src->socket, iov.iov_base, MIN(iov.iov_len, count - *moved), &error))) {
+			if (error == EPIPE) {
+				src->ibuf.eof = 1;
+
+				break;
+			}
+
+			return error;
+		}
+
+		fifo_update(&S->obuf.fifo, n);
+		*moved += n;
+	}
+
+	return lso_doflush(S, LSO_NOBUF);
+} /* lso_splicecopy() */
+
+
+static lso_nargs_t lso_splice3(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	struct luasocket *src = lso_checkself(L, 2);
+	size_t count = (lua_isnoneornil(L, 3))? LSO_INFSIZ : lso_checksize(L, 3);
+	size_t moved = 0, n;
+	struct iovec iov;
+	int error;
+
+	luaL_argcheck(L, S != src, 2, "cannot splice socket to itself");
+
+	if ((error = lso_prepsnd(L, S)) || (error = lso_preprcv(L, src)))
+		goto error;
+
+	so_clear(S->socket);
+
+	/* input already buffered by the source goes first */
+	while (moved < count && fifo_rvec(&src->ibuf.fifo, &iov, 0)) {
+		n = MIN(count - moved, iov.iov_len);
+
+		if ((error = fifo_write(&S->obuf.fifo, iov.iov_base, n)))
+			goto error;
+
+		fifo_discard(&src->ibuf.fifo, n);
+		moved += n;
+	}
+
+	if ((error = lso_doflush(S, LSO_NOBUF)))
+		goto error;
+
+	if (moved < count && !src->ibuf.eof) {
+		if (S->type == SOCK_STREAM && src->type == SOCK_STREAM && !so_checktls(S->socket) && !so_checktls(src->socket)) {
+			error = lso_splicekernel(S, src, count, &moved);
+
+			/* e.g. one end isn't a socket */
+			if (error == EOPNOTSUPP)
+				error = lso_splicecopy(S, src, count, &moved);
+		} else {
+			error = lso_splicecopy(S, src, count, &moved);
+		}
+
+		if (error)
+			goto error;
+	}
+
+	lua_pushinteger(L, moved);
+
+	return 1;
+error:
+	lua_pushinteger(L, moved);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_splice3() */
+
+
 static lso_nargs_t lso_pending(lua_State *L) {
 	struct luasocket *S = lso_checkself(L, 1);
 
@@ -2492,6 +3389,8 @@ static lso_nargs_t lso_recvfd2(lua_State *L) {
 	else if ((error = cqs_socket_fdopen(L, fd, so_opts())))
 		goto error;
 
+	fifo_release(&S->ibuf.fifo);
+
 	return 2;
 trunc:
 	error = ENOBUFS;
@@ -2651,6 +3550,11 @@ static lso_nargs_t lso_events(lua_State *L) {
 
 double cqs_socket_timeout(lua_State *L NOTUSED, int index NOTUSED) {
 	struct luasocket *S = lso_checkvalid(L, index, lua_touserdata(L, index));
+	double timeout = so_timeout(S->socket);
+
+	/* a racing connect wants to look again before anything is ready */
+	if (timeout >= 0 && !(S->timeout <= timeout))
+		return timeout;
 
 	return S->timeout;
 } /* cqs_socket_timeout() */
@@ -2878,6 +3782,223 @@ static lso_nargs_t lso_localname(lua_State *L) {
 } /* lso_localname() */
 
 
+static void lso_pushpeer(lua_State *L, struct sockaddr_storage *ss, socklen_t salen) {
+	int top = lua_gettop(L), n, i;
+
+	n = lso_pushname(L, ss, salen);
+	lua_createtable(L, n, 0);
+	lua_insert(L, top + 1);
+
+	for (i = n; i > 0; i--)
+		lua_rawseti(L, top + 1, i);
+} /* lso_pushpeer() */
+
+
+/* destination of a sendmany entry, { data, addr, port } or { data, peer } */
+static socklen_t lso_topeer(lua_State *L, int index, struct sockaddr_storage *ss) {
+	int top = lua_gettop(L), family = AF_UNSPEC, port = 0, error;
+	const char *addr;
+	size_t plen;
+	socklen_t salen;
+
+	index = lua_absindex(L, index);
+	memset(ss, 0, sizeof *ss);
+
+	lua_rawgeti(L, index, 2);
+
+	if (lua_istable(L, -1)) {
+		lua_rawgeti(L, top + 1, 1);
+		family = luaL_optint(L, -1, AF_UNSPEC);
+		lua_rawgeti(L, top + 1, 2);
+		lua_rawgeti(L, top + 1, 3);
+	} else if (lua_isnil(L, -1)) {
+		lua_settop(L, top);
+
+		return 0;
+	} else {
+		lua_rawgeti(L, index, 3);
+	}
+
+	if (!(addr = lua_tolstring(L, -2, &plen)))
+		return luaL_error(L, "sendmany: expected address string");
+
+	port = luaL_optint(L, -1, 0);
+
+	if (family == AF_UNIX) {
+		struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+
+		sun->sun_family = AF_UNIX;
+		memcpy(sun->sun_path, addr, MIN(plen, sizeof sun->sun_path));
+		salen = offsetof(struct sockaddr_un, sun_path) + MIN(plen, sizeof sun->sun_path);
+	} else {
+		if (!sa_pton(ss, sizeof *ss, addr, NULL, &error))
+			return luaL_error(L, "%s: unable to parse address (%s)", addr, cqs_strerror(error));
+
+		*sa_port(ss, &(unsigned short){ 0 }, NULL) = htons((unsigned short)port);
+		salen = sa_len(ss);
+	}
+
+	lua_settop(L, top);
+
+	return salen;
+} /* lso_topeer() */
+
+
+static lso_nargs_t lso_sendmany3(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	struct so_mmsg msg[LSO_MMSGMAX];
+	struct iovec iov[LSO_MMSGMAX];
+	struct sockaddr_storage peer[LSO_MMSGMAX];
+	lua_Integer index;
+	size_t count = 0, n;
+	int error;
+
+	if ((error = lso_prepsnd(L, S)))
+		goto error;
+
+	lua_settop(L, 3);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	index = luaL_optinteger(L, 3, 1);
+	luaL_checkstack(L, LSO_MMSGMAX, "too many datagrams");
+
+	memset(msg, 0, sizeof msg);
+
+	/* datagrams stay on the stack so they can't be collected */
+	for (n = 0; n < LSO_MMSGMAX; n++) {
+		socklen_t salen = 0;
+
+		lua_rawgeti(L, 2, index + n);
+
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+
+			break;
+		} else if (lua_istable(L, -1)) {
+			salen = lso_topeer(L, -1, &peer[n]);
+			lua_rawgeti(L, -1, 1);
+			lua_remove(L, -2);
+		}
+
+		if (!(iov[n].iov_base = (void *)lua_tolstring(L, -1, &iov[n].iov_len)))
+			return luaL_argerror(L, 2, "expected array of datagrams");
+
+		msg[n].msg_hdr.msg_iov = &iov[n];
+		msg[n].msg_hdr.msg_iovlen = 1;
+
+		if (salen > 0) {
+			msg[n].msg_hdr.msg_name = &peer[n];
+			msg[n].msg_hdr.msg_namelen = salen;
+		}
+	}
+
+	so_clear(S->socket);
+
+	if (fifo_rlen(&S->obuf.fifo) && (error = lso_doflush(S, LSO_NOBUF)))
+		goto error;
+
+	if (n > 0 && !(count = so_sendmany(S->socket, msg, n, 0, &error)))
+		goto error;
+
+	lua_pushinteger(L, count);
+
+	return 1;
+error:
+	lua_pushinteger(L, count);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_sendmany3() */
+
+
+static lso_nargs_t lso_recvmany3(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	size_t limit = luaL_optunsigned(L, 2, LSO_MMSGMAX);
+	size_t bufsiz = luaL_optunsigned(L, 3, S->ibuf.maxline);
+	struct so_mmsg msg[LSO_MMSGMAX];
+	struct iovec iov[LSO_MMSGMAX], buf;
+	struct sockaddr_storage peer[LSO_MMSGMAX];
+	size_t count = 0, n, i;
+	int error;
+
+	luaL_argcheck(L, bufsiz > 0 && bufsiz <= SIZE_MAX / LSO_MMSGMAX, 3, "invalid buffer size");
+	limit = MAX(1, MIN(limit, LSO_MMSGMAX));
+
+	if ((error = lso_preprcv(L, S)))
+		goto error;
+
+	lua_settop(L, 3);
+	lua_createtable(L, limit, 0);
+	lua_createtable(L, limit, 0);
+
+	/* anything already buffered came first on the wire */
+	if (fifo_rlen(&S->ibuf.fifo)) {
+		fifo_rvec(&S->ibuf.fifo, &buf, 1);
+		lua_pushlstring(L, buf.iov_base, buf.iov_len);
+		lua_rawseti(L, 4, ++count);
+		lua_pushboolean(L, 0);
+		lua_rawseti(L, 5, count);
+
+		fifo_purge(&S->ibuf.fifo);
+		S->ibuf.eom = 0;
+
+		if (count >= limit)
+			return 2;
+	}
+
+	/* larger datagrams mean fewer per call, not a bigger buffer */
+	limit = MIN(limit, count + MAX(1, LSO_MMSGBUF / bufsiz));
+
+	if ((error = fifo_grow(&S->ibuf.fifo, (limit - count) * bufsiz)))
+		goto error;
+
+	fifo_wvec(&S->ibuf.fifo, &buf, 1);
+
+	memset(msg, 0, sizeof msg);
+
+	for (i = 0; i < limit - count; i++) {
+		iov[i].iov_base = (char *)buf.iov_base + (i * bufsiz);
+		iov[i].iov_len = bufsiz;
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		msg[i].msg_hdr.msg_name = &peer[i];
+		msg[i].msg_hdr.msg_namelen = sizeof peer[i];
+	}
+
+	so_clear(S->socket);
+
+	if (!(n = so_recvmany(S->socket, msg, limit - count, 0, &error))) {
+		fifo_release(&S->ibuf.fifo);
+
+		if (count > 0)
+			return 2;
+
+		goto error;
+	}
+
+	for (i = 0; i < n; i++) {
+		lua_pushlstring(L, iov[i].iov_base, MIN(msg[i].msg_len, bufsiz));
+		lua_rawseti(L, 4, ++count);
+
+		if (msg[i].msg_hdr.msg_namelen > 0)
+			lso_pushpeer(L, &peer[i], msg[i].msg_hdr.msg_namelen);
+		else
+			lua_pushboolean(L, 0);
+
+		lua_rawseti(L, 5, count);
+	}
+
+	fifo_release(&S->ibuf.fifo);
+
+	return 2;
+error:
+	lua_pushnil(L);
+	lua_pushnil(L);
+	lua_pushinteger(L, error);
+
+	return 3;
+} /* lso_recvmany3() */
+
+
 static lso_nargs_t lso_stat(lua_State *L) {
 	struct luasocket *S = lso_checkself(L, 1);
 	const struct so_stat *st = so_stat(S->socket);
@@ -2907,6 +4028,8 @@ static lso_nargs_t lso_stat(lua_State *L) {
 
 
 static void lso_destroy(lua_State *L, struct luasocket *S) {
+	lso_corkdel(S);
+
 	cqs_unref(L, &S->onerror);
 
 	if (S->tls.config.instance) {
@@ -2922,6 +4045,10 @@ static void lso_destroy(lua_State *L, struct luasocket *S) {
 	fifo_reset(&S->ibuf.fifo);
 	fifo_reset(&S->obuf.fifo);
 
+	cqs_closefd(&S->splice.fd[0]);
+	cqs_closefd(&S->splice.fd[1]);
+	S->splice.pending = 0;
+
 	/* Hack for Lua 5.1 and LuaJIT */
 	if (!S->mainthread) {
 		S->mainthread = L;
@@ -2938,6 +4065,10 @@ static void lso_destroy(lua_State *L, struct luasocket *S) {
 static lso_nargs_t lso_close(lua_State *L) {
 	struct luasocket *S = luaL_checkudata(L, 1, LSO_CLASS);
 
+	/* best effort for output still waiting on the end of the step */
+	if (S->cork.prev && S->socket)
+		(void)lso_doflush(S, LSO_NOBUF);
+
 	lso_destroy(L, S);
 
 	return 0;
@@ -2981,6 +4112,9 @@ static luaL_Reg lso_methods[] = {
 	{ "setmode",    &lso_setmode3 },
 	{ "setbufsiz",  &lso_setbufsiz3 },
 	{ "setmaxline", &lso_setmaxline3 },
+	{ "setmaxbuf",  &lso_setmaxbuf3 },
+	{ "setmaxframe", &lso_setmaxframe3 },
+	{ "setautocork", &lso_setautocork2 },
 	{ "settimeout", &lso_settimeout2 },
 	{ "seterror",   &lso_seterror },
 	{ "setmaxerrs", &lso_setmaxerrs2 },
@@ -2990,11 +4124,16 @@ static luaL_Reg lso_methods[] = {
 	{ "recv",       &lso_recv3 },
 	{ "unget",      &lso_unget2 },
 	{ "send",       &lso_send5 },
+	{ "writev",     &lso_writev3 },
 	{ "flush",      &lso_flush },
 	{ "uncork",     &lso_uncork },
+	{ "sendfile",   &lso_sendfile4 },
+	{ "splice",     &lso_splice3 },
 	{ "pending",    &lso_pending },
 	{ "sendfd",     &lso_sendfd3 },
 	{ "recvfd",     &lso_recvfd2 },
+	{ "sendmany",   &lso_sendmany3 },
+	{ "recvmany",   &lso_recvmany3 },
 	{ "pack",       &lso_pack4 },
 	{ "unpack",     &lso_unpack2 },
 	{ "fill",       &lso_fill2 },
@@ -3033,9 +4172,14 @@ static luaL_Reg lso_globals[] = {
 	{ "setmode",    &lso_setmode2 },
 	{ "setbufsiz",  &lso_setbufsiz2 },
 	{ "setmaxline", &lso_setmaxline2 },
+	{ "setmaxbuf",  &lso_setmaxbuf2 },
+	{ "setmaxframe", &lso_setmaxframe2 },
+	{ "setautocork", &lso_setautocork1 },
 	{ "settimeout", &lso_settimeout1 },
 	{ "setmaxerrs", &lso_setmaxerrs1 },
 	{ "onerror",    &lso_onerror1 },
+	{ "sessioncache", &lso_sessioncache1 },
+	{ "bufpool",    &lso_bufpool1 },
 	{ 0, 0 }
 }; /* lso_globals[] */
 
@@ -28,7 +28,7 @@ local format = string.format
 --
 -- ========================================================================
 
-local function timed_poll(self, deadline)
+local function timed_poll(self, deadline, other)
 	if deadline then
 		local curtime = monotime()
 
@@ -36,11 +36,11 @@ local function timed_poll(self, deadline)
 			return false
 		end
 
-		poll(self, deadline - curtime)
+		poll(self, other, deadline - curtime)
 
 		return true
 	else
-		poll(self)
+		poll(self, other)
 
 		return true
 	end
@@ -123,15 +123,17 @@ end
 --
 local preserve = {
 	read = "r", lines = "r", fill = "r", unpack = "r",
-	write = "w", flush = "w", pack = "w",
+	write = "w", writev = "w", flush = "w", pack = "w",
 
 	-- these too for good measure, even though they're not buffered
-	recvfd = "r", sendfd = "w",
+	recvfd = "r", sendfd = "w", sendfile = "w",
+	recvmany = "r", sendmany = "w",
 }
 
 -- drop EPIPE errors on input channel
 local nopipe = {
-	read = true, lines = true, fill = true, unpack = true, recvfd = true
+	read = true, lines = true, fill = true, unpack = true, recvfd = true,
+	recvmany = true,
 }
 
 local function oops(self, op, why, level)
@@ -284,9 +286,9 @@ end)
 local _starttls; _starttls = socket.interpose("starttls", function(self, arg1, arg2)
 	local ctx, timeout
 
-	if type(arg1) == "userdata" then
+	if type(arg1) == "userdata" or type(arg1) == "table" then
 		ctx = arg1
-	elseif type(arg2) == "userdata" then
+	elseif type(arg2) == "userdata" or type(arg2) == "table" then
 		ctx = arg2
 	end
 
@@ -491,6 +493,35 @@ socket.interpose("write", function (self, ...)
 end)
 
 
+--
+-- Yielding socket:writev
+--
+local _writev; _writev = socket.interpose("writev", function (self, list, timeout)
+	if not timeout then
+		timeout = self:timeout()
+	end
+	local deadline = timeout and (monotime() + timeout)
+	local skip, n, why = 0
+
+	repeat
+		n, why = _writev(self, list, skip)
+		skip = skip + n
+
+		if why then
+			if why == EAGAIN then
+				if not timed_poll(self, deadline) then
+					return nil, oops(self, "writev", ETIMEDOUT)
+				end
+			else
+				return nil, oops(self, "writev", why)
+			end
+		end
+	until not why
+
+	return self
+end)
+
+
 --
 -- Add socket:lines
 --
@@ -644,6 +675,97 @@ local _sendfd; _sendfd = socket.interpose("sendfd", function (self, msg, fd, tim
 end)
 
 
+--
+-- Yielding socket:sendfile
+--
+local _sendfile; _sendfile = socket.interpose("sendfile", function (self, file, offset, count, timeout)
+	if not timeout then
+		timeout = self:timeout()
+	end
+	local deadline = timeout and (monotime() + timeout)
+	local total, n, why = 0
+
+	offset = offset or 0
+
+	repeat
+		n, why = _sendfile(self, file, offset + total, count and (count - total))
+		total = total + n
+
+		if why then
+			if why == EAGAIN then
+				if not timed_poll(self, deadline) then
+					return nil, oops(self, "sendfile", ETIMEDOUT)
+				end
+			else
+				return nil, oops(self, "sendfile", why)
+			end
+		end
+	until not why
+
+	return total
+end)
+
+
+--
+-- Yielding socket:splice
+--
+-- Either end may block, so poll both; only the one which would block has
+-- any events set.
+--
+local _splice; _splice = socket.interpose("splice", function (self, other, count, timeout)
+	if not timeout then
+		timeout = self:timeout()
+	end
+	local deadline = timeout and (monotime() + timeout)
+	local total, n, why = 0
+
+	repeat
+		n, why = _splice(self, other, count and (count - total))
+		total = total + n
+
+		if why then
+			if why == EAGAIN then
+				if not timed_poll(self, deadline, other) then
+					return nil, oops(self, "splice", ETIMEDOUT)
+				end
+			else
+				return nil, oops(self, "splice", why)
+			end
+		end
+	until not why
+
+	return total
+end)
+
+--
+-- Yielding socket:sendmany
+--
+local _sendmany; _sendmany = socket.interpose("sendmany", function (self, list, timeout)
+	if not timeout then
+		timeout = self:timeout()
+	end
+	local deadline = timeout and (monotime() + timeout)
+	local index, n, why = 1
+
+	repeat
+		n, why = _sendmany(self, list, index)
+		index = index + n
+
+		if why then
+			if why == EAGAIN then
+				if not timed_poll(self, deadline) then
+					return nil, oops(self, "sendmany", ETIMEDOUT)
+				end
+			else
+				return nil, oops(self, "sendmany", why)
+			end
+		end
+	until not why and list[index] == nil
+
+	return self
+end)
+
+
 --
 -- Yielding socket:recvfd
 --
@@ -671,6 +793,33 @@ local _recvfd; _recvfd = socket.interpose("recvfd", function (self, prepbufsiz,
 	return msg, fd
 end)
 
+--
+-- Yielding socket:recvmany
+--
+local _recvmany; _recvmany = socket.interpose("recvmany", function (self, count, prepbufsiz, timeout)
+	if not timeout then
+		timeout = self:timeout()
+	end
+	local deadline = timeout and (monotime() + timeout)
+	local msgs, peers, why
+
+	repeat
+		msgs, peers, why = _recvmany(self, count, prepbufsiz)
+
+		if not msgs then
+			if why == EAGAIN then
+				if not timed_poll(self, deadline) then
+					return nil, nil, oops(self, "recvmany", ETIMEDOUT)
+				end
+			else
+				return nil, nil, oops(self, "recvmany", why)
+			end
+		end
+	until msgs
+
+	return msgs, peers
+end)
+
 
 --
 -- Yielding socket:pack
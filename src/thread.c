@@ -25,6 +25,7 @@
  */
 #include "config.h"
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,11 +33,17 @@
 #include <signal.h>
 #include <errno.h>
 
+#include <unistd.h>
+
 #include <sys/uio.h>
 #include <sys/socket.h>
 
 #include <pthread.h>
 
+#if HAVE_PTHREAD_ATTR_SETAFFINITY_NP
+#include <sched.h>
+#endif
+
 #include <dlfcn.h>
 
 #include "cqueues.h"
@@ -53,25 +60,6 @@
 #define CT_EOWNERDEAD EBUSY
 #endif
 
-struct cthread_arg {
-	int type;
-	int iscfunction:1;
-	int isinteger:1;
-
-	/*
-	 * NB: The value representation below is not a simple mapping to the
-	 * Lua type. Ex: Lua functions are serialized to a Lua string stored
-	 * in .v.string, but the argument type is still LUA_TFUNCTION.
-	 */
-	union {
-		struct iovec string;
-		lua_Number number;
-		lua_Integer integer;
-		_Bool boolean;
-		void *pointer;
-	} v;
-}; /* struct cthread_arg */
-
 struct cthread_lib {
 	Dl_info info;
 	void *ref;
@@ -107,8 +95,11 @@ struct cthread {
 	struct {
 		struct cthread_arg *arg;
 		unsigned argc;
+		unsigned npreload; /* leading arguments a warm state skips */
 		int fd[2];
 	} tmp;
+
+	struct cthread *next; /* pending handoff to a warm thread */
 }; /* struct cthread */
 
 
@@ -265,6 +256,7 @@ static struct cthread *ct_checkthread(lua_State *L, int index) {
 static void ct_release(struct cthread *ct) {
 	_Bool destroy;
 	struct cthread_lib *ent, *nxt;
+	unsigned i;
 
 	pthread_mutex_lock(&ct->mutex);
 	destroy = !--ct->refs;
@@ -292,6 +284,12 @@ static void ct_release(struct cthread *ct) {
 	cqs_closefd(&ct->tmp.fd[0]);
 	cqs_closefd(&ct->tmp.fd[1]);
 
+	/* channel references never handed to the new thread */
+	for (i = 0; ct->tmp.arg && i < ct->tmp.argc; i++) {
+		if (ct->tmp.arg[i].type == LUA_TUSERDATA && ct->tmp.arg[i].v.pointer)
+			cqs_channel_unref(ct->tmp.arg[i].v.pointer);
+	}
+
 	free(ct->tmp.arg);
 
 	free(ct->msg);
@@ -299,9 +297,13 @@ static void ct_release(struct cthread *ct) {
 } /* ct_release() */
 
 
-static void *ct_enter(void *arg) {
-	struct cthread *ct = arg, **ud;
-	lua_State *L = NULL;
+static void ct_warmfill(void);
+
+/* warmL is a pre-warmed state (see ct_warm) or NULL to create a fresh one */
+static void *ct_run(struct cthread *ct, lua_State *warmL) {
+	lua_State *volatile L = warmL; /* must survive a panic longjmp */
+	_Bool warm = (warmL != NULL);
+	struct cthread **ud;
 	int error;
 
 	/*
@@ -317,10 +319,11 @@ static void *ct_enter(void *arg) {
 	 *  1) Acquire lock.
 	 *  -- BEGIN CRITICAL SECTION --
 	 *  2) Grab struct cthread reference.
-	 *  3) Open new main Lua thread.
+	 *  3) Open new main Lua thread, unless pre-warmed.
 	 *  4) Set Lua panic trap.
 	 *  5) Load low-level components from memory as we might be
-	 *     chroot'd and unable to load them from disk.
+	 *     chroot'd and unable to load them from disk. (Pre-warmed
+	 *     states have done this already.)
 	 *  6) Load arg[0] as our Lua start routine.
 	 *  7) Push reference to struct cthread.
 	 *  8) Push reference to our socket.
@@ -337,7 +340,9 @@ static void *ct_enter(void *arg) {
 
 	ct->refs++;
 
-	if (!(L = luaL_newstate()))
+	if (warm)
+		ct->id = pthread_self();
+	else if (!(L = luaL_newstate()))
 		goto syerr;
 
 	if ((error = pthread_once(&atpanic.once, &atpanic_once)))
@@ -351,8 +356,10 @@ static void *ct_enter(void *arg) {
 	if ((error = _setjmp(ct->trap)))
 		goto error;
 
-	luaL_openlibs(L);
-	cqs_openlibs(L);
+	if (!warm) {
+		luaL_openlibs(L);
+		cqs_openlibs(L);
+	}
 
 	if (ct->tmp.arg[0].iscfunction) {
 		lua_pushcfunction(L, EXTENSION (lua_CFunction)ct->tmp.arg[0].v.pointer);
@@ -377,7 +384,11 @@ static void *ct_enter(void *arg) {
 
 	ct->tmp.fd[1] = -1;
 
-	for (struct cthread_arg *arg = &ct->tmp.arg[1]; arg < &ct->tmp.arg[ct->tmp.argc]; arg++) {
+	/* pre-warmed states have already run what the preload block carries */
+	if (ct->tmp.npreload)
+		lua_pushinteger(L, (warm)? 0 : ct->tmp.npreload);
+
+	for (struct cthread_arg *arg = &ct->tmp.arg[(warm)? 1 + ct->tmp.npreload : 1]; arg < &ct->tmp.arg[ct->tmp.argc]; arg++) {
 		switch (arg->type) {
 		case LUA_TNUMBER:
 			if (arg->isinteger) {
@@ -392,6 +403,10 @@ static void *ct_enter(void *arg) {
 		case LUA_TLIGHTUSERDATA:
 			lua_pushlightuserdata(L, arg->v.pointer);
 			break;
+		case LUA_TUSERDATA:
+			cqs_channel_push(L, arg->v.pointer);
+			arg->v.pointer = NULL;
+			break;
 		case LUA_TSTRING:
 			lua_pushlstring(L, arg->v.string.iov_base, arg->v.string.iov_len);
 			break;
@@ -415,6 +430,10 @@ static void *ct_enter(void *arg) {
 	pthread_mutex_unlock(&ct->mutex);
 	pthread_cond_signal(&ct->cond);
 
+	/* replace ourselves in the pool now that the parent is released */
+	if (warm)
+		ct_warmfill();
+
 	if ((error = _setjmp(ct->trap))) {
 		ct->error = error;
 		goto close;
@@ -450,9 +469,186 @@ error: /* NOTE: Only critical section errors reach here. */
 	pthread_cond_signal(&ct->cond);
 
 	goto close;
+} /* ct_run() */
+
+
+static void *ct_enter(void *arg) {
+	return ct_run(arg, NULL);
 } /* ct_enter() */
 
 
+/*
+ * Pool of idle LWP threads, each holding a Lua state with the standard
+ * and cqueues libraries already open and optionally a warm-up chunk
+ * already run (thread.lua preloads its module loaders that way). A
+ * start request is handed to an idle thread instead of paying for
+ * pthread_create and luaL_newstate; the thread then spawns its own
+ * replacement after releasing the parent. States are never reused.
+ */
+struct ct_warmcfg {
+	long refs;
+	unsigned argc;
+	struct iovec arg[]; /* arg[0] is the chunk; strings follow */
+}; /* struct ct_warmcfg */
+
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_attr_t attr;
+	int error;
+
+	unsigned target, idle, starting, nqueue;
+	struct cthread *head, **tail;
+
+	struct ct_warmcfg *cfg;
+} warm = {
+	PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+};
+
+static void ct_warmonce(void) {
+	warm.tail = &warm.head;
+
+	if ((warm.error = pthread_attr_init(&warm.attr)))
+		return;
+
+	warm.error = pthread_attr_setdetachstate(&warm.attr, PTHREAD_CREATE_DETACHED);
+} /* ct_warmonce() */
+
+static void ct_warmunref(struct ct_warmcfg *cfg) {
+	if (cfg && !__atomic_sub_fetch(&cfg->refs, 1, __ATOMIC_ACQ_REL))
+		free(cfg);
+} /* ct_warmunref() */
+
+static int ct_warmopen(lua_State *L) {
+	struct ct_warmcfg *cfg = lua_touserdata(L, 1);
+	unsigned i;
+
+	luaL_openlibs(L);
+	cqs_openlibs(L);
+
+	if (!cfg || !cfg->argc)
+		return 0;
+
+	if (LUA_OK != luaL_loadbuffer(L, cfg->arg[0].iov_base, cfg->arg[0].iov_len, "[thread warm]"))
+		return lua_error(L);
+
+	for (i = 1; i < cfg->argc; i++)
+		lua_pushlstring(L, cfg->arg[i].iov_base, cfg->arg[i].iov_len);
+
+	lua_call(L, cfg->argc - 1, 0);
+
+	return 0;
+} /* ct_warmopen() */
+
+static void *ct_warm(void *arg) {
+	struct ct_warmcfg *cfg = arg;
+	struct cthread *ct = NULL;
+	lua_State *L;
+
+	/* protected, so allocation failures can't panic */
+	if ((L = luaL_newstate())) {
+		lua_pushcfunction(L, &ct_warmopen);
+		lua_pushlightuserdata(L, cfg);
+
+		if (LUA_OK != lua_pcall(L, 1, 0, 0)) {
+			lua_close(L);
+			L = NULL;
+		}
+	}
+
+	ct_warmunref(cfg);
+
+	pthread_mutex_lock(&warm.mutex);
+
+	warm.starting--;
+
+	if (L) {
+		warm.idle++;
+
+		while (!(ct = warm.head) && warm.idle <= warm.target)
+			pthread_cond_wait(&warm.cond, &warm.mutex);
+
+		warm.idle--;
+
+		if (ct) {
+			if (!(warm.head = ct->next))
+				warm.tail = &warm.head;
+			warm.nqueue--;
+		}
+	}
+
+	pthread_mutex_unlock(&warm.mutex);
+
+	if (!ct) {
+		if (L)
+			lua_close(L);
+
+		return NULL;
+	}
+
+	return ct_run(ct, L);
+} /* ct_warm() */
+
+/* top up the pool to its target size */
+static void ct_warmfill(void) {
+	sigset_t mask, omask;
+	pthread_t id;
+
+	sigfillset(&mask);
+	sigemptyset(&omask);
+	pthread_sigmask(SIG_SETMASK, &mask, &omask);
+
+	pthread_mutex_lock(&warm.mutex);
+
+	while (warm.idle + warm.starting < warm.target + warm.nqueue) {
+		struct ct_warmcfg *cfg = warm.cfg;
+
+		if (cfg)
+			__atomic_fetch_add(&cfg->refs, 1, __ATOMIC_RELAXED);
+
+		if (0 != pthread_create(&id, &warm.attr, &ct_warm, cfg)) {
+			ct_warmunref(cfg);
+			break;
+		}
+
+		warm.starting++;
+	}
+
+	pthread_mutex_unlock(&warm.mutex);
+
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+} /* ct_warmfill() */
+
+/* queue ct for an idle warm thread; false if none is free */
+static _Bool ct_warmtake(struct cthread *ct) {
+	_Bool taken = 0;
+
+	/* pool disabled (the default); don't bother with the lock */
+	if (!__atomic_load_n(&warm.target, __ATOMIC_RELAXED))
+		return 0;
+
+	if (pthread_once(&warm.once, &ct_warmonce) || warm.error)
+		return 0;
+
+	pthread_mutex_lock(&warm.mutex);
+
+	if (warm.idle > warm.nqueue) {
+		ct->next = NULL;
+		*warm.tail = ct;
+		warm.tail = &ct->next;
+		warm.nqueue++;
+
+		pthread_cond_signal(&warm.cond);
+		taken = 1;
+	}
+
+	pthread_mutex_unlock(&warm.mutex);
+
+	return taken;
+} /* ct_warmtake() */
+
+
 static int dump_add(lua_State *L NOTUSED, const void *p, size_t sz, void *ud) {
 	luaL_addlstring(((luaL_Buffer *)ud), p, sz);
 	return 0;
@@ -597,13 +793,52 @@ error:
 	return NULL;
 } /* ct_create() */
 
+/* pin new thread to a single CPU; applied to the creation attributes */
+static int ct_setcpu(struct cthread *ct, lua_Integer cpu) {
+#if HAVE_PTHREAD_ATTR_SETAFFINITY_NP
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return EINVAL;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	return pthread_attr_setaffinity_np(&ct->attr, sizeof set, &set);
+#else
+	(void)ct;
+	(void)cpu;
+
+	return ENOTSUP;
+#endif
+} /* ct_setcpu() */
+
+/*
+ * start([options,] function [, ...]) -- function may also be a string of
+ * source or bytecode. options.preload = n marks the n arguments after
+ * it as needed only by a fresh state; the function then receives, after
+ * the socket, how many of them were passed (0 from a pre-warmed state).
+ */
 static int ct_start(lua_State *L) {
 	struct cthread **ud, *ct;
 	sigset_t mask, omask;
+	lua_Integer cpu = -1, npreload = 0;
 	int top, error;
 
+	if (lua_istable(L, 1)) {
+		lua_getfield(L, 1, "cpu");
+		cpu = luaL_optinteger(L, -1, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 1, "preload");
+		npreload = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+		lua_remove(L, 1);
+	}
+
 	top = lua_gettop(L);
 
+	luaL_argcheck(L, npreload == 0 || (npreload > 0 && npreload < top), 1, "preload count out of range");
+
 	ud = lua_newuserdata(L, sizeof *ud);
 	*ud = NULL;
 
@@ -613,11 +848,17 @@ static int ct_start(lua_State *L) {
 	if (!(ct = *ud = ct_create(&error)))
 		goto error;
 
-	luaL_checktype(L, 1, LUA_TFUNCTION);
+	if (cpu >= 0 && (error = ct_setcpu(ct, cpu)))
+		goto error;
+
+	if (lua_type(L, 1) != LUA_TSTRING)
+		luaL_checktype(L, 1, LUA_TFUNCTION);
 
 	if (!(ct->tmp.arg = calloc(sizeof *ct->tmp.arg, top)))
 		goto syerr;
 
+	ct->tmp.npreload = npreload;
+
 	for (int index = 1; index <= top; index++) {
 		struct cthread_arg *arg = &ct->tmp.arg[ct->tmp.argc];
 
@@ -649,6 +890,13 @@ static int ct_start(lua_State *L) {
 			if ((error = ct_setfarg(L, ct, arg, index)))
 				goto error;
 			break;
+		case LUA_TUSERDATA:
+			/* channels are shared, not copied */
+			if ((arg->v.pointer = cqs_channel_ref(L, index))) {
+				arg->type = LUA_TUSERDATA;
+				break;
+			}
+			/* FALL THROUGH */
 		default:
 			/* FALL THROUGH (maybe has __tostring metamethod) */
 		case LUA_TSTRING:
@@ -679,7 +927,10 @@ static int ct_start(lua_State *L) {
 
 	pthread_mutex_lock(&ct->mutex);
 
-	if (!(error = pthread_create(&ct->id, &ct->attr, &ct_enter, ct)))
+	/* pinned threads need their own creation attributes */
+	if (cpu < 0 && ct_warmtake(ct))
+		pthread_cond_wait(&ct->cond, &ct->mutex);
+	else if (!(error = pthread_create(&ct->id, &ct->attr, &ct_enter, ct)))
 		pthread_cond_wait(&ct->cond, &ct->mutex);
 
 	pthread_mutex_unlock(&ct->mutex);
@@ -803,6 +1054,90 @@ static int ct_self(lua_State *L) {
 } /* ct_self() */
 
 
+static int ct_ncpu(lua_State *L) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	lua_pushinteger(L, (n > 0)? n : 1);
+
+	return 1;
+} /* ct_ncpu() */
+
+
+/*
+ * prewarm(n [, chunk, ...]) -- keep n idle threads with fresh states.
+ * chunk (source or bytecode) is run in each new state with the
+ * remaining string arguments. States warmed before a change keep the
+ * old chunk.
+ */
+static int ct_prewarm(lua_State *L) {
+	static void *dlref;
+	lua_Integer n = luaL_checkinteger(L, 1);
+	struct ct_warmcfg *cfg = NULL, *ocfg;
+	int top = lua_gettop(L), i;
+	size_t size, len;
+	char *p;
+
+	luaL_argcheck(L, n >= 0 && n <= 1024, 1, "pool size out of range");
+
+	if (pthread_once(&warm.once, &ct_warmonce) || warm.error)
+		return luaL_error(L, "%s", cqs_strerror(warm.error));
+
+	/* warm threads outlive any Lua state, so keep our code mapped */
+	if (!dlref) {
+		Dl_info info;
+
+		if (!dladdr(EXTENSION (void *)&luaopen__cqueues_thread, &info))
+			return luaL_error(L, "%s", dlerror());
+
+		if (!(dlref = dlopen(info.dli_fname, RTLD_NOW|RTLD_LOCAL)))
+			return luaL_error(L, "%s", dlerror());
+	}
+
+	if (top > 1) {
+		size = offsetof(struct ct_warmcfg, arg) + (top - 1) * sizeof cfg->arg[0];
+
+		for (i = 2; i <= top; i++) {
+			luaL_checklstring(L, i, &len);
+			size += len + 1;
+		}
+
+		if (!(cfg = malloc(size)))
+			return luaL_error(L, "%s", cqs_strerror(errno));
+
+		cfg->refs = 1;
+		cfg->argc = top - 1;
+		p = (char *)&cfg->arg[cfg->argc];
+
+		for (i = 2; i <= top; i++) {
+			const char *s = lua_tolstring(L, i, &len);
+
+			memcpy(p, s, len + 1);
+			cfg->arg[i - 2].iov_base = p;
+			cfg->arg[i - 2].iov_len = len;
+			p += len + 1;
+		}
+	}
+
+	pthread_mutex_lock(&warm.mutex);
+
+	ocfg = warm.cfg;
+	warm.cfg = cfg;
+	warm.target = n;
+
+	/* surplus idle threads exit */
+	pthread_cond_broadcast(&warm.cond);
+
+	pthread_mutex_unlock(&warm.mutex);
+
+	ct_warmunref(ocfg);
+	ct_warmfill();
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* ct_prewarm() */
+
+
 static const luaL_Reg ct_methods[] = {
 	{ "join",    &ct_join },
 	{ "pollfd",  &ct_pollfd },
@@ -824,6 +1159,8 @@ static const luaL_Reg ct_globals[] = {
 	{ "type",      &ct_type },
 	{ "interpose", &ct_interpose },
 	{ "self",      &ct_self },
+	{ "ncpu",      &ct_ncpu },
+	{ "prewarm",   &ct_prewarm },
 	{ NULL,        NULL }
 };
 
@@ -4,18 +4,24 @@ local loader = function(loader, ...)
 	--
 	-- thread.start
 	--
-	local cache = {}
+	-- Functions are dumped once each, here rather than by ct_start, and
+	-- then passed as bytecode strings.
+	--
+	local cache = setmetatable({}, { __mode = "k" })
 
-	local function dump(fn)
-		if type(fn) == "string" then
+	local function dump(fn, checkups)
+		if type(fn) ~= "function" or debug.getinfo(fn, "S").what == "C" then
 			return fn
-		else
-			if not cache[fn] then
-				cache[fn] = string.dump(fn)
+		elseif not cache[fn] then
+			-- as ct_setfarg: _ENV is always first upvalue (if any) in Lua 5.2+
+			if checkups and debug.getupvalue(fn, (_VERSION == "Lua 5.1") and 1 or 2) then
+				error("bad argument #1 to 'start' (function has upvalues)", 4)
 			end
 
-			return cache[fn]
+			cache[fn] = string.dump(fn)
 		end
+
+		return cache[fn]
 	end
 
 	local include = {
@@ -25,51 +31,122 @@ local loader = function(loader, ...)
 		"cqueues.signal",
 		"cqueues.thread",
 		"cqueues.notify",
+		"cqueues.channel",
 	}
 
-	local start = thread.start; thread.start = function(enter, ...)
-		local function init(self, pipe, nloaders, ...)
-			local function loadblob(chunk, source, ...)
-				if _VERSION == "Lua 5.1" then
-					return loadstring(chunk, source)
-				else
-					return load(chunk, source, ...)
-				end
+	local start = thread.start
+
+	-- npreload is 0 when ct_run used a pre-warmed state (see thread.prewarm)
+	local function init(self, pipe, npreload, ...)
+		local function loadblob(chunk, source, ...)
+			if _VERSION == "Lua 5.1" then
+				return loadstring(chunk, source)
+			else
+				return load(chunk, source, ...)
 			end
+		end
 
-			local function preload(name, code)
-				local loader = loadblob(code, nil, "bt", _ENV)
-				package.loaded[name] = loader(loader, name)
+		local function preload(name, code)
+			if package.loaded[name] then
+				return
 			end
 
-			local function unpack(n, ...)
-				if n > 0 then
-					local name, code = select(1, ...)
-					preload(name, code)
-					return unpack(n - 1, select(3, ...))
-				else
-					return ...
-				end
+			local loader = loadblob(code, nil, "bt", _ENV)
+			package.loaded[name] = loader(loader, name)
+		end
+
+		local function unpack(n, ...)
+			if n > 0 then
+				local name, code = select(1, ...)
+				preload(name, code)
+				return unpack(n - 2, select(3, ...))
+			else
+				return ...
 			end
+		end
+
+		local enter = unpack(npreload, ...)
+
+		if type(enter) == "string" then
+			enter = assert(loadblob(enter, "[thread enter]"))
+		end
+
+		return enter(pipe, select(npreload + 2, ...))
+	end
 
-			nloaders = tonumber(nloaders)
+	local preloads
 
-			local enter = unpack(nloaders, ...)
+	local function pack(i, ...)
+		if not preloads then
+			preloads = {}
 
-			return enter(pipe, select(nloaders * 2 + 2, ...))
+			for _, name in ipairs(include) do
+				preloads[#preloads + 1] = name
+				preloads[#preloads + 1] = dump(require(name).loader)
+			end
 		end
 
-		local function pack(i, enter, ...)
-			if i == 1 then
-				return init, #include, pack(i + 1, enter, ...)
-			elseif include[i - 1] then
-				return include[i - 1], dump(require(include[i - 1]).loader), pack(i + 1, enter, ...)
-			else
-				return enter, ...
+		if preloads[i] then
+			return preloads[i], pack(i + 1, ...)
+		else
+			return ...
+		end
+	end
+
+	local function spawn(opts, enter, ...)
+		local options = { preload = #include * 2 }
+
+		if opts then
+			options.cpu = opts.cpu
+		end
+
+		return start(options, dump(init), pack(1, dump(enter, true), ...))
+	end
+
+	-- optional leading table of creation options, e.g. { cpu = 0 }
+	thread.start = function(enter, ...)
+		if type(enter) == "table" then
+			return spawn(enter, ...)
+		else
+			return spawn(nil, enter, ...)
+		end
+	end
+
+
+	--
+	-- thread.prewarm
+	--
+	-- Keep n idle threads with the cqueues modules already loaded, so
+	-- thread.start only has to hand over its arguments.
+	--
+	local prewarm = thread.prewarm
+
+	local function warm(nloaders, ...)
+		local function preload(name, code, ...)
+			local loader = (loadstring or load)(code)
+			package.loaded[name] = loader(loader, name)
+
+			return ...
+		end
+
+		local function unpack(n, ...)
+			if n > 0 then
+				return unpack(n - 1, preload(...))
 			end
 		end
 
-		return start(pack(1, enter, ...))
+		unpack(tonumber(nloaders), ...)
+	end
+
+	thread.prewarm = function(n)
+		local args = { dump(warm), #include }
+
+		for _, name in ipairs(include) do
+			args[#args + 1] = name
+			args[#args + 1] = dump(require(name).loader)
+		end
+
+		return prewarm(n, (table.unpack or unpack)(args))
 	end
 
 